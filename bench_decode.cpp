@@ -0,0 +1,130 @@
+// Microbenchmark for MessageSerialization::decode.
+// Compares the single-pass decoder against the previous
+// istringstream-based implementation (reproduced below), and
+// counts heap allocations per decoded message.
+//
+// Usage: ./bench_decode [iterations]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "exceptions.h"
+#include "message.h"
+#include "message_serialization.h"
+
+namespace {
+
+unsigned long g_num_allocs = 0;
+
+}
+
+void *operator new(size_t size)
+{
+  g_num_allocs++;
+  void *p = std::malloc(size ? size : 1);
+  if (p == nullptr) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void operator delete(void *p) noexcept
+{
+  std::free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+  std::free(p);
+}
+
+namespace {
+
+// The decoder as it was before the single-pass rewrite
+void legacy_decode(const std::string &encoded_msg, Message &msg)
+{
+  const std::map<std::string, MessageType> StringToMessageType = {
+    {"NONE", MessageType::NONE}, {"LOGIN", MessageType::LOGIN},
+    {"CREATE", MessageType::CREATE}, {"PUSH", MessageType::PUSH},
+    {"POP", MessageType::POP}, {"TOP", MessageType::TOP},
+    {"SET", MessageType::SET}, {"GET", MessageType::GET},
+    {"ADD", MessageType::ADD}, {"SUB", MessageType::SUB},
+    {"MUL", MessageType::MUL}, {"DIV", MessageType::DIV},
+    {"BEGIN", MessageType::BEGIN}, {"COMMIT", MessageType::COMMIT},
+    {"BYE", MessageType::BYE}, {"OK", MessageType::OK},
+    {"FAILED", MessageType::FAILED}, {"ERROR", MessageType::ERROR},
+    {"DATA", MessageType::DATA}
+  };
+
+  msg.clear_args();
+  std::istringstream iss(encoded_msg);
+  std::vector<std::string> args;
+  std::string arg;
+  while (iss >> arg) {
+    args.push_back(arg);
+  }
+  if (args.empty()) {
+    throw InvalidMessage("Empty message");
+  }
+  auto it = StringToMessageType.find(args[0]);
+  msg.set_message_type(it != StringToMessageType.end() ? it->second : MessageType::NONE);
+  for (size_t i = 1; i < args.size(); i++) {
+    msg.push_arg(args[i]);
+  }
+  if (encoded_msg.back() != '\n' || !msg.is_valid()) {
+    throw InvalidMessage("Decoded message is not valid");
+  }
+}
+
+// A mix of typical requests, as sent by incr_value -t
+const std::vector<std::string> REQUESTS = {
+  "LOGIN alice\n",
+  "BEGIN\n",
+  "GET accounts acct12345\n",
+  "PUSH 1\n",
+  "ADD\n",
+  "SET accounts acct12345\n",
+  "COMMIT\n",
+  "BYE\n",
+};
+
+template<typename Fn>
+void run(const char *name, unsigned long iterations, Fn decode)
+{
+  Message msg;
+  // warm up (and let msg grow its argument storage)
+  for (const std::string &req : REQUESTS) {
+    decode(req, msg);
+  }
+
+  unsigned long allocs_before = g_num_allocs;
+  auto start = std::chrono::steady_clock::now();
+  for (unsigned long i = 0; i < iterations; i++) {
+    decode(REQUESTS[i % REQUESTS.size()], msg);
+  }
+  auto end = std::chrono::steady_clock::now();
+  unsigned long allocs = g_num_allocs - allocs_before;
+
+  double ns = std::chrono::duration<double, std::nano>(end - start).count();
+  std::printf("%-10s %10.1f ns/msg %8.2f allocs/msg\n",
+              name, ns / iterations, double(allocs) / iterations);
+}
+
+}
+
+int main(int argc, char **argv)
+{
+  unsigned long iterations = (argc > 1) ? std::strtoul(argv[1], nullptr, 10) : 1000000;
+
+  run("legacy", iterations, legacy_decode);
+  run("decode", iterations, [](const std::string &req, Message &msg) {
+    MessageSerialization::decode(req, msg);
+  });
+
+  return 0;
+}
@@ -0,0 +1,133 @@
+// Benchmark for LSM tables (see LsmStorage) holding several times
+// their memtable size. Loads a dataset of the given multiple of the
+// memtable size in random key order, then reads random present and
+// absent keys. Reports write amplification (run bytes written per
+// byte loaded), read amplification (runs searched per get), how many
+// runs the bloom filters skipped, and the process's peak memory.
+//
+// Usage: ./bench_lsm [run dir] [memtable MB] [dataset multiple]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+#include <sys/resource.h>
+#include "commit_clock.h"
+#include "lsm_storage.h"
+#include "table.h"
+#include "write_set.h"
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+const size_t VALUE_LEN = 100;
+const unsigned BATCH = 100;
+
+std::string key_of(uint64_t i)
+{
+  char buf[32];
+  std::snprintf(buf, sizeof(buf), "key%012llu", (unsigned long long) i);
+  return buf;
+}
+
+double seconds_since(Clock::time_point start)
+{
+  return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+void read_keys(Table &table, LsmStorage &lsm, uint64_t num_keys, uint64_t num_reads, bool present)
+{
+  std::mt19937_64 rng(present ? 1 : 2);
+  LsmStorage::Stats before = lsm.get_stats();
+  Clock::time_point start = Clock::now();
+  std::string value;
+  uint64_t ts, found = 0;
+  for (uint64_t i = 0; i < num_reads; i++) {
+    uint64_t k = rng() % num_keys;
+    found += table.read_snapshot(key_of(present ? k : num_keys + k), value, ts);
+  }
+  double elapsed = seconds_since(start);
+  LsmStorage::Stats after = lsm.get_stats();
+  double gets = double(after.num_gets - before.num_gets);
+  std::printf("  %-8s %9.0f gets/s   %5.2f runs searched/get   %5.2f skipped by bloom/get   (%llu found)\n",
+              present ? "present" : "absent", num_reads / elapsed,
+              (after.runs_probed - before.runs_probed) / gets,
+              (after.bloom_skips - before.bloom_skips) / gets, (unsigned long long) found);
+}
+
+}
+
+int main(int argc, char **argv)
+{
+  std::string dir = argc > 1 ? argv[1] : "/tmp";
+  size_t memtable_mb = argc > 2 ? size_t(std::atoi(argv[2])) : 16;
+  unsigned multiple = argc > 3 ? unsigned(std::atoi(argv[3])) : 5;
+
+  size_t memtable_bytes = memtable_mb << 20;
+  uint64_t entry_len = key_of(0).size() + VALUE_LEN;
+  uint64_t num_keys = memtable_bytes * multiple / entry_len;
+  Storage::configure(dir, memtable_bytes);
+  Table table("bench", Storage::LSM);
+  LsmStorage &lsm = dynamic_cast<LsmStorage &>(*table.get_storage());
+
+  std::printf("Loading %llu keys (%.0f MB, %ux the %zu MB memtable) in random order\n",
+              (unsigned long long) num_keys, num_keys * entry_len / 1048576.0, multiple, memtable_mb);
+  std::vector<uint64_t> order(num_keys);
+  for (uint64_t i = 0; i < num_keys; i++) {
+    order[i] = i;
+  }
+  std::shuffle(order.begin(), order.end(), std::mt19937_64(0));
+
+  std::string value(VALUE_LEN, 'v');
+  WriteSet writes;
+  Clock::time_point start = Clock::now();
+  for (uint64_t i = 0; i < num_keys; i += BATCH) {
+    // Lock the shards the batch writes to, in order
+    std::vector<unsigned> shards;
+    for (uint64_t j = i; j < std::min(num_keys, i + BATCH); j++) {
+      std::string key = key_of(order[j]);
+      shards.push_back(Table::shard_of(key));
+      writes.set(&table, key, value);
+    }
+    std::sort(shards.begin(), shards.end());
+    shards.erase(std::unique(shards.begin(), shards.end()), shards.end());
+    for (unsigned shard : shards) {
+      table.lock_shard(shard);
+    }
+    writes.commit();
+    for (unsigned shard : shards) {
+      table.unlock_shard(shard);
+    }
+  }
+  double load_seconds = seconds_since(start);
+  lsm.wait_compactions();
+  double total_seconds = seconds_since(start);
+
+  LsmStorage::Stats stats = lsm.get_stats();
+  double loaded = double(num_keys * entry_len);
+  std::printf("  load     %9.0f sets/s   (%.1f s, %.1f s with compactions)\n",
+              num_keys / load_seconds, load_seconds, total_seconds);
+  std::printf("  write amplification %.2f: flushed %.0f MB, compacted %.0f MB in %llu compactions\n",
+              (stats.bytes_flushed + stats.bytes_compacted) / loaded, stats.bytes_flushed / 1048576.0,
+              stats.bytes_compacted / 1048576.0, (unsigned long long) stats.num_compactions);
+
+  std::vector<unsigned> shape = lsm.get_shape(0);
+  std::printf("  shard 0: %u L0 runs", shape[0]);
+  for (size_t i = 1; i < shape.size(); i++) {
+    std::printf(", L%zu %s", i, shape[i] ? "full" : "empty");
+  }
+  std::printf("\n");
+
+  uint64_t num_reads = std::min<uint64_t>(num_keys, 200000);
+  read_keys(table, lsm, num_keys, num_reads, true);
+  read_keys(table, lsm, num_keys, num_reads, false);
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  std::printf("  peak RSS %.0f MB\n", usage.ru_maxrss / 1024.0);
+  return 0;
+}
@@ -0,0 +1,202 @@
+// Microbenchmark for the index of a Table's committed data.
+// Compares std::map and FlatHashMap (Table's earlier indexes, the
+// latter still used by WriteSet) against Table itself, for inserting
+// N keys, looking up all of them in random order, and looking up N
+// keys that aren't present. Table is measured through its lock
+// holder's lookup (get()) and its snapshot read (get_snapshot(),
+// which takes no lock) for hits, and has_key() for misses; its index
+// lets snapshot reads run alongside commits, at the cost of an
+// allocation per key and per version.
+//
+// Usage: ./bench_table [num_keys...]   (default: 1000000 10000000 50000000)
+//
+// Note that 50M keys need several GB of memory per index.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+#include "flat_hash_map.h"
+#include "commit_clock.h"
+#include "table.h"
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+double ns_per_op(Clock::time_point start, size_t n)
+{
+  return std::chrono::duration<double, std::nano>(Clock::now() - start).count() / n;
+}
+
+// Keys of varying length, like "user_12345" (short enough to be
+// stored inline) and "session_12345_..." (too long to be)
+std::string make_key(size_t i)
+{
+  if (i % 4 == 0) {
+    return "session_" + std::to_string(i) + "_payload_index";
+  }
+  return "user_" + std::to_string(i);
+}
+
+struct Result {
+  double insert, hit, miss;
+};
+
+Result bench_std_map(const std::vector<std::string> &keys, const std::vector<size_t> &order)
+{
+  Result r;
+  size_t n = keys.size();
+  std::map<std::string, std::string> map;
+
+  Clock::time_point start = Clock::now();
+  for (size_t i = 0; i < n; i++) {
+    map[keys[i]] = "42";
+  }
+  r.insert = ns_per_op(start, n);
+
+  size_t found = 0;
+  start = Clock::now();
+  for (size_t i : order) {
+    found += map.find(keys[i]) != map.end();
+  }
+  r.hit = ns_per_op(start, n);
+
+  std::string missing;
+  start = Clock::now();
+  for (size_t i : order) {
+    missing = keys[i];
+    missing[0] = 'X';
+    found += map.find(missing) != map.end();
+  }
+  r.miss = ns_per_op(start, n);
+
+  if (found != n) {
+    std::fprintf(stderr, "std::map lookups failed\n");
+    std::exit(1);
+  }
+  return r;
+}
+
+Result bench_flat_hash_map(const std::vector<std::string> &keys, const std::vector<size_t> &order)
+{
+  Result r;
+  size_t n = keys.size();
+  FlatHashMap<std::string> map;
+
+  Clock::time_point start = Clock::now();
+  for (size_t i = 0; i < n; i++) {
+    map[keys[i]] = "42";
+  }
+  r.insert = ns_per_op(start, n);
+
+  size_t found = 0;
+  start = Clock::now();
+  for (size_t i : order) {
+    found += map.find(keys[i]) != nullptr;
+  }
+  r.hit = ns_per_op(start, n);
+
+  std::string missing;
+  start = Clock::now();
+  for (size_t i : order) {
+    missing = keys[i];
+    missing[0] = 'X';
+    found += map.find(missing) != nullptr;
+  }
+  r.miss = ns_per_op(start, n);
+
+  if (found != n) {
+    std::fprintf(stderr, "FlatHashMap lookups failed\n");
+    std::exit(1);
+  }
+  return r;
+}
+
+// Keys are inserted as recovered versions, which go straight into
+// the shards' indexes
+Result bench_table(const std::vector<std::string> &keys, const std::vector<size_t> &order, double &snapshot_hit)
+{
+  Result r;
+  size_t n = keys.size();
+  Table table("bench");
+  CommitClock::recover(1);
+
+  Clock::time_point start = Clock::now();
+  for (size_t i = 0; i < n; i++) {
+    table.recover(keys[i], "42", 1);
+  }
+  r.insert = ns_per_op(start, n);
+
+  size_t found = 0;
+  start = Clock::now();
+  for (size_t i : order) {
+    found += table.get(keys[i]).size() == 2;
+  }
+  r.hit = ns_per_op(start, n);
+
+  start = Clock::now();
+  for (size_t i : order) {
+    found += table.get_snapshot(keys[i]).size() == 2;
+  }
+  snapshot_hit = ns_per_op(start, n);
+
+  std::string missing;
+  start = Clock::now();
+  for (size_t i : order) {
+    missing = keys[i];
+    missing[0] = 'X';
+    found += table.has_key(missing);
+  }
+  r.miss = ns_per_op(start, n);
+
+  if (found != 2 * n) {
+    std::fprintf(stderr, "Table lookups failed\n");
+    std::exit(1);
+  }
+  return r;
+}
+
+void report(const char *name, const Result &r)
+{
+  std::printf("  %-12s insert %7.1f ns   hit %7.1f ns   miss %7.1f ns\n", name, r.insert, r.hit, r.miss);
+}
+
+}
+
+int main(int argc, char **argv)
+{
+  std::vector<size_t> sizes;
+  for (int i = 1; i < argc; i++) {
+    sizes.push_back(std::strtoul(argv[i], nullptr, 10));
+  }
+  if (sizes.empty()) {
+    sizes = { 1000000, 10000000, 50000000 };
+  }
+
+  for (size_t n : sizes) {
+    std::vector<std::string> keys;
+    keys.reserve(n);
+    for (size_t i = 0; i < n; i++) {
+      keys.push_back(make_key(i));
+    }
+    std::vector<size_t> order(n);
+    for (size_t i = 0; i < n; i++) {
+      order[i] = i;
+    }
+    std::shuffle(order.begin(), order.end(), std::mt19937_64(n));
+
+    std::printf("%zu keys:\n", n);
+    report("std::map", bench_std_map(keys, order));
+    report("FlatHashMap", bench_flat_hash_map(keys, order));
+    double snapshot_hit;
+    report("Table", bench_table(keys, order, snapshot_hit));
+    std::printf("  %-12s                    hit %7.1f ns\n", "(snapshot)", snapshot_hit);
+  }
+
+  return 0;
+}
@@ -0,0 +1,107 @@
+// Benchmark for group commit in the write-ahead log.
+// Several threads commit concurrently (appending a record and waiting
+// until it is durable), first with a sync per commit and then with
+// group commit at a range of batching windows, and finally group
+// commit through io_uring. Reports commits/sec and the average number
+// of commits per fdatasync().
+//
+// Usage: ./bench_wal [log file] [threads] [seconds per run]
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include <unistd.h>
+#include "guard.h"
+#include "wal.h"
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+struct Run {
+  Wal *wal;
+  pthread_mutex_t commit_lock; // stands in for the commit clock's lock
+  std::atomic<bool> stop;
+  std::atomic<uint64_t> commits;
+};
+
+void *committer(void *arg)
+{
+  Run *run = static_cast<Run *>(arg);
+  WalRecord record;
+  std::string key = "key", value(32, 'v');
+  uint64_t ts = 0;
+  while (!run->stop.load()) {
+    uint64_t lsn;
+    {
+      Guard g(run->commit_lock);
+      record.begin_commit(++ts);
+      record.add_write("bench", key, value);
+      lsn = run->wal->append(record.finish());
+    }
+    run->wal->wait_durable(lsn);
+    run->commits++;
+  }
+  return nullptr;
+}
+
+void bench(const std::string &path, Wal::Durability durability, unsigned window_us,
+           unsigned nthreads, double seconds, bool use_io_uring = false)
+{
+  unlink(path.c_str());
+  Run run;
+  run.wal = new Wal(path, durability, window_us, use_io_uring);
+  run.wal->open(0);
+  pthread_mutex_init(&run.commit_lock, nullptr);
+  run.stop = false;
+  run.commits = 0;
+
+  std::vector<pthread_t> threads(nthreads);
+  Clock::time_point start = Clock::now();
+  for (pthread_t &t : threads) {
+    pthread_create(&t, nullptr, committer, &run);
+  }
+  usleep(useconds_t(seconds * 1e6));
+  run.stop = true;
+  for (pthread_t &t : threads) {
+    pthread_join(t, nullptr);
+  }
+  double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+  uint64_t syncs = run.wal->get_num_syncs();
+  if (durability == Wal::SYNC) {
+    std::printf("  sync per commit       ");
+  } else if (run.wal->is_using_io_uring()) {
+    std::printf("  window %6u io_uring", window_us);
+  } else {
+    std::printf("  window %6u us      ", window_us);
+  }
+  std::printf("%9.0f commits/s   %6.1f commits/sync\n",
+              run.commits / elapsed, syncs ? double(run.commits) / syncs : 0.0);
+
+  delete run.wal;
+  pthread_mutex_destroy(&run.commit_lock);
+  unlink(path.c_str());
+}
+
+}
+
+int main(int argc, char **argv)
+{
+  std::string path = (argc > 1) ? argv[1] : "bench_wal.log";
+  unsigned nthreads = (argc > 2) ? unsigned(std::atoi(argv[2])) : 16;
+  double seconds = (argc > 3) ? std::atof(argv[3]) : 2.0;
+
+  std::printf("%u committing threads, log file %s:\n", nthreads, path.c_str());
+  bench(path, Wal::SYNC, 0, nthreads, seconds);
+  const unsigned windows[] = { 0, 50, 200, 1000, 5000 };
+  for (unsigned window_us : windows) {
+    bench(path, Wal::BATCHED, window_us, nthreads, seconds);
+  }
+  bench(path, Wal::BATCHED, 0, nthreads, seconds, true);
+  return 0;
+}
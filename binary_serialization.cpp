@@ -0,0 +1,210 @@
+#include <charconv>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include "exceptions.h"
+#include "message.h"
+#include "binary_serialization.h"
+
+namespace {
+
+// Maximum number of arguments in a decoded message
+const unsigned MAX_ARGS = Message::MAX_ARGS;
+
+// Enough for the decimal representation of any int64
+const size_t MAX_INT_DIGITS = 20;
+
+void put_u32(char *buf, uint32_t val) {
+    buf[0] = char(val >> 24);
+    buf[1] = char(val >> 16);
+    buf[2] = char(val >> 8);
+    buf[3] = char(val);
+}
+
+uint32_t get_u32(const char *buf) {
+    const unsigned char *p = reinterpret_cast<const unsigned char *>(buf);
+    return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | uint32_t(p[3]);
+}
+
+void put_i64(char *buf, int64_t val) {
+    uint64_t u = uint64_t(val);
+    put_u32(buf, uint32_t(u >> 32));
+    put_u32(buf + 4, uint32_t(u));
+}
+
+int64_t get_i64(const char *buf) {
+    return int64_t((uint64_t(get_u32(buf)) << 32) | get_u32(buf + 4));
+}
+
+void put_header(char *buf, MessageType type, unsigned argc, size_t frame_len) {
+    put_u32(buf, uint32_t(frame_len - BinarySerialization::LENGTH_FIELD_LEN));
+    buf[4] = char(type);
+    buf[5] = char(argc);
+}
+
+// Frames of the messages without arguments, indexed by MessageType
+struct FrameTable {
+    char frames[size_t(LAST_MESSAGE_TYPE) + 1][BinarySerialization::HEADER_LEN];
+
+    FrameTable() {
+        for (size_t i = 0; i <= size_t(LAST_MESSAGE_TYPE); i++) {
+            put_header(frames[i], MessageType(i), 0, BinarySerialization::HEADER_LEN);
+        }
+    }
+};
+
+const FrameTable FRAME_TABLE;
+
+// Whether the arguments of a message of the given type are values
+// that should be sent as integers when possible
+bool has_value_args(MessageType type) {
+    return type == MessageType::PUSH || type == MessageType::DATA || type == MessageType::MPUSH
+        || type == MessageType::INCRBY;
+}
+
+}
+
+size_t BinarySerialization::frame_length(std::string_view buf) {
+    if (buf.size() < LENGTH_FIELD_LEN) {
+        return 0;
+    }
+    return LENGTH_FIELD_LEN + get_u32(buf.data());
+}
+
+std::string_view BinarySerialization::frame(MessageType type) {
+    return std::string_view(FRAME_TABLE.frames[size_t(type)], HEADER_LEN);
+}
+
+size_t BinarySerialization::encode_bytes_prefix(MessageType type, size_t len, char *buf) {
+    put_header(buf, type, 1, BYTES_FRAME_PREFIX_LEN + len);
+    buf[HEADER_LEN] = char(ARG_BYTES);
+    put_u32(buf + HEADER_LEN + 1, uint32_t(len));
+    return BYTES_FRAME_PREFIX_LEN;
+}
+
+size_t BinarySerialization::encode_int(MessageType type, int64_t value, char *buf) {
+    put_header(buf, type, 1, INT_FRAME_LEN);
+    buf[HEADER_LEN] = char(ARG_INT);
+    put_i64(buf + HEADER_LEN + 1, value);
+    return INT_FRAME_LEN;
+}
+
+bool BinarySerialization::parse_int(std::string_view s, int64_t &value) {
+    if (s.empty() || s.size() > MAX_INT_DIGITS) {
+        return false;
+    }
+    const char *end = s.data() + s.size();
+    std::from_chars_result res = std::from_chars(s.data(), end, value);
+    if (res.ec != std::errc() || res.ptr != end) {
+        return false;
+    }
+    // Reject non-canonical forms such as "007" or "-0", which
+    // wouldn't survive the round trip
+    char buf[MAX_INT_DIGITS];
+    std::to_chars_result out = std::to_chars(buf, buf + sizeof(buf), value);
+    return std::string_view(buf, out.ptr - buf) == s;
+}
+
+namespace {
+
+void append_arg(MessageType type, const std::string &arg, std::string &encoded_msg) {
+    int64_t value;
+    char buf[9];
+    if (has_value_args(type) && BinarySerialization::parse_int(arg, value)) {
+        buf[0] = char(BinarySerialization::ARG_INT);
+        put_i64(buf + 1, value);
+        encoded_msg.append(buf, 9);
+    } else {
+        buf[0] = char(BinarySerialization::ARG_BYTES);
+        put_u32(buf + 1, uint32_t(arg.size()));
+        encoded_msg.append(buf, 5);
+        encoded_msg += arg;
+    }
+}
+
+}
+
+void BinarySerialization::encode(const Message &msg, std::string &encoded_msg) {
+    MessageType type = msg.get_message_type();
+    unsigned argc = msg.get_num_args();
+
+    encoded_msg.assign(HEADER_LEN, '\0');
+    for (unsigned i = 0; i < argc; i++) {
+        append_arg(type, msg.get_arg(i), encoded_msg);
+    }
+
+    if (encoded_msg.size() > MAX_FRAME_LEN) {
+        throw InvalidMessage("Encoded message exceeds maximum length");
+    }
+    put_header(&encoded_msg[0], type, argc, encoded_msg.size());
+}
+
+void BinarySerialization::encode_data(const std::string *values, unsigned num_values, std::string &encoded_msg) {
+    size_t start = encoded_msg.size();
+    encoded_msg.append(HEADER_LEN, '\0');
+    for (unsigned i = 0; i < num_values; i++) {
+        append_arg(MessageType::DATA, values[i], encoded_msg);
+    }
+
+    size_t len = encoded_msg.size() - start;
+    if (len > MAX_FRAME_LEN || num_values > MAX_ARGS) {
+        encoded_msg.resize(start);
+        throw InvalidMessage("Encoded message exceeds maximum length");
+    }
+    put_header(&encoded_msg[start], MessageType::DATA, num_values, len);
+}
+
+void BinarySerialization::decode(std::string_view encoded_msg, Message &msg) {
+    if (encoded_msg.size() < HEADER_LEN || encoded_msg.size() > MAX_FRAME_LEN
+        || frame_length(encoded_msg) != encoded_msg.size()) {
+        throw InvalidMessage("Invalid message. ");
+    }
+
+    unsigned char opcode = (unsigned char) encoded_msg[4];
+    unsigned argc = (unsigned char) encoded_msg[5];
+    if (opcode == 0 || opcode > (unsigned char) LAST_MESSAGE_TYPE || argc > MAX_ARGS) {
+        throw InvalidMessage("Invalid message. ");
+    }
+
+    std::string_view args[MAX_ARGS];
+    char digits[MAX_ARGS][MAX_INT_DIGITS];
+    size_t pos = HEADER_LEN;
+    for (unsigned i = 0; i < argc; i++) {
+        if (pos + 1 > encoded_msg.size()) {
+            throw InvalidMessage("Invalid message. ");
+        }
+        uint8_t tag = uint8_t(encoded_msg[pos++]);
+        if (tag == ARG_INT) {
+            if (pos + 8 > encoded_msg.size()) {
+                throw InvalidMessage("Invalid message. ");
+            }
+            int64_t value = get_i64(encoded_msg.data() + pos);
+            pos += 8;
+            std::to_chars_result out = std::to_chars(digits[i], digits[i] + MAX_INT_DIGITS, value);
+            args[i] = std::string_view(digits[i], out.ptr - digits[i]);
+        } else if (tag == ARG_BYTES) {
+            if (pos + 4 > encoded_msg.size()) {
+                throw InvalidMessage("Invalid message. ");
+            }
+            size_t len = get_u32(encoded_msg.data() + pos);
+            pos += 4;
+            if (len > encoded_msg.size() - pos) {
+                throw InvalidMessage("Invalid message. ");
+            }
+            args[i] = encoded_msg.substr(pos, len);
+            pos += len;
+        } else {
+            throw InvalidMessage("Invalid message. ");
+        }
+    }
+    if (pos != encoded_msg.size()) {
+        throw InvalidMessage("Invalid message. ");
+    }
+
+    msg.set_message_type(MessageType(opcode));
+    msg.set_args(args, argc);
+
+    if (!msg.is_valid()) {
+        throw InvalidMessage("Invalid message. ");
+    }
+}
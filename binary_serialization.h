@@ -0,0 +1,77 @@
+#ifndef BINARY_SERIALIZATION_H
+#define BINARY_SERIALIZATION_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include "message.h"
+
+// Binary wire protocol. A client selects it by sending MAGIC as the
+// first byte on the connection; otherwise the connection uses the
+// text protocol (see MessageSerialization).
+//
+// Each message is a frame:
+//
+//   u32 length   number of bytes following the length field
+//   u8  opcode   the MessageType value
+//   u8  argc
+//   argc arguments, each either
+//     u8 ARG_BYTES, u32 length, bytes   (any bytes, including whitespace)
+//     u8 ARG_INT, i64 value
+//
+// Multi-byte integers are in network byte order. Integer arguments
+// are decoded to their decimal representation, so that the rest of
+// the server sees the same Message either way.
+namespace BinarySerialization {
+    const char MAGIC = char(0xB1);
+
+    const uint8_t ARG_BYTES = 0;
+    const uint8_t ARG_INT = 1;
+
+    // Size of the frame length field, and of the fixed frame header
+    // (length, opcode and argc)
+    const size_t LENGTH_FIELD_LEN = 4;
+    const size_t HEADER_LEN = 6;
+
+    // Maximum total frame length
+    const size_t MAX_FRAME_LEN = 16 * 1024 * 1024;
+
+    // Total length of the frame at the start of buf, as given by its
+    // length field (the frame may not have been received completely),
+    // or 0 if buf doesn't contain the length field yet
+    size_t frame_length(std::string_view buf);
+
+    // Complete encoding of a message of the given type without arguments
+    std::string_view frame(MessageType type);
+
+    // Encode a frame with a single bytes argument of length len into
+    // buf, except for the argument's bytes, which must follow.
+    // Returns the number of bytes written (BYTES_FRAME_PREFIX_LEN).
+    const size_t BYTES_FRAME_PREFIX_LEN = HEADER_LEN + 1 + 4;
+    size_t encode_bytes_prefix(MessageType type, size_t len, char *buf);
+
+    // Encode a complete frame with a single integer argument into buf.
+    // Returns the number of bytes written (INT_FRAME_LEN).
+    const size_t INT_FRAME_LEN = HEADER_LEN + 1 + 8;
+    size_t encode_int(MessageType type, int64_t value, char *buf);
+
+    // Check whether s is the canonical decimal representation of
+    // an int64 (and so can be sent as an integer argument)
+    bool parse_int(std::string_view s, int64_t &value);
+
+    // Arguments of PUSH, MPUSH, INCRBY and DATA messages that are
+    // integers are sent as ARG_INT, everything else as ARG_BYTES
+    void encode(const Message &msg, std::string &encoded_msg);
+
+    // Encode a DATA frame with the given values as its arguments,
+    // appending it to encoded_msg (the arguments are encoded as by
+    // encode(), without building a Message)
+    void encode_data(const std::string *values, unsigned num_values, std::string &encoded_msg);
+
+    // Decode the complete frame in encoded_msg. As with
+    // MessageSerialization::decode(), msg's argument storage is reused.
+    void decode(std::string_view encoded_msg, Message &msg);
+};
+
+#endif // BINARY_SERIALIZATION_H
@@ -0,0 +1,51 @@
+#ifndef BLOOM_FILTER_H
+#define BLOOM_FILTER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Bloom filter over key hashes (e.g. from FlatHashMap::hash()). With
+// BITS_PER_KEY bits per key and NUM_PROBES probes, about 1% of the keys
+// not added are reported as possibly present. The probes are derived
+// from the one hash by double hashing.
+class BloomFilter {
+public:
+  static const size_t BITS_PER_KEY = 10;
+  static const unsigned NUM_PROBES = 7;
+
+private:
+  std::vector<uint64_t> m_bits;
+  uint64_t m_num_bits;
+
+  static uint64_t rotate( uint64_t hash ) { return (hash >> 32) | (hash << 32); }
+
+public:
+  BloomFilter( size_t num_keys )
+    : m_bits( (num_keys * BITS_PER_KEY + 63) / 64 + 1 )
+    , m_num_bits( m_bits.size() * 64 )
+  { }
+
+  void add( uint64_t hash ) {
+    uint64_t delta = rotate(hash) | 1;
+    for (unsigned i = 0; i < NUM_PROBES; i++) {
+      uint64_t bit = hash % m_num_bits;
+      m_bits[bit / 64] |= uint64_t(1) << (bit % 64);
+      hash += delta;
+    }
+  }
+
+  bool may_contain( uint64_t hash ) const {
+    uint64_t delta = rotate(hash) | 1;
+    for (unsigned i = 0; i < NUM_PROBES; i++) {
+      uint64_t bit = hash % m_num_bits;
+      if ((m_bits[bit / 64] & (uint64_t(1) << (bit % 64))) == 0) {
+        return false;
+      }
+      hash += delta;
+    }
+    return true;
+  }
+};
+
+#endif // BLOOM_FILTER_H
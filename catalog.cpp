@@ -0,0 +1,100 @@
+#include "catalog.h"
+#include "flat_hash_map.h"
+#include "table.h"
+
+namespace {
+
+const size_t INITIAL_SLOTS = 16;
+
+size_t hash_of( std::string_view name )
+{
+  return FlatHashMap<Table *>::hash(name);
+}
+
+}
+
+Catalog::Catalog()
+  : m_index( new_index(INITIAL_SLOTS) )
+  , m_size( 0 )
+{
+}
+
+Catalog::~Catalog()
+{
+  delete_index(m_index.load());
+  for (Index *index : m_retired) {
+    delete_index(index);
+  }
+}
+
+Catalog::Index *Catalog::new_index( size_t num_slots )
+{
+  Index *index = new Index;
+  index->mask = num_slots - 1;
+  index->slots = new Slot[num_slots];
+  for (size_t i = 0; i < num_slots; i++) {
+    index->slots[i].hash = 0;
+    index->slots[i].table.store(nullptr, std::memory_order_relaxed);
+  }
+  return index;
+}
+
+void Catalog::delete_index( Index *index )
+{
+  delete[] index->slots;
+  delete index;
+}
+
+// Store the table in the first empty slot of its probe sequence
+void Catalog::fill( Index *index, size_t hash, Table *table )
+{
+  size_t i = hash & index->mask;
+  while (index->slots[i].table.load(std::memory_order_relaxed) != nullptr) {
+    i = (i + 1) & index->mask;
+  }
+  index->slots[i].hash = hash;
+  index->slots[i].table.store(table, std::memory_order_release);
+}
+
+Table *Catalog::find( std::string_view name ) const
+{
+  size_t hash = hash_of(name);
+  const Index *index = m_index.load(std::memory_order_acquire);
+  for (size_t i = hash & index->mask; ; i = (i + 1) & index->mask) {
+    Table *table = index->slots[i].table.load(std::memory_order_acquire);
+    if (table == nullptr) {
+      return nullptr;
+    }
+    if (index->slots[i].hash == hash && table->get_name() == name) {
+      return table;
+    }
+  }
+}
+
+bool Catalog::insert( Table *table )
+{
+  if (find(table->get_name()) != nullptr) {
+    return false;
+  }
+
+  size_t hash = hash_of(table->get_name());
+  Index *index = m_index.load(std::memory_order_relaxed);
+  if (2 * (m_size + 1) > index->mask + 1) {
+    // The new array is filled before it is published, so lookups find
+    // every table in whichever array they probe
+    Index *grown = new_index(2 * (index->mask + 1));
+    for (size_t i = 0; i <= index->mask; i++) {
+      Table *t = index->slots[i].table.load(std::memory_order_relaxed);
+      if (t != nullptr) {
+        fill(grown, index->slots[i].hash, t);
+      }
+    }
+    fill(grown, hash, table);
+    m_index.store(grown, std::memory_order_release);
+    m_retired.push_back(index);
+  } else {
+    fill(index, hash, table);
+  }
+  m_size++;
+  return true;
+}
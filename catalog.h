@@ -0,0 +1,60 @@
+#ifndef CATALOG_H
+#define CATALOG_H
+
+#include <atomic>
+#include <cstddef>
+#include <string_view>
+#include <vector>
+
+class Table; // forward declaration
+
+// Index of the tables by name, for the lookup every request makes.
+// Lookups take no lock and write no shared memory: they load the
+// published slot array and probe it. Tables are never dropped, so
+// slots only ever go from empty to filled, and an insertion fills one
+// in place (the table pointer is stored last, with release ordering).
+// When the array gets half full, insert() copies the tables into one
+// twice the size and publishes that instead. Replaced arrays are kept
+// until the catalog is destroyed, as lookups may still be probing
+// them; their sizes halve, so together they take no more memory than
+// the current one.
+class Catalog {
+private:
+  struct Slot {
+    size_t hash;                // valid once table is set
+    std::atomic<Table *> table; // null if the slot is empty
+  };
+
+  struct Index {
+    size_t mask; // number of slots - 1
+    Slot *slots;
+  };
+
+  std::atomic<Index *> m_index;
+  size_t m_size;
+  std::vector<Index *> m_retired;
+
+  // copy constructor and assignment operator are prohibited
+  Catalog( const Catalog & );
+  Catalog &operator=( const Catalog & );
+
+  static Index *new_index( size_t num_slots );
+  static void delete_index( Index *index );
+  static void fill( Index *index, size_t hash, Table *table );
+
+public:
+  Catalog();
+  ~Catalog();
+
+  // The table with the given name, or null. May be called from any
+  // thread, concurrently with insert().
+  Table *find( std::string_view name ) const;
+
+  // Add a table, unless there is one with its name already (returning
+  // false). Calls must be serialized by the caller.
+  bool insert( Table *table );
+
+  size_t size() const { return m_size; }
+};
+
+#endif // CATALOG_H
@@ -0,0 +1,31 @@
+#include "checksum.h"
+
+namespace {
+
+struct CrcTable {
+  uint32_t entries[256];
+
+  CrcTable() {
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t c = i;
+      for (int k = 0; k < 8; k++) {
+        c = (c & 1) ? (0xEDB88320u ^ (c >> 1)) : (c >> 1);
+      }
+      entries[i] = c;
+    }
+  }
+};
+
+const CrcTable CRC_TABLE;
+
+}
+
+uint32_t crc32( const void *data, size_t len, uint32_t crc )
+{
+  const unsigned char *p = static_cast<const unsigned char *>(data);
+  crc = ~crc;
+  for (size_t i = 0; i < len; i++) {
+    crc = CRC_TABLE.entries[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+  }
+  return ~crc;
+}
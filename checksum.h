@@ -0,0 +1,11 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <cstddef>
+#include <cstdint>
+
+// CRC-32 (IEEE 802.3 polynomial) of the given bytes. A checksum can be
+// computed in pieces by passing the previous result as crc.
+uint32_t crc32( const void *data, size_t len, uint32_t crc = 0 );
+
+#endif // CHECKSUM_H
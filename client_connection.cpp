@@ -1,3 +1,7 @@
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cerrno>
 #include <exception>
 #include <iostream>
 #include <cassert>
@@ -5,279 +9,914 @@
 #include <string>
 #include <unistd.h>
 #include <vector>
-#include "csapp.h"
+#include <sys/socket.h>
 #include "message.h"
 #include "message_serialization.h"
+#include "binary_serialization.h"
 #include "server.h"
 #include "exceptions.h"
 #include "client_connection.h"
+#include "event_loop.h"
 #include "table.h"
+#include "commit_clock.h"
 
-ClientConnection::ClientConnection( Server *server, int client_fd )
+namespace {
+
+// Maximum number of bytes read from a client socket per readiness
+// event, so that one busy client can't starve the others
+const size_t MAX_READ_PER_EVENT = 64 * 1024;
+
+// Longest a transaction waits for a shard lock before it is aborted,
+// in case the holder's client is slow or has stalled
+const uint64_t LOCK_WAIT_TIMEOUT_MS = 500;
+
+uint64_t now_ms() {
+  return uint64_t(std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+}
+
+ClientConnection::ClientConnection( Server *server, EventLoop *loop, int client_fd )
   : m_server( server )
+  , m_loop( loop )
   , m_client_fd( client_fd )
+  , m_in_pos( 0 )
+  , m_in_end( 0 )
+  , m_protocol( UNDECIDED )
+  , m_peer_closed( false )
+  , m_blocked( false )
+  , m_lock_released( false )
   , autocommit_mode(true)
+  , txn_aborted(false)
+  , m_optimistic(false)
+  , m_readonly(false)
+  , m_snapshot(0)
+  , m_wait_lsn(0)
+  , m_txn_id(0)
+  , m_wait_start(0)
+  , m_wait_table(nullptr)
+  , m_wait_shard(0)
   , logged_in(false)
   , loop(true)
+  , m_table(nullptr)
 {
-  rio_readinitb( &m_fdbuf, m_client_fd );
 }
 
 ClientConnection::~ClientConnection()
 {
+  abort_transaction();
   close(m_client_fd);
 }
 
-void ClientConnection::chat_with_client()
+bool ClientConnection::read_input()
 {
-  while (loop) {
-    char buf[1024];
-    Message client_message;
-    ssize_t n = rio_readlineb(&m_fdbuf, buf, 1024);
-    if (n <= 0) {
-      break; // Handle no more info from client
+  // Discard consumed input before reading more
+  if (m_in_pos > 0) {
+    m_inbuf.erase(0, m_in_pos);
+    m_in_pos = 0;
+  }
+
+  size_t total = 0;
+  char buf[4096];
+  while (total < MAX_READ_PER_EVENT) {
+    ssize_t n = recv(m_client_fd, buf, sizeof(buf), 0);
+    if (n > 0) {
+      m_inbuf.append(buf, size_t(n));
+      total += size_t(n);
+    } else if (n == 0) {
+      m_peer_closed = true;
+      break;
+    } else if (errno == EINTR) {
+      continue;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      break;
+    } else {
+      return false;
     }
+  }
+
+  detect_protocol();
+  return true;
+}
+
+char *ClientConnection::prepare_input( size_t len )
+{
+  if (m_in_pos > 0) {
+    m_inbuf.erase(0, m_in_pos);
+    m_in_pos = 0;
+  }
+  m_in_end = m_inbuf.size();
+  m_inbuf.resize(m_in_end + len);
+  return &m_inbuf[m_in_end];
+}
+
+bool ClientConnection::input_received( int result )
+{
+  m_inbuf.resize(m_in_end + size_t(result > 0 ? result : 0));
+  if (result == 0) {
+    m_peer_closed = true;
+  } else if (result < 0 && result != -EINTR && result != -EAGAIN && result != -ECANCELED) {
+    return false;
+  }
+  detect_protocol();
+  return true;
+}
 
-    try{
-      MessageSerialization::decode(buf, client_message);
+void ClientConnection::output_sent( int result )
+{
+  if (result >= 0) {
+    m_outbuf.sent(size_t(result));
+  } else if (result != -EINTR && result != -EAGAIN) {
+    // Client went away: drop the output and end the session
+    m_outbuf.clear();
+    loop = false;
+  }
+}
+
+void ClientConnection::detect_protocol()
+{
+  if (m_protocol == UNDECIDED && !m_inbuf.empty()) {
+    if (m_inbuf[0] == BinarySerialization::MAGIC) {
+      m_protocol = BINARY;
+      m_in_pos = 1;
+    } else {
+      m_protocol = TEXT;
+    }
+  }
+}
+
+bool ClientConnection::flush_output()
+{
+  try {
+    return m_outbuf.flush(m_client_fd);
+  } catch (CommException &e) {
+    // Client went away: drop the output and end the session
+    m_outbuf.clear();
+    loop = false;
+    return true;
+  }
+}
+
+bool ClientConnection::is_output_durable() const
+{
+  Wal *wal = m_server->get_wal();
+  return wal == nullptr || wal->is_durable(m_wait_lsn);
+}
+
+bool ClientConnection::has_request() const
+{
+  return loop && front_request_length() != 0;
+}
+
+// Length of the request at the front of the input buffer, or 0 if it
+// hasn't been received completely. An overlong request counts as
+// received (with a length exceeding max_request_length()), so that it
+// gets rejected.
+size_t ClientConnection::front_request_length() const
+{
+  std::string_view pending(m_inbuf.data() + m_in_pos, m_inbuf.size() - m_in_pos);
+
+  if (m_protocol == BINARY) {
+    size_t len = BinarySerialization::frame_length(pending);
+    return (len > BinarySerialization::MAX_FRAME_LEN || len <= pending.size()) ? len : 0;
+  }
+
+  size_t eol = pending.find('\n');
+  if (eol != std::string_view::npos) {
+    return eol + 1;
+  }
+  size_t max_len = MessageSerialization::max_length(pending);
+  return pending.size() >= max_len ? max_len + 1 : 0;
+}
+
+// The maximum length of the request at the front of the input buffer
+size_t ClientConnection::max_request_length() const
+{
+  if (m_protocol == BINARY) {
+    return BinarySerialization::MAX_FRAME_LEN;
+  }
+  return MessageSerialization::max_length(std::string_view(m_inbuf.data() + m_in_pos, m_inbuf.size() - m_in_pos));
+}
+
+// The event loop resubmits the connection once it has it back (see
+// EventLoop::retry_deferred())
+void ClientConnection::lock_released()
+{
+  m_lock_released = true;
+  m_loop->wake();
+}
+
+void ClientConnection::process_requests()
+{
+  m_blocked = false;
+
+  // Pipelined requests are all executed in one go; their responses
+  // accumulate in m_outbuf and are sent together by the event loop
+  while (has_request()) {
+    size_t len = front_request_length();
+    if (len > max_request_length()) {
+      respond_error("Message too long");
+      return;
+    }
+
+    try {
+      std::string_view encoded(m_inbuf.data() + m_in_pos, len);
+      if (m_protocol == BINARY) {
+        BinarySerialization::decode(encoded, m_request);
+      } else {
+        MessageSerialization::decode(encoded, m_request);
+      }
     } catch (InvalidMessage& e) {
       respond_error("Invalid message type");
-      break; 
+      return;
     }
-    try {
-      switch(client_message.get_message_type()){
-        case MessageType::NONE:
-          respond_error("Invalid message type");
-          break;
-        case MessageType::LOGIN: {
-          logged_in = true;
-          respond_ok();
-          break;
+
+    handle_request(m_request);
+
+    // A blocked request stays at the front of the input buffer, and
+    // is executed again when the event loop retries it
+    if (m_blocked) {
+      return;
+    }
+    m_in_pos += len;
+  }
+}
+
+void ClientConnection::handle_request( const Message &client_message )
+{
+  // Once a request in a transaction has failed, everything up to the
+  // COMMIT is rejected, so that requests pipelined after the failure
+  // can't take effect outside of the transaction
+  if (txn_aborted) {
+    MessageType type = client_message.get_message_type();
+    if (type == MessageType::COMMIT) {
+      txn_aborted = false;
+      autocommit_mode = true;
+      respond_failed("Transaction was aborted. ");
+      return;
+    }
+    if (type != MessageType::BYE) {
+      respond_failed("Transaction was aborted, request ignored until COMMIT. ");
+      return;
+    }
+  }
+
+  try {
+    switch(client_message.get_message_type()){
+      case MessageType::NONE:
+        respond_error("Invalid message type");
+        break;
+      case MessageType::LOGIN: {
+        logged_in = true;
+        respond_ok();
+        break;
+      }
+      case MessageType::CREATE: {
+        handle_logged_in();
+        Storage::Kind kind = Storage::MEMORY;
+        if (client_message.get_num_args() == 2 && !Storage::parse_kind(client_message.get_arg(1), kind)) {
+          throw OperationException("Unknown storage engine. ");
         }
-        case MessageType::CREATE: {
-          handle_logged_in();
-          m_server->create_table(client_message.get_table());
-          respond_ok();
-          break;
+        m_wait_lsn = std::max(m_wait_lsn, m_server->create_table(client_message.get_table(), kind));
+        respond_ok();
+        break;
+      }
+      case MessageType::PUSH: {
+        handle_logged_in();
+        operand_stack.push(client_message.get_value());
+        respond_ok();
+        break;
+      }
+      case MessageType::POP: {
+        handle_logged_in();
+        if (operand_stack.is_empty()){
+          throw OperationException("Operand Stack was empty. ");
         }
-        case MessageType::PUSH: {
-          handle_logged_in();
-          operand_stack.push(client_message.get_value());
-          respond_ok();
-          break;
+        operand_stack.pop();
+        respond_ok();
+        break;
+      }
+      case MessageType::TOP: {
+        handle_logged_in();
+        if (operand_stack.is_empty()){
+          throw OperationException("Operand Stack was empty. ");
+        }
+        respond_value(operand_stack.top());
+        break;
+      }
+      case MessageType::SET: {
+        handle_logged_in();
+        handle_write();
+        Table *table = find_table(client_message.get_table());
+        if (operand_stack.is_empty()) {
+          throw OperationException("Operand Stack was empty. ");
         }
-        case MessageType::POP: {
-          handle_logged_in();
-          if (operand_stack.empty()){
-            throw OperationException("Operand Stack was empty. ");
+        if (m_optimistic) {
+          std::string value = operand_stack.top().take_string();
+          operand_stack.pop();
+          m_txn.set(table, client_message.get_key(), value);
+        } else if (autocommit_mode) {
+          // Don't hold up a worker thread waiting for the lock:
+          // leave the request queued and let the event loop retry it
+          unsigned shard = Table::shard_of(client_message.get_key());
+          if (!trylock_shard(table, shard)) {
+            m_blocked = true;
+            return;
           }
+          std::string value = operand_stack.top().take_string();
           operand_stack.pop();
-          respond_ok();
-          break;
+          m_writes.set(table, client_message.get_key(), std::move(value));
+          uint64_t ts = CommitClock::begin_commit();
+          m_log_record.begin_commit(ts);
+          m_writes.commit(ts, &m_log_record);
+          m_wait_lsn = std::max(m_wait_lsn, CommitClock::end_commit(ts, m_log_record));
+          table->unlock_shard(shard);
+        } else {
+          if (!lock_for_transaction(table, client_message.get_key(), true)) {
+            return;
+          }
+          std::string value = operand_stack.top().take_string();
+          operand_stack.pop();
+          m_writes.set(table, client_message.get_key(), std::move(value));
         }
-        case MessageType::TOP: {
-          handle_logged_in();
-          if (operand_stack.empty()){
-            throw OperationException("Operand Stack was empty. ");
+        respond_ok();
+        break;
+      }
+      case MessageType::GET: {
+        handle_logged_in();
+        Table *table = find_table(client_message.get_table());
+        if (m_optimistic) {
+          operand_stack.push(m_txn.get(table, client_message.get_key()));
+        } else if (m_readonly) {
+          operand_stack.push(table->get_snapshot(client_message.get_key(), m_snapshot));
+        } else if (autocommit_mode) {
+          // Reads the latest snapshot without taking any locks
+          operand_stack.push(table->get_snapshot(client_message.get_key()));
+        } else {
+          if (!lock_for_transaction(table, client_message.get_key(), false)) {
+            return;
           }
-          std::string top_value = operand_stack.top();
-          Message top(MessageType::DATA, {top_value});
-          std::string response;
-          MessageSerialization::encode(top, response);
-          rio_writen(m_client_fd, response.c_str(), response.length());
-          break;
+          operand_stack.push(m_writes.get(table, client_message.get_key()));
         }
-        case MessageType::SET: {
-          handle_logged_in();
-          Table *table = m_server->find_table(client_message.get_table());
-          if (table == nullptr) {
-            throw OperationException("Table does not exist. ");
+        respond_ok();
+        break;
+      }
+      case MessageType::MPUSH: {
+        handle_logged_in();
+        for (unsigned i = 0; i < client_message.get_num_args(); i++) {
+          operand_stack.push(client_message.get_arg(i));
+        }
+        respond_ok();
+        break;
+      }
+      case MessageType::MSET: {
+        handle_logged_in();
+        handle_write();
+        Table *table = find_table(client_message.get_table());
+        unsigned num_keys = client_message.get_num_args() - 1;
+        if (operand_stack.size() < num_keys) {
+          throw OperationException("Not enough values on Operand Stack. ");
+        }
+        if (!m_optimistic && autocommit_mode) {
+          // All of the keys' shards are locked (or the request is
+          // retried, as for SET) before anything is taken off the stack
+          if (!trylock_shards(table, client_message)) {
+            m_blocked = true;
+            return;
           }
-          if (autocommit_mode) {
-            table->lock();
-            std::string value = operand_stack.top();
-            operand_stack.pop();
-            table->set(client_message.get_key(), value);
-            table->commit_changes();
-            table->unlock();
-          } else {
-            if (table->trylock()) {
-              std::string value = operand_stack.top();
-              operand_stack.pop();
-              locked_tables.push_back(table);
-              table->set(client_message.get_key(), value);
-            } else { // table alr locked
-              throw FailedTransaction("Couldn't aquire lock for requested table");
+        } else if (!m_optimistic) {
+          // Shards already locked stay locked if the request waits
+          for (unsigned i = 1; i <= num_keys; i++) {
+            if (!lock_for_transaction(table, client_message.get_arg(i), true)) {
+              return;
             }
           }
-          respond_ok();
-          break;
         }
-        case MessageType::GET: {
-          handle_logged_in();
-          Table *table = m_server->find_table(client_message.get_table());
-          if (table == nullptr) {
-            throw OperationException("Table does not exist. ");
+
+        // The values were pushed in the order of the keys, so the last
+        // key's is on top. Keys are set in order, so that if a key is
+        // repeated its last value wins, as with separate SETs.
+        m_values.resize(num_keys);
+        for (unsigned i = num_keys; i > 0; i--) {
+          m_values[i - 1] = operand_stack.top().take_string();
+          operand_stack.pop();
+        }
+        for (unsigned i = 1; i <= num_keys; i++) {
+          if (m_optimistic) {
+            m_txn.set(table, client_message.get_arg(i), m_values[i - 1]);
+          } else {
+            m_writes.set(table, client_message.get_arg(i), std::move(m_values[i - 1]));
           }
-          operand_stack.push(table->get(client_message.get_key()));
-          respond_ok();
-          break;
         }
-        case MessageType::ADD: {
-          handle_logged_in();
-          if (operand_stack.size() < 2) {
-            throw OperationException("Less than 2 values on Operand Stack. ");
+
+        if (!m_optimistic && autocommit_mode) {
+          // One commit (and log record) for all of the keys
+          uint64_t ts = CommitClock::begin_commit();
+          m_log_record.begin_commit(ts);
+          m_writes.commit(ts, &m_log_record);
+          m_wait_lsn = std::max(m_wait_lsn, CommitClock::end_commit(ts, m_log_record));
+          for (unsigned shard : m_shards) {
+            table->unlock_shard(shard);
           }
-          std::string val1 = operand_stack.top();
-          int num1 = string_to_int(val1);
-          operand_stack.pop();
-          std::string val2 = operand_stack.top();
-          int num2 = string_to_int(val2);
-          operand_stack.pop();
-          operand_stack.push(std::to_string(num2 + num1));
-          respond_ok();
-          break;
         }
-        case MessageType::SUB: {
-          handle_logged_in();
-          if (operand_stack.size() < 2) {
-            throw OperationException("Less than 2 values on Operand Stack. ");
+        respond_ok();
+        break;
+      }
+      case MessageType::MGET: {
+        handle_logged_in();
+        Table *table = find_table(client_message.get_table());
+        unsigned num_keys = client_message.get_num_args() - 1;
+        m_values.resize(num_keys);
+        for (unsigned i = 1; i <= num_keys; i++) {
+          const std::string &key = client_message.get_arg(i);
+          if (m_optimistic) {
+            m_values[i - 1] = m_txn.get(table, key);
+          } else if (m_readonly) {
+            m_values[i - 1] = table->get_snapshot(key, m_snapshot);
+          } else if (autocommit_mode) {
+            // Each key is read from the latest snapshot, as by GET
+            m_values[i - 1] = table->get_snapshot(key);
+          } else {
+            if (!lock_for_transaction(table, key, false)) {
+              return;
+            }
+            m_values[i - 1] = m_writes.get(table, key);
           }
-          std::string val1 = operand_stack.top();
-          int num1 = string_to_int(val1);
-          operand_stack.pop();
-          std::string val2 = operand_stack.top();
-          int num2 = string_to_int(val2);
-          operand_stack.pop();
-          operand_stack.push(std::to_string(num2 - num1));
-          respond_ok();
-          break;
         }
-        case MessageType::MUL: {
-          handle_logged_in();
-          if (operand_stack.size() < 2) {
-            throw OperationException("Less than 2 values on Operand Stack. ");
+        respond_values(m_values.data(), num_keys);
+        break;
+      }
+      case MessageType::INCR:
+      case MessageType::DECR:
+      case MessageType::INCRBY: {
+        handle_logged_in();
+        handle_write();
+        Table *table = find_table(client_message.get_table());
+        const std::string &key = client_message.get_key();
+        int64_t delta = 1;
+        if (client_message.get_message_type() == MessageType::DECR) {
+          delta = -1;
+        } else if (client_message.get_message_type() == MessageType::INCRBY) {
+          delta = Value::parse_int(client_message.get_arg(2));
+        }
+        std::string value;
+        if (m_optimistic) {
+          value = std::to_string(Value::add(Value::parse_int(m_txn.get(table, key)), delta));
+          m_txn.set(table, key, value);
+        } else if (autocommit_mode) {
+          // Read, update and commit the key under its shard's lock, in
+          // one request (retried later if the lock is busy, as for SET)
+          unsigned shard = Table::shard_of(key);
+          if (!trylock_shard(table, shard)) {
+            m_blocked = true;
+            return;
           }
-          std::string val1 = operand_stack.top();
-          int num1 = string_to_int(val1);
-          operand_stack.pop();
-          std::string val2 = operand_stack.top();
-          int num2 = string_to_int(val2);
-          operand_stack.pop();
-          operand_stack.push(std::to_string(num2 * num1));
-          respond_ok();
+          try {
+            value = std::to_string(Value::add(Value::parse_int(table->get(key)), delta));
+          } catch (...) {
+            table->unlock_shard(shard);
+            throw;
+          }
+          m_writes.set(table, key, value);
+          uint64_t ts = CommitClock::begin_commit();
+          m_log_record.begin_commit(ts);
+          m_writes.commit(ts, &m_log_record);
+          m_wait_lsn = std::max(m_wait_lsn, CommitClock::end_commit(ts, m_log_record));
+          table->unlock_shard(shard);
+        } else {
+          if (!lock_for_transaction(table, key, true)) {
+            return;
+          }
+          value = std::to_string(Value::add(Value::parse_int(m_writes.get(table, key)), delta));
+          m_writes.set(table, key, value);
+        }
+        respond_data(value);
+        break;
+      }
+      case MessageType::ADD:
+      case MessageType::SUB:
+      case MessageType::MUL:
+      case MessageType::DIV: {
+        handle_logged_in();
+        if (operand_stack.size() < 2) {
+          throw OperationException("Less than 2 values on Operand Stack. ");
+        }
+        // The right operand is on top. The result stays an integer
+        // until it is stored or sent.
+        int64_t rhs = operand_stack.top().to_int();
+        operand_stack.pop();
+        int64_t lhs = operand_stack.top().to_int();
+        operand_stack.pop();
+        switch (client_message.get_message_type()) {
+          case MessageType::ADD: operand_stack.push(Value::add(lhs, rhs)); break;
+          case MessageType::SUB: operand_stack.push(Value::sub(lhs, rhs)); break;
+          case MessageType::MUL: operand_stack.push(Value::mul(lhs, rhs)); break;
+          default: operand_stack.push(Value::div(lhs, rhs)); break;
+        }
+        respond_ok();
+        break;
+      }
+      case MessageType::BEGIN: {
+        handle_logged_in();
+        if (!autocommit_mode) {
+          // Roll back the open transaction and return to autocommit mode
+          abort_transaction();
+          respond_failed("Cannot nest transactions. ");
           break;
         }
-        case MessageType::DIV: {
-          handle_logged_in();
-          if (operand_stack.size() < 2) {
-            throw OperationException("Less than 2 values on Operand Stack. ");
+        if (client_message.get_num_args() == 1) {
+          if (client_message.get_arg(0) == "OPTIMISTIC") {
+            m_optimistic = true;
+          } else if (client_message.get_arg(0) == "READONLY") {
+            // Every GET reads the snapshot as of now, taking no locks
+            m_snapshot = CommitClock::pin_snapshot();
+            m_readonly = true;
+          } else {
+            throw OperationException("Unknown transaction mode. ");
           }
-          std::string val1 = operand_stack.top();
-          int num1 = string_to_int(val1);
-          operand_stack.pop();
-          std::string val2 = operand_stack.top();
-          int num2 = string_to_int(val2);
-          operand_stack.pop();
-          operand_stack.push(std::to_string(num2 / num1));
-          respond_ok();
+        } else {
+          m_txn_id = m_server->get_deadlock_detector()->begin_transaction();
+        }
+        autocommit_mode = false;
+        respond_ok();
+        break;
+      }
+      case MessageType::COMMIT: {
+        handle_logged_in();
+        if (autocommit_mode) {
+          respond_failed("Cannot commit in autocommit mode. ");
           break;
         }
-        case MessageType::BEGIN: {
-          handle_logged_in();
-          if (!autocommit_mode) {
-            for (std::vector<Table*>::const_iterator it = locked_tables.cbegin(); it != locked_tables.cend(); it++) {
-              (*it)->rollback_changes();
+        if (m_optimistic) {
+          // Validation failure ends the transaction (without the
+          // aborted state, since nothing remains to be rejected)
+          try {
+            if (!m_txn.commit(this)) {
+              m_blocked = true; // retried by the event loop
+              return;
             }
-            locked_tables.clear();
-            autocommit_mode = true;
-            respond_failed("Cannot nest transactions. ");
+            m_wait_lsn = std::max(m_wait_lsn, m_txn.get_commit_lsn());
+          } catch (FailedTransaction &e) {
+            abort_transaction();
+            respond_failed(e.what());
             break;
           }
-          autocommit_mode = false;
+          m_optimistic = false;
+          autocommit_mode = true;
           respond_ok();
           break;
         }
-        case MessageType::COMMIT: {
-          handle_logged_in();
-          if (autocommit_mode) {
-            respond_failed("Cannot commit in autocommit mode. ");
-            break;
-          }
-          for (std::vector<Table*>::const_iterator it = locked_tables.cbegin(); it != locked_tables.cend(); it++) {
-            (*it)->commit_changes();
-          }
-          locked_tables.clear();
-          autocommit_mode = true; 
+        if (m_readonly) {
+          abort_transaction(); // nothing to commit
           respond_ok();
           break;
         }
-        case MessageType::BYE: {
-          handle_logged_in();
-          respond_ok();
-          loop = false;
-          close(m_client_fd);
-        }
-        default: {
-          throw InvalidMessage("Invalid Message Type");
-          break;
+        // All of the transaction's changes get the same commit
+        // timestamp, so snapshot reads see all of them or none. A
+        // transaction that only read has nothing to commit, and just
+        // releases its locks.
+        if (!m_writes.empty()) {
+          uint64_t ts = CommitClock::begin_commit();
+          m_log_record.begin_commit(ts);
+          m_writes.commit(ts, &m_log_record);
+          m_wait_lsn = std::max(m_wait_lsn, CommitClock::end_commit(ts, m_log_record));
         }
+        release_shard_locks();
+        autocommit_mode = true; 
+        respond_ok();
+        break;
+      }
+      case MessageType::SNAPSHOT: {
+        handle_logged_in();
+        m_server->start_snapshot();
+        respond_ok();
+        break;
+      }
+      case MessageType::BYE: {
+        handle_logged_in();
+        respond_ok();
+        loop = false; // close once the response has been sent
+        break;
+      }
+      default: {
+        throw InvalidMessage("Invalid Message Type");
+        break;
       }
-    } catch (OperationException& e) {
-      respond_failed(e.what());
-    } catch (FailedTransaction& e) {
-      respond_failed(e.what());
-    } catch (std::exception& e) {
-      respond_error(e.what());
-      loop = false;
     }
+  } catch (OperationException& e) {
+    if (!autocommit_mode) {
+      fail_transaction();
+    }
+    respond_failed(e.what());
+  } catch (FailedTransaction& e) {
+    fail_transaction();
+    respond_failed(e.what());
+  } catch (std::exception& e) {
+    respond_error(e.what());
   }
 }
 
 // Other Member Functions
 
+// Responses are encoded straight into m_outbuf from the preencoded
+// frames and prefixes, so sending them doesn't allocate
+
 void ClientConnection::respond_ok() {
-  Message ok(MessageType::OK);
-  std::string response;
-  MessageSerialization::encode(ok, response);
-  rio_writen(m_client_fd, response.c_str(), response.length());
+  if (m_protocol == BINARY) {
+    m_outbuf.append(BinarySerialization::frame(MessageType::OK));
+  } else {
+    m_outbuf.append(MessageSerialization::frame(MessageType::OK));
+  }
+}
+
+void ClientConnection::respond_data(const std::string &value)
+{
+  if (m_protocol == BINARY) {
+    char buf[BinarySerialization::INT_FRAME_LEN];
+    int64_t n;
+    if (BinarySerialization::parse_int(value, n)) {
+      m_outbuf.append(buf, BinarySerialization::encode_int(MessageType::DATA, n, buf));
+    } else {
+      m_outbuf.append(buf, BinarySerialization::encode_bytes_prefix(MessageType::DATA, value.size(), buf));
+      m_outbuf.append(value);
+    }
+    return;
+  }
+
+  // Values stored by binary protocol clients may not fit in a line
+  std::string_view prefix = MessageSerialization::prefix(MessageType::DATA);
+  if (prefix.size() + value.size() + 1 > Message::MAX_ENCODED_LEN) {
+    throw OperationException("Value is too long for the text protocol. ");
+  }
+  for (char c : value) {
+    if (std::isspace((unsigned char) c)) {
+      throw OperationException("Value contains whitespace, which the text protocol can't send. ");
+    }
+  }
+  m_outbuf.append(prefix);
+  m_outbuf.append(value);
+  m_outbuf.append("\n", 1);
+}
+
+// A DATA response with a stack value. In the binary protocol an
+// integer is sent as one without formatting it.
+void ClientConnection::respond_value(const Value &value)
+{
+  if (m_protocol == BINARY && value.is_int()) {
+    char buf[BinarySerialization::INT_FRAME_LEN];
+    m_outbuf.append(buf, BinarySerialization::encode_int(MessageType::DATA, value.to_int(), buf));
+    return;
+  }
+  respond_data(value.to_string());
+}
+
+// A DATA response with several values
+void ClientConnection::respond_values(const std::string *values, unsigned num_values)
+{
+  m_encoded.clear();
+  if (m_protocol == BINARY) {
+    try {
+      BinarySerialization::encode_data(values, num_values, m_encoded);
+    } catch (InvalidMessage &e) {
+      throw OperationException("Values are too long to send. ");
+    }
+    m_outbuf.append(m_encoded);
+    return;
+  }
+
+  m_encoded += MessageSerialization::prefix(MessageType::DATA);
+  for (unsigned i = 0; i < num_values; i++) {
+    for (char c : values[i]) {
+      if (std::isspace((unsigned char) c)) {
+        throw OperationException("Value contains whitespace, which the text protocol can't send. ");
+      }
+    }
+    if (i > 0) {
+      m_encoded += ' ';
+    }
+    m_encoded += values[i];
+  }
+  m_encoded += '\n';
+  if (m_encoded.size() > Message::MAX_MULTI_ENCODED_LEN) {
+    throw OperationException("Values are too long for the text protocol. ");
+  }
+  m_outbuf.append(m_encoded);
 }
 
 void ClientConnection::respond_error(const std::string &error_msg)
 {
-  Message error(MessageType::ERROR, {error_msg});
-  std::string response;
-  MessageSerialization::encode(error, response);
-  rio_writen(m_client_fd, response.c_str(), response.length());
-  close(m_client_fd);
-  loop = false;
+  respond_text(MessageType::ERROR, error_msg);
+  loop = false; // close once the response has been sent
 }
 
 void ClientConnection::respond_failed(const std::string &error_msg)
 {
-  Message failed(MessageType::FAILED, {error_msg});
-  std::string response;
-  MessageSerialization::encode(failed, response);
-  rio_writen(m_client_fd, response.c_str(), response.length());
+  respond_text(MessageType::FAILED, error_msg);
 }
 
-void ClientConnection::handle_logged_in() {
-  if (!logged_in) {
-    throw OperationException("Must be logged in. ");
+void ClientConnection::respond_text(MessageType type, std::string_view text)
+{
+  if (!text.empty() && text.back() == ' ') {
+    text.remove_suffix(1); // remove trailing space
+  }
+
+  if (m_protocol == BINARY) {
+    char buf[BinarySerialization::BYTES_FRAME_PREFIX_LEN];
+    m_outbuf.append(buf, BinarySerialization::encode_bytes_prefix(type, text.size(), buf));
+    m_outbuf.append(text);
+    return;
   }
+
+  if (text.empty()) {
+    m_outbuf.append(MessageSerialization::frame(type));
+    return;
+  }
+  // Overlong text is truncated rather than dropping the response
+  std::string_view prefix = MessageSerialization::prefix(type);
+  size_t max_text = Message::MAX_ENCODED_LEN - prefix.size() - 1;
+  if (text.size() > max_text) {
+    text = text.substr(0, max_text);
+  }
+  m_outbuf.append(prefix);
+  m_outbuf.append(text);
+  m_outbuf.append("\n", 1);
 }
 
-int ClientConnection::string_to_int(std::string &str) {
-  try {
-    size_t pos;
-    int result = std::stoi(str, &pos);
+// Lock a shard for an autocommit request. If it's locked already, the
+// request waits for it (see ShardLock) until it's retried and succeeds.
+bool ClientConnection::trylock_shard(Table *table, unsigned shard) {
+  bool locked = table->trylock_shard(shard, 0, this);
+  wait_for_shard(locked ? nullptr : table, shard);
+  return locked;
+}
+
+// Lock the shards of all of an MSET's keys, in m_shards. Returns
+// false (holding none of them) if one is locked already.
+bool ClientConnection::trylock_shards(Table *table, const Message &msg) {
+  m_shards.clear();
+  for (unsigned i = 1; i < msg.get_num_args(); i++) {
+    m_shards.push_back(Table::shard_of(msg.get_arg(i)));
+  }
+  std::sort(m_shards.begin(), m_shards.end());
+  m_shards.erase(std::unique(m_shards.begin(), m_shards.end()), m_shards.end());
+  for (size_t i = 0; i < m_shards.size(); i++) {
+    if (!trylock_shard(table, m_shards[i])) {
+      while (i > 0) {
+        table->unlock_shard(m_shards[--i]);
+      }
+      return false;
+    }
+  }
+  return true;
+}
+
+// The named table. Tables are never dropped, so the last one found is
+// cached, and a run of requests on the same table doesn't repeat the
+// catalog lookup.
+Table *ClientConnection::find_table(const std::string &name) {
+  if (m_table == nullptr || name != m_table_name) {
+    Table *table = m_server->find_table(name);
+    if (table == nullptr) {
+      throw OperationException("Table does not exist. ");
+    }
+    m_table = table;
+    m_table_name = name;
+  }
+  return m_table;
+}
+
+// Make sure the current transaction holds the lock of the table
+// shard containing the given key: shared for reading it, or
+// exclusive for changing it (upgrading a shared lock it holds). If
+// other requests hold it, returns false with the request blocked: the
+// event loop retries it, so no worker thread waits. The transaction
+// is aborted instead if waiting would deadlock (see DeadlockDetector),
+// or once it has waited for LOCK_WAIT_TIMEOUT_MS.
+bool ClientConnection::lock_for_transaction(Table *table, const std::string &key, bool exclusive) {
+  unsigned shard = Table::shard_of(key);
+  LockedShard *held = nullptr;
+  for (LockedShard &locked : locked_shards) {
+    if (locked.table == table && locked.shard == shard) {
+      held = &locked;
+      break;
+    }
+  }
+  if (held != nullptr && exclusive) {
+    held->written = true;
+  }
+  if (held != nullptr && (held->exclusive || !exclusive)) {
+    return true;
+  }
+
+  // A read takes the lock exclusively if writes usually follow reads
+  // of the shard, rather than share it and deadlock upgrading it
+  bool read_first = (held == nullptr && !exclusive);
+  if (read_first && table->expects_write_after_read(shard)) {
+    exclusive = true;
+  }
 
-    if (pos != str.length()) {
-      throw OperationException("Operand is not an integer. ");
+  bool acquired;
+  if (held != nullptr) {
+    acquired = table->upgrade_shard_lock(shard, m_txn_id, this);
+  } else if (exclusive) {
+    acquired = table->trylock_shard(shard, m_txn_id, this);
+  } else {
+    acquired = table->trylock_shard_shared(shard, m_txn_id, this);
+  }
+  wait_for_shard(acquired ? nullptr : table, shard);
+  DeadlockDetector *deadlocks = m_server->get_deadlock_detector();
+  if (!acquired) {
+    // The holders may have changed since the last retry
+    m_holders.clear();
+    table->get_shard_holders(shard, m_txn_id, m_holders);
+    if (!deadlocks->wait(m_txn_id, m_holders)) {
+      throw FailedTransaction("Aborted to avoid a deadlock. ");
+    }
+    uint64_t now = now_ms();
+    if (m_wait_start == 0) {
+      m_wait_start = now;
+    } else if (now - m_wait_start >= LOCK_WAIT_TIMEOUT_MS) {
+      throw FailedTransaction("Timed out waiting for a lock. ");
+    }
+    m_blocked = true;
+    return false;
+  }
+
+  if (m_wait_start != 0) {
+    deadlocks->stop_waiting(m_txn_id);
+    m_wait_start = 0;
+  }
+  if (held != nullptr) {
+    held->exclusive = true;
+  } else {
+    locked_shards.push_back(LockedShard{ table, shard, exclusive, read_first, !read_first });
+  }
+  return true;
+}
+
+// Unlock the shards the current transaction holds, and tell each
+// shard whether the transaction's read of it led to a write (see
+// lock_for_transaction())
+void ClientConnection::release_shard_locks() {
+  for (const LockedShard &locked : locked_shards) {
+    if (locked.read_first) {
+      locked.table->note_read(locked.shard, locked.written);
+    }
+    if (locked.exclusive) {
+      locked.table->unlock_shard(locked.shard);
     } else {
-      return result;
+      locked.table->unlock_shard_shared(locked.shard, m_txn_id);
     }
-  } catch (std::invalid_argument &e) {
-    throw OperationException("Operand is not an integer. ");
   }
-}
\ No newline at end of file
+  locked_shards.clear();
+}
+
+// Note which shard's lock (if any: table null) the front request now
+// waits for, no longer waiting for any other
+void ClientConnection::wait_for_shard(Table *table, unsigned shard) {
+  if (m_wait_table != nullptr && (m_wait_table != table || m_wait_shard != shard)) {
+    m_wait_table->stop_waiting_for_shard(m_wait_shard, this);
+  }
+  m_wait_table = table;
+  m_wait_shard = shard;
+}
+
+// Roll back and unlock everything the current transaction (if any)
+// has touched, stop waiting for a lock, and return to autocommit mode
+void ClientConnection::abort_transaction() {
+  m_writes.clear();
+  release_shard_locks();
+  wait_for_shard(nullptr, 0);
+  if (m_wait_start != 0) {
+    m_server->get_deadlock_detector()->stop_waiting(m_txn_id);
+    m_wait_start = 0;
+  }
+  m_txn.clear();
+  m_optimistic = false;
+  if (m_readonly) {
+    CommitClock::unpin_snapshot(m_snapshot);
+    m_readonly = false;
+  }
+  autocommit_mode = true;
+}
+
+// Abort the current transaction because one of its requests failed.
+// The session stays in the (aborted) transaction until COMMIT.
+void ClientConnection::fail_transaction() {
+  abort_transaction();
+  autocommit_mode = false;
+  txn_aborted = true;
+}
+
+void ClientConnection::handle_logged_in() {
+  if (!logged_in) {
+    throw OperationException("Must be logged in. ");
+  }
+}
+
+void ClientConnection::handle_write() {
+  if (m_readonly) {
+    throw OperationException("Cannot write in a read-only transaction. ");
+  }
+}
@@ -1,42 +1,152 @@
 #ifndef CLIENT_CONNECTION_H
 #define CLIENT_CONNECTION_H
 
+#include <atomic>
 #include <cstdint>
 #include <set>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
 #include "message.h"
-#include "csapp.h"
-#include <stack>
+#include "output_buffer.h"
+#include "shard_lock.h"
+#include "transaction.h"
+#include "value_stack.h"
+#include "wal.h"
+#include "write_set.h"
 
 class Server; // forward declaration
 class Table; // forward declaration
+class EventLoop; // forward declaration
 
-class ClientConnection {
+// State of one client session. A connection alternates between being
+// owned by its EventLoop (which reads requests into m_inbuf and writes
+// responses out of m_outbuf using non-blocking socket I/O) and being
+// owned by a worker thread (which executes the request at the front
+// of m_inbuf via process_requests()). Only one of them touches the
+// connection at a time. A request that has to wait for a shard lock
+// is left at the front of m_inbuf, and the lock tells the connection
+// (as a LockWaiter) when the event loop should retry it.
+class ClientConnection : public LockWaiter {
 private:
+  // Wire protocol, chosen by the first byte the client sends
+  enum Protocol { UNDECIDED, TEXT, BINARY };
+
+  // A shard lock held by the current transaction
+  struct LockedShard {
+    Table *table;
+    unsigned shard;
+    bool exclusive; // otherwise shared
+    bool read_first; // the transaction read the shard before writing it, if at all
+    bool written;    // the transaction wrote the shard, or tried to
+  };
+
   Server *m_server;
+  EventLoop *m_loop;
   int m_client_fd;
-  rio_t m_fdbuf;
-  std::stack<std::string> operand_stack;
+  std::string m_inbuf;   // received data, consumed from m_in_pos
+  size_t m_in_pos;
+  size_t m_in_end;       // end of the received data while a read is pending
+  Protocol m_protocol;
+  OutputBuffer m_outbuf; // encoded responses not yet sent
+  Message m_request;     // reused for each request, to reuse its storage
+  bool m_peer_closed;    // client has shut down its side of the socket
+  bool m_blocked;        // front request is waiting for a table lock
+  std::atomic<bool> m_lock_released; // ...which may have become available
+  ValueStack operand_stack;
   bool autocommit_mode;
-  std::vector<Table*> locked_tables;
+  bool txn_aborted;      // a request in the current transaction failed
+  bool m_optimistic;     // current transaction uses m_txn
+  bool m_readonly;       // current transaction reads m_snapshot, which is pinned
+  uint64_t m_snapshot;
+  Transaction m_txn;
+  WriteSet m_writes;     // uncommitted writes of a request or (pessimistic) transaction
+  WalRecord m_log_record; // reused for each commit
+  uint64_t m_wait_lsn;   // responses wait until the log is durable up to here
+  std::vector<LockedShard> locked_shards;
+  uint64_t m_txn_id;     // age of the current transaction (see lock_for_transaction())
+  uint64_t m_wait_start; // when the front request started waiting for a lock (ms), 0 if it isn't
+  Table *m_wait_table;   // the front request waits for this table's shard lock
+  unsigned m_wait_shard; // (see ShardLock), if m_wait_table isn't null
   bool logged_in;
   bool loop;
+  std::string m_table_name; // the table last resolved by find_table()
+  Table *m_table;
+  std::vector<std::string> m_values; // values of a multi-key request
+  std::vector<unsigned> m_shards;    // shards locked by an autocommit MSET
+  std::string m_encoded;             // encoding of a multi-value response
+  std::vector<uint64_t> m_holders;   // holders of a lock being waited for
 
   // copy constructor and assignment operator are prohibited
   ClientConnection( const ClientConnection & );
   ClientConnection &operator=( const ClientConnection & );
 
+  void detect_protocol();
+  size_t front_request_length() const;
+  Table *find_table( const std::string &name );
+  bool trylock_shard( Table *table, unsigned shard );
+  bool trylock_shards( Table *table, const Message &msg );
+  void wait_for_shard( Table *table, unsigned shard );
+  size_t max_request_length() const;
+  void handle_request( const Message &msg );
+  bool lock_for_transaction( Table *table, const std::string &key, bool exclusive );
+  void release_shard_locks();
+  void abort_transaction();
+  void fail_transaction();
+
 public:
-  ClientConnection( Server *server, int client_fd );
+  ClientConnection( Server *server, EventLoop *loop, int client_fd );
   ~ClientConnection();
 
-  void chat_with_client();
+  int get_fd() const { return m_client_fd; }
+  EventLoop *get_event_loop() const { return m_loop; }
+
+  // Socket I/O, called only by the owning EventLoop.
+  // read_input() returns false if the socket failed; flush_output()
+  // returns false if some output is still waiting for the socket
+  // to become writable.
+  bool read_input();
+  bool flush_output();
+
+  // Asynchronous socket I/O (see IoUring), also only by the owning
+  // EventLoop: prepare_input() returns a buffer for receiving up to
+  // len bytes, and input_received() is passed the result of the
+  // receive (returning false if the socket failed); prepare_output()
+  // describes the output to send, and output_sent() is passed the
+  // result of sending it.
+  char *prepare_input( size_t len );
+  bool input_received( int result );
+  bool has_output() const { return !m_outbuf.empty(); }
+  const struct msghdr *prepare_output() { return m_outbuf.prepare_send(); }
+  void output_sent( int result );
+
+  bool has_request() const;
+  bool is_open() const { return loop; }
+  bool is_peer_closed() const { return m_peer_closed; }
+  bool is_blocked() const { return m_blocked; }
+
+  // Called by a ShardLock the front request waits for, from any thread
+  void lock_released();
+
+  // Whether the lock the front request waits for may have become
+  // available since the last call, called only by the owning EventLoop
+  bool take_lock_released() { return m_lock_released.exchange(false); }
+  bool is_output_durable() const;
+
+  // Execute the complete requests in the input buffer (stopping early
+  // if one has to wait for a lock). Called by a worker thread.
+  void process_requests();
 
-  // TODO: additional member functions
   void respond_ok();
   void respond_error(const std::string &error_msg); 
-  void respond_failed(const std::string &error_msg); 
+  void respond_failed(const std::string &error_msg);
+  void respond_data(const std::string &value);
+  void respond_value(const Value &value);
+  void respond_values(const std::string *values, unsigned num_values);
+  void respond_text(MessageType type, std::string_view text); 
   void handle_logged_in();
-  int string_to_int(std::string &str);
+  void handle_write();
 };
 
 #endif // CLIENT_CONNECTION_H
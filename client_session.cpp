@@ -0,0 +1,105 @@
+#include <unistd.h>
+#include "exceptions.h"
+#include "message_serialization.h"
+#include "binary_serialization.h"
+#include "client_session.h"
+
+ClientSession::ClientSession( const std::string &hostname, const std::string &port, bool pipelined, bool binary )
+  : m_fd( open_clientfd(hostname.c_str(), port.c_str()) )
+  , m_pipelined( pipelined )
+  , m_binary( binary )
+{
+  if (m_fd < 0) {
+    throw CommException("Couldn't connect to server");
+  }
+  rio_readinitb(&m_fdbuf, m_fd);
+  if (m_binary) {
+    try {
+      send(std::string(1, BinarySerialization::MAGIC));
+    } catch (CommException &e) {
+      close(m_fd);
+      throw;
+    }
+  }
+}
+
+ClientSession::~ClientSession()
+{
+  close(m_fd);
+}
+
+void ClientSession::send( const std::string &encoded )
+{
+  if (rio_writen(m_fd, encoded.c_str(), encoded.length()) != ssize_t(encoded.length())) {
+    throw CommException("Couldn't send request to server");
+  }
+}
+
+void ClientSession::encode( const Message &msg, std::string &encoded )
+{
+  if (m_binary) {
+    BinarySerialization::encode(msg, encoded);
+  } else {
+    MessageSerialization::encode(msg, encoded);
+  }
+}
+
+void ClientSession::receive( Message &response )
+{
+  if (m_binary) {
+    char lenbuf[BinarySerialization::LENGTH_FIELD_LEN];
+    if (rio_readnb(&m_fdbuf, lenbuf, sizeof(lenbuf)) != ssize_t(sizeof(lenbuf))) {
+      throw CommException("No response from server. ");
+    }
+    size_t len = BinarySerialization::frame_length(std::string_view(lenbuf, sizeof(lenbuf)));
+    if (len > BinarySerialization::MAX_FRAME_LEN) {
+      throw CommException("Invalid response from server. ");
+    }
+    std::string frame(lenbuf, sizeof(lenbuf));
+    frame.resize(len);
+    size_t rest = len - sizeof(lenbuf);
+    if (rio_readnb(&m_fdbuf, &frame[sizeof(lenbuf)], rest) != ssize_t(rest)) {
+      throw CommException("No response from server. ");
+    }
+    BinarySerialization::decode(frame, response);
+  } else {
+    char buf[Message::MAX_ENCODED_LEN + 1];
+    ssize_t n = rio_readlineb(&m_fdbuf, buf, sizeof(buf));
+    if (n <= 0) {
+      throw CommException("No response from server. ");
+    }
+    MessageSerialization::decode(buf, response);
+  }
+
+  if (response.get_message_type() == MessageType::FAILED
+      || response.get_message_type() == MessageType::ERROR) {
+    std::string text = response.get_quoted_text();
+    throw OperationException(text.empty() ? response.get_value() : text);
+  }
+}
+
+void ClientSession::exchange( const std::vector<Message> &requests, std::vector<Message> &responses )
+{
+  responses.clear();
+
+  if (m_pipelined) {
+    std::string batch, encoded;
+    for (const Message &req : requests) {
+      encode(req, encoded);
+      batch += encoded;
+    }
+    send(batch);
+    for (size_t i = 0; i < requests.size(); i++) {
+      responses.push_back(Message());
+      receive(responses.back());
+    }
+  } else {
+    std::string encoded;
+    for (const Message &req : requests) {
+      encode(req, encoded);
+      send(encoded);
+      responses.push_back(Message());
+      receive(responses.back());
+    }
+  }
+}
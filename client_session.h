@@ -0,0 +1,41 @@
+#ifndef CLIENT_SESSION_H
+#define CLIENT_SESSION_H
+
+#include <string>
+#include <vector>
+#include "message.h"
+#include "csapp.h"
+
+// Client side of a connection to the server, shared by the command
+// line clients. In pipelined mode a sequence of requests is written
+// to the socket in one go before any responses are read, so the whole
+// exchange costs one round trip instead of one per request. In binary
+// mode the session uses the binary protocol (see BinarySerialization).
+class ClientSession {
+private:
+  int m_fd;
+  rio_t m_fdbuf;
+  bool m_pipelined;
+  bool m_binary;
+
+  // copy constructor and assignment operator are prohibited
+  ClientSession( const ClientSession & );
+  ClientSession &operator=( const ClientSession & );
+
+  void send( const std::string &encoded );
+  void encode( const Message &msg, std::string &encoded );
+  void receive( Message &response );
+
+public:
+  // Throws CommException if the server can't be reached
+  ClientSession( const std::string &hostname, const std::string &port, bool pipelined, bool binary = false );
+  ~ClientSession();
+
+  // Send the requests and collect one response per request.
+  // Throws CommException if the server doesn't respond, and
+  // OperationException (with the server's explanation) if
+  // a request results in a FAILED or ERROR response.
+  void exchange( const std::vector<Message> &requests, std::vector<Message> &responses );
+};
+
+#endif // CLIENT_SESSION_H
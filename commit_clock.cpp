@@ -0,0 +1,153 @@
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <vector>
+#include <pthread.h>
+#include "commit_clock.h"
+#include "wal.h"
+
+namespace {
+
+// Protects handing out timestamps, adding pins and freezing; only
+// held briefly
+pthread_mutex_t g_commit_mutex = PTHREAD_MUTEX_INITIALIZER;
+uint64_t g_last_ts = 0; // the latest timestamp handed out
+
+// Commits are published (and logged) in timestamp order: each waits
+// under g_publish_mutex for the one before it to be published
+pthread_mutex_t g_publish_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t g_published_cond = PTHREAD_COND_INITIALIZER;
+std::atomic<uint64_t> g_published(0);
+Wal *g_log = nullptr;
+
+// Pinned snapshots, in order. Pins are only added under
+// g_commit_mutex, once every commit already started has ended, so a
+// commit sees every pin taken before it started.
+pthread_mutex_t g_pin_mutex = PTHREAD_MUTEX_INITIALIZER;
+std::vector<uint64_t> g_pins;
+std::atomic<unsigned> g_num_pins(0);
+
+// Called with g_publish_mutex held
+void wait_published(uint64_t ts) {
+  while (g_published.load(std::memory_order_relaxed) < ts) {
+    pthread_cond_wait(&g_published_cond, &g_publish_mutex);
+  }
+}
+
+// Wait until the latest timestamp handed out has been published.
+// Called with g_commit_mutex held, so that no commit starts meanwhile.
+uint64_t wait_for_commits() {
+  pthread_mutex_lock(&g_publish_mutex);
+  wait_published(g_last_ts);
+  pthread_mutex_unlock(&g_publish_mutex);
+  return g_last_ts;
+}
+
+}
+
+void CommitClock::set_log(Wal *wal) {
+  g_log = wal;
+}
+
+bool CommitClock::has_log() {
+  return g_log != nullptr;
+}
+
+void CommitClock::recover(uint64_t ts) {
+  pthread_mutex_lock(&g_commit_mutex);
+  g_last_ts = ts;
+  g_published.store(ts, std::memory_order_release);
+  pthread_mutex_unlock(&g_commit_mutex);
+}
+
+uint64_t CommitClock::snapshot() {
+  return g_published.load(std::memory_order_acquire);
+}
+
+uint64_t CommitClock::begin_commit() {
+  pthread_mutex_lock(&g_commit_mutex);
+  uint64_t ts = ++g_last_ts;
+  pthread_mutex_unlock(&g_commit_mutex);
+  return ts;
+}
+
+void CommitClock::wait_for_earlier(uint64_t ts) {
+  pthread_mutex_lock(&g_publish_mutex);
+  wait_published(ts - 1);
+  pthread_mutex_unlock(&g_publish_mutex);
+}
+
+void CommitClock::end_commit(uint64_t ts) {
+  WalRecord none;
+  end_commit(ts, none);
+}
+
+uint64_t CommitClock::end_commit(uint64_t ts, WalRecord &record) {
+  // The record is completed (checksummed) before waiting for its turn
+  bool logged = (g_log != nullptr && record.get_num_writes() > 0);
+  std::string_view data;
+  if (logged) {
+    data = record.finish();
+  }
+
+  uint64_t lsn = 0;
+  pthread_mutex_lock(&g_publish_mutex);
+  wait_published(ts - 1);
+  assert(g_published.load(std::memory_order_relaxed) == ts - 1);
+  if (logged) {
+    lsn = g_log->append_unsynced(data);
+  }
+  g_published.store(ts, std::memory_order_release);
+  pthread_cond_broadcast(&g_published_cond);
+  pthread_mutex_unlock(&g_publish_mutex);
+
+  if (logged && g_log->get_durability() == Wal::SYNC) {
+    g_log->wait_durable(lsn);
+  }
+  return lsn;
+}
+
+uint64_t CommitClock::freeze() {
+  pthread_mutex_lock(&g_commit_mutex);
+  return wait_for_commits();
+}
+
+void CommitClock::thaw() {
+  pthread_mutex_unlock(&g_commit_mutex);
+}
+
+void CommitClock::cancel_commit(uint64_t ts) {
+  end_commit(ts);
+}
+
+uint64_t CommitClock::pin_snapshot() {
+  pthread_mutex_lock(&g_commit_mutex);
+  uint64_t ts = wait_for_commits();
+  pthread_mutex_lock(&g_pin_mutex);
+  g_pins.insert(std::upper_bound(g_pins.begin(), g_pins.end(), ts), ts);
+  g_num_pins.fetch_add(1, std::memory_order_relaxed);
+  pthread_mutex_unlock(&g_pin_mutex);
+  pthread_mutex_unlock(&g_commit_mutex);
+  return ts;
+}
+
+void CommitClock::unpin_snapshot(uint64_t ts) {
+  pthread_mutex_lock(&g_pin_mutex);
+  auto i = std::lower_bound(g_pins.begin(), g_pins.end(), ts);
+  assert(i != g_pins.end() && *i == ts);
+  g_pins.erase(i);
+  g_num_pins.fetch_sub(1, std::memory_order_relaxed);
+  pthread_mutex_unlock(&g_pin_mutex);
+}
+
+bool CommitClock::has_pinned_snapshots() {
+  return g_num_pins.load(std::memory_order_relaxed) > 0;
+}
+
+bool CommitClock::is_pinned(uint64_t from, uint64_t to) {
+  pthread_mutex_lock(&g_pin_mutex);
+  auto i = std::lower_bound(g_pins.begin(), g_pins.end(), from);
+  bool pinned = (i != g_pins.end() && *i < to);
+  pthread_mutex_unlock(&g_pin_mutex);
+  return pinned;
+}
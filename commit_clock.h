@@ -0,0 +1,78 @@
+#ifndef COMMIT_CLOCK_H
+#define COMMIT_CLOCK_H
+
+#include <cstdint>
+
+class Wal; // forward declaration
+class WalRecord; // forward declaration
+
+// Global commit timestamps for multi-version tables. A commit gets
+// the next timestamp, installs its versions in every table shard it
+// changed, and then publishes the timestamp. Commits run concurrently
+// (their shard locks keep them from changing the same keys), but are
+// published in timestamp order: a reader's snapshot is the latest
+// published timestamp, so it sees either all of a commit's changes or
+// none of them, and all of every earlier commit's.
+//
+// If a log has been set, commits are also appended to it as they are
+// published, so that the log's order (and LSNs) follow timestamps. In
+// SYNC mode (see Wal), the committer then writes and syncs the record
+// after publishing it, outside of any lock.
+//
+// A snapshot can be pinned, for a reader that needs it to stay
+// readable for a while (e.g. a read-only transaction): tables then
+// keep the older versions it can see (see Table) until it is unpinned.
+namespace CommitClock {
+  // Log commits to wal (or stop logging them, if wal is null)
+  void set_log(Wal *wal);
+
+  // Whether commits are logged, so that committers need to fill in
+  // their log records
+  bool has_log();
+
+  // Continue from ts, the latest timestamp recovered from a log, so
+  // that further commits are ordered after the recovered ones. Only
+  // for use before any commit.
+  void recover(uint64_t ts);
+
+  // Timestamp of the latest commit whose changes are all installed
+  uint64_t snapshot();
+
+  // Start a commit, and return its timestamp
+  uint64_t begin_commit();
+
+  // Wait until every commit with a timestamp before ts has ended, so
+  // that all of their versions are installed (e.g. for validating
+  // reads against them)
+  void wait_for_earlier(uint64_t ts);
+
+  // Publish the changes of the commit started by begin_commit(), once
+  // every earlier commit has been published
+  void end_commit(uint64_t ts);
+
+  // Like end_commit(), but also append the commit's record to the log.
+  // Returns the record's LSN (the committer's response must wait until
+  // the log is durable up to it), or 0 if there is no log.
+  uint64_t end_commit(uint64_t ts, WalRecord &record);
+
+  // Block new commits (waiting for any in progress to finish), and
+  // return the latest timestamp, so that all versions up to it are
+  // installed and no others are being installed until thaw()
+  uint64_t freeze();
+  void thaw();
+
+  // End a commit started by begin_commit() that didn't install
+  // any versions
+  void cancel_commit(uint64_t ts);
+
+  // Pin the latest snapshot (waiting for any commit in progress to
+  // finish, as it may not have seen the pin), and return its timestamp
+  uint64_t pin_snapshot();
+  void unpin_snapshot(uint64_t ts);
+
+  // Whether any snapshot is pinned, and whether one in [from, to) is
+  bool has_pinned_snapshots();
+  bool is_pinned(uint64_t from, uint64_t to);
+};
+
+#endif // COMMIT_CLOCK_H
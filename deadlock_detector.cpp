@@ -0,0 +1,66 @@
+#include <algorithm>
+#include "deadlock_detector.h"
+#include "guard.h"
+
+DeadlockDetector::DeadlockDetector()
+  : m_next_id( 1 )
+{
+  pthread_mutex_init( &m_lock, nullptr );
+}
+
+DeadlockDetector::~DeadlockDetector()
+{
+  pthread_mutex_destroy( &m_lock );
+}
+
+uint64_t DeadlockDetector::begin_transaction()
+{
+  return m_next_id.fetch_add( 1, std::memory_order_relaxed );
+}
+
+bool DeadlockDetector::wait( uint64_t txn, const std::vector<uint64_t> &holders )
+{
+  Guard g( m_lock );
+  m_waits_for.erase( txn );
+
+  // Search the transactions the holders wait for, directly or not
+  m_pending.clear();
+  m_visited.clear();
+  for (uint64_t holder : holders) {
+    if (holder != 0) {
+      m_pending.push_back( holder );
+    }
+  }
+  while (!m_pending.empty()) {
+    uint64_t t = m_pending.back();
+    m_pending.pop_back();
+    if (t == txn) {
+      return false;
+    }
+    if (std::find( m_visited.begin(), m_visited.end(), t ) != m_visited.end()) {
+      continue;
+    }
+    m_visited.push_back( t );
+    auto i = m_waits_for.find( t );
+    if (i != m_waits_for.end()) {
+      m_pending.insert( m_pending.end(), i->second.begin(), i->second.end() );
+    }
+  }
+
+  std::vector<uint64_t> &edges = m_waits_for[txn];
+  for (uint64_t holder : holders) {
+    if (holder != 0) {
+      edges.push_back( holder );
+    }
+  }
+  if (edges.empty()) {
+    m_waits_for.erase( txn );
+  }
+  return true;
+}
+
+void DeadlockDetector::stop_waiting( uint64_t txn )
+{
+  Guard g( m_lock );
+  m_waits_for.erase( txn );
+}
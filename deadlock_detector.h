@@ -0,0 +1,49 @@
+#ifndef DEADLOCK_DETECTOR_H
+#define DEADLOCK_DETECTOR_H
+
+#include <atomic>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+#include <pthread.h>
+
+// The wait-for graph of the (pessimistic) transactions waiting for
+// shard locks held by other transactions: a waiter waits for every
+// holder of the lock it wants (several, if they share it). A wait that
+// would deadlock is found by following the waits from the holders: if
+// they lead back to the waiter, the waiter is the victim and is
+// aborted, and nobody else is.
+//
+// The graph only changes when a transaction starts or stops waiting,
+// so transactions that get their locks straight away never touch it.
+class DeadlockDetector {
+private:
+  pthread_mutex_t m_lock;
+  std::unordered_map<uint64_t, std::vector<uint64_t>> m_waits_for; // waiter -> holders
+  std::atomic<uint64_t> m_next_id;
+  std::vector<uint64_t> m_pending; // for searching the graph
+  std::vector<uint64_t> m_visited;
+
+  // copy constructor and assignment operator are prohibited
+  DeadlockDetector( const DeadlockDetector & );
+  DeadlockDetector &operator=( const DeadlockDetector & );
+
+public:
+  DeadlockDetector();
+  ~DeadlockDetector();
+
+  // An id for a new transaction (never 0, which stands for requests
+  // that aren't part of a transaction)
+  uint64_t begin_transaction();
+
+  // Record that txn waits for holders, replacing its earlier wait if
+  // any (holders of 0 are left out: such requests never wait while
+  // holding a lock). Returns false, leaving txn waiting for nobody, if
+  // one of the holders is waiting for txn, directly or through others.
+  bool wait( uint64_t txn, const std::vector<uint64_t> &holders );
+
+  // txn is no longer waiting (it got the lock, or ended)
+  void stop_waiting( uint64_t txn );
+};
+
+#endif // DEADLOCK_DETECTOR_H
@@ -0,0 +1,429 @@
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include "exceptions.h"
+#include "guard.h"
+#include "io_uring.h"
+#include "server.h"
+#include "worker_pool.h"
+#include "client_connection.h"
+#include "event_loop.h"
+
+namespace {
+
+const int MAX_EVENTS = 128;
+
+// Submission queue size of an event loop's IoUring
+const unsigned RING_ENTRIES = 256;
+
+// Bytes received from a client socket per io_uring receive
+const size_t RECV_LEN = 16 * 1024;
+
+// io_uring operations are tagged with a connection pointer (which is
+// aligned, leaving its low bits for the kind of operation), or with a
+// null pointer for the loop's own operations
+const uint64_t OP_MASK = 7;
+enum LoopOp { OP_ACCEPT = 1, OP_ACCEPT_POLL, OP_WAKEUP, OP_TIMEOUT };
+enum ConnectionOp { OP_RECV = 1, OP_SEND, OP_SEND_THEN_RECV };
+
+uint64_t tag( ClientConnection *conn, ConnectionOp op )
+{
+  return reinterpret_cast<uint64_t>(conn) | op;
+}
+
+uint64_t now_ms()
+{
+  return uint64_t(std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+}
+
+EventLoop::EventLoop( Server *server, WorkerPool *workers, int listen_fd, bool use_io_uring )
+  : m_server( server )
+  , m_workers( workers )
+  , m_listen_fd( listen_fd )
+  , m_epoll_fd( -1 )
+  , m_wakeup_fd( -1 )
+  , m_ring( nullptr )
+  , m_wakeup_count( 0 )
+  , m_timeout_pending( false )
+  , m_next_retry( 0 )
+{
+  pthread_mutex_init(&m_completed_lock, nullptr);
+
+  if (use_io_uring) {
+    try {
+      m_ring = new IoUring(RING_ENTRIES);
+    } catch (CommException &e) {
+      m_server->log_error(std::string(e.what()) + ", using epoll");
+    }
+  }
+  if (m_ring != nullptr) {
+    // The ring reads the eventfd, so it can block
+    m_wakeup_fd = eventfd(0, EFD_CLOEXEC);
+    if (m_wakeup_fd < 0) {
+      throw CommException("Could not create eventfd");
+    }
+    return;
+  }
+
+  m_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (m_epoll_fd < 0) {
+    throw CommException("Could not create epoll instance");
+  }
+  m_wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (m_wakeup_fd < 0) {
+    throw CommException("Could not create eventfd");
+  }
+
+  // The listen socket is identified by a null data pointer, the
+  // wakeup eventfd by a pointer to m_wakeup_fd, and client sockets
+  // by a pointer to their ClientConnection
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.ptr = nullptr;
+  if (epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_listen_fd, &ev) < 0) {
+    throw CommException("Could not watch listen socket");
+  }
+  ev.events = EPOLLIN;
+  ev.data.ptr = &m_wakeup_fd;
+  if (epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_wakeup_fd, &ev) < 0) {
+    throw CommException("Could not watch eventfd");
+  }
+}
+
+EventLoop::~EventLoop()
+{
+  // Closing the ring cancels its operations, which refer to the
+  // connections' buffers
+  delete m_ring;
+  for (ClientConnection *conn : m_connections) {
+    delete conn;
+  }
+  if (m_wakeup_fd >= 0) {
+    close(m_wakeup_fd);
+  }
+  if (m_epoll_fd >= 0) {
+    close(m_epoll_fd);
+  }
+  pthread_mutex_destroy(&m_completed_lock);
+}
+
+void EventLoop::run()
+{
+  if (m_ring != nullptr) {
+    run_uring();
+  } else {
+    run_epoll();
+  }
+}
+
+void EventLoop::run_epoll()
+{
+  struct epoll_event events[MAX_EVENTS];
+
+  while (true) {
+    int timeout = -1;
+    if (!m_deferred.empty()) {
+      uint64_t now = now_ms();
+      timeout = m_next_retry > now ? int(m_next_retry - now) : 0;
+    }
+    int n = epoll_wait(m_epoll_fd, events, MAX_EVENTS, timeout);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw CommException("epoll_wait failed");
+    }
+
+    for (int i = 0; i < n; i++) {
+      void *ptr = events[i].data.ptr;
+      if (ptr == nullptr) {
+        accept_connections();
+      } else if (ptr == &m_wakeup_fd) {
+        ssize_t rc = read(m_wakeup_fd, &m_wakeup_count, sizeof(m_wakeup_count));
+        (void) rc;
+        handle_completions();
+        check_wal_waiting();
+      } else {
+        handle_io(static_cast<ClientConnection *>(ptr), events[i].events);
+      }
+    }
+
+    retry_deferred();
+  }
+}
+
+void EventLoop::run_uring()
+{
+  // The listen socket is non-blocking (so that an epoll loop can drain
+  // it), so accepts that find no connection waiting fall back to
+  // polling it. Client sockets are left blocking: their receives and
+  // sends wait in the kernel.
+  m_ring->accept(m_listen_fd, SOCK_CLOEXEC, OP_ACCEPT);
+  m_ring->read(m_wakeup_fd, &m_wakeup_count, sizeof(m_wakeup_count), OP_WAKEUP);
+
+  while (true) {
+    if (!m_deferred.empty() && !m_timeout_pending) {
+      m_ring->timeout(RETRY_INTERVAL_MS, OP_TIMEOUT);
+      m_timeout_pending = true;
+    }
+
+    // One system call submits everything queued since the last
+    // iteration and waits for the next completion
+    m_ring->submit(1);
+    uint64_t data;
+    int result;
+    while (m_ring->next_completion(data, result)) {
+      handle_completion(data, result);
+    }
+
+    retry_deferred();
+  }
+}
+
+void EventLoop::handle_completion( uint64_t data, int result )
+{
+  ClientConnection *conn = reinterpret_cast<ClientConnection *>(data & ~OP_MASK);
+  unsigned op = unsigned(data & OP_MASK);
+
+  if (conn == nullptr) {
+    switch (op) {
+    case OP_ACCEPT:
+      if (result >= 0) {
+        add_connection(result);
+        m_ring->accept(m_listen_fd, SOCK_CLOEXEC, OP_ACCEPT);
+        break;
+      }
+      if (result != -EAGAIN && result != -EINTR) {
+        m_server->log_error(std::string("Could not accept connection: ") + strerror(-result));
+      }
+      m_ring->poll(m_listen_fd, POLLIN, OP_ACCEPT_POLL);
+      break;
+    case OP_ACCEPT_POLL:
+      m_ring->accept(m_listen_fd, SOCK_CLOEXEC, OP_ACCEPT);
+      break;
+    case OP_WAKEUP:
+      handle_completions();
+      check_wal_waiting();
+      m_ring->read(m_wakeup_fd, &m_wakeup_count, sizeof(m_wakeup_count), OP_WAKEUP);
+      break;
+    case OP_TIMEOUT:
+      m_timeout_pending = false;
+      break;
+    }
+    return;
+  }
+
+  if (op == OP_RECV) {
+    if (!conn->input_received(result)) {
+      close_connection(conn);
+      return;
+    }
+  } else {
+    conn->output_sent(result);
+    if (op == OP_SEND_THEN_RECV) {
+      return; // the receive completes next
+    }
+  }
+  advance(conn);
+}
+
+void EventLoop::request_completed( ClientConnection *conn )
+{
+  {
+    Guard g(m_completed_lock);
+    m_completed.push_back(conn);
+  }
+  wake();
+}
+
+void EventLoop::wake()
+{
+  uint64_t one = 1;
+  ssize_t rc = write(m_wakeup_fd, &one, sizeof(one));
+  (void) rc; // EAGAIN just means a wakeup is already pending
+}
+
+void EventLoop::accept_connections()
+{
+  while (true) {
+    int client_fd = accept4(m_listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (client_fd < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        m_server->log_error(std::string("Could not accept connection: ") + strerror(errno));
+      }
+      return;
+    }
+
+    add_connection(client_fd);
+  }
+}
+
+void EventLoop::add_connection( int client_fd )
+{
+  ClientConnection *conn = new ClientConnection(m_server, this, client_fd);
+  if (m_ring != nullptr) {
+    m_connections.insert(conn);
+    wait_for_input(conn);
+    return;
+  }
+
+  struct epoll_event ev;
+  ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+  ev.data.ptr = conn;
+  if (epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) < 0) {
+    m_server->log_error("Could not watch client socket");
+    delete conn;
+    return;
+  }
+  m_connections.insert(conn);
+}
+
+void EventLoop::handle_io( ClientConnection *conn, uint32_t events )
+{
+  if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+    if (!conn->read_input()) {
+      close_connection(conn);
+      return;
+    }
+  }
+  advance(conn);
+}
+
+void EventLoop::handle_completions()
+{
+  std::vector<ClientConnection *> completed;
+  {
+    Guard g(m_completed_lock);
+    completed.swap(m_completed);
+  }
+
+  for (ClientConnection *conn : completed) {
+    if (conn->is_blocked()) {
+      // Send the responses to any requests that were executed before
+      // the blocked one while the connection waits
+      if (conn->is_output_durable()) {
+        conn->flush_output();
+      }
+      if (m_deferred.empty()) {
+        m_next_retry = now_ms() + RETRY_INTERVAL_MS;
+      }
+      m_deferred.push_back(conn);
+    } else {
+      advance(conn);
+    }
+  }
+}
+
+// Resubmit the deferred connections whose locks may have become
+// available, or all of them once RETRY_INTERVAL_MS has passed
+void EventLoop::retry_deferred()
+{
+  if (m_deferred.empty()) {
+    return;
+  }
+  uint64_t now = now_ms();
+  bool all = now >= m_next_retry;
+  if (all) {
+    m_next_retry = now + RETRY_INTERVAL_MS;
+  }
+  size_t kept = 0;
+  for (ClientConnection *conn : m_deferred) {
+    if (conn->take_lock_released() || all) {
+      m_workers->submit(conn);
+    } else {
+      m_deferred[kept++] = conn;
+    }
+  }
+  m_deferred.resize(kept);
+}
+
+void EventLoop::check_wal_waiting()
+{
+  if (m_wal_waiting.empty()) {
+    return;
+  }
+  std::vector<ClientConnection *> waiting;
+  waiting.swap(m_wal_waiting);
+  for (ClientConnection *conn : waiting) {
+    advance(conn); // waits again if still not durable
+  }
+}
+
+// Decide what a connection owned by the event loop should do next:
+// wait for its commits to become durable, finish sending output, run
+// its next request, wait for more input, or be closed.
+void EventLoop::advance( ClientConnection *conn )
+{
+  if (!conn->is_output_durable()) {
+    m_wal_waiting.push_back(conn);
+    return;
+  }
+  if (m_ring != nullptr) {
+    if (conn->has_output()) {
+      // If the connection will wait for input next, the receive is
+      // linked to the send, so that both are submitted together. With
+      // MSG_WAITALL, a short send fails the link (cancelling the
+      // receive), and advance() sends the rest.
+      if (conn->is_open() && !conn->has_request() && !conn->is_peer_closed()) {
+        m_ring->sendmsg(conn->get_fd(), conn->prepare_output(), MSG_NOSIGNAL | MSG_WAITALL,
+                        tag(conn, OP_SEND_THEN_RECV), true);
+        wait_for_input(conn);
+      } else {
+        m_ring->sendmsg(conn->get_fd(), conn->prepare_output(), MSG_NOSIGNAL, tag(conn, OP_SEND));
+      }
+      return;
+    }
+  } else if (!conn->flush_output()) {
+    rearm(conn, EPOLLOUT);
+    return;
+  }
+  if (!conn->is_open()) {
+    close_connection(conn);
+    return;
+  }
+  if (conn->has_request()) {
+    m_workers->submit(conn);
+    return;
+  }
+  if (conn->is_peer_closed()) {
+    close_connection(conn);
+    return;
+  }
+  wait_for_input(conn);
+}
+
+void EventLoop::rearm( ClientConnection *conn, uint32_t events )
+{
+  struct epoll_event ev;
+  ev.events = events | EPOLLONESHOT;
+  ev.data.ptr = conn;
+  if (epoll_ctl(m_epoll_fd, EPOLL_CTL_MOD, conn->get_fd(), &ev) < 0) {
+    m_server->log_error("Could not re-arm client socket");
+  }
+}
+
+void EventLoop::wait_for_input( ClientConnection *conn )
+{
+  if (m_ring != nullptr) {
+    m_ring->recv(conn->get_fd(), conn->prepare_input(RECV_LEN), RECV_LEN, tag(conn, OP_RECV));
+  } else {
+    rearm(conn, EPOLLIN | EPOLLRDHUP);
+  }
+}
+
+void EventLoop::close_connection( ClientConnection *conn )
+{
+  if (m_ring == nullptr) {
+    epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, conn->get_fd(), nullptr);
+  }
+  m_connections.erase(conn);
+  delete conn;
+}
@@ -0,0 +1,97 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <cstdint>
+#include <set>
+#include <vector>
+#include <pthread.h>
+
+class Server; // forward declaration
+class WorkerPool; // forward declaration
+class ClientConnection; // forward declaration
+class IoUring; // forward declaration
+
+// epoll-based reactor. The event loop owns its connections and does
+// all socket I/O on them (non-blocking); complete requests are handed
+// to the worker pool, and the worker hands the connection back via
+// request_completed() when it is done. Client sockets are registered
+// EPOLLONESHOT and only re-armed while the connection is waiting for
+// socket I/O, so a connection only ties up a thread while a request
+// is actually executing, and never sees events while a worker has it.
+//
+// Alternatively (if use_io_uring is passed, and io_uring is
+// available), the loop does its I/O through an IoUring: it queues
+// accepts, receives and sends instead of waiting for readiness, and
+// submits everything queued in an iteration, and waits for the next
+// completions, with one system call. A connection then has at most one
+// operation in flight, and is only handed to a worker when it has none.
+class EventLoop {
+private:
+  Server *m_server;
+  WorkerPool *m_workers;
+  int m_listen_fd;
+  int m_epoll_fd;
+  int m_wakeup_fd;
+  std::set<ClientConnection *> m_connections;
+
+  IoUring *m_ring;         // null when using epoll
+  uint64_t m_wakeup_count; // read from m_wakeup_fd by m_ring
+  bool m_timeout_pending;  // m_ring has a retry timeout queued
+
+  // connections whose front request is waiting for a table lock,
+  // retried when the lock may have become available (see
+  // ClientConnection::lock_released()), and every RETRY_INTERVAL_MS
+  std::vector<ClientConnection *> m_deferred;
+  uint64_t m_next_retry; // when all of m_deferred are retried next (ms)
+
+  // connections whose responses are waiting for their commits to
+  // become durable (see Wal)
+  std::vector<ClientConnection *> m_wal_waiting;
+
+  // connections handed back by workers (protected by m_completed_lock)
+  std::vector<ClientConnection *> m_completed;
+  pthread_mutex_t m_completed_lock;
+
+  // copy constructor and assignment operator are prohibited
+  EventLoop( const EventLoop & );
+  EventLoop &operator=( const EventLoop & );
+
+  void run_epoll();
+  void run_uring();
+  void accept_connections();
+  void add_connection( int client_fd );
+  void handle_io( ClientConnection *conn, uint32_t events );
+  void handle_completion( uint64_t data, int result );
+  void handle_completions();
+  void retry_deferred();
+  void check_wal_waiting();
+  void advance( ClientConnection *conn );
+  void rearm( ClientConnection *conn, uint32_t events );
+  void wait_for_input( ClientConnection *conn );
+  void close_connection( ClientConnection *conn );
+
+public:
+  // Interval (in milliseconds) at which requests blocked on a table
+  // lock are retried even if the lock hasn't told them to, so that
+  // transactions' lock waits time out, and their deadlock checks see
+  // the lock's current holders
+  static const int RETRY_INTERVAL_MS = 50;
+
+  // If io_uring is requested but isn't available, the loop logs why
+  // and uses epoll
+  EventLoop( Server *server, WorkerPool *workers, int listen_fd, bool use_io_uring = false );
+  ~EventLoop();
+
+  void run();
+  bool is_using_io_uring() const { return m_ring != nullptr; }
+
+  // Called by a worker thread when it has finished executing
+  // a connection's request
+  void request_completed( ClientConnection *conn );
+
+  // Make run() check for completed requests and durable commits.
+  // May be called from any thread.
+  void wake();
+};
+
+#endif // EVENT_LOOP_H
@@ -0,0 +1,238 @@
+#ifndef FLAT_HASH_MAP_H
+#define FLAT_HASH_MAP_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <new>
+#include <string>
+#include <string_view>
+#include <utility>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Open addressing hash map from strings to V, in the style of a Swiss
+// table. Slots are stored in one flat array, with a parallel array of
+// one-byte control values: EMPTY, or the low 7 bits of the hash of the
+// slot's key. Lookups probe groups of 16 slots, comparing all 16
+// control bytes against the key's hash bits at once (with SSE2 where
+// available), so usually only one key comparison is needed. Keys are
+// std::strings, so short keys are stored inline in the slot.
+//
+// Callers that look a key up in several maps can compute hash() once
+// and pass it to the lookup functions.
+template<typename V>
+class FlatHashMap {
+private:
+  static const size_t GROUP_SIZE = 16;
+  static const int8_t EMPTY = -128;
+
+  struct Slot {
+    std::string key;
+    V value;
+  };
+
+  int8_t *m_ctrl;      // control byte of each slot
+  Slot *m_slots;       // slot i is constructed iff m_ctrl[i] != EMPTY
+  size_t m_num_groups; // a power of 2 (or 0 before the first insertion)
+  size_t m_size;
+
+  // copy constructor and assignment operator are prohibited
+  FlatHashMap( const FlatHashMap & );
+  FlatHashMap &operator=( const FlatHashMap & );
+
+  static int8_t h2( size_t hash ) { return int8_t(hash & 0x7f); }
+  static size_t h1( size_t hash ) { return hash >> 7; }
+
+  // Bit i of the result is set if control byte i of the group equals c
+  static uint32_t match( const int8_t *group, int8_t c ) {
+#ifdef __SSE2__
+    __m128i ctrl = _mm_loadu_si128(reinterpret_cast<const __m128i *>(group));
+    return uint32_t(_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(c))));
+#else
+    uint32_t mask = 0;
+    for (size_t i = 0; i < GROUP_SIZE; i++) {
+      if (group[i] == c) {
+        mask |= uint32_t(1) << i;
+      }
+    }
+    return mask;
+#endif
+  }
+
+  size_t capacity() const { return m_num_groups * GROUP_SIZE; }
+
+  // Index of the first empty slot in key's probe sequence
+  size_t find_empty( size_t hash ) const {
+    size_t mask = m_num_groups - 1;
+    size_t g = h1(hash) & mask;
+    for (size_t i = 1; ; i++) {
+      uint32_t empty = match(m_ctrl + g * GROUP_SIZE, EMPTY);
+      if (empty != 0) {
+        return g * GROUP_SIZE + __builtin_ctz(empty);
+      }
+      g = (g + i) & mask; // triangular probing visits every group
+    }
+  }
+
+  void rehash( size_t num_groups ) {
+    int8_t *old_ctrl = m_ctrl;
+    Slot *old_slots = m_slots;
+    size_t old_capacity = capacity();
+
+    m_ctrl = new int8_t[num_groups * GROUP_SIZE];
+    std::memset(m_ctrl, EMPTY, num_groups * GROUP_SIZE);
+    m_slots = static_cast<Slot *>(::operator new(num_groups * GROUP_SIZE * sizeof(Slot)));
+    m_num_groups = num_groups;
+
+    for (size_t i = 0; i < old_capacity; i++) {
+      if (old_ctrl[i] != EMPTY) {
+        size_t hash = FlatHashMap::hash(old_slots[i].key);
+        size_t idx = find_empty(hash);
+        m_ctrl[idx] = h2(hash);
+        new (&m_slots[idx]) Slot(std::move(old_slots[i]));
+        old_slots[i].~Slot();
+      }
+    }
+    delete[] old_ctrl;
+    ::operator delete(old_slots);
+  }
+
+  void destroy_slots() {
+    for (size_t i = 0; i < capacity(); i++) {
+      if (m_ctrl[i] != EMPTY) {
+        m_slots[i].~Slot();
+      }
+    }
+  }
+
+  // Construct an entry for a key (with the given hash) that isn't
+  // present, growing the table if needed, and return its slot
+  Slot *new_slot( size_t hash ) {
+    // Keep the load factor at most 7/8, so probing stays short
+    // (and always finds an empty slot)
+    if ((m_size + 1) * 8 > capacity() * 7) {
+      rehash(m_num_groups == 0 ? 1 : m_num_groups * 2);
+    }
+    size_t idx = find_empty(hash);
+    Slot *slot = new (&m_slots[idx]) Slot();
+    m_ctrl[idx] = h2(hash);
+    m_size++;
+    return slot;
+  }
+
+  void deallocate() {
+    delete[] m_ctrl;
+    ::operator delete(m_slots);
+    m_ctrl = nullptr;
+    m_slots = nullptr;
+    m_num_groups = 0;
+  }
+
+public:
+  FlatHashMap()
+    : m_ctrl( nullptr )
+    , m_slots( nullptr )
+    , m_num_groups( 0 )
+    , m_size( 0 )
+  { }
+
+  ~FlatHashMap() {
+    destroy_slots();
+    deallocate();
+  }
+
+  static size_t hash( std::string_view key ) {
+    return std::hash<std::string_view>()(key);
+  }
+
+  size_t size() const { return m_size; }
+  bool empty() const { return m_size == 0; }
+
+  // Returns a pointer to key's value, or nullptr if key isn't present
+  V *find( std::string_view key, size_t hash ) {
+    if (m_num_groups == 0) {
+      return nullptr;
+    }
+    size_t mask = m_num_groups - 1;
+    size_t g = h1(hash) & mask;
+    for (size_t i = 1; ; i++) {
+      const int8_t *group = m_ctrl + g * GROUP_SIZE;
+      for (uint32_t m = match(group, h2(hash)); m != 0; m &= m - 1) {
+        Slot &slot = m_slots[g * GROUP_SIZE + __builtin_ctz(m)];
+        if (slot.key == key) {
+          return &slot.value;
+        }
+      }
+      if (match(group, EMPTY) != 0) {
+        return nullptr;
+      }
+      g = (g + i) & mask;
+    }
+  }
+
+  V *find( std::string_view key ) { return find(key, hash(key)); }
+
+  // Returns key's value, inserting a default-constructed value
+  // if key isn't present
+  V &operator[]( std::string_view key ) { return get_or_insert(key, hash(key)); }
+
+  V &get_or_insert( std::string_view key, size_t hash ) {
+    V *value = find(key, hash);
+    if (value != nullptr) {
+      return *value;
+    }
+    Slot *slot = new_slot(hash);
+    slot->key.assign(key.data(), key.size());
+    return slot->value;
+  }
+
+  // Insert key, which must not be present, taking over its storage,
+  // and return its default-constructed value
+  V &insert( std::string &&key, size_t hash ) {
+    Slot *slot = new_slot(hash);
+    slot->key = std::move(key);
+    return slot->value;
+  }
+
+  // Call f(key, value) for each entry
+  template<typename F>
+  void for_each( F f ) {
+    for (size_t i = 0; i < capacity(); i++) {
+      if (m_ctrl[i] != EMPTY) {
+        f(static_cast<const std::string &>(m_slots[i].key), m_slots[i].value);
+      }
+    }
+  }
+
+  // Call f(key, value) for each entry, which may move either of them
+  // away, and then remove all entries
+  template<typename F>
+  void drain( F f ) {
+    for (size_t i = 0; i < capacity(); i++) {
+      if (m_ctrl[i] != EMPTY) {
+        f(m_slots[i].key, m_slots[i].value);
+      }
+    }
+    clear();
+  }
+
+  // Remove all entries. The storage is kept for reuse unless the map
+  // has grown large.
+  void clear() {
+    if (m_size == 0) {
+      return;
+    }
+    destroy_slots();
+    if (m_num_groups > 64) {
+      deallocate();
+    } else {
+      std::memset(m_ctrl, EMPTY, capacity());
+    }
+    m_size = 0;
+  }
+};
+
+#endif // FLAT_HASH_MAP_H
@@ -24,4 +24,49 @@ public:
   }
 };
 
+// Guards holding a reader-writer lock in shared (ReadGuard) or
+// exclusive (WriteGuard) mode
+
+class ReadGuard {
+private:
+  pthread_rwlock_t &m_lock;
+
+  // copy constructor and assignment operator are prohibited
+  ReadGuard( const ReadGuard & );
+  ReadGuard &operator=( const ReadGuard & );
+
+public:
+  ReadGuard( pthread_rwlock_t &lock )
+    : m_lock( lock )
+  {
+    pthread_rwlock_rdlock( &m_lock );
+  }
+
+  ~ReadGuard()
+  {
+    pthread_rwlock_unlock( &m_lock );
+  }
+};
+
+class WriteGuard {
+private:
+  pthread_rwlock_t &m_lock;
+
+  // copy constructor and assignment operator are prohibited
+  WriteGuard( const WriteGuard & );
+  WriteGuard &operator=( const WriteGuard & );
+
+public:
+  WriteGuard( pthread_rwlock_t &lock )
+    : m_lock( lock )
+  {
+    pthread_rwlock_wrlock( &m_lock );
+  }
+
+  ~WriteGuard()
+  {
+    pthread_rwlock_unlock( &m_lock );
+  }
+};
+
 #endif // GUARD_H
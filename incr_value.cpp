@@ -1,168 +1,84 @@
-#include <cstdlib>
 #include <iostream>
-#include "csapp.h"
+#include <stdexcept>
+#include <unistd.h>
 #include "message.h"
-#include "message_serialization.h"
+#include "client_session.h"
 
 int main(int argc, char **argv) {
-  if ( argc != 6 && (argc != 7 || std::string(argv[1]) != "-t") ) {
-    std::cerr << "Usage: ./incr_value [-t] <hostname> <port> <username> <table> <key>\n";
-    std::cerr << "Options:\n";
-    std::cerr << "  -t      execute the increment as a transaction\n";
-    return 1;
-  }
-
-  int count = 1;
-
   bool use_transaction = false;
-  if ( argc == 7 ) {
-    use_transaction = true;
-    count = 2;
-  }
-
-  std::string hostname = argv[count++];
-  std::string port = argv[count++];
-  std::string username = argv[count++];
-  std::string table = argv[count++];
-  std::string key = argv[count++];
-
-  int fd = open_clientfd(hostname.c_str(), port.c_str());
-  if (fd < 0){
-    std::cerr << "Error: Couldn't connect to server" << std::endl;
-    exit(1);
-  }
-
-  Message login(MessageType::LOGIN, {username});
-  Message begin(MessageType::BEGIN);
-  Message get(MessageType::GET, {table, key});
-  Message push(MessageType::PUSH, {"1"});
-  Message add(MessageType::ADD);
-  Message set(MessageType::SET, {table, key});
-  Message commit(MessageType::COMMIT);
-  Message bye(MessageType::BYE);
-
-  std::string encoded_login, encoded_begin, encoded_get, encoded_push, encoded_add, encoded_set, encoded_commit, encoded_bye; 
-  MessageSerialization::encode(login, encoded_login);
-  MessageSerialization::encode(begin, encoded_begin);
-  MessageSerialization::encode(get, encoded_get);
-  MessageSerialization::encode(push, encoded_push);
-  MessageSerialization::encode(add, encoded_add);
-  MessageSerialization::encode(set, encoded_set);
-  MessageSerialization::encode(commit, encoded_commit);
-  MessageSerialization::encode(bye, encoded_bye);
-
-  rio_t rio;
-  char buf[1024];
-  Message response;
-
-  rio_writen(fd, encoded_login.c_str(), encoded_login.length());
-  rio_readinitb(&rio, fd);
-  ssize_t n = rio_readlineb(&rio, buf, sizeof(buf));
-  if(n <= 0){
-    std::cerr << "Error: No response from server. " << std::endl;
-    exit(1);
-  }
-  MessageSerialization::decode(buf, response);
-  if(response.get_message_type() != MessageType::OK){
-    std::cerr << "Error: " << response.get_quoted_text() << std::endl;
-    exit(1);
-  }
-
-  if(use_transaction) {
-    rio_writen(fd, encoded_begin.c_str(), encoded_begin.length());
-    rio_readinitb(&rio, fd);
-    n = rio_readlineb(&rio, buf, sizeof(buf));
-    if(n <= 0){
-      std::cerr << "Error: No response from server. " << std::endl;
-      exit(1);
-    }
-    MessageSerialization::decode(buf, response);
-    if(response.get_message_type() != MessageType::OK){
-      std::cerr << "Error: " << response.get_quoted_text() << std::endl;
-      exit(1);
+  bool optimistic = false;
+  bool pipelined = false;
+  bool binary = false;
+  bool use_stack = false;
+
+  int opt;
+  while ( (opt = getopt(argc, argv, "topbs")) != -1 ) {
+    if ( opt == 't' ) {
+      use_transaction = true;
+    } else if ( opt == 'o' ) {
+      use_transaction = true;
+      optimistic = true;
+    } else if ( opt == 'p' ) {
+      pipelined = true;
+    } else if ( opt == 'b' ) {
+      binary = true;
+    } else if ( opt == 's' ) {
+      use_stack = true;
+    } else {
+      argc = 0; // force usage message
+      break;
     }
   }
 
-  rio_writen(fd, encoded_get.c_str(), encoded_get.length());
-  rio_readinitb(&rio, fd);
-  n = rio_readlineb(&rio, buf, sizeof(buf));
-  if(n <= 0){
-    std::cerr << "Error: No response from server. " << std::endl;
-    exit(1);
-  }
-  MessageSerialization::decode(buf, response);
-  if(response.get_message_type() != MessageType::OK){
-    std::cerr << "Error: " << response.get_quoted_text() << std::endl;
-    exit(1);
+  if ( argc - optind != 5 ) {
+    std::cerr << "Usage: ./incr_value [-t|-o] [-p] [-b] [-s] <hostname> <port> <username> <table> <key>\n";
+    std::cerr << "Options:\n";
+    std::cerr << "  -t      execute the increment as a transaction\n";
+    std::cerr << "  -o      execute the increment as an optimistic transaction\n";
+    std::cerr << "  -p      pipeline the requests (one round trip)\n";
+    std::cerr << "  -b      use the binary protocol\n";
+    std::cerr << "  -s      increment with GET, PUSH 1, ADD and SET rather than INCR\n";
+    return 1;
   }
 
-  rio_writen(fd, encoded_push.c_str(), encoded_push.length());
-  rio_readinitb(&rio, fd);
-  n = rio_readlineb(&rio, buf, sizeof(buf));
-  if(n <= 0){
-    std::cerr << "Error: No response from server. " << std::endl;
-    exit(1);
-  }
-  MessageSerialization::decode(buf, response);
-  if(response.get_message_type() != MessageType::OK){
-    std::cerr << "Error: " << response.get_quoted_text() << std::endl;
-    exit(1);
-  }
+  std::string hostname = argv[optind];
+  std::string port = argv[optind + 1];
+  std::string username = argv[optind + 2];
+  std::string table = argv[optind + 3];
+  std::string key = argv[optind + 4];
 
-  rio_writen(fd, encoded_add.c_str(), encoded_add.length());
-  rio_readinitb(&rio, fd);
-  n = rio_readlineb(&rio, buf, sizeof(buf));
-  if(n <= 0){
-    std::cerr << "Error: No response from server. " << std::endl;
-    exit(1);
-  }
-  MessageSerialization::decode(buf, response);
-  if(response.get_message_type() != MessageType::OK){
-    std::cerr << "Error: " << response.get_quoted_text() << std::endl;
-    exit(1);
+  std::vector<Message> requests;
+  requests.push_back(Message(MessageType::LOGIN, {username}));
+  if (use_transaction) {
+    if (optimistic) {
+      requests.push_back(Message(MessageType::BEGIN, {"OPTIMISTIC"}));
+    } else {
+      requests.push_back(Message(MessageType::BEGIN));
+    }
   }
-
-  rio_writen(fd, encoded_set.c_str(), encoded_set.length());
-  rio_readinitb(&rio, fd);
-  n = rio_readlineb(&rio, buf, sizeof(buf));
-  if(n <= 0){
-    std::cerr << "Error: No response from server. " << std::endl;
-    exit(1);
+  if (use_stack) {
+    requests.push_back(Message(MessageType::GET, {table, key}));
+    requests.push_back(Message(MessageType::PUSH, {"1"}));
+    requests.push_back(Message(MessageType::ADD));
+    requests.push_back(Message(MessageType::SET, {table, key}));
+  } else {
+    // One request, executed atomically by the server
+    requests.push_back(Message(MessageType::INCR, {table, key}));
   }
-  MessageSerialization::decode(buf, response);
-  if(response.get_message_type() != MessageType::OK){
-    std::cerr << "Error: " << response.get_quoted_text() << std::endl;
-    exit(1);
+  if (use_transaction) {
+    requests.push_back(Message(MessageType::COMMIT));
   }
+  requests.push_back(Message(MessageType::BYE));
 
-  if(use_transaction){
-    rio_writen(fd, encoded_commit.c_str(), encoded_commit.length());
-    rio_readinitb(&rio, fd);
-    n = rio_readlineb(&rio, buf, sizeof(buf));
-    if(n <= 0){
-      std::cerr << "Error: No response from server. " << std::endl;
-      exit(1);
-    }
-    MessageSerialization::decode(buf, response);
-    if(response.get_message_type() != MessageType::OK){
-      std::cerr << "Error: " << response.get_quoted_text() << std::endl;
-      exit(1);
-    }
-  }
+  try {
+    ClientSession session(hostname, port, pipelined, binary);
 
-  rio_writen(fd, encoded_bye.c_str(), encoded_bye.length());
-  rio_readinitb(&rio, fd);
-  n = rio_readlineb(&rio, buf, sizeof(buf));
-  if(n <= 0){
-    std::cerr << "Error: No response from server. " << std::endl;
-    exit(1);
-  }
-  MessageSerialization::decode(buf, response);
-  if(response.get_message_type() != MessageType::OK){
-    std::cerr << "Error: " << response.get_quoted_text() << std::endl;
-    exit(1);
+    std::vector<Message> responses;
+    session.exchange(requests, responses);
+  } catch (std::runtime_error &ex) {
+    std::cerr << "Error: " << ex.what() << std::endl;
+    return 1;
   }
-  
-  close(fd);
 
+  return 0;
 }
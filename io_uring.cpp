@@ -0,0 +1,276 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include "exceptions.h"
+#include "io_uring.h"
+
+#if __has_include(<linux/io_uring.h>)
+
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+namespace {
+
+int sys_io_uring_setup(unsigned entries, struct io_uring_params *params) {
+  return int(syscall(__NR_io_uring_setup, entries, params));
+}
+
+int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+  return int(syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0));
+}
+
+unsigned load_acquire(const unsigned *p) {
+  return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+void store_release(unsigned *p, unsigned val) {
+  __atomic_store_n(p, val, __ATOMIC_RELEASE);
+}
+
+void *map_ring(int fd, size_t len, off_t offset) {
+  void *p = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+  return p == MAP_FAILED ? nullptr : p;
+}
+
+}
+
+bool IoUring::is_supported()
+{
+  return true;
+}
+
+IoUring::IoUring( unsigned entries )
+  : m_fd( -1 )
+  , m_sq_ring( nullptr )
+  , m_sq_ring_len( 0 )
+  , m_cq_ring( nullptr )
+  , m_cq_ring_len( 0 )
+  , m_sqes( nullptr )
+  , m_sqes_len( 0 )
+  , m_queued_tail( 0 )
+  , m_submitted( 0 )
+{
+  // A completion queue larger than the default (twice the submission
+  // queue), as a loop may have an operation pending per connection
+  struct io_uring_params params;
+  std::memset(&params, 0, sizeof(params));
+  params.flags = IORING_SETUP_CQSIZE;
+  params.cq_entries = entries * 16;
+  m_fd = sys_io_uring_setup(entries, &params);
+  if (m_fd < 0) {
+    throw CommException(std::string("Could not set up io_uring: ") + strerror(errno));
+  }
+  m_sq_entries = params.sq_entries;
+
+  m_sq_ring_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  m_cq_ring_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    m_sq_ring_len = m_cq_ring_len = std::max(m_sq_ring_len, m_cq_ring_len);
+  }
+  m_sq_ring = map_ring(m_fd, m_sq_ring_len, IORING_OFF_SQ_RING);
+  if (m_sq_ring != nullptr) {
+    m_cq_ring = (params.features & IORING_FEAT_SINGLE_MMAP) ? m_sq_ring
+        : map_ring(m_fd, m_cq_ring_len, IORING_OFF_CQ_RING);
+  }
+  m_sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+  if (m_cq_ring != nullptr) {
+    m_sqes = map_ring(m_fd, m_sqes_len, IORING_OFF_SQES);
+  }
+  if (m_sqes == nullptr) {
+    int err = errno;
+    release();
+    throw CommException(std::string("Could not map io_uring: ") + strerror(err));
+  }
+
+  char *sq = static_cast<char *>(m_sq_ring), *cq = static_cast<char *>(m_cq_ring);
+  m_sq_head = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+  m_sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+  m_sq_mask = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+  m_sq_array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+  m_cq_head = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+  m_cq_tail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+  m_cq_mask = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+  m_cqes = cq + params.cq_off.cqes;
+  m_queued_tail = m_submitted = *m_sq_tail;
+}
+
+IoUring::~IoUring()
+{
+  release();
+}
+
+void IoUring::release()
+{
+  if (m_sqes != nullptr) {
+    munmap(m_sqes, m_sqes_len);
+  }
+  if (m_cq_ring != nullptr && m_cq_ring != m_sq_ring) {
+    munmap(m_cq_ring, m_cq_ring_len);
+  }
+  if (m_sq_ring != nullptr) {
+    munmap(m_sq_ring, m_sq_ring_len);
+  }
+  if (m_fd >= 0) {
+    close(m_fd);
+  }
+}
+
+// The next free submission queue entry, cleared and filled in with the
+// common fields. When the queue is full, the queued entries are
+// submitted first to make room.
+void *IoUring::next_sqe( uint8_t opcode, int fd, uint64_t data )
+{
+  while (m_queued_tail - load_acquire(m_sq_head) >= m_sq_entries) {
+    if (!enter(0)) {
+      throw CommException("io_uring submission queue is full");
+    }
+  }
+  unsigned index = m_queued_tail & *m_sq_mask;
+  struct io_uring_sqe *sqe = static_cast<struct io_uring_sqe *>(m_sqes) + index;
+  std::memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = opcode;
+  sqe->fd = fd;
+  sqe->user_data = data;
+  m_sq_array[index] = index;
+  m_queued_tail++;
+  return sqe;
+}
+
+void IoUring::accept( int fd, int flags, uint64_t data )
+{
+  struct io_uring_sqe *sqe = static_cast<struct io_uring_sqe *>(next_sqe(IORING_OP_ACCEPT, fd, data));
+  sqe->accept_flags = unsigned(flags);
+}
+
+void IoUring::recv( int fd, void *buf, size_t len, uint64_t data )
+{
+  struct io_uring_sqe *sqe = static_cast<struct io_uring_sqe *>(next_sqe(IORING_OP_RECV, fd, data));
+  sqe->addr = reinterpret_cast<uint64_t>(buf);
+  sqe->len = unsigned(len);
+}
+
+void IoUring::sendmsg( int fd, const struct msghdr *msg, int flags, uint64_t data, bool link )
+{
+  struct io_uring_sqe *sqe = static_cast<struct io_uring_sqe *>(next_sqe(IORING_OP_SENDMSG, fd, data));
+  sqe->addr = reinterpret_cast<uint64_t>(msg);
+  sqe->len = 1;
+  sqe->msg_flags = unsigned(flags);
+  if (link) {
+    sqe->flags |= IOSQE_IO_LINK;
+  }
+}
+
+void IoUring::read( int fd, void *buf, size_t len, uint64_t data )
+{
+  struct io_uring_sqe *sqe = static_cast<struct io_uring_sqe *>(next_sqe(IORING_OP_READ, fd, data));
+  sqe->addr = reinterpret_cast<uint64_t>(buf);
+  sqe->len = unsigned(len);
+  sqe->off = uint64_t(-1); // the file position
+}
+
+void IoUring::write( int fd, const void *buf, size_t len, uint64_t offset, uint64_t data, bool link )
+{
+  struct io_uring_sqe *sqe = static_cast<struct io_uring_sqe *>(next_sqe(IORING_OP_WRITE, fd, data));
+  sqe->addr = reinterpret_cast<uint64_t>(buf);
+  sqe->len = unsigned(len);
+  sqe->off = offset;
+  if (link) {
+    sqe->flags |= IOSQE_IO_LINK;
+  }
+}
+
+void IoUring::fdatasync( int fd, uint64_t data )
+{
+  struct io_uring_sqe *sqe = static_cast<struct io_uring_sqe *>(next_sqe(IORING_OP_FSYNC, fd, data));
+  sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+}
+
+void IoUring::poll( int fd, unsigned events, uint64_t data )
+{
+  struct io_uring_sqe *sqe = static_cast<struct io_uring_sqe *>(next_sqe(IORING_OP_POLL_ADD, fd, data));
+  sqe->poll32_events = events;
+}
+
+void IoUring::timeout( unsigned ms, uint64_t data )
+{
+  static_assert(sizeof(m_timeout) == sizeof(struct __kernel_timespec), "m_timeout must hold a __kernel_timespec");
+  m_timeout[0] = ms / 1000;
+  m_timeout[1] = (ms % 1000) * 1000000LL;
+  struct io_uring_sqe *sqe = static_cast<struct io_uring_sqe *>(next_sqe(IORING_OP_TIMEOUT, -1, data));
+  sqe->addr = reinterpret_cast<uint64_t>(m_timeout);
+  sqe->len = 1;
+}
+
+// Returns false if the kernel took no entries because completions
+// must be taken first
+bool IoUring::enter( unsigned wait_nr )
+{
+  store_release(m_sq_tail, m_queued_tail);
+  unsigned to_submit = m_queued_tail - m_submitted;
+  unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+  while (true) {
+    int n = sys_io_uring_enter(m_fd, to_submit, wait_nr, flags);
+    if (n >= 0) {
+      m_submitted += unsigned(n);
+      return true;
+    }
+    if (errno == EINTR) {
+      continue;
+    }
+    if (errno == EBUSY || errno == EAGAIN) {
+      return false;
+    }
+    throw CommException(std::string("io_uring_enter failed: ") + strerror(errno));
+  }
+}
+
+void IoUring::submit( unsigned wait_nr )
+{
+  enter(wait_nr);
+}
+
+bool IoUring::next_completion( uint64_t &data, int &result )
+{
+  unsigned head = *m_cq_head;
+  if (head == load_acquire(m_cq_tail)) {
+    return false;
+  }
+  const struct io_uring_cqe *cqe = static_cast<const struct io_uring_cqe *>(m_cqes) + (head & *m_cq_mask);
+  data = cqe->user_data;
+  result = cqe->res;
+  store_release(m_cq_head, head + 1);
+  return true;
+}
+
+#else // no <linux/io_uring.h>
+
+bool IoUring::is_supported()
+{
+  return false;
+}
+
+IoUring::IoUring( unsigned )
+  : m_fd( -1 )
+{
+  throw CommException("Built without io_uring support");
+}
+
+IoUring::~IoUring()
+{
+}
+
+void IoUring::release() { }
+void IoUring::accept( int, int, uint64_t ) { }
+void IoUring::recv( int, void *, size_t, uint64_t ) { }
+void IoUring::sendmsg( int, const struct msghdr *, int, uint64_t, bool ) { }
+void IoUring::read( int, void *, size_t, uint64_t ) { }
+void IoUring::write( int, const void *, size_t, uint64_t, uint64_t, bool ) { }
+void IoUring::fdatasync( int, uint64_t ) { }
+void IoUring::poll( int, unsigned, uint64_t ) { }
+void IoUring::timeout( unsigned, uint64_t ) { }
+void IoUring::submit( unsigned ) { }
+bool IoUring::next_completion( uint64_t &, int & ) { return false; }
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef IO_URING_H
+#define IO_URING_H
+
+#include <cstddef>
+#include <cstdint>
+#include <sys/socket.h>
+
+// Minimal io_uring submission/completion queue pair, driven with the
+// raw system calls (no liburing). Operations are queued with the
+// functions below, each tagged with a caller-chosen data value, and
+// everything queued is handed to the kernel by one submit() call,
+// which can also wait for completions. Only for use by one thread.
+//
+// io_uring support is detected when building (it needs
+// <linux/io_uring.h>); without it, or on a kernel that lacks or
+// forbids io_uring, the constructor throws and callers fall back to
+// ordinary system calls.
+class IoUring {
+private:
+  int m_fd;
+  unsigned m_sq_entries;
+  void *m_sq_ring;
+  size_t m_sq_ring_len;
+  void *m_cq_ring;
+  size_t m_cq_ring_len;
+  void *m_sqes;
+  size_t m_sqes_len;
+
+  // Pointers into the rings
+  unsigned *m_sq_head;
+  unsigned *m_sq_tail;
+  unsigned *m_sq_mask;
+  unsigned *m_sq_array;
+  unsigned *m_cq_head;
+  unsigned *m_cq_tail;
+  unsigned *m_cq_mask;
+  void *m_cqes;
+
+  unsigned m_queued_tail; // tail including queued but unsubmitted entries
+  unsigned m_submitted;   // tail as of the last submission
+
+  // The pending timeout: a struct __kernel_timespec, which this header
+  // can't name without the kernel headers
+  long long m_timeout[2];
+
+  // copy constructor and assignment operator are prohibited
+  IoUring( const IoUring & );
+  IoUring &operator=( const IoUring & );
+
+  void release();
+  void *next_sqe( uint8_t opcode, int fd, uint64_t data );
+  bool enter( unsigned wait_nr );
+
+public:
+  // Whether the server was built with io_uring support
+  static bool is_supported();
+
+  // Throws CommException if io_uring isn't available
+  IoUring( unsigned entries );
+  ~IoUring();
+
+  // Queue an operation. The buffers (and msg) must stay valid until its
+  // completion. If link is true, the next operation queued only starts
+  // once this one has succeeded completely (otherwise it completes with
+  // -ECANCELED).
+  void accept( int fd, int flags, uint64_t data );
+  void recv( int fd, void *buf, size_t len, uint64_t data );
+  void sendmsg( int fd, const struct msghdr *msg, int flags, uint64_t data, bool link = false );
+  void read( int fd, void *buf, size_t len, uint64_t data );
+  void write( int fd, const void *buf, size_t len, uint64_t offset, uint64_t data, bool link = false );
+  void fdatasync( int fd, uint64_t data );
+  void poll( int fd, unsigned events, uint64_t data );
+
+  // Complete (with -ETIME) after ms milliseconds. Only one timeout may
+  // be pending at a time.
+  void timeout( unsigned ms, uint64_t data );
+
+  // Hand the queued operations to the kernel, and wait until at least
+  // wait_nr operations have completed. Throws CommException on failure.
+  void submit( unsigned wait_nr = 0 );
+
+  // Take the next completion: its data and result (as a system call
+  // would return it, with -errno for errors). Returns false if there
+  // is none.
+  bool next_completion( uint64_t &data, int &result );
+};
+
+#endif // IO_URING_H
@@ -0,0 +1,540 @@
+#include <cerrno>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "exceptions.h"
+#include "flat_hash_map.h"
+#include "guard.h"
+#include "lsm_storage.h"
+
+namespace {
+
+uint64_t key_hash(std::string_view key) {
+  return FlatHashMap<std::string>::hash(key);
+}
+
+// Run values: u64 commit timestamp, then the value
+void encode_value(std::string &buf, uint64_t ts, std::string_view value) {
+  buf.clear();
+  for (int i = 0; i < 8; i++) {
+    buf += char(ts >> (8 * i));
+  }
+  buf += value;
+}
+
+void decode_value(std::string_view encoded, std::string_view &value, uint64_t &ts) {
+  if (encoded.size() < 8) {
+    throw OperationException("LSM run is corrupted. ");
+  }
+  ts = 0;
+  for (int i = 7; i >= 0; i--) {
+    ts = (ts << 8) | (unsigned char) encoded[i];
+  }
+  value = encoded.substr(8);
+}
+
+// Writes a run file, building its bloom filter along the way
+class RunWriter {
+private:
+  int m_fd;
+  FileWriter m_out;
+  TableFileBuilder m_builder;
+
+public:
+  BloomFilter bloom;
+
+  RunWriter(int fd, size_t max_keys) : m_fd(fd), m_out(fd), m_builder(m_out), bloom(max_keys) { }
+
+  ~RunWriter() {
+    if (m_fd >= 0) {
+      close(m_fd);
+    }
+  }
+
+  void add(std::string_view key, std::string_view encoded_value) {
+    m_builder.add(key, encoded_value);
+    bloom.add(key_hash(key));
+  }
+
+  // Returns false (with errno set) on failure
+  bool finish() {
+    m_builder.finish();
+    bool ok = m_out.flush();
+    int err = errno;
+    if (close(m_fd) < 0 && ok) {
+      ok = false;
+      err = errno;
+    }
+    m_fd = -1;
+    errno = err;
+    return ok;
+  }
+};
+
+// Iterates over the union of several table files' entries in key
+// order, taking each key's value from the first file that has it
+class MergeIterator {
+private:
+  std::vector<TableFile::Iterator> m_its;
+  size_t m_current;
+
+  void find_smallest() {
+    m_current = m_its.size();
+    for (size_t i = 0; i < m_its.size(); i++) {
+      if (m_its[i].valid() && (m_current == m_its.size() || m_its[i].key() < m_its[m_current].key())) {
+        m_current = i;
+      }
+    }
+  }
+
+public:
+  MergeIterator(const std::vector<const TableFile *> &files) {
+    m_its.reserve(files.size());
+    for (const TableFile *file : files) {
+      m_its.emplace_back(*file);
+    }
+    find_smallest();
+  }
+
+  bool valid() const { return m_current < m_its.size(); }
+  std::string_view key() const { return m_its[m_current].key(); }
+  std::string_view value() const { return m_its[m_current].value(); }
+
+  void next() {
+    // The key is a view into a mapped file, so it survives next()
+    std::string_view key = this->key();
+    for (TableFile::Iterator &it : m_its) {
+      if (it.valid() && it.key() == key) {
+        it.next();
+      }
+    }
+    find_smallest();
+  }
+};
+
+}
+
+////////////////////////////////////////////////////////////////////////
+// LsmStorage::Run
+////////////////////////////////////////////////////////////////////////
+
+LsmStorage::Run::Run( const std::string &path, BloomFilter &&bloom )
+  : path( path )
+  , file( path )
+  , table( file.get_data() )
+  , bloom( std::move(bloom) )
+{
+}
+
+LsmStorage::Run::~Run()
+{
+  unlink(path.c_str());
+}
+
+////////////////////////////////////////////////////////////////////////
+// LsmStorage
+////////////////////////////////////////////////////////////////////////
+
+LsmStorage::LsmStorage( const std::string &dir, const std::string &table_name, unsigned num_shards, size_t flush_bytes )
+  : m_dir( dir )
+  , m_table_name( table_name )
+  , m_flush_bytes( flush_bytes )
+  , m_num_shards( num_shards )
+  , m_shards( nullptr )
+  , m_next_seq( 0 )
+  , m_has_compactor( false )
+  , m_compacting( false )
+  , m_stop( false )
+  , m_bytes_flushed( 0 )
+  , m_bytes_compacted( 0 )
+  , m_num_gets( 0 )
+  , m_runs_probed( 0 )
+  , m_bloom_skips( 0 )
+  , m_num_compactions( 0 )
+{
+  remove_stale_runs();
+
+  m_shards = new Shard[num_shards];
+  for (unsigned i = 0; i < num_shards; i++) {
+    pthread_mutex_init(&m_shards[i].mutex, nullptr);
+    m_shards[i].levels = std::make_shared<const Levels>();
+    m_shards[i].queued = false;
+  }
+  pthread_mutex_init(&m_queue_mutex, nullptr);
+  pthread_cond_init(&m_queue_cond, nullptr);
+
+  if (pthread_create(&m_compactor, nullptr, compactor_main, this) != 0) {
+    pthread_cond_destroy(&m_queue_cond);
+    pthread_mutex_destroy(&m_queue_mutex);
+    for (unsigned i = 0; i < num_shards; i++) {
+      pthread_mutex_destroy(&m_shards[i].mutex);
+    }
+    delete[] m_shards;
+    throw CommException("Could not start compaction thread");
+  }
+  m_has_compactor = true;
+}
+
+LsmStorage::~LsmStorage()
+{
+  {
+    Guard g(m_queue_mutex);
+    m_stop = true;
+    pthread_cond_broadcast(&m_queue_cond);
+  }
+  if (m_has_compactor) {
+    pthread_join(m_compactor, nullptr);
+  }
+  pthread_cond_destroy(&m_queue_cond);
+  pthread_mutex_destroy(&m_queue_mutex);
+  for (unsigned i = 0; i < m_num_shards; i++) {
+    pthread_mutex_destroy(&m_shards[i].mutex);
+  }
+  // Dropping the last references to the runs removes their files
+  delete[] m_shards;
+}
+
+// Remove the runs left by an earlier server process (runs aren't
+// reopened, see above). Throws CommException if dir can't be read.
+void LsmStorage::remove_stale_runs()
+{
+  DIR *dir = opendir(m_dir.c_str());
+  if (dir == nullptr) {
+    throw CommException("Could not open LSM directory " + m_dir + ": " + strerror(errno));
+  }
+  std::string prefix = m_table_name + ".", suffix = ".run";
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != nullptr) {
+    std::string_view name(entry->d_name);
+    if (name.size() <= prefix.size() + suffix.size() || name.substr(0, prefix.size()) != prefix
+        || name.substr(name.size() - suffix.size()) != suffix) {
+      continue;
+    }
+    std::string_view seq = name.substr(prefix.size(), name.size() - prefix.size() - suffix.size());
+    if (seq.find_first_not_of("0123456789") == std::string_view::npos) {
+      unlink((m_dir + "/" + std::string(name)).c_str());
+    }
+  }
+  closedir(dir);
+}
+
+std::string LsmStorage::next_path()
+{
+  return m_dir + "/" + m_table_name + "." + std::to_string(m_next_seq++) + ".run";
+}
+
+// Write entries as a new run. Returns null on failure.
+LsmStorage::RunPtr LsmStorage::write_run( const std::vector<Entry> &entries )
+{
+  std::string path = next_path();
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    return nullptr;
+  }
+  RunWriter writer(fd, entries.size());
+  std::string encoded;
+  for (const Entry &entry : entries) {
+    encode_value(encoded, entry.ts, entry.value);
+    writer.add(entry.key, encoded);
+  }
+  try {
+    if (writer.finish()) {
+      return std::make_shared<const Run>(path, std::move(writer.bloom));
+    }
+  } catch (CommException &e) {
+    // fall through
+  }
+  unlink(path.c_str());
+  return nullptr;
+}
+
+// Merge runs (newest first, so a key's value is taken from the newest
+// run that has it) into a new run. Returns null on failure.
+LsmStorage::RunPtr LsmStorage::merge_runs( const std::vector<RunPtr> &inputs )
+{
+  std::vector<const TableFile *> files;
+  uint64_t max_keys = 0;
+  for (const RunPtr &run : inputs) {
+    files.push_back(&run->table);
+    max_keys += run->table.get_num_keys();
+  }
+
+  std::string path = next_path();
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    return nullptr;
+  }
+  RunWriter writer(fd, max_keys);
+  try {
+    for (MergeIterator it(files); it.valid(); it.next()) {
+      writer.add(it.key(), it.value());
+    }
+    if (writer.finish()) {
+      return std::make_shared<const Run>(path, std::move(writer.bloom));
+    }
+  } catch (std::exception &e) {
+    // a corrupted input or an unreadable output: leave the runs as
+    // they are
+  }
+  unlink(path.c_str());
+  return nullptr;
+}
+
+bool LsmStorage::flush( unsigned shard, const std::vector<Entry> &entries )
+{
+  if (entries.empty()) {
+    return true;
+  }
+  RunPtr run = write_run(entries);
+  if (!run) {
+    return false;
+  }
+  m_bytes_flushed += run->get_bytes();
+
+  Shard &s = m_shards[shard];
+  bool full;
+  {
+    Guard g(s.mutex);
+    std::shared_ptr<Levels> levels = std::make_shared<Levels>(*s.levels);
+    levels->l0.insert(levels->l0.begin(), run);
+    full = levels->l0.size() >= L0_RUNS;
+    s.levels = levels;
+  }
+  if (full) {
+    schedule(shard);
+  }
+  return true;
+}
+
+// Size above which level i (L(i+1)) is merged into the next level
+uint64_t LsmStorage::level_limit( unsigned level ) const
+{
+  uint64_t limit = uint64_t(m_flush_bytes) * L0_RUNS;
+  for (unsigned i = 0; i <= level; i++) {
+    limit *= LEVEL_FACTOR;
+  }
+  return limit;
+}
+
+bool LsmStorage::find( const Levels &levels, std::string_view key, std::string &value, uint64_t &ts )
+{
+  uint64_t hash = key_hash(key);
+  auto probe = [this, key, hash, &value, &ts](const RunPtr &run) {
+    if (!run->bloom.may_contain(hash)) {
+      m_bloom_skips.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    m_runs_probed.fetch_add(1, std::memory_order_relaxed);
+    std::string_view encoded, run_value;
+    if (!run->table.find(key, encoded)) {
+      return false;
+    }
+    decode_value(encoded, run_value, ts);
+    value.assign(run_value.data(), run_value.size());
+    return true;
+  };
+
+  for (const RunPtr &run : levels.l0) {
+    if (probe(run)) {
+      return true;
+    }
+  }
+  for (const RunPtr &run : levels.levels) {
+    if (run && probe(run)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool LsmStorage::get( unsigned shard, std::string_view key, std::string &value, uint64_t &ts )
+{
+  m_num_gets.fetch_add(1, std::memory_order_relaxed);
+  std::shared_ptr<const Levels> levels;
+  {
+    Guard g(m_shards[shard].mutex);
+    levels = m_shards[shard].levels;
+  }
+  return find(*levels, key, value, ts);
+}
+
+void LsmStorage::prepare_fork()
+{
+  for (unsigned i = 0; i < m_num_shards; i++) {
+    pthread_mutex_lock(&m_shards[i].mutex);
+  }
+}
+
+void LsmStorage::after_fork()
+{
+  for (unsigned i = m_num_shards; i > 0; i--) {
+    pthread_mutex_unlock(&m_shards[i - 1].mutex);
+  }
+}
+
+bool LsmStorage::get_unlocked( unsigned shard, std::string_view key, std::string &value, uint64_t &ts )
+{
+  return find(*m_shards[shard].levels, key, value, ts);
+}
+
+void LsmStorage::for_each_unlocked( const std::function<void(std::string_view, std::string_view)> &f )
+{
+  for (unsigned i = 0; i < m_num_shards; i++) {
+    const Levels &levels = *m_shards[i].levels;
+    std::vector<const TableFile *> files;
+    for (const RunPtr &run : levels.l0) {
+      files.push_back(&run->table);
+    }
+    for (const RunPtr &run : levels.levels) {
+      if (run) {
+        files.push_back(&run->table);
+      }
+    }
+    for (MergeIterator it(files); it.valid(); it.next()) {
+      std::string_view value;
+      uint64_t ts;
+      decode_value(it.value(), value, ts);
+      f(it.key(), value);
+    }
+  }
+}
+
+// Queue the shard for compaction, unless it already is
+void LsmStorage::schedule( unsigned shard )
+{
+  Guard g(m_queue_mutex);
+  if (!m_shards[shard].queued) {
+    m_shards[shard].queued = true;
+    m_queue.push_back(shard);
+    pthread_cond_broadcast(&m_queue_cond);
+  }
+}
+
+void *LsmStorage::compactor_main( void *arg )
+{
+  static_cast<LsmStorage *>(arg)->run_compactor();
+  return nullptr;
+}
+
+void LsmStorage::run_compactor()
+{
+  Guard g(m_queue_mutex);
+  while (true) {
+    while (m_queue.empty() && !m_stop) {
+      pthread_cond_wait(&m_queue_cond, &m_queue_mutex);
+    }
+    if (m_stop) {
+      break;
+    }
+    unsigned shard = m_queue.front();
+    m_queue.pop_front();
+    // Cleared before compacting, so that a flush during the compaction
+    // queues the shard again rather than being missed
+    m_shards[shard].queued = false;
+    m_compacting = true;
+
+    pthread_mutex_unlock(&m_queue_mutex);
+    compact(shard);
+    pthread_mutex_lock(&m_queue_mutex);
+
+    m_compacting = false;
+    pthread_cond_broadcast(&m_queue_cond);
+  }
+}
+
+// Merge the shard's L0 into L1 if it is full, then each level over
+// its limit into the next, until the shard's shape is within limits.
+// Only the compactor changes the levels (flushes only add L0 runs), so
+// the merged runs are still in place when the result is installed.
+void LsmStorage::compact( unsigned shard )
+{
+  Shard &s = m_shards[shard];
+  while (true) {
+    std::shared_ptr<const Levels> current;
+    {
+      Guard g(s.mutex);
+      current = s.levels;
+    }
+
+    std::vector<RunPtr> inputs;
+    size_t num_l0 = 0;
+    size_t target;
+    if (current->l0.size() >= L0_RUNS) {
+      inputs = current->l0;
+      num_l0 = inputs.size();
+      target = 0;
+    } else {
+      target = current->levels.size();
+      for (size_t i = 0; i < current->levels.size(); i++) {
+        if (current->levels[i] && current->levels[i]->get_bytes() > level_limit(unsigned(i))) {
+          inputs.push_back(current->levels[i]);
+          target = i + 1;
+          break;
+        }
+      }
+      if (inputs.empty()) {
+        return;
+      }
+    }
+    if (target < current->levels.size() && current->levels[target]) {
+      inputs.push_back(current->levels[target]);
+    }
+
+    RunPtr out = merge_runs(inputs);
+    if (!out) {
+      return; // tried again after the next flush
+    }
+    m_bytes_compacted += out->get_bytes();
+    m_num_compactions++;
+
+    Guard g(s.mutex);
+    std::shared_ptr<Levels> levels = std::make_shared<Levels>(*s.levels);
+    if (num_l0 > 0) {
+      // The merged runs are the oldest in L0
+      levels->l0.resize(levels->l0.size() - num_l0);
+    } else {
+      levels->levels[target - 1] = nullptr;
+    }
+    if (levels->levels.size() <= target) {
+      levels->levels.resize(target + 1);
+    }
+    levels->levels[target] = out;
+    s.levels = levels;
+  }
+}
+
+void LsmStorage::wait_compactions()
+{
+  Guard g(m_queue_mutex);
+  while (!m_queue.empty() || m_compacting) {
+    pthread_cond_wait(&m_queue_cond, &m_queue_mutex);
+  }
+}
+
+LsmStorage::Stats LsmStorage::get_stats() const
+{
+  Stats stats;
+  stats.bytes_flushed = m_bytes_flushed.load();
+  stats.bytes_compacted = m_bytes_compacted.load();
+  stats.num_gets = m_num_gets.load();
+  stats.runs_probed = m_runs_probed.load();
+  stats.bloom_skips = m_bloom_skips.load();
+  stats.num_compactions = m_num_compactions.load();
+  return stats;
+}
+
+std::vector<unsigned> LsmStorage::get_shape( unsigned shard )
+{
+  std::shared_ptr<const Levels> levels;
+  {
+    Guard g(m_shards[shard].mutex);
+    levels = m_shards[shard].levels;
+  }
+  std::vector<unsigned> shape;
+  shape.push_back(unsigned(levels->l0.size()));
+  for (const RunPtr &run : levels->levels) {
+    shape.push_back(run ? 1 : 0);
+  }
+  return shape;
+}
@@ -0,0 +1,142 @@
+#ifndef LSM_STORAGE_H
+#define LSM_STORAGE_H
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include "bloom_filter.h"
+#include "storage.h"
+#include "table_file.h"
+
+// Log-structured merge tree storage, for tables larger than memory.
+// Each table shard is its own tree: the shard's in-memory versions are
+// its memtable, and are flushed as a sorted run (a TableFile, with a
+// bloom filter of its keys) once they reach the flush size. Runs are
+// organized in levels:
+//
+//   L0       flushed runs, newest first (their key ranges overlap)
+//   L1..Ln   one run each, each level up to LEVEL_FACTOR times the
+//            size of the one before
+//
+// When L0 reaches L0_RUNS runs, a background thread merges them into
+// L1, and then any level over its size into the next. A lookup probes
+// the L0 runs then each level, skipping runs whose bloom filter rules
+// the key out.
+//
+// Run values are a u64 commit timestamp followed by the value. Runs
+// aren't synced or reopened: the log (or snapshot) remains the source
+// of truth, and rebuilds them on restart.
+class LsmStorage : public Storage {
+public:
+  static const unsigned L0_RUNS = 4;
+  static const unsigned LEVEL_FACTOR = 10;
+
+  struct Stats {
+    uint64_t bytes_flushed;   // run bytes written by flushes
+    uint64_t bytes_compacted; // run bytes written by compactions
+    uint64_t num_gets;
+    uint64_t runs_probed;     // runs searched by gets
+    uint64_t bloom_skips;     // runs skipped by gets thanks to the bloom filter
+    uint64_t num_compactions;
+  };
+
+private:
+  // An immutable sorted run. The file is removed when the last
+  // reference to the run is dropped.
+  struct Run {
+    std::string path;
+    MappedFile file;
+    TableFile table;
+    BloomFilter bloom;
+
+    // Throws CommException if the file can't be opened
+    Run( const std::string &path, BloomFilter &&bloom );
+    ~Run();
+
+    uint64_t get_bytes() const { return file.get_data().size(); }
+  };
+  typedef std::shared_ptr<const Run> RunPtr;
+
+  struct Levels {
+    std::vector<RunPtr> l0;     // newest first
+    std::vector<RunPtr> levels; // levels[i] is L(i+1) (null if empty)
+  };
+
+  struct Shard {
+    // Protects levels (the pointer: a Levels is never modified once
+    // published, so readers just take a reference to it)
+    pthread_mutex_t mutex;
+    std::shared_ptr<const Levels> levels;
+    bool queued; // waiting for (or undergoing) compaction
+  };
+
+  std::string m_dir;
+  std::string m_table_name;
+  size_t m_flush_bytes;
+  unsigned m_num_shards;
+  Shard *m_shards;
+  std::atomic<uint64_t> m_next_seq;
+
+  pthread_t m_compactor;
+  bool m_has_compactor;
+  pthread_mutex_t m_queue_mutex;
+  pthread_cond_t m_queue_cond;
+  std::deque<unsigned> m_queue; // shards to compact
+  bool m_compacting;            // the compactor is working on a shard
+  bool m_stop;
+
+  std::atomic<uint64_t> m_bytes_flushed;
+  std::atomic<uint64_t> m_bytes_compacted;
+  std::atomic<uint64_t> m_num_gets;
+  std::atomic<uint64_t> m_runs_probed;
+  std::atomic<uint64_t> m_bloom_skips;
+  std::atomic<uint64_t> m_num_compactions;
+
+  // copy constructor and assignment operator are prohibited
+  LsmStorage( const LsmStorage & );
+  LsmStorage &operator=( const LsmStorage & );
+
+  static void *compactor_main( void *arg );
+  void run_compactor();
+  void compact( unsigned shard );
+  void schedule( unsigned shard );
+
+  RunPtr write_run( const std::vector<Entry> &entries );
+  RunPtr merge_runs( const std::vector<RunPtr> &inputs );
+  std::string next_path();
+
+  uint64_t level_limit( unsigned level ) const;
+  bool find( const Levels &levels, std::string_view key, std::string &value, uint64_t &ts );
+  void remove_stale_runs();
+
+public:
+  // Keep the runs of the given table in dir, flushing each of its
+  // num_shards shards at flush_bytes. Throws CommException if the
+  // compaction thread can't be started.
+  LsmStorage( const std::string &dir, const std::string &table_name, unsigned num_shards, size_t flush_bytes );
+  ~LsmStorage();
+
+  Kind get_kind() const { return LSM; }
+  size_t get_flush_bytes() const { return m_flush_bytes; }
+  bool flush( unsigned shard, const std::vector<Entry> &entries );
+  bool get( unsigned shard, std::string_view key, std::string &value, uint64_t &ts );
+  void prepare_fork();
+  void after_fork();
+  bool get_unlocked( unsigned shard, std::string_view key, std::string &value, uint64_t &ts );
+  void for_each_unlocked( const std::function<void(std::string_view, std::string_view)> &f );
+
+  Stats get_stats() const;
+
+  // Wait until no compaction is queued or running (e.g. for tests and
+  // benchmarks)
+  void wait_compactions();
+
+  // Number of runs in L0 and in each level, for the given shard
+  std::vector<unsigned> get_shape( unsigned shard );
+};
+
+#endif // LSM_STORAGE_H
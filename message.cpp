@@ -52,28 +52,28 @@ void Message::set_message_type(MessageType message_type)
   m_message_type = message_type;
 }
 
-std::string Message::get_username() const
+const std::string &Message::get_username() const
 {
+  static const std::string empty;
   if (m_args.size() > 0) { 
-    return m_args[0].c_str();
+    return m_args[0];
   }
-  return "";
+  return empty;
 }
 
-std::string Message::get_table() const
+const std::string &Message::get_table() const
 {
-    return m_args[0].c_str();
+    return m_args[0];
 }
 
-std::string Message::get_key() const
+const std::string &Message::get_key() const
 {
-  std::string result = (m_args.size() > 1) ? m_args[1] : m_args[0];
-  return result; 
+  return (m_args.size() > 1) ? m_args[1] : m_args[0];
 }
 
-std::string Message::get_value() const
+const std::string &Message::get_value() const
 {
-  return m_args[0].c_str();
+  return m_args[0];
 }
 
 std::string Message::get_quoted_text() const
@@ -94,57 +94,78 @@ void Message::push_arg( const std::string &arg )
   m_args.push_back( arg );
 }
 
-bool Message::is_valid() const
+void Message::set_args( const std::string_view *args, unsigned num_args )
 {
-  static const std::set<MessageType> valid_types = {
-    MessageType::LOGIN, MessageType::CREATE, MessageType::PUSH,
-    MessageType::POP, MessageType::TOP, MessageType::SET,
-    MessageType::GET, MessageType::ADD, MessageType::SUB,
-    MessageType::MUL, MessageType::DIV, MessageType::BEGIN,
-    MessageType::COMMIT, MessageType::BYE, MessageType::OK,
-    MessageType::FAILED, MessageType::ERROR, MessageType::DATA
-  };
-
-  bool is_valid = false; 
-
-  for(MessageType m : valid_types) {
-    if (m == m_message_type) {
-      is_valid = true;
-    }
+  m_args.resize( num_args );
+  for (unsigned i = 0; i < num_args; i++) {
+    m_args[i].assign( args[i].data(), args[i].size() );
   }
+}
 
-  if (m_message_type == MessageType::LOGIN || m_message_type == MessageType::CREATE) {
-    if (get_num_args() != 1) {
-      
-      return false;
-    }
-    return is_identifier();
+unsigned Message::max_encoded_len( MessageType message_type )
+{
+  switch (message_type) {
+    case MessageType::MGET:
+    case MessageType::MSET:
+    case MessageType::MPUSH:
+    case MessageType::DATA:
+      return MAX_MULTI_ENCODED_LEN;
+    default:
+      return MAX_ENCODED_LEN;
   }
+}
 
-  if (m_message_type == MessageType::SET || m_message_type == MessageType::GET) {
-    if (get_num_args() != 2) {
-      std::printf("Debug message returning: %d\n", 2);
-      return false;
-    }
-    return is_identifier();
+bool Message::is_valid() const
+{
+  if (get_num_args() > MAX_ARGS) {
+    return false;
   }
-
-  if (m_message_type == MessageType::PUSH || m_message_type == MessageType::FAILED || m_message_type == MessageType::ERROR || m_message_type == MessageType::DATA) {
-    if (get_num_args() != 1) {
-    
+  switch (m_message_type) {
+    case MessageType::LOGIN:
+      return get_num_args() == 1 && is_identifier();
+    case MessageType::CREATE:
+      // table, and optionally its storage engine
+      return (get_num_args() == 1 || get_num_args() == 2) && is_identifier();
+    case MessageType::SET:
+    case MessageType::GET:
+    case MessageType::INCR:
+    case MessageType::DECR:
+      return get_num_args() == 2 && is_identifier();
+    case MessageType::INCRBY:
+      // table, key and delta (checked when executed, like operands)
+      return get_num_args() == 3 && is_identifier(2);
+    case MessageType::MGET:
+    case MessageType::MSET:
+      // table, and one or more keys
+      return get_num_args() >= 2 && is_identifier();
+    case MessageType::PUSH:
+    case MessageType::FAILED:
+    case MessageType::ERROR:
+      return get_num_args() == 1;
+    case MessageType::MPUSH:
+    case MessageType::DATA:
+      return get_num_args() >= 1;
+    case MessageType::BEGIN:
+      return get_num_args() == 0 || (get_num_args() == 1 && is_identifier());
+    case MessageType::NONE:
       return false;
-    }
+    default:
+      return true;
   }
-  return is_valid; 
 }
 
 bool Message::is_identifier() const {
-  for (const auto& identifier : m_args) {
-    if (identifier.empty() || !std::isalpha(identifier[0])) {
+  return is_identifier(get_num_args());
+}
+
+bool Message::is_identifier( unsigned num_args ) const {
+  for (unsigned i = 0; i < num_args && i < get_num_args(); i++) {
+    const std::string &identifier = m_args[i];
+    if (identifier.empty() || identifier.size() > MAX_IDENTIFIER_LEN || !std::isalpha(identifier[0])) {
       return false;
     }
-    for (size_t i = 1; i < identifier.size(); ++i) {
-      if (!std::isalnum(identifier[i]) && identifier[i] != '_') {
+    for (size_t j = 1; j < identifier.size(); ++j) {
+      if (!std::isalnum(identifier[j]) && identifier[j] != '_') {
         return false;
       }
     }
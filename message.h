@@ -3,6 +3,7 @@
 
 #include <vector>
 #include <string>
+#include <string_view>
 #include <map>
 
 
@@ -25,14 +26,29 @@ enum class MessageType {
   BEGIN,
   COMMIT,
   BYE,
+  SNAPSHOT,
 
   // Responses
   OK,
   FAILED,
   ERROR,
   DATA,
+
+  // Multi-key requests (numbered after the responses, so that the
+  // binary protocol's existing opcodes keep their values)
+  MGET,
+  MSET,
+  MPUSH,
+
+  // Counter requests
+  INCR,
+  DECR,
+  INCRBY,
 };
 
+// The highest MessageType value
+const MessageType LAST_MESSAGE_TYPE = MessageType::INCRBY;
+
 class Message {
 private:
   MessageType m_message_type;
@@ -43,6 +59,20 @@ public:
   // Maximum encoded message length (including terminator newline character)
   static const unsigned MAX_ENCODED_LEN = 1024;
 
+  // Maximum encoded length of a multi-key request (MGET, MSET or
+  // MPUSH) or a DATA response with several values, and the maximum
+  // number of arguments of any message (the binary protocol's limit)
+  static const unsigned MAX_MULTI_ENCODED_LEN = 256 * 1024;
+  static const unsigned MAX_ARGS = 255;
+
+  // Maximum length of an identifier (user, table or key name). Logs
+  // and snapshots store table names with a 16-bit length, and the
+  // binary protocol would otherwise allow names of up to 16 MB.
+  static const unsigned MAX_IDENTIFIER_LEN = 1024;
+
+  // The maximum encoded length of a message of the given type
+  static unsigned max_encoded_len( MessageType message_type );
+
   Message();
   Message( MessageType message_type, std::initializer_list<std::string> args = std::initializer_list<std::string>() );
   Message( MessageType message_type, std::vector<std::string> args);
@@ -54,19 +84,24 @@ public:
   MessageType get_message_type() const;
   void set_message_type( MessageType message_type );
 
-  std::string get_username() const;
-  std::string get_table() const;
-  std::string get_key() const;
-  std::string get_value() const;
+  const std::string &get_username() const;
+  const std::string &get_table() const;
+  const std::string &get_key() const;
+  const std::string &get_value() const;
   std::string get_quoted_text() const;
 
   void push_arg( const std::string &arg );
 
+  // Replace the arguments, reusing the storage of the existing ones
+  void set_args( const std::string_view *args, unsigned num_args );
+
   bool is_valid() const;
   bool is_identifier() const;
+  // Whether the first num_args arguments are identifiers
+  bool is_identifier( unsigned num_args ) const;
 
   unsigned get_num_args() const { return m_args.size(); }
-  std::string get_arg( unsigned i ) const { return m_args.at( i ); }
+  const std::string &get_arg( unsigned i ) const { return m_args.at( i ); }
   void clear_args();
 };
 
@@ -1,204 +1,328 @@
-#include <iostream>
 #include <string>
-#include <utility>
-#include <sstream>
+#include <string_view>
 #include <cassert>
-#include <map>
 #include "exceptions.h"
 #include "message.h"
 #include "message_serialization.h"
-#include <algorithm>
-
-std::string MessageTypeToStringFunc(MessageType type) {
-    const std::map<MessageType, std::string> MessageTypeToString = {
-    {MessageType::NONE, "NONE"},
-    {MessageType::LOGIN, "LOGIN"},
-    {MessageType::CREATE, "CREATE"},
-    {MessageType::PUSH, "PUSH"},
-    {MessageType::POP, "POP"},
-    {MessageType::TOP, "TOP"},
-    {MessageType::SET, "SET"},
-    {MessageType::GET, "GET"},
-    {MessageType::ADD, "ADD"},
-    {MessageType::SUB, "SUB"},
-    {MessageType::MUL, "MUL"},
-    {MessageType::DIV, "DIV"},
-    {MessageType::BEGIN, "BEGIN"},
-    {MessageType::COMMIT, "COMMIT"},
-    {MessageType::BYE, "BYE"},
-    {MessageType::OK, "OK"},
-    {MessageType::FAILED, "FAILED"},
-    {MessageType::ERROR, "ERROR"},
-    {MessageType::DATA, "DATA"}
+
+namespace {
+
+// Encoded forms of each message type, indexed by MessageType: the
+// complete frame of a message without arguments, and the prefix of
+// a message with arguments
+const std::string_view FRAMES[] = {
+    "NONE\n", "LOGIN\n", "CREATE\n", "PUSH\n", "POP\n", "TOP\n", "SET\n",
+    "GET\n", "ADD\n", "SUB\n", "MUL\n", "DIV\n", "BEGIN\n", "COMMIT\n",
+    "BYE\n", "SNAPSHOT\n", "OK\n", "FAILED\n", "ERROR\n", "DATA\n",
+    "MGET\n", "MSET\n", "MPUSH\n", "INCR\n", "DECR\n", "INCRBY\n",
 };
-    
-    auto it = MessageTypeToString.find(type);
-    if (it != MessageTypeToString.end()) {
-        return it->second;
-    }
-    return "UNKNOWN";
+
+const std::string_view PREFIXES[] = {
+    "NONE ", "LOGIN ", "CREATE ", "PUSH ", "POP ", "TOP ", "SET ",
+    "GET ", "ADD ", "SUB ", "MUL ", "DIV ", "BEGIN ", "COMMIT ",
+    "BYE ", "SNAPSHOT ", "OK ", "FAILED ", "ERROR ", "DATA ",
+    "MGET ", "MSET ", "MPUSH ", "INCR ", "DECR ", "INCRBY ",
+};
+
+static_assert(sizeof(FRAMES) / sizeof(FRAMES[0]) == size_t(LAST_MESSAGE_TYPE) + 1,
+              "FRAMES must have an entry for each MessageType");
+static_assert(sizeof(PREFIXES) / sizeof(PREFIXES[0]) == size_t(LAST_MESSAGE_TYPE) + 1,
+              "PREFIXES must have an entry for each MessageType");
+
 }
 
-MessageType StringToMessageTypeFunc(const std::string &str) {
-    const std::map<std::string, MessageType> StringToMessageType = {
-        {"NONE", MessageType::NONE},
-        {"LOGIN", MessageType::LOGIN},
-        {"CREATE", MessageType::CREATE},
-        {"PUSH", MessageType::PUSH},
-        {"POP", MessageType::POP},
-        {"TOP", MessageType::TOP},
-        {"SET", MessageType::SET},
-        {"GET", MessageType::GET},
-        {"ADD", MessageType::ADD},
-        {"SUB", MessageType::SUB},
-        {"MUL", MessageType::MUL},
-        {"DIV", MessageType::DIV},
-        {"BEGIN", MessageType::BEGIN},
-        {"COMMIT", MessageType::COMMIT},
-        {"BYE", MessageType::BYE},
-        {"OK", MessageType::OK},
-        {"FAILED", MessageType::FAILED},
-        {"ERROR", MessageType::ERROR},
-        {"DATA", MessageType::DATA}
-    };
-
-    auto it = StringToMessageType.find(str);
-    if (it != StringToMessageType.end()) {
-        return it->second;
+std::string_view MessageSerialization::frame(MessageType type) {
+    return FRAMES[size_t(type)];
+}
+
+std::string_view MessageSerialization::prefix(MessageType type) {
+    return PREFIXES[size_t(type)];
+}
+
+namespace {
+
+// Resolve a command/response name without building any lookup
+// structure: dispatch on the length and first character, then
+// compare the whole token.
+MessageType lookup_message_type(std::string_view tok) {
+    switch (tok.size()) {
+        case 2:
+            if (tok == "OK") return MessageType::OK;
+            break;
+        case 3:
+            switch (tok[0]) {
+                case 'A': if (tok == "ADD") return MessageType::ADD; break;
+                case 'B': if (tok == "BYE") return MessageType::BYE; break;
+                case 'D': if (tok == "DIV") return MessageType::DIV; break;
+                case 'G': if (tok == "GET") return MessageType::GET; break;
+                case 'M': if (tok == "MUL") return MessageType::MUL; break;
+                case 'P': if (tok == "POP") return MessageType::POP; break;
+                case 'S':
+                    if (tok == "SET") return MessageType::SET;
+                    if (tok == "SUB") return MessageType::SUB;
+                    break;
+                case 'T': if (tok == "TOP") return MessageType::TOP; break;
+            }
+            break;
+        case 4:
+            switch (tok[0]) {
+                case 'D':
+                    if (tok == "DATA") return MessageType::DATA;
+                    if (tok == "DECR") return MessageType::DECR;
+                    break;
+                case 'I': if (tok == "INCR") return MessageType::INCR; break;
+                case 'M':
+                    if (tok == "MGET") return MessageType::MGET;
+                    if (tok == "MSET") return MessageType::MSET;
+                    break;
+                case 'P': if (tok == "PUSH") return MessageType::PUSH; break;
+            }
+            break;
+        case 5:
+            switch (tok[0]) {
+                case 'B': if (tok == "BEGIN") return MessageType::BEGIN; break;
+                case 'E': if (tok == "ERROR") return MessageType::ERROR; break;
+                case 'L': if (tok == "LOGIN") return MessageType::LOGIN; break;
+                case 'M': if (tok == "MPUSH") return MessageType::MPUSH; break;
+            }
+            break;
+        case 6:
+            switch (tok[0]) {
+                case 'C':
+                    if (tok == "CREATE") return MessageType::CREATE;
+                    if (tok == "COMMIT") return MessageType::COMMIT;
+                    break;
+                case 'F': if (tok == "FAILED") return MessageType::FAILED; break;
+                case 'I': if (tok == "INCRBY") return MessageType::INCRBY; break;
+            }
+            break;
+        case 8:
+            if (tok == "SNAPSHOT") return MessageType::SNAPSHOT;
+            break;
     }
     return MessageType::NONE;
 }
 
+bool is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
+}
+
+// Splits a message into whitespace-separated tokens, in place
+class Tokenizer {
+private:
+    const char *m_pos;
+    const char *m_end;
+
+public:
+    Tokenizer(std::string_view s) : m_pos(s.data()), m_end(s.data() + s.size()) { }
+
+    bool next(std::string_view &tok) {
+        while (m_pos != m_end && is_space(*m_pos)) {
+            ++m_pos;
+        }
+        if (m_pos == m_end) {
+            return false;
+        }
+        const char *start = m_pos;
+        while (m_pos != m_end && !is_space(*m_pos)) {
+            ++m_pos;
+        }
+        tok = std::string_view(start, m_pos - start);
+        return true;
+    }
+
+    bool at_end() {
+        std::string_view tok;
+        return !next(tok);
+    }
+
+    // Everything not yet consumed, with surrounding whitespace removed
+    std::string_view rest() {
+        const char *start = m_pos, *end = m_end;
+        while (start != end && is_space(*start)) {
+            ++start;
+        }
+        while (end != start && is_space(end[-1])) {
+            --end;
+        }
+        m_pos = m_end;
+        return std::string_view(start, end - start);
+    }
+};
+
+// Decode between min_n and max_n arguments
+void decode_args(Tokenizer &tokens, Message &msg, unsigned min_n, unsigned max_n) {
+    std::string_view args[Message::MAX_ARGS];
+    unsigned n = 0;
+    while (n < max_n && tokens.next(args[n])) {
+        n++;
+    }
+    if (n < min_n || !tokens.at_end()) {
+        throw InvalidMessage("Invalid message. ");
+    }
+    msg.set_args(args, n);
+}
+
+// Decode exactly n arguments
+void decode_args(Tokenizer &tokens, Message &msg, unsigned n) {
+    decode_args(tokens, msg, n, n);
+}
+
+// Decode the quoted text of a FAILED or ERROR response. Runs of
+// whitespace inside the text are collapsed to a single space.
+void decode_text(Tokenizer &tokens, Message &msg) {
+    std::string_view text = tokens.rest();
+    if (text.empty()) {
+        throw InvalidMessage("Invalid message. ");
+    }
+
+    bool normalized = true;
+    for (size_t i = 0; i < text.size() && normalized; i++) {
+        if (is_space(text[i]) && (text[i] != ' ' || (i + 1 < text.size() && is_space(text[i + 1])))) {
+            normalized = false;
+        }
+    }
+    if (normalized) {
+        msg.set_args(&text, 1);
+        return;
+    }
+
+    std::string joined;
+    Tokenizer words(text);
+    std::string_view word;
+    while (words.next(word)) {
+        if (!joined.empty()) {
+            joined += ' ';
+        }
+        joined.append(word.data(), word.size());
+    }
+    std::string_view arg(joined);
+    msg.set_args(&arg, 1);
+}
+
+}
+
 void MessageSerialization::encode(const Message &msg, std::string &encoded_msg) {
-    std::ostringstream oss;
-    oss << MessageTypeToStringFunc(msg.get_message_type()) << " ";
+    MessageType type = msg.get_message_type();
 
-    switch (msg.get_message_type()) {
+    unsigned num_args;
+    switch (type) {
         case MessageType::LOGIN:
-        case MessageType::CREATE:
-            oss << msg.get_username();
-            break;
-        case MessageType::SET:
-        case MessageType::GET:
-            oss << msg.get_table() << " " << msg.get_key();
-            break;
         case MessageType::PUSH:
         case MessageType::FAILED:
         case MessageType::ERROR:
-        case MessageType::DATA:
-            oss << msg.get_value();
+            num_args = 1;
+            break;
+        case MessageType::SET:
+        case MessageType::GET:
+            num_args = 2;
             break;
         default:
-            for (unsigned int i = 0; i < msg.get_num_args(); i++) {
-                const auto &arg = msg.get_arg(i);  
-                oss << arg << " ";
-            }
+            num_args = msg.get_num_args();
             break;
     }
 
-    encoded_msg = oss.str();
-    if (!encoded_msg.empty() && encoded_msg.back() == ' ') {
-        encoded_msg.pop_back(); // remove trailing space
+    // Build the encoding in place (assign() and append() reuse
+    // encoded_msg's existing storage)
+    if (num_args == 0) {
+        encoded_msg.assign(frame(type));
+    } else {
+        encoded_msg.assign(prefix(type));
+        for (unsigned i = 0; i < num_args; i++) {
+            if (i > 0) {
+                encoded_msg += ' ';
+            }
+            encoded_msg += msg.get_arg(i);
+        }
+        if (encoded_msg.back() == ' ') {
+            encoded_msg.pop_back(); // remove trailing space
+        }
+        encoded_msg += '\n';
     }
-    encoded_msg += '\n';
 
-    if (encoded_msg.length() > Message::MAX_ENCODED_LEN) {
+    if (encoded_msg.length() > Message::max_encoded_len(type)) {
         throw InvalidMessage("Encoded message exceeds maximum length");
     }
 }
 
-void MessageSerialization::decode(const std::string &encoded_msg, Message &msg) {
-    msg.clear_args();
-    std::istringstream iss(encoded_msg);
+size_t MessageSerialization::max_length(std::string_view encoded_start) {
+    // Only the command is needed (and when it hasn't been received
+    // completely, the start is far shorter than any limit)
+    Tokenizer tokens(encoded_start);
+    std::string_view command;
+    if (!tokens.next(command)) {
+        return Message::MAX_ENCODED_LEN;
+    }
+    return Message::max_encoded_len(lookup_message_type(command));
+}
 
-    std::vector<std::string> args;
-    std::string arg;
-    while (iss >> arg) {
-        args.push_back(arg);
+void MessageSerialization::decode(std::string_view encoded_msg, Message &msg) {
+    if (encoded_msg.empty() || encoded_msg.back() != '\n') {
+        throw InvalidMessage("Encoded message does not end with newline character");
+    }
+
+    Tokenizer tokens(encoded_msg);
+    std::string_view command;
+    if (!tokens.next(command)) {
+        throw InvalidMessage("Empty message");
+    }
+    MessageType type = lookup_message_type(command);
+    if (encoded_msg.size() > Message::max_encoded_len(type)) {
+        throw InvalidMessage("Encoded message exceeds maximum length");
     }
-    MessageType type = StringToMessageTypeFunc(args[0]);
     msg.set_message_type(type);
+
     switch (type) {
-        case MessageType::LOGIN: {
-            if (args.size() != 2) {
-                throw InvalidMessage("Invalid message. ");
-            }
-            msg.push_arg(args[1]);
+        case MessageType::LOGIN:
+        case MessageType::PUSH:
+            decode_args(tokens, msg, 1);
             break;
-        }
-        case MessageType::CREATE: {
-            if (args.size() != 2) {
-                throw InvalidMessage("Invalid message. ");
-            }
-            msg.push_arg(args[1]);
+        case MessageType::MPUSH:
+        case MessageType::DATA:
+            decode_args(tokens, msg, 1, Message::MAX_ARGS);
             break;
-        }
-        case MessageType::SET: {
-            if (args.size() != 3) {
-                throw InvalidMessage("Invalid message. ");
-            }
-            msg.push_arg(args[1]);
-            msg.push_arg(args[2]);
+        case MessageType::MGET:
+        case MessageType::MSET:
+            // table, and one or more keys
+            decode_args(tokens, msg, 2, Message::MAX_ARGS);
             break;
-        }
-        case MessageType::GET: {
-            if (args.size() != 3) {
-                throw InvalidMessage("Invalid message. ");
-            }
-            msg.push_arg(args[1]);
-            msg.push_arg(args[2]);
+        case MessageType::CREATE:
+            // optional storage engine
+            decode_args(tokens, msg, 1, 2);
             break;
-        }
-        case MessageType::PUSH: {
-            if (args.size() != 2) {
-                throw InvalidMessage("Invalid message. ");
-            }
-            msg.push_arg(args[1]);
+        case MessageType::SET:
+        case MessageType::GET:
+        case MessageType::INCR:
+        case MessageType::DECR:
+            decode_args(tokens, msg, 2);
             break;
-        }
-        case MessageType::FAILED: {
-            if(args.size() < 2){
-                throw InvalidMessage("Invalid message. ");
-            }
-            std::stringstream ss;
-            for(size_t i = 1; i < args.size() - 1; i++){
-                ss << args[i];
-                ss << " ";
-            }
-            ss<<args[args.size() - 1];
-            msg.push_arg(ss.str());
+        case MessageType::INCRBY:
+            // table, key and delta
+            decode_args(tokens, msg, 3);
             break;
-        }   
-        case MessageType::ERROR: {
-            if(args.size() < 2){
-                throw InvalidMessage("Invalid message. ");
-            }
-            std::stringstream ss;
-            for(size_t i = 1; i < args.size() - 1; i++){
-                ss << args[i];
-                ss << " ";
-            }
-            ss<<args[args.size() - 1];
-            msg.push_arg(ss.str());
+        case MessageType::FAILED:
+        case MessageType::ERROR:
+            decode_text(tokens, msg);
             break;
-        }
-        case MessageType::DATA: {
-            if(args.size() != 2){
-                throw InvalidMessage("Invalid message. ");
+        case MessageType::BEGIN: {
+            // optional transaction mode
+            std::string_view mode;
+            if (tokens.next(mode)) {
+                if (!tokens.at_end()) {
+                    throw InvalidMessage("Invalid message. ");
+                }
+                msg.set_args(&mode, 1);
+            } else {
+                msg.set_args(nullptr, 0);
             }
-            msg.push_arg(args[1]);
             break;
         }
         default:
-            while (iss >> arg) {
-                msg.push_arg(arg);
-            }
+            // requests without arguments (any extra tokens are ignored)
+            msg.set_args(nullptr, 0);
             break;
     }
 
-    if (encoded_msg.back() != '\n') {
-        throw InvalidMessage("Encoded message does not end with newline character");
-    }
     if (!msg.is_valid()) {
         throw InvalidMessage("Decoded message is not valid");
     }
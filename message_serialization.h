@@ -1,11 +1,27 @@
 #ifndef MESSAGE_SERIALIZATION_H
 #define MESSAGE_SERIALIZATION_H
 
+#include <string_view>
 #include "message.h"
 
 namespace MessageSerialization {
+  // Preencoded frames: frame() is the complete encoding of a message
+  // of the given type without arguments (e.g. "OK\n"), and prefix()
+  // is the start of one with arguments (e.g. "DATA ")
+  std::string_view frame(MessageType type);
+  std::string_view prefix(MessageType type);
+
   void encode(const Message &msg, std::string &encoded_msg);
-  void decode(const std::string &encoded_msg, Message &msg);
+
+  // The maximum length of the message starting with encoded_start,
+  // which only needs to include its command (see
+  // Message::max_encoded_len())
+  size_t max_length(std::string_view encoded_start);
+
+  // Decodes in a single pass over encoded_msg. When msg is reused
+  // across calls, its argument storage is reused, so decoding a
+  // typical request doesn't allocate.
+  void decode(std::string_view encoded_msg, Message &msg);
 };
 
 #endif // MESSAGE_SERIALIZATION_H
@@ -0,0 +1,65 @@
+#include <cerrno>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "exceptions.h"
+#include "output_buffer.h"
+
+OutputBuffer::OutputBuffer()
+  : m_sent( 0 )
+  , m_iov()
+  , m_msg()
+{
+}
+
+OutputBuffer::~OutputBuffer()
+{
+}
+
+void OutputBuffer::append( const char *data, size_t len )
+{
+  m_data.append(data, len);
+}
+
+bool OutputBuffer::flush( int fd )
+{
+  while (!empty()) {
+    ssize_t n = sendmsg(fd, prepare_send(), MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return false;
+      }
+      throw CommException("Could not write to client socket");
+    }
+    sent(size_t(n));
+  }
+  return true;
+}
+
+const struct msghdr *OutputBuffer::prepare_send()
+{
+  m_iov.iov_base = const_cast<char *>(m_data.data()) + m_sent;
+  m_iov.iov_len = m_data.size() - m_sent;
+  m_msg = msghdr();
+  m_msg.msg_iov = &m_iov;
+  m_msg.msg_iovlen = 1;
+  return &m_msg;
+}
+
+bool OutputBuffer::sent( size_t n )
+{
+  m_sent += n;
+  if (!empty()) {
+    return false;
+  }
+  clear();
+  return true;
+}
+
+void OutputBuffer::clear()
+{
+  m_data.clear();
+  m_sent = 0;
+}
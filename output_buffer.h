@@ -0,0 +1,52 @@
+#ifndef OUTPUT_BUFFER_H
+#define OUTPUT_BUFFER_H
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+// Responses waiting to be sent to a client. Everything that has
+// accumulated (e.g., the responses to a batch of pipelined requests) is
+// kept in one contiguous buffer, so that it can be sent with a single
+// write (sendmsg() with MSG_NOSIGNAL, i.e. a send() that can't raise
+// SIGPIPE).
+// Once the buffer has been drained its storage is kept for reuse, so in
+// the steady state appending doesn't allocate.
+class OutputBuffer {
+private:
+  std::string m_data;
+  size_t m_sent;     // bytes of m_data already sent
+  struct iovec m_iov; // describes the unsent data for m_msg
+  struct msghdr m_msg;
+
+  // copy constructor and assignment operator are prohibited
+  OutputBuffer( const OutputBuffer & );
+  OutputBuffer &operator=( const OutputBuffer & );
+
+public:
+  OutputBuffer();
+  ~OutputBuffer();
+
+  bool empty() const { return m_sent == m_data.size(); }
+
+  void append( const char *data, size_t len );
+  void append( std::string_view data ) { append( data.data(), data.size() ); }
+
+  // Write as much as possible to the given socket (without blocking).
+  // Returns true if the buffer was drained, false if the socket would
+  // block. Throws CommException if the socket failed.
+  bool flush( int fd );
+
+  // For sending asynchronously (see IoUring): a message describing
+  // (a prefix of) the unsent data, valid until the buffer is next
+  // modified. Once it has been sent, sent() must be called with the
+  // number of bytes written; it returns true if the buffer was drained.
+  const struct msghdr *prepare_send();
+  bool sent( size_t n );
+
+  void clear();
+};
+
+#endif // OUTPUT_BUFFER_H
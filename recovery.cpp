@@ -0,0 +1,189 @@
+#include <algorithm>
+#include <chrono>
+#include <pthread.h>
+#include <unistd.h>
+#include "exceptions.h"
+#include "wal.h"
+#include "recovery.h"
+
+namespace {
+
+struct ThreadArg {
+  Recovery *recovery;
+  void (Recovery::*work)( unsigned );
+  unsigned index;
+};
+
+void *thread_main(void *arg)
+{
+  ThreadArg *t = static_cast<ThreadArg *>(arg);
+  (t->recovery->*t->work)(t->index);
+  return nullptr;
+}
+
+}
+
+Recovery::Recovery( std::string_view log, unsigned num_threads, uint64_t after_ts )
+  : m_log( log )
+  , m_after_ts( after_ts )
+  , m_num_ranges_valid( 0 )
+  , m_next_partition( 0 )
+{
+  if (num_threads == 0) {
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    num_threads = (ncpus > 0) ? unsigned(ncpus) : 1;
+  }
+  m_stats.num_threads = num_threads;
+}
+
+Recovery::~Recovery()
+{
+}
+
+void Recovery::run( std::map<std::string, Table*> &tables )
+{
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+  WalReader reader(m_log);
+  std::string_view record;
+  while (reader.next_frame(record)) {
+    m_records.push_back(record);
+  }
+
+  // One range of records per thread
+  size_t nranges = std::max<size_t>(1, std::min<size_t>(m_stats.num_threads, m_records.size()));
+  m_ranges.resize(nranges);
+  for (size_t i = 0; i < nranges; i++) {
+    m_ranges[i].begin = m_records.size() * i / nranges;
+    m_ranges[i].end = m_records.size() * (i + 1) / nranges;
+  }
+  run_threads(&Recovery::decode_range);
+
+  // Only the ranges up to the first corrupted record are replayed
+  for (const Range &range : m_ranges) {
+    m_num_ranges_valid++;
+    m_stats.num_records += range.num_valid;
+    m_stats.num_writes += range.num_writes;
+    m_stats.last_ts = std::max(m_stats.last_ts, range.last_ts);
+    if (range.begin + range.num_valid < range.end) {
+      break;
+    }
+  }
+  if (m_stats.num_records > 0) {
+    std::string_view last = m_records[m_stats.num_records - 1];
+    m_stats.valid_end = size_t(last.data() + last.size() - m_log.data());
+  }
+
+  std::map<std::string_view, Table *> recovered;
+  for (auto &pair : tables) {
+    recovered[pair.first] = pair.second;
+  }
+  for (size_t i = 0; i < m_num_ranges_valid; i++) {
+    for (auto &create : m_ranges[i].creates) {
+      std::string_view name = create.first;
+      if (recovered.find(name) == recovered.end()) {
+        if (create.second != Storage::MEMORY && create.second != Storage::LSM) {
+          throw CommException("Log has unknown storage engine for table " + std::string(name));
+        }
+        std::string table_name(name);
+        Table *table = new Table(table_name, Storage::Kind(create.second));
+        tables[table_name] = table;
+        recovered[name] = table;
+        m_stats.num_tables++;
+      }
+    }
+  }
+
+  for (size_t i = 0; i < m_num_ranges_valid; i++) {
+    for (auto &pair : m_ranges[i].writes) {
+      if (recovered.find(pair.first) == recovered.end()) {
+        throw CommException("Log refers to unknown table " + std::string(pair.first));
+      }
+    }
+  }
+  for (auto &pair : recovered) {
+    for (unsigned shard = 0; shard < Table::NUM_SHARDS; shard++) {
+      m_partitions.push_back({ pair.second, shard });
+    }
+  }
+  run_threads(&Recovery::replay_partitions);
+
+  m_stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Run work(i) in a thread for each range i, and wait for them all
+void Recovery::run_threads( void (Recovery::*work)( unsigned ) )
+{
+  std::vector<ThreadArg> args(m_ranges.size());
+  std::vector<pthread_t> threads(m_ranges.size());
+  std::vector<bool> started(m_ranges.size());
+  for (unsigned i = 0; i < m_ranges.size(); i++) {
+    args[i] = { this, work, i };
+    started[i] = pthread_create(&threads[i], nullptr, thread_main, &args[i]) == 0;
+    if (!started[i]) {
+      // Do the work here instead
+      thread_main(&args[i]);
+    }
+  }
+  for (unsigned i = 0; i < m_ranges.size(); i++) {
+    if (started[i]) {
+      pthread_join(threads[i], nullptr);
+    }
+  }
+}
+
+// Verify and decode a range of records, partitioning the writes
+void Recovery::decode_range( unsigned index )
+{
+  Range &range = m_ranges[index];
+  range.num_valid = 0;
+  range.num_writes = 0;
+  range.last_ts = 0;
+
+  WalReader::Record rec;
+  for (size_t i = range.begin; i < range.end; i++) {
+    if (!WalReader::check(m_records[i], rec)) {
+      break;
+    }
+    range.num_valid++;
+    if (rec.type == WalRecord::CREATE) {
+      range.creates.push_back({ rec.table, rec.engine });
+      continue;
+    }
+
+    range.last_ts = rec.ts;
+    if (rec.ts <= m_after_ts) {
+      continue; // already in the snapshot
+    }
+    range.num_writes += rec.writes.size();
+    for (const WalReader::Write &w : rec.writes) {
+      TableWrites &writes = range.writes[w.table];
+      if (writes.empty()) {
+        writes.resize(Table::NUM_SHARDS);
+      }
+      writes[Table::shard_of(w.key)].push_back({ w.key, w.value, rec.ts });
+    }
+  }
+}
+
+// Replay partitions until there are none left
+void Recovery::replay_partitions( unsigned )
+{
+  while (true) {
+    size_t next = m_next_partition.fetch_add(1);
+    if (next >= m_partitions.size()) {
+      break;
+    }
+    Partition &partition = m_partitions[next];
+    const std::string &name = partition.table->get_name();
+    for (size_t i = 0; i < m_num_ranges_valid; i++) {
+      auto it = m_ranges[i].writes.find(name);
+      if (it == m_ranges[i].writes.end()) {
+        continue;
+      }
+      for (const Write &w : it->second[partition.shard]) {
+        partition.table->recover(w.key, w.value, w.ts);
+      }
+    }
+  }
+}
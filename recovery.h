@@ -0,0 +1,98 @@
+#ifndef RECOVERY_H
+#define RECOVERY_H
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "table.h"
+
+// Rebuilds the tables from a write-ahead log (see wal.h) with several
+// threads, so that restart time stays bounded as the log grows.
+//
+// The log is first framed sequentially, which only reads each
+// record's length, and the records are split into one contiguous range
+// per thread. Each thread verifies the checksums of its range, decodes
+// it, and partitions its writes by table and table shard, keeping them
+// in log order. Then the (table, shard) partitions are replayed in
+// parallel into new Tables: a partition's writes are applied range by
+// range, so in log order, and different partitions never touch the
+// same data, so no locks are needed.
+//
+// As with WalReader, recovery stops at the first incomplete or
+// corrupted record, and everything after it is discarded.
+//
+// After loading a snapshot (see snapshot.h), only the commits after
+// the snapshot's timestamp are replayed.
+class Recovery {
+public:
+  struct Stats {
+    size_t num_records = 0; // valid records replayed
+    size_t num_writes = 0;
+    size_t num_tables = 0;  // tables created
+    size_t valid_end = 0;   // offset of the end of the last valid record
+    uint64_t last_ts = 0;   // latest commit timestamp recovered
+    unsigned num_threads = 0;
+    double seconds = 0;
+  };
+
+private:
+  struct Write {
+    std::string_view key;
+    std::string_view value;
+    uint64_t ts;
+  };
+
+  // A table's writes from one range of records, by table shard
+  typedef std::vector<std::vector<Write>> TableWrites;
+
+  struct Range {
+    size_t begin, end;       // indexes into m_records
+    size_t num_valid;        // records before the first corrupted one
+    size_t num_writes;
+    uint64_t last_ts;
+    std::vector<std::pair<std::string_view, uint8_t>> creates; // table, engine
+    std::unordered_map<std::string_view, TableWrites> writes;
+  };
+
+  struct Partition {
+    Table *table;
+    unsigned shard;
+  };
+
+  std::string_view m_log;
+  uint64_t m_after_ts;
+  std::vector<std::string_view> m_records;
+  std::vector<Range> m_ranges;
+  size_t m_num_ranges_valid;
+  std::vector<Partition> m_partitions;
+  std::atomic<size_t> m_next_partition;
+  Stats m_stats;
+
+  // copy constructor and assignment operator are prohibited
+  Recovery( const Recovery & );
+  Recovery &operator=( const Recovery & );
+
+  void run_threads( void (Recovery::*work)( unsigned ) );
+  void decode_range( unsigned index );
+  void replay_partitions( unsigned index );
+
+public:
+  // Recover from log (which must outlive the Recovery) with the given
+  // number of threads (0 means one per CPU), skipping the commits with
+  // timestamps up to after_ts
+  Recovery( std::string_view log, unsigned num_threads = 0, uint64_t after_ts = 0 );
+  ~Recovery();
+
+  // Create the log's tables that aren't already in tables, and replay
+  // the log into them. Throws CommException if a commit refers to a
+  // table that was never created.
+  void run( std::map<std::string, Table*> &tables );
+
+  const Stats &get_stats() const { return m_stats; }
+};
+
+#endif // RECOVERY_H
@@ -1,65 +1,331 @@
+#include <algorithm>
 #include <iostream>
 #include <cassert>
-#include <memory>
+#include <chrono>
+#include <cstdio>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/wait.h>
 #include "csapp.h"
 #include "exceptions.h"
+#include "commit_clock.h"
 #include "guard.h"
+#include "event_loop.h"
+#include "recovery.h"
+#include "snapshot.h"
+#include "worker_pool.h"
 #include "server.h"
 #include <cstring>
 
-Server::Server()
-  : server_fd(-1)
+namespace {
+
+// The CPUs the server may run on, which under a cpuset or taskset
+// needn't be the first few the machine has
+std::vector<int> allowed_cpus()
+{
+  std::vector<int> cpus;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &set)) {
+        cpus.push_back(cpu);
+      }
+    }
+  }
+  if (cpus.empty()) {
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    for (long cpu = 0; cpu < std::max(ncpus, 1L); cpu++) {
+      cpus.push_back(int(cpu));
+    }
+  }
+  return cpus;
+}
+
+unsigned num_cpus()
+{
+  return unsigned(allowed_cpus().size());
+}
+
+// Like open_listenfd(), but sets SO_REUSEPORT so that several
+// sockets can listen on the same port
+int open_reuseport_listenfd(const char *port)
+{
+  struct addrinfo hints, *listp, *p;
+  int listenfd = -1, optval = 1;
+
+  memset(&hints, 0, sizeof(struct addrinfo));
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG | AI_NUMERICSERV;
+  if (getaddrinfo(NULL, port, &hints, &listp) != 0) {
+    return -1;
+  }
+
+  for (p = listp; p; p = p->ai_next) {
+    if ((listenfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0) {
+      continue;
+    }
+    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(int));
+    if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(int)) == 0
+        && bind(listenfd, p->ai_addr, p->ai_addrlen) == 0) {
+      break;
+    }
+    close(listenfd);
+    listenfd = -1;
+  }
+  freeaddrinfo(listp);
+
+  if (listenfd >= 0 && ::listen(listenfd, LISTENQ) < 0) {
+    close(listenfd);
+    return -1;
+  }
+  return listenfd;
+}
+
+}
+
+Server::Server( unsigned num_workers, unsigned num_shards )
+  : m_num_workers( num_workers == 0 ? num_cpus() : num_workers )
+  , m_use_io_uring( false )
+  , m_wal( nullptr )
+  , m_snapshot_file( nullptr )
+  , m_snapshot_ts( 0 )
+  , m_snapshot_path( "snapshot.kvs" )
+  , m_snapshot_pid( -1 )
+  , m_snapshot_lsn( 0 )
 {
+  if (num_shards == 0) {
+    num_shards = num_cpus();
+  }
+  std::vector<int> cpus = allowed_cpus();
+  for (unsigned i = 0; i < num_shards; i++) {
+    Shard shard;
+    shard.listen_fd = -1;
+    // pinning is only worthwhile if there is more than one shard
+    shard.cpu = (num_shards > 1) ? cpus[i % cpus.size()] : -1;
+    shard.workers = nullptr;
+    shard.loop = nullptr;
+    m_shards.push_back(shard);
+  }
   pthread_mutex_init(&tables_mutex, nullptr);
+  pthread_mutex_init(&m_snapshot_mutex, nullptr);
 }
 
 Server::~Server()
 {
-  if (server_fd != -1) {
-    close(server_fd);
+  for (Shard &shard : m_shards) {
+    delete shard.loop;
+    delete shard.workers;
+    if (shard.listen_fd != -1) {
+      close(shard.listen_fd);
+    }
   }
+  if (m_wal != nullptr) {
+    CommitClock::set_log(nullptr);
+    delete m_wal;
+  }
+  pthread_mutex_destroy(&m_snapshot_mutex);
   pthread_mutex_destroy(&tables_mutex);
   for (auto &pair : tables) {
     delete pair.second;
   }
+  delete m_snapshot_file;
 }
 
-void Server::listen( const std::string &port )
+void Server::load_snapshot( const std::string &path )
 {
-  server_fd = Open_listenfd(port.c_str());
-  if (server_fd < 0) {
-    throw std::runtime_error("Could not open listen socket");
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  m_snapshot_file = new MappedFile(path);
+  try {
+    m_snapshot_ts = Snapshot::load(*m_snapshot_file, tables);
+  } catch (CommException &ex) {
+    throw CommException("Could not load snapshot " + path + ": " + ex.what());
   }
+  CommitClock::recover(m_snapshot_ts);
+  double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+  std::printf("Loaded %zu tables from snapshot %s in %.1f ms\n", tables.size(), path.c_str(), ms);
+  std::fflush(stdout);
+  publish_tables();
 }
 
-void Server::server_loop()
+void Server::open_log( const std::string &path, Wal::Durability durability, unsigned window_us )
 {
-  struct sockaddr_storage client_addr;
-  socklen_t client_len = sizeof(client_addr);
-  while (true) {
-    int client_fd = accept(server_fd, (SA *)&client_addr, &client_len);
-    if (client_fd < 0) {
-      log_error("Could not accept connection");
-      continue;
+  std::string data;
+  Wal::read_file(path, data);
+
+  // The tables are replayed in parallel, by the threads that will
+  // later run requests
+  Recovery recovery(data, m_num_workers, m_snapshot_ts);
+  recovery.run(tables);
+  const Recovery::Stats &stats = recovery.get_stats();
+  CommitClock::recover(std::max(m_snapshot_ts, stats.last_ts));
+  if (stats.num_records > 0) {
+    double mb = stats.valid_end / 1e6;
+    std::printf("Recovered %zu tables from %zu log records (%zu writes, %.1f MB) in %.3f s "
+                "with %u threads: %.0f records/s, %.1f MB/s\n",
+                stats.num_tables, stats.num_records, stats.num_writes, mb, stats.seconds,
+                stats.num_threads, stats.num_records / stats.seconds, mb / stats.seconds);
+    std::fflush(stdout);
+  }
+  if (stats.valid_end < data.size()) {
+    log_error("Discarding " + std::to_string(data.size() - stats.valid_end) + " bytes of incomplete log records");
+  }
+
+  publish_tables();
+  m_wal = new Wal(path, durability, window_us, m_use_io_uring);
+  m_wal->open(stats.valid_end);
+  CommitClock::set_log(m_wal);
+}
+
+void Server::start_snapshot()
+{
+  Guard g(m_snapshot_mutex);
+  if (m_snapshot_pid != -1) {
+    throw OperationException("A snapshot is already being written. ");
+  }
+
+  // Forking while commits are blocked (and no table can be created)
+  // gives the child a consistent copy of every table; afterwards the
+  // parent's writes only cost copying the pages they touch
+  uint64_t ts;
+  uint64_t lsn = 0;
+  pid_t pid;
+  {
+    Guard tables_guard(tables_mutex);
+    ts = CommitClock::freeze();
+    // Every commit up to ts, and every table creation, has been
+    // logged by now, and nothing else has
+    if (m_wal != nullptr) {
+      lsn = m_wal->get_appended_lsn();
+    }
+    for (auto &pair : tables) {
+      pair.second->prepare_fork();
+    }
+    pid = fork();
+    if (pid == 0) {
+      // Only this thread exists in the child, so it must not wait for
+      // any lock another thread held when it forked
+      if (!Snapshot::write(m_snapshot_path, tables, ts)) {
+        std::string msg = "Error: Could not write snapshot " + m_snapshot_path + ": " + strerror(errno) + "\n";
+        ssize_t ignored = write(STDERR_FILENO, msg.data(), msg.size());
+        (void) ignored;
+        _exit(1);
+      }
+      _exit(0);
     }
+    for (auto &pair : tables) {
+      pair.second->after_fork();
+    }
+    CommitClock::thaw();
+  }
+  if (pid < 0) {
+    throw OperationException("Could not start snapshot. ");
+  }
+
+  m_snapshot_pid = pid;
+  m_snapshot_lsn = lsn;
+  pthread_t thread;
+  if (pthread_create(&thread, nullptr, snapshot_reaper, this) != 0) {
+    wait_snapshot(pid, lsn); // wait here instead
+    m_snapshot_pid = -1;
+    return;
+  }
+  pthread_detach(thread);
+}
+
+void *Server::snapshot_reaper( void *arg )
+{
+  Server *server = static_cast<Server *>(arg);
+  pid_t pid;
+  uint64_t lsn;
+  {
+    Guard g(server->m_snapshot_mutex);
+    pid = server->m_snapshot_pid;
+    lsn = server->m_snapshot_lsn;
+  }
+  server->wait_snapshot(pid, lsn);
+
+  Guard g(server->m_snapshot_mutex);
+  server->m_snapshot_pid = -1;
+  return nullptr;
+}
 
-    ClientConnection *client = new ClientConnection(this, client_fd);
-    pthread_t thr_id;
-    if (pthread_create(&thr_id, nullptr, client_worker, client) != 0) {
-      log_error("Could not create client thread");
-      delete client;
-      close(client_fd);
+// Wait for the snapshot child to exit, and report how it went. Once
+// the snapshot is written, the log records before lsn (those it
+// covers) are dropped.
+void Server::wait_snapshot( pid_t pid, uint64_t lsn )
+{
+  int status = 0;
+  pid_t rc;
+  while ((rc = waitpid(pid, &status, 0)) < 0 && errno == EINTR) {
+  }
+  if (rc < 0) {
+    log_error("Could not wait for the snapshot child process");
+  } else if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+    std::printf("Snapshot written to %s\n", m_snapshot_path.c_str());
+    std::fflush(stdout);
+    if (m_wal != nullptr && !m_wal->rotate(lsn)) {
+      log_error("Could not shorten the log " + m_wal->get_path() + ": " + strerror(errno));
     }
+  } else {
+    log_error("Snapshot child process failed");
   }
 }
 
+void Server::listen( const std::string &port )
+{
+  for (Shard &shard : m_shards) {
+    if (m_shards.size() == 1) {
+      shard.listen_fd = Open_listenfd(port.c_str());
+    } else {
+      shard.listen_fd = open_reuseport_listenfd(port.c_str());
+    }
+    if (shard.listen_fd < 0) {
+      throw std::runtime_error("Could not open listen socket");
+    }
+    // The event loop accepts until accept() would block
+    int flags = fcntl(shard.listen_fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(shard.listen_fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+      throw std::runtime_error("Could not make listen socket non-blocking");
+    }
+  }
+}
 
-void *Server::client_worker( void *arg )
+void Server::server_loop()
 {
-  pthread_detach(pthread_self());
+  unsigned nshards = m_shards.size();
+  for (unsigned i = 0; i < nshards; i++) {
+    Shard &shard = m_shards[i];
+    unsigned nworkers = m_num_workers / nshards + (i < m_num_workers % nshards ? 1 : 0);
+    shard.workers = new WorkerPool(nworkers > 0 ? nworkers : 1, shard.cpu);
+    shard.workers->start();
+    shard.loop = new EventLoop(this, shard.workers, shard.listen_fd, m_use_io_uring);
+    if (m_wal != nullptr) {
+      EventLoop *loop = shard.loop;
+      m_wal->add_sync_callback([loop]() { loop->wake(); });
+    }
+  }
+
+  // Shard 0 runs in the calling thread, the others get a thread each
+  for (unsigned i = 1; i < nshards; i++) {
+    if (pthread_create(&m_shards[i].thread, nullptr, shard_main, &m_shards[i]) != 0) {
+      throw std::runtime_error("Could not create shard thread");
+    }
+  }
+  m_shards[0].thread = pthread_self();
+  shard_main(&m_shards[0]);
+}
 
-  std::unique_ptr<ClientConnection> client(static_cast<ClientConnection *>(arg));
-  client->chat_with_client();
+void *Server::shard_main( void *arg )
+{
+  Shard *shard = static_cast<Shard *>(arg);
+  if (shard->cpu >= 0) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(shard->cpu, &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+  }
+  shard->loop->run();
   return nullptr;
 }
 
@@ -68,23 +334,35 @@ void Server::log_error( const std::string &what )
   std::cerr << "Error: " << what << "\n";
 }
 
-void Server::create_table(const std::string &name)
+// Make the tables restored at startup visible to find_table()
+void Server::publish_tables()
+{
+  Guard g(tables_mutex);
+  for (auto &pair : tables) {
+    m_catalog.insert(pair.second);
+  }
+}
+
+uint64_t Server::create_table(const std::string &name, Storage::Kind kind)
 {
-  pthread_mutex_lock(&tables_mutex);
+  uint64_t lsn = 0;
+  Guard g(tables_mutex);
   if (tables.find(name) == tables.end()) {
-    tables[name] = new Table(name);
+    Table *table = new Table(name, kind);
+    // Logged before the table can be found, so that the creation
+    // precedes any commit to the table in the log
+    if (m_wal != nullptr) {
+      WalRecord record;
+      record.begin_create(name, uint8_t(kind));
+      lsn = m_wal->append(record.finish());
+    }
+    tables[name] = table;
+    m_catalog.insert(table);
   }
-  pthread_mutex_unlock(&tables_mutex);
+  return lsn;
 }
 
 Table *Server::find_table(const std::string &name)
 {
-  pthread_mutex_lock(&tables_mutex);
-  Table *table = nullptr;
-  auto it = tables.find(name);
-  if (it != tables.end()) {
-      table = it->second;
-  }
-  pthread_mutex_unlock(&tables_mutex);
-  return table;
+  return m_catalog.find(name);
 }
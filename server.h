@@ -3,38 +3,115 @@
 
 #include <map>
 #include <string>
+#include <vector>
 #include <pthread.h>
+#include <sys/types.h>
+#include "catalog.h"
+#include "deadlock_detector.h"
 #include "table.h"
+#include "table_file.h"
 #include "client_connection.h"
+#include "wal.h"
+
+class EventLoop; // forward declaration
+class WorkerPool; // forward declaration
 
 class Server {
 private:
-  int server_fd;
+  // Each shard owns a listening socket (SO_REUSEPORT when there is more
+  // than one shard, so the kernel spreads incoming connections across
+  // them), an event loop with its own set of connections, and a worker
+  // pool. A shard's threads are pinned to one CPU: shard i to the i-th
+  // of the CPUs the server may run on.
+  struct Shard {
+    int listen_fd;
+    int cpu;
+    WorkerPool *workers;
+    EventLoop *loop;
+    pthread_t thread;
+  };
+
+  unsigned m_num_workers;
+  std::vector<Shard> m_shards;
+  // The tables are owned by the map, which only CREATE (under
+  // tables_mutex), startup and snapshots use; requests find them
+  // through the lock-free m_catalog
   std::map<std::string, Table*> tables;
   pthread_mutex_t tables_mutex;
+  Catalog m_catalog;
+  DeadlockDetector m_deadlocks;
+  bool m_use_io_uring;
+  Wal *m_wal; // null if the server isn't durable
+  MappedFile *m_snapshot_file; // the snapshot loaded at startup, if any
+  uint64_t m_snapshot_ts;
+  std::string m_snapshot_path;
+  pid_t m_snapshot_pid; // child writing a snapshot, or -1
+  uint64_t m_snapshot_lsn; // end of the log records it covers
+  pthread_mutex_t m_snapshot_mutex;
 
   // Copy constructor and assignment operator are prohibited
   Server(const Server &);
   Server &operator=(const Server &);
 
+  static void *shard_main( void *arg );
+  static void *snapshot_reaper( void *arg );
+  void wait_snapshot( pid_t pid, uint64_t lsn );
+  void publish_tables();
 
 public:
-  Server();
+  // num_workers is the total number of request worker threads
+  // (0 means one worker per CPU), divided evenly among num_shards
+  // shards (0 means one shard per CPU)
+  Server( unsigned num_workers = 0, unsigned num_shards = 1 );
   ~Server();
 
+  // Restore the tables from the snapshot at path (see snapshot.h),
+  // which stays mapped to serve them. Must be called before
+  // open_log(), which then replays only the commits after the
+  // snapshot. Throws CommException if the snapshot can't be loaded.
+  void load_snapshot( const std::string &path );
+
+  // Recover the tables from the log at path (in parallel, see
+  // Recovery), and log all further changes to it. Must be called
+  // before server_loop(). Throws CommException if the log can't be
+  // read or opened.
+  void open_log( const std::string &path, Wal::Durability durability, unsigned window_us );
+  Wal *get_wal() const { return m_wal; }
+
+  // Do socket and log I/O through io_uring where it is available (see
+  // EventLoop and Wal). Must be called before open_log().
+  void set_io_uring( bool use_io_uring ) { m_use_io_uring = use_io_uring; }
+
+  // Where SNAPSHOT writes snapshots
+  void set_snapshot_path( const std::string &path ) { m_snapshot_path = path; }
+
+  // Fork a child process which writes a snapshot of every table (as of
+  // the latest commit) in the background, copy-on-write. Commits are
+  // only blocked while forking. Once the snapshot is written, the log
+  // is rotated to a new file without the records it covers (so a
+  // restart needs load_snapshot()). Throws OperationException if a
+  // snapshot is already being written or the child can't be created.
+  void start_snapshot();
+
   void listen( const std::string &port );
   void server_loop();
 
-  static void *client_worker( void *arg );
-
   void log_error( const std::string &what );
 
   // TODO: add member functions
 
   // Some suggested member functions:
 
-  void create_table(const std::string &name);
+  // Returns the LSN of the table's creation (see CommitClock::end_commit()).
+  // Throws CommException if the table's storage engine can't be created.
+  uint64_t create_table(const std::string &name, Storage::Kind kind = Storage::MEMORY);
+
+  // Lock-free. Tables are never dropped, so the result stays valid
+  // (and may be cached) for the server's lifetime.
   Table *find_table(const std::string &name);
+
+  // The wait-for graph of transactions waiting for shard locks
+  DeadlockDetector *get_deadlock_detector() { return &m_deadlocks; }
   //void log_error( const std::string &what );
 
 };
@@ -1,20 +1,131 @@
 #include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <getopt.h>
+#include <unistd.h>
 #include "server.h"
+#include "storage.h"
+
+static void usage()
+{
+  std::cerr << "Usage: ./server [-w <workers>] [-s <shards>] [-l <log> [-d <durability>] [-g <usec>]]\n";
+  std::cerr << "                [--snapshot-file <file>] [--load-snapshot <file>]\n";
+  std::cerr << "                [--lsm-dir <dir>] [--lsm-memtable-mb <mb>] [--io-uring] <port>\n";
+  std::cerr << "Options:\n";
+  std::cerr << "  -w <workers>   number of request worker threads (default: one per CPU)\n";
+  std::cerr << "  -s <shards>    number of event loop shards, each with its own listen\n";
+  std::cerr << "                 socket and pinned to a CPU (default: 1, 0: one per CPU)\n";
+  std::cerr << "  -l <log>       recover tables from, and log commits to, the given file\n";
+  std::cerr << "  -d <durability>  none, batch (group commit, the default) or sync\n";
+  std::cerr << "  -g <usec>      group commit window in microseconds (default: 0)\n";
+  std::cerr << "  --snapshot-file <file>  where SNAPSHOT writes (default: snapshot.kvs)\n";
+  std::cerr << "  --load-snapshot <file>  restore the tables from a snapshot at startup\n";
+  std::cerr << "  --lsm-dir <dir>         where LSM tables keep their runs (default: .)\n";
+  std::cerr << "  --lsm-memtable-mb <mb>  memory of each LSM table before it flushes\n";
+  std::cerr << "                          to disk (default: 64)\n";
+  std::cerr << "  --io-uring              do socket and log I/O through io_uring (falls\n";
+  std::cerr << "                          back to epoll if it isn't available)\n";
+}
 
 int main(int argc, char **argv)
 {
-  if ( argc != 2 ) {
-    std::cerr << "Usage: ./server <port>\n";
+  unsigned num_workers = 0;
+  unsigned num_shards = 1;
+  std::string log_path;
+  Wal::Durability durability = Wal::BATCHED;
+  unsigned window_us = 0;
+  std::string snapshot_path;
+  std::string load_snapshot_path;
+  std::string lsm_dir = ".";
+  size_t lsm_memtable_mb = 64;
+  bool use_io_uring = false;
+
+  enum { OPT_SNAPSHOT_FILE = 256, OPT_LOAD_SNAPSHOT, OPT_LSM_DIR, OPT_LSM_MEMTABLE_MB, OPT_IO_URING };
+  static const struct option long_options[] = {
+    { "snapshot-file", required_argument, nullptr, OPT_SNAPSHOT_FILE },
+    { "load-snapshot", required_argument, nullptr, OPT_LOAD_SNAPSHOT },
+    { "lsm-dir", required_argument, nullptr, OPT_LSM_DIR },
+    { "lsm-memtable-mb", required_argument, nullptr, OPT_LSM_MEMTABLE_MB },
+    { "io-uring", no_argument, nullptr, OPT_IO_URING },
+    { nullptr, 0, nullptr, 0 },
+  };
+
+  int opt;
+  while ( (opt = getopt_long(argc, argv, "w:s:l:d:g:", long_options, nullptr)) != -1 ) {
+    switch ( opt ) {
+    case 'w':
+      num_workers = unsigned( std::atoi( optarg ) );
+      break;
+    case 's':
+      num_shards = unsigned( std::atoi( optarg ) );
+      break;
+    case 'l':
+      log_path = optarg;
+      break;
+    case 'd':
+      if ( strcmp( optarg, "none" ) == 0 ) {
+        durability = Wal::NONE;
+      } else if ( strcmp( optarg, "batch" ) == 0 ) {
+        durability = Wal::BATCHED;
+      } else if ( strcmp( optarg, "sync" ) == 0 ) {
+        durability = Wal::SYNC;
+      } else {
+        usage();
+        return 1;
+      }
+      break;
+    case 'g':
+      window_us = unsigned( std::atoi( optarg ) );
+      break;
+    case OPT_SNAPSHOT_FILE:
+      snapshot_path = optarg;
+      break;
+    case OPT_LOAD_SNAPSHOT:
+      load_snapshot_path = optarg;
+      break;
+    case OPT_LSM_DIR:
+      lsm_dir = optarg;
+      break;
+    case OPT_LSM_MEMTABLE_MB:
+      lsm_memtable_mb = size_t( std::atoi( optarg ) );
+      if ( lsm_memtable_mb == 0 ) {
+        usage();
+        return 1;
+      }
+      break;
+    case OPT_IO_URING:
+      use_io_uring = true;
+      break;
+    default:
+      usage();
+      return 1;
+    }
+  }
+
+  if ( argc - optind != 1 ) {
+    usage();
     return 1;
   }
 
-  Server server;
+  Storage::configure( lsm_dir, lsm_memtable_mb << 20 );
+  Server server( num_workers, num_shards );
+  server.set_io_uring( use_io_uring );
+
+  if ( !snapshot_path.empty() ) {
+    server.set_snapshot_path( snapshot_path );
+  }
 
   try {
-    server.listen( argv[1] );
+    if ( !load_snapshot_path.empty() ) {
+      server.load_snapshot( load_snapshot_path );
+    }
+    if ( !log_path.empty() ) {
+      server.open_log( log_path, durability, window_us );
+    }
+    server.listen( argv[optind] );
     server.server_loop();
   } catch ( std::runtime_error &ex ) {
-    server.log_error( "Fatal error starting server" );
+    server.log_error( std::string( "Fatal error starting server: " ) + ex.what() );
     return 1;
   }
 
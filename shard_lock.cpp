@@ -0,0 +1,197 @@
+#include <algorithm>
+#include <cassert>
+#include "guard.h"
+#include "shard_lock.h"
+
+namespace {
+
+// How far the balance of note_read() can go towards writes, so that a
+// few reads without writes are enough to go back to sharing the lock
+const int MAX_WRITES_AFTER_READS = 4;
+
+}
+
+ShardLock::ShardLock()
+  : m_num_blocked( 0 )
+  , m_exclusive( false )
+  , m_owner( 0 )
+  , m_writes_after_reads( 0 )
+{
+  pthread_mutex_init( &m_mutex, nullptr );
+  pthread_cond_init( &m_released, nullptr );
+}
+
+ShardLock::~ShardLock()
+{
+  pthread_cond_destroy( &m_released );
+  pthread_mutex_destroy( &m_mutex );
+}
+
+// Called with m_mutex held: whether a request taking the lock now
+// would go ahead of the waiters queued before it (all of them, if it
+// isn't waiting) that it mustn't overtake
+bool ShardLock::is_overtaking( LockWaiter *waiter, bool exclusive ) const
+{
+  for (const Waiter &w : m_waiters) {
+    if (w.waiter == waiter) {
+      return false;
+    }
+    if (exclusive || w.exclusive) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Called with m_mutex held whenever the lock may have become free
+void ShardLock::released()
+{
+  if (m_num_blocked > 0 && is_free()) {
+    pthread_cond_broadcast( &m_released );
+  }
+  wake_waiters();
+}
+
+// Called with m_mutex held: tell the first waiter, and the shared
+// waiters right after a shared one, to retry
+void ShardLock::wake_waiters()
+{
+  for (const Waiter &w : m_waiters) {
+    if (w.exclusive && &w != &m_waiters.front()) {
+      break;
+    }
+    w.waiter->lock_released();
+    if (w.exclusive) {
+      break;
+    }
+  }
+}
+
+// Called with m_mutex held when a request fails to take the lock
+void ShardLock::wait( LockWaiter *waiter, bool exclusive )
+{
+  if (waiter == nullptr) {
+    return;
+  }
+  for (Waiter &w : m_waiters) {
+    if (w.waiter == waiter) {
+      w.exclusive = exclusive;
+      return;
+    }
+  }
+  m_waiters.push_back( Waiter{ waiter, exclusive } );
+}
+
+// Called with m_mutex held. Returns false if waiter wasn't waiting.
+bool ShardLock::dequeue( LockWaiter *waiter )
+{
+  for (auto i = m_waiters.begin(); i != m_waiters.end(); ++i) {
+    if (i->waiter == waiter) {
+      m_waiters.erase( i );
+      return true;
+    }
+  }
+  return false;
+}
+
+void ShardLock::lock()
+{
+  Guard g( m_mutex );
+  m_num_blocked++;
+  while (!is_free()) {
+    pthread_cond_wait( &m_released, &m_mutex );
+  }
+  m_num_blocked--;
+  m_exclusive = true;
+  m_owner = 0;
+}
+
+bool ShardLock::try_lock( uint64_t owner, LockWaiter *waiter )
+{
+  Guard g( m_mutex );
+  if (!is_free() || is_overtaking( waiter, true )) {
+    wait( waiter, true );
+    return false;
+  }
+  m_exclusive = true;
+  m_owner = owner;
+  dequeue( waiter );
+  return true;
+}
+
+void ShardLock::unlock()
+{
+  Guard g( m_mutex );
+  assert( m_exclusive );
+  m_exclusive = false;
+  m_owner = 0;
+  released();
+}
+
+bool ShardLock::try_lock_shared( uint64_t owner, LockWaiter *waiter )
+{
+  Guard g( m_mutex );
+  // Threads blocked in lock() count as exclusive waiters too
+  if (m_exclusive || m_num_blocked > 0 || is_overtaking( waiter, false )) {
+    wait( waiter, false );
+    return false;
+  }
+  m_sharers.push_back( owner );
+  dequeue( waiter );
+  return true;
+}
+
+void ShardLock::unlock_shared( uint64_t owner )
+{
+  Guard g( m_mutex );
+  auto i = std::find( m_sharers.begin(), m_sharers.end(), owner );
+  assert( i != m_sharers.end() );
+  *i = m_sharers.back();
+  m_sharers.pop_back();
+  released();
+}
+
+bool ShardLock::try_upgrade( uint64_t owner, LockWaiter *waiter )
+{
+  Guard g( m_mutex );
+  if (m_sharers.size() != 1) {
+    wait( waiter, true );
+    return false;
+  }
+  assert( m_sharers[0] == owner );
+  m_sharers.clear();
+  m_exclusive = true;
+  m_owner = owner;
+  dequeue( waiter );
+  return true;
+}
+
+// The waiters behind this one may be able to go ahead now
+void ShardLock::stop_waiting( LockWaiter *waiter )
+{
+  Guard g( m_mutex );
+  if (dequeue( waiter )) {
+    wake_waiters();
+  }
+}
+
+void ShardLock::get_holders( uint64_t self, std::vector<uint64_t> &holders )
+{
+  Guard g( m_mutex );
+  if (m_exclusive && m_owner != self) {
+    holders.push_back( m_owner );
+  }
+  for (uint64_t sharer : m_sharers) {
+    if (sharer != self) {
+      holders.push_back( sharer );
+    }
+  }
+}
+
+// Not exact under concurrent updates, which doesn't matter for a hint
+void ShardLock::note_read( bool then_written )
+{
+  int n = m_writes_after_reads.load( std::memory_order_relaxed );
+  n = then_written ? std::min( n + 1, MAX_WRITES_AFTER_READS ) : std::max( n - 1, 0 );
+  m_writes_after_reads.store( n, std::memory_order_relaxed );
+}
@@ -0,0 +1,103 @@
+#ifndef SHARD_LOCK_H
+#define SHARD_LOCK_H
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <vector>
+#include <pthread.h>
+
+// A request waiting for a ShardLock. lock_released() is called (with
+// the lock's internal mutex held, so it must not use the lock) when
+// the request may be able to take the lock, and should retry.
+class LockWaiter {
+public:
+  virtual ~LockWaiter() { }
+  virtual void lock_released() = 0;
+};
+
+// The lock of a table shard: held either exclusively by one request,
+// or shared by any number of transactions. Holders are identified by
+// transaction id (0 for requests outside a transaction), so that a
+// request finding the lock busy can tell whom it would wait for (see
+// DeadlockDetector). Requests don't block on the lock: they try to
+// take it, and if they fail, wait in a FIFO queue to be told when to
+// try again (see LockWaiter); only lock() blocks. The lock may be
+// released by a different thread than the one that acquired it.
+//
+// Releasing the lock tells the first waiter to retry (and the shared
+// waiters right after it, if it is shared). Waiters are served in
+// order: a request can't lock exclusively ahead of any waiter, nor
+// share the lock ahead of an exclusive waiter, so that a stream of
+// transactions sharing the lock can't starve a writer. A waiter stops
+// waiting when it takes the lock, or when it gives up and calls
+// stop_waiting().
+//
+// Two transactions that share the lock and then both want to upgrade
+// it deadlock, and one of them has to be aborted. So the lock keeps
+// track of whether transactions that read the shard usually go on to
+// write it; if so, they should take it exclusively from the start.
+class ShardLock {
+private:
+  pthread_mutex_t m_mutex; // protects the fields below, only held briefly
+  pthread_cond_t m_released;
+  unsigned m_num_blocked;  // threads waiting in lock()
+  bool m_exclusive;
+  uint64_t m_owner;        // exclusive holder
+  std::vector<uint64_t> m_sharers;
+  struct Waiter {
+    LockWaiter *waiter;
+    bool exclusive;
+  };
+  std::deque<Waiter> m_waiters;
+  std::atomic<int> m_writes_after_reads; // recent balance, never negative
+
+  // copy constructor and assignment operator are prohibited
+  ShardLock( const ShardLock & );
+  ShardLock &operator=( const ShardLock & );
+
+  bool is_free() const { return !m_exclusive && m_sharers.empty(); }
+  bool is_overtaking( LockWaiter *waiter, bool exclusive ) const;
+  void released();
+  void wake_waiters();
+  void wait( LockWaiter *waiter, bool exclusive );
+  bool dequeue( LockWaiter *waiter );
+
+public:
+  ShardLock();
+  ~ShardLock();
+
+  // Exclusive locking. lock() waits until the lock is free. If
+  // try_lock() fails and waiter isn't null, waiter waits for the lock
+  // (keeping its place in the queue if it already was).
+  void lock();
+  bool try_lock( uint64_t owner = 0, LockWaiter *waiter = nullptr );
+  void unlock();
+
+  // Shared locking, by a transaction (owner isn't 0) which doesn't
+  // hold the lock already, waiting as for try_lock()
+  bool try_lock_shared( uint64_t owner, LockWaiter *waiter = nullptr );
+  void unlock_shared( uint64_t owner );
+
+  // Turn owner's shared hold into an exclusive one, which only
+  // succeeds if no other transaction shares the lock (waiting as for
+  // try_lock() otherwise). Waiters don't hold it up, as they would
+  // have to wait for owner anyway.
+  bool try_upgrade( uint64_t owner, LockWaiter *waiter = nullptr );
+
+  // Stop waiting for the lock, if waiter is
+  void stop_waiting( LockWaiter *waiter );
+
+  // Append the holders of the lock other than self to holders
+  void get_holders( uint64_t self, std::vector<uint64_t> &holders );
+
+  // Whether transactions reading the shard have recently tended to
+  // write it too, as recorded by note_read()
+  bool expects_write_after_read() const { return m_writes_after_reads.load(std::memory_order_relaxed) > 0; }
+
+  // Record whether a transaction that read the shard (before writing
+  // it, if at all) also wrote it, or tried to
+  void note_read( bool then_written );
+};
+
+#endif // SHARD_LOCK_H
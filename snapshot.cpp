@@ -0,0 +1,153 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include "checksum.h"
+#include "exceptions.h"
+#include "snapshot.h"
+
+namespace {
+
+const char MAGIC[] = "KVSNAP3\n";
+const size_t MAGIC_LEN = 8;
+const size_t FOOTER_LEN = 24;
+
+uint64_t get_uint(const char *p, int nbytes) {
+  uint64_t val = 0;
+  for (int i = nbytes - 1; i >= 0; i--) {
+    val = (val << 8) | (unsigned char) p[i];
+  }
+  return val;
+}
+
+void append_uint(std::string &buf, uint64_t val, int nbytes) {
+  for (int i = 0; i < nbytes; i++) {
+    buf += char(val >> (8 * i));
+  }
+}
+
+}
+
+bool Snapshot::write( const std::string &path, const std::map<std::string, Table*> &tables, uint64_t ts )
+{
+  // The directory stores names with a 16-bit length (names are limited
+  // to far less, see Message::MAX_IDENTIFIER_LEN)
+  for (const auto &pair : tables) {
+    if (pair.first.size() > UINT16_MAX) {
+      errno = ENAMETOOLONG;
+      return false;
+    }
+  }
+
+  std::string tmp_path = path + ".tmp";
+  int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    return false;
+  }
+
+  FileWriter out(fd);
+  out.put(MAGIC, MAGIC_LEN);
+  std::string directory;
+  std::vector<std::pair<std::string_view, std::string_view>> entries;
+  for (const auto &pair : tables) {
+    // A table file must be written in key order
+    entries.clear();
+    pair.second->scan_snapshot(ts, [&entries](std::string_view key, std::string_view value) {
+      entries.push_back({ key, value });
+    });
+    std::sort(entries.begin(), entries.end());
+
+    uint64_t offset = out.get_offset();
+    TableFileBuilder builder(out);
+    for (const auto &entry : entries) {
+      builder.add(entry.first, entry.second);
+    }
+    uint64_t len = builder.finish();
+
+    append_uint(directory, pair.first.size(), 2);
+    directory += pair.first;
+    directory += char(pair.second->get_storage()->get_kind());
+    append_uint(directory, offset, 8);
+    append_uint(directory, len, 8);
+  }
+
+  std::string footer;
+  append_uint(footer, ts, 8);
+  append_uint(footer, out.get_offset(), 8);
+  append_uint(footer, tables.size(), 4);
+  uint32_t crc = crc32(directory.data(), directory.size());
+  append_uint(footer, crc32(footer.data(), footer.size(), crc), 4);
+  out.put(directory);
+  out.put(footer);
+
+  bool ok = out.flush() && fsync(fd) == 0;
+  int saved_errno = errno;
+  close(fd);
+  if (ok && rename(tmp_path.c_str(), path.c_str()) == 0) {
+    // The log records the snapshot covers are dropped once it is
+    // written, so the rename must be durable too
+    std::string dir = path.find('/') == std::string::npos ? "." : path.substr(0, path.rfind('/') + 1);
+    int dir_fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd >= 0) {
+      fsync(dir_fd);
+      close(dir_fd);
+    }
+    return true;
+  }
+  if (ok) {
+    saved_errno = errno; // from rename()
+  }
+  unlink(tmp_path.c_str());
+  errno = saved_errno;
+  return false;
+}
+
+uint64_t Snapshot::load( const MappedFile &file, std::map<std::string, Table*> &tables )
+{
+  std::string_view data = file.get_data();
+  if (data.size() < MAGIC_LEN + FOOTER_LEN || data.compare(0, MAGIC_LEN, MAGIC) != 0) {
+    throw CommException("Not a snapshot");
+  }
+  const char *footer = data.data() + data.size() - FOOTER_LEN;
+  uint64_t ts = get_uint(footer, 8);
+  uint64_t directory_offset = get_uint(footer + 8, 8);
+  uint64_t num_tables = get_uint(footer + 16, 4);
+  if (directory_offset < MAGIC_LEN || directory_offset > data.size() - FOOTER_LEN) {
+    throw CommException("Snapshot is corrupted");
+  }
+  std::string_view directory = data.substr(directory_offset, data.size() - FOOTER_LEN - directory_offset);
+  uint32_t crc = crc32(directory.data(), directory.size());
+  if (crc32(footer, FOOTER_LEN - 4, crc) != uint32_t(get_uint(footer + 20, 4))) {
+    throw CommException("Snapshot is corrupted");
+  }
+
+  for (uint64_t i = 0; i < num_tables; i++) {
+    if (directory.size() < 2 || directory.size() - 2 < get_uint(directory.data(), 2) + 17) {
+      throw CommException("Snapshot is corrupted");
+    }
+    size_t name_len = get_uint(directory.data(), 2);
+    std::string name(directory.substr(2, name_len));
+    uint64_t kind = get_uint(directory.data() + 2 + name_len, 1);
+    uint64_t offset = get_uint(directory.data() + 3 + name_len, 8);
+    uint64_t len = get_uint(directory.data() + 11 + name_len, 8);
+    directory.remove_prefix(19 + name_len);
+    if (offset < MAGIC_LEN || offset > directory_offset || directory_offset - offset < len
+        || (kind != Storage::MEMORY && kind != Storage::LSM)) {
+      throw CommException("Snapshot is corrupted");
+    }
+
+    TableFile *base = new TableFile(data.substr(offset, len));
+    Table *&table = tables[name];
+    if (table == nullptr) {
+      table = new Table(name, Storage::Kind(kind));
+    }
+    table->set_base(base, ts);
+  }
+  if (!directory.empty()) {
+    throw CommException("Snapshot is corrupted");
+  }
+  return ts;
+}
@@ -0,0 +1,40 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include "table.h"
+#include "table_file.h"
+
+// Point-in-time snapshot files of all of the tables. A snapshot is
+//
+//   "KVSNAP3\n"
+//   a TableFile for each table
+//   directory   each table: u16 length, name, u8 storage engine (see
+//               Storage::Kind), u64 offset, u64 length
+//   footer      u64 timestamp, u64 directory offset, u32 number of
+//               tables, u32 CRC-32 of the directory and footer
+//
+// with all integers little endian. It holds the versions visible at
+// the timestamp, so the log records of commits up to the timestamp
+// don't need to be replayed after loading it.
+//
+// Loading a snapshot doesn't read its tables: they are served directly
+// from the mapped file (see TableFile), so a restart takes a few mmap
+// calls however large the tables are.
+namespace Snapshot {
+  // Write the versions of tables visible at ts to path (by way of a
+  // temporary file, which is synced and renamed into place, so path is
+  // always either the old snapshot or the complete new one). Returns
+  // false, with errno set, on failure. Takes no locks (see
+  // Table::scan_snapshot()), so it is meant for a forked child.
+  bool write( const std::string &path, const std::map<std::string, Table*> &tables, uint64_t ts );
+
+  // Create the tables of the snapshot in file, each with its TableFile
+  // as its base, and return its timestamp. file must outlive the
+  // tables. Throws CommException if the snapshot is corrupted.
+  uint64_t load( const MappedFile &file, std::map<std::string, Table*> &tables );
+};
+
+#endif // SNAPSHOT_H
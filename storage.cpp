@@ -0,0 +1,45 @@
+#include "lsm_storage.h"
+#include "storage.h"
+
+namespace {
+
+std::string g_lsm_dir = ".";
+size_t g_lsm_memtable_bytes = 64 << 20;
+
+}
+
+Storage::~Storage()
+{
+}
+
+void Storage::configure( const std::string &lsm_dir, size_t lsm_memtable_bytes )
+{
+  g_lsm_dir = lsm_dir;
+  g_lsm_memtable_bytes = lsm_memtable_bytes;
+}
+
+Storage *Storage::create( Kind kind, const std::string &table_name, unsigned num_shards )
+{
+  if (kind == LSM) {
+    size_t flush_bytes = g_lsm_memtable_bytes / num_shards;
+    return new LsmStorage(g_lsm_dir, table_name, num_shards, flush_bytes > 0 ? flush_bytes : 1);
+  }
+  return new MemoryStorage();
+}
+
+const char *Storage::kind_name( Kind kind )
+{
+  return kind == LSM ? "LSM" : "MEMORY";
+}
+
+bool Storage::parse_kind( const std::string &name, Kind &kind )
+{
+  if (name == "MEMORY") {
+    kind = MEMORY;
+  } else if (name == "LSM") {
+    kind = LSM;
+  } else {
+    return false;
+  }
+  return true;
+}
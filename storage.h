@@ -0,0 +1,87 @@
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Storage engine for a table's committed data. Each table shard keeps
+// its recent committed versions in memory (see Table); the engine
+// decides whether they stay there (MEMORY) or are flushed, once the
+// shard has accumulated get_flush_bytes() of them, to storage that can
+// grow beyond memory (LSM, see LsmStorage). Values in the engine are
+// older than any in the shards, so the engine is only consulted for
+// keys the shard doesn't have.
+//
+// The engine is chosen per table when it is created.
+class Storage {
+public:
+  enum Kind { MEMORY = 0, LSM = 1 };
+
+  // A committed value flushed from a table shard
+  struct Entry {
+    std::string_view key;
+    std::string_view value;
+    uint64_t ts;
+  };
+
+  virtual ~Storage();
+
+  virtual Kind get_kind() const = 0;
+
+  // Size of the versions held in memory by a table shard at which
+  // they are flushed to the engine (0 if they are never flushed)
+  virtual size_t get_flush_bytes() const = 0;
+
+  // Take over the shard's versions: entries are sorted by key, and
+  // each is the latest version of its key. Once this returns true, the
+  // engine serves them from get(); it returns false (e.g. if the disk
+  // is full) if they must stay in memory.
+  virtual bool flush( unsigned shard, const std::vector<Entry> &entries ) = 0;
+
+  // Find the latest value of a key (in the given table shard). May be
+  // called concurrently with everything else.
+  virtual bool get( unsigned shard, std::string_view key, std::string &value, uint64_t &ts ) = 0;
+
+  // Block (or allow) changes to the engine's structures, so that a
+  // child forked in between sees them in a consistent state
+  virtual void prepare_fork() = 0;
+  virtual void after_fork() = 0;
+
+  // Versions of get() and of iterating over every key's latest value
+  // (in no particular order) which take no locks, for use in a child
+  // forked after prepare_fork()
+  virtual bool get_unlocked( unsigned shard, std::string_view key, std::string &value, uint64_t &ts ) = 0;
+  virtual void for_each_unlocked( const std::function<void(std::string_view, std::string_view)> &f ) = 0;
+
+  // Where LSM tables keep their files, and their memtable size (the
+  // total of the flush sizes of all shards of a table)
+  static void configure( const std::string &lsm_dir, size_t lsm_memtable_bytes );
+
+  // Create the storage of a table with num_shards shards. Throws
+  // CommException on failure.
+  static Storage *create( Kind kind, const std::string &table_name, unsigned num_shards );
+
+  // The name of a kind ("MEMORY" or "LSM"), and the inverse (returning
+  // false if name isn't a kind)
+  static const char *kind_name( Kind kind );
+  static bool parse_kind( const std::string &name, Kind &kind );
+};
+
+// Keeps everything in the table shards
+class MemoryStorage : public Storage {
+public:
+  Kind get_kind() const { return MEMORY; }
+  size_t get_flush_bytes() const { return 0; }
+  bool flush( unsigned, const std::vector<Entry> & ) { return true; }
+  bool get( unsigned, std::string_view, std::string &, uint64_t & ) { return false; }
+  void prepare_fork() { }
+  void after_fork() { }
+  bool get_unlocked( unsigned, std::string_view, std::string &, uint64_t & ) { return false; }
+  void for_each_unlocked( const std::function<void(std::string_view, std::string_view)> & ) { }
+};
+
+#endif // STORAGE_H
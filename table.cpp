@@ -1,56 +1,582 @@
+#include <algorithm>
 #include <cassert>
+#include <utility>
 #include "table.h"
 #include "exceptions.h"
-#include "guard.h"
+#include "commit_clock.h"
+#include "table_file.h"
+#include "wal.h"
 
-Table::Table(const std::string& name)
-  : m_name(name) {
-  pthread_mutex_init(&m_lock, nullptr);
+namespace {
+
+const size_t INITIAL_SLOTS = 16;
+
+}
+
+// Marks a snapshot read of a shard's versions, so that nothing the
+// read may reach is freed before it ends. A reader counts itself in
+// the current epoch; if the epoch changes meanwhile, it may have been
+// missed by reclaim(), so it tries again in the new one.
+class Table::ReadSection {
+private:
+  Shard &m_shard;
+  unsigned m_parity;
+
+  // copy constructor and assignment operator are prohibited
+  ReadSection( const ReadSection & );
+  ReadSection &operator=( const ReadSection & );
+
+public:
+  ReadSection( Shard &shard )
+    : m_shard( shard )
+  {
+    while (true) {
+      uint64_t epoch = m_shard.epoch.load();
+      m_parity = unsigned(epoch & 1);
+      m_shard.readers[m_parity].fetch_add(1);
+      if (m_shard.epoch.load() == epoch) {
+        break;
+      }
+      m_shard.readers[m_parity].fetch_sub(1);
+    }
+  }
+
+  ~ReadSection()
+  {
+    m_shard.readers[m_parity].fetch_sub(1, std::memory_order_release);
+  }
+};
+
+Table::Table(const std::string& name, Storage::Kind kind)
+  : m_name(name)
+  , m_storage(Storage::create(kind, name, NUM_SHARDS))
+  , m_base(nullptr)
+  , m_base_ts(0) {
+  for (Shard &shard : m_shards) {
+    shard.index.store(new_index(INITIAL_SLOTS), std::memory_order_relaxed);
+    shard.epoch.store(0, std::memory_order_relaxed);
+    shard.readers[0].store(0, std::memory_order_relaxed);
+    shard.readers[1].store(0, std::memory_order_relaxed);
+    shard.bytes = 0;
+    shard.flush_at = m_storage->get_flush_bytes();
+  }
 }
 
 Table::~Table() {
-  pthread_mutex_destroy(&m_lock);
+  for (Shard &shard : m_shards) {
+    free_index(shard.index.load(), true);
+    free_garbage(shard.garbage[0]);
+    free_garbage(shard.garbage[1]);
+  }
+  delete m_storage;
+  delete m_base;
 }
 
-void Table::lock() {
-  pthread_mutex_lock(&m_lock);
+void Table::set_base(TableFile *base, uint64_t ts) {
+  delete m_base;
+  m_base = base;
+  m_base_ts = ts;
 }
 
-void Table::unlock() {
-  pthread_mutex_unlock(&m_lock);
+unsigned Table::shard_of(std::string_view key) {
+  return shard_of_hash(FlatHashMap<std::string>::hash(key));
 }
 
-bool Table::trylock() {
-  return pthread_mutex_trylock(&m_lock) == 0;
+void Table::lock_shard(unsigned shard) {
+  m_shards[shard].lock.lock();
 }
 
-void Table::set(const std::string& key, const std::string& value) {
-  m_pre_data[key] = value;
+void Table::unlock_shard(unsigned shard) {
+  Shard &s = m_shards[shard];
+  // The engine keeps only the latest version of each key, which a
+  // pinned snapshot may not see
+  if (s.flush_at != 0 && s.bytes >= s.flush_at && !CommitClock::has_pinned_snapshots()) {
+    flush_shard(shard);
+  }
+  s.lock.unlock();
 }
 
+Table::Index *Table::new_index(size_t num_slots) {
+  Index *index = new Index;
+  index->mask = num_slots - 1;
+  index->size = 0;
+  index->slots = new std::atomic<Entry *>[num_slots];
+  for (size_t i = 0; i < num_slots; i++) {
+    index->slots[i].store(nullptr, std::memory_order_relaxed);
+  }
+  return index;
+}
+
+Table::Entry *Table::find_entry(const Index *index, std::string_view key, size_t hash) {
+  for (size_t i = hash & index->mask; ; i = (i + 1) & index->mask) {
+    Entry *entry = index->slots[i].load(std::memory_order_acquire);
+    if (entry == nullptr) {
+      return nullptr;
+    }
+    if (entry->hash == hash && entry->key == key) {
+      return entry;
+    }
+  }
+}
+
+// The latest version visible at ts that the entry still has, if any
+const Table::Version *Table::visible_version(const Entry *entry, uint64_t ts) {
+  const Version *version = entry->latest.load(std::memory_order_acquire);
+  while (version != nullptr && version->ts > ts) {
+    version = version->next.load(std::memory_order_acquire);
+  }
+  return version;
+}
+
+void Table::free_index(Index *index, bool with_entries) {
+  if (with_entries) {
+    for (size_t i = 0; i <= index->mask; i++) {
+      Entry *entry = index->slots[i].load(std::memory_order_relaxed);
+      if (entry == nullptr) {
+        continue;
+      }
+      Version *version = entry->latest.load(std::memory_order_relaxed);
+      while (version != nullptr) {
+        Version *next = version->next.load(std::memory_order_relaxed);
+        delete version;
+        version = next;
+      }
+      delete entry;
+    }
+  }
+  delete[] index->slots;
+  delete index;
+}
+
+void Table::free_garbage(Garbage &garbage) {
+  for (Version *version : garbage.versions) {
+    delete version;
+  }
+  for (Index *index : garbage.arrays) {
+    free_index(index, false);
+  }
+  for (Index *index : garbage.indexes) {
+    free_index(index, true);
+  }
+  garbage.versions.clear();
+  garbage.arrays.clear();
+  garbage.indexes.clear();
+}
+
+// Add an entry for a key the shard doesn't have. When the index gets
+// half full, the entries are copied into one twice the size, which is
+// published instead (as in Catalog::insert()).
+Table::Entry *Table::insert_entry(Shard &s, std::string &&key, size_t hash) {
+  Entry *entry = new Entry;
+  entry->hash = hash;
+  entry->key = std::move(key);
+  entry->latest.store(nullptr, std::memory_order_relaxed);
+
+  Index *index = s.index.load(std::memory_order_relaxed);
+  Index *target = index;
+  if (2 * (index->size + 1) > index->mask + 1) {
+    target = new_index(2 * (index->mask + 1));
+    for (size_t i = 0; i <= index->mask; i++) {
+      Entry *e = index->slots[i].load(std::memory_order_relaxed);
+      if (e != nullptr) {
+        size_t j = e->hash & target->mask;
+        while (target->slots[j].load(std::memory_order_relaxed) != nullptr) {
+          j = (j + 1) & target->mask;
+        }
+        target->slots[j].store(e, std::memory_order_relaxed);
+      }
+    }
+    target->size = index->size;
+  }
+
+  size_t i = hash & target->mask;
+  while (target->slots[i].load(std::memory_order_relaxed) != nullptr) {
+    i = (i + 1) & target->mask;
+  }
+  target->slots[i].store(entry, std::memory_order_release);
+  target->size++;
+  if (target != index) {
+    s.index.store(target, std::memory_order_release);
+    s.garbage[s.epoch.load(std::memory_order_relaxed) & 1].arrays.push_back(index);
+  }
+  return entry;
+}
+
+void Table::retire(Shard &s, Version *version) {
+  s.bytes -= sizeof(Version) + version->value.size();
+  s.garbage[s.epoch.load(std::memory_order_relaxed) & 1].versions.push_back(version);
+}
+
+// Free the previous epoch's garbage if its readers have all left, and
+// start a new epoch if there is garbage to wait for. Requires the
+// shard's lock.
+void Table::reclaim(Shard &s) {
+  uint64_t epoch = s.epoch.load(std::memory_order_relaxed);
+  Garbage &previous = s.garbage[(epoch + 1) & 1];
+  Garbage &current = s.garbage[epoch & 1];
+  if (s.readers[(epoch + 1) & 1].load() != 0) {
+    return;
+  }
+  free_garbage(previous);
+  if (!current.versions.empty() || !current.arrays.empty() || !current.indexes.empty()) {
+    s.epoch.store(epoch + 1);
+  }
+}
+
+// Hand the latest version of each of the shard's keys over to the
+// storage engine. Requires the shard's lock (or that the table isn't
+// shared yet).
+void Table::flush_shard(unsigned shard) {
+  Shard &s = m_shards[shard];
+  Index *index = s.index.load(std::memory_order_relaxed);
+  std::vector<Storage::Entry> entries;
+  entries.reserve(index->size);
+  for (size_t i = 0; i <= index->mask; i++) {
+    Entry *entry = index->slots[i].load(std::memory_order_relaxed);
+    if (entry != nullptr) {
+      Version *latest = entry->latest.load(std::memory_order_relaxed);
+      entries.push_back({ entry->key, latest->value, latest->ts });
+    }
+  }
+  std::sort(entries.begin(), entries.end(), [](const Storage::Entry &a, const Storage::Entry &b) {
+    return a.key < b.key;
+  });
+  if (!m_storage->flush(shard, entries)) {
+    // Keep the versions, and try again once the shard has grown
+    s.flush_at = s.bytes * 2;
+    return;
+  }
+
+  // The engine serves the versions before they leave the shard, so
+  // readers always find them in one or the other
+  s.index.store(new_index(INITIAL_SLOTS), std::memory_order_release);
+  s.garbage[s.epoch.load(std::memory_order_relaxed) & 1].indexes.push_back(index);
+  s.bytes = 0;
+  s.flush_at = m_storage->get_flush_bytes();
+  reclaim(s);
+}
+
+bool Table::trylock_shard(unsigned shard) {
+  return m_shards[shard].lock.try_lock();
+}
+
+bool Table::trylock_shard(unsigned shard, uint64_t owner, LockWaiter *waiter) {
+  return m_shards[shard].lock.try_lock(owner, waiter);
+}
+
+void Table::stop_waiting_for_shard(unsigned shard, LockWaiter *waiter) {
+  m_shards[shard].lock.stop_waiting(waiter);
+}
+
+void Table::get_shard_holders(unsigned shard, uint64_t self, std::vector<uint64_t> &holders) {
+  m_shards[shard].lock.get_holders(self, holders);
+}
+
+bool Table::trylock_shard_shared(unsigned shard, uint64_t owner, LockWaiter *waiter) {
+  return m_shards[shard].lock.try_lock_shared(owner, waiter);
+}
+
+// Shared holders don't change the shard, so there is nothing to
+// flush when they unlock
+void Table::unlock_shard_shared(unsigned shard, uint64_t owner) {
+  m_shards[shard].lock.unlock_shared(owner);
+}
+
+bool Table::upgrade_shard_lock(unsigned shard, uint64_t owner, LockWaiter *waiter) {
+  return m_shards[shard].lock.try_upgrade(owner, waiter);
+}
+
+// The key is hashed once, for choosing the shard and for the lookup.
+// (The lock holder reads the latest versions directly: only commits
+// and flushes, which require the exclusive lock, modify the shard.)
+
 std::string Table::get(const std::string& key) {
-  auto it = m_pre_data.find(key);
-  if (it != m_pre_data.end()) {
-    return it->second;
+  size_t hash = FlatHashMap<std::string>::hash(key);
+  Shard &shard = m_shards[shard_of_hash(hash)];
+  Entry *entry = find_entry(shard.index.load(std::memory_order_acquire), key, hash);
+  if (entry != nullptr) {
+    return entry->latest.load(std::memory_order_acquire)->value;
   }
-  it = m_data.find(key);
-  if (it != m_data.end()) {
-    return it->second;
+  std::string stored;
+  uint64_t ts;
+  if (m_storage->get(shard_of_hash(hash), key, stored, ts)) {
+    return stored;
   }
-  throw OperationException("Key not found: " + key);
+  std::string_view base_value;
+  if (m_base == nullptr || !m_base->find(key, base_value)) {
+    throw OperationException("Key not found: " + key);
+  }
+  return std::string(base_value);
 }
 
 bool Table::has_key(const std::string& key) {
-  return m_pre_data.find(key) != m_pre_data.end()|| m_data.find(key) != m_data.end();
+  size_t hash = FlatHashMap<std::string>::hash(key);
+  Shard &shard = m_shards[shard_of_hash(hash)];
+  std::string stored;
+  uint64_t ts;
+  std::string_view base_value;
+  return find_entry(shard.index.load(std::memory_order_acquire), key, hash) != nullptr
+      || m_storage->get(shard_of_hash(hash), key, stored, ts)
+      || (m_base != nullptr && m_base->find(key, base_value));
+}
+
+std::string Table::get_snapshot(const std::string& key) {
+  std::string value;
+  uint64_t ts;
+  if (!read_snapshot(key, value, ts)) {
+    throw OperationException("Key not found: " + key);
+  }
+  return value;
+}
+
+bool Table::read_snapshot(const std::string& key, std::string& value, uint64_t& ts) {
+  return read_version(key, false, 0, value, ts);
+}
+
+std::string Table::get_snapshot(const std::string& key, uint64_t snapshot) {
+  std::string value;
+  uint64_t ts;
+  if (!read_version(key, true, snapshot, value, ts)) {
+    throw OperationException("Key not found: " + key);
+  }
+  return value;
+}
+
+// Look for the key's version in the snapshot among the shard's
+// versions. A version's commit was published before the version it
+// replaced was discarded, so only a reader whose snapshot has since
+// been overtaken can find the version it needs gone: it returns RETRY,
+// to read a newer snapshot instead. A pinned snapshot's versions are
+// kept for it.
+Table::Lookup Table::find_version(Shard &s, const std::string &key, size_t hash, bool pinned, uint64_t snapshot, std::string &value, uint64_t &ts) {
+  ReadSection section(s);
+  const Entry *entry = find_entry(s.index.load(std::memory_order_acquire), key, hash);
+  if (entry == nullptr) {
+    return NOT_IN_SHARD;
+  }
+  const Version *version;
+  if (pinned) {
+    version = visible_version(entry, snapshot);
+  } else {
+    version = entry->latest.load(std::memory_order_acquire);
+    while (version != nullptr && version->ts > snapshot) {
+      if (version->replaced_ts == 0) {
+        return NOT_IN_SHARD;
+      }
+      const Version *next = version->next.load(std::memory_order_acquire);
+      if (next == nullptr || next->ts != version->replaced_ts) {
+        return RETRY;
+      }
+      version = next;
+    }
+  }
+  if (version == nullptr) {
+    return NOT_IN_SHARD;
+  }
+  value = version->value;
+  ts = version->ts;
+  return FOUND;
+}
+
+// Read the key's version in the given snapshot if pinned is set, or
+// else in the latest one
+bool Table::read_version(const std::string& key, bool pinned, uint64_t snapshot, std::string& value, uint64_t& ts) {
+  size_t hash = FlatHashMap<std::string>::hash(key);
+  unsigned shard = shard_of_hash(hash);
+  Shard &s = m_shards[shard];
+
+  while (true) {
+    // The snapshot is taken before the index is loaded: any version
+    // committed later, or flushed after the load, is newer than it
+    if (!pinned) {
+      snapshot = CommitClock::snapshot();
+    }
+    Lookup lookup = find_version(s, key, hash, pinned, snapshot, value, ts);
+    if (lookup == FOUND) {
+      return true;
+    }
+    if (lookup == RETRY) {
+      continue;
+    }
+
+    // A key missing from the index loaded may have been committed and
+    // flushed since, which makes the engine's version newer than the
+    // snapshot. Shards aren't flushed while a snapshot is pinned.
+    if (m_storage->get(shard, key, value, ts)) {
+      if (pinned || ts <= snapshot) {
+        return true;
+      }
+      continue;
+    }
+    break;
+  }
+
+  // The base is immutable
+  std::string_view base_value;
+  if (m_base == nullptr || !m_base->find(key, base_value)) {
+    return false;
+  }
+  value.assign(base_value.data(), base_value.size());
+  ts = m_base_ts;
+  return true;
+}
+
+uint64_t Table::latest_ts(const std::string& key) {
+  size_t hash = FlatHashMap<std::string>::hash(key);
+  Shard &shard = m_shards[shard_of_hash(hash)];
+
+  {
+    ReadSection section(shard);
+    const Entry *entry = find_entry(shard.index.load(std::memory_order_acquire), key, hash);
+    if (entry != nullptr) {
+      return entry->latest.load(std::memory_order_acquire)->ts;
+    }
+  }
+  std::string stored;
+  uint64_t ts;
+  if (m_storage->get(shard_of_hash(hash), key, stored, ts)) {
+    return ts;
+  }
+  std::string_view base_value;
+  return (m_base != nullptr && m_base->find(key, base_value)) ? m_base_ts : 0;
+}
+
+void Table::commit_changes(unsigned shard, FlatHashMap<std::string> &writes, uint64_t ts, WalRecord *record) {
+  Shard &s = m_shards[shard];
+  if (writes.empty()) {
+    return;
+  }
+  if (!CommitClock::has_log()) {
+    record = nullptr; // the record would only be thrown away
+  }
+
+  // Pins are only taken while no commit is in progress, so they
+  // can't change during this one (other than by being released)
+  bool pinned = CommitClock::has_pinned_snapshots();
+  // The keys and values are moved into the versions rather than
+  // copied: the cost is per key, whatever the size of the values
+  writes.drain([this, &s, ts, record, pinned](std::string &key, std::string &value) {
+    if (record != nullptr) {
+      record->add_write(m_name, key, value);
+    }
+    size_t hash = FlatHashMap<std::string>::hash(key);
+    Entry *entry = find_entry(s.index.load(std::memory_order_relaxed), key, hash);
+    if (entry == nullptr) {
+      s.bytes += key.size() + sizeof(Entry);
+      entry = insert_entry(s, std::move(key), hash);
+    }
+
+    Version *replaced = entry->latest.load(std::memory_order_relaxed);
+    Version *version = new Version;
+    version->ts = ts;
+    version->replaced_ts = replaced != nullptr ? replaced->ts : 0;
+    version->value = std::move(value);
+    version->next.store(replaced, std::memory_order_relaxed);
+    s.bytes += sizeof(Version) + version->value.size();
+    entry->latest.store(version, std::memory_order_release);
+    if (replaced == nullptr) {
+      return;
+    }
+
+    // The replaced version's commit was published before this one
+    // took the shard's lock, so it is the only older version still
+    // visible to any current snapshot. Older ones are discarded,
+    // unless a pinned snapshot sees them.
+    Version *kept = replaced;
+    Version *older = replaced->next.load(std::memory_order_relaxed);
+    while (older != nullptr) {
+      Version *next = older->next.load(std::memory_order_relaxed);
+      if (pinned && CommitClock::is_pinned(older->ts, kept->ts)) {
+        if (kept->next.load(std::memory_order_relaxed) != older) {
+          kept->next.store(older, std::memory_order_release);
+        }
+        kept = older;
+      } else {
+        retire(s, older);
+      }
+      older = next;
+    }
+    if (kept->next.load(std::memory_order_relaxed) != nullptr) {
+      kept->next.store(nullptr, std::memory_order_release);
+    }
+  });
+  reclaim(s);
 }
 
-void Table::commit_changes() {
-  for (const auto& kv : m_pre_data) {
-    m_data[kv.first] = kv.second;
+void Table::recover(std::string_view key, std::string_view value, uint64_t ts) {
+  size_t hash = FlatHashMap<std::string>::hash(key);
+  unsigned shard = shard_of_hash(hash);
+  Shard &s = m_shards[shard];
+  Entry *entry = find_entry(s.index.load(std::memory_order_relaxed), key, hash);
+  if (entry == nullptr) {
+    s.bytes += key.size() + sizeof(Entry);
+    entry = insert_entry(s, std::string(key), hash);
   }
-  m_pre_data.clear();
+  // Nothing reads the table yet, so the replaced version is freed
+  // straight away
+  Version *replaced = entry->latest.load(std::memory_order_relaxed);
+  if (replaced != nullptr) {
+    s.bytes -= sizeof(Version) + replaced->value.size();
+    delete replaced;
+  }
+  Version *version = new Version;
+  version->ts = ts;
+  version->replaced_ts = 0;
+  version->value.assign(value.data(), value.size());
+  version->next.store(nullptr, std::memory_order_relaxed);
+  s.bytes += sizeof(Version) + version->value.size();
+  entry->latest.store(version, std::memory_order_relaxed);
+  if (s.flush_at != 0 && s.bytes >= s.flush_at) {
+    flush_shard(shard);
+  }
+}
+
+void Table::scan_snapshot(uint64_t ts, const std::function<void(std::string_view, std::string_view)> &f) {
+  // Whether the key has a version visible at ts in the delta
+  auto in_delta = [this, ts](std::string_view key, size_t hash) {
+    const Index *index = m_shards[shard_of_hash(hash)].index.load(std::memory_order_relaxed);
+    const Entry *entry = find_entry(index, key, hash);
+    return entry != nullptr && visible_version(entry, ts) != nullptr;
+  };
+
+  for (Shard &s : m_shards) {
+    const Index *index = s.index.load(std::memory_order_relaxed);
+    for (size_t i = 0; i <= index->mask; i++) {
+      const Entry *entry = index->slots[i].load(std::memory_order_relaxed);
+      if (entry != nullptr) {
+        const Version *version = visible_version(entry, ts);
+        if (version != nullptr) {
+          f(entry->key, version->value);
+        }
+      }
+    }
+  }
+  // The engine's versions were all published before ts (see
+  // prepare_fork())
+  m_storage->for_each_unlocked([&in_delta, &f](std::string_view key, std::string_view value) {
+    if (!in_delta(key, FlatHashMap<std::string>::hash(key))) {
+      f(key, value);
+    }
+  });
+  if (m_base != nullptr) {
+    m_base->for_each([this, &in_delta, &f](std::string_view key, std::string_view value) {
+      size_t hash = FlatHashMap<std::string>::hash(key);
+      std::string stored;
+      uint64_t stored_ts;
+      if (!in_delta(key, hash) && !m_storage->get_unlocked(shard_of_hash(hash), key, stored, stored_ts)) {
+        f(key, value);
+      }
+    });
+  }
+}
+
+// Flushes replace a shard's index with one store, once the engine has
+// its versions (and a key found in both is read from the index), so
+// only the engine's changes need holding off
+void Table::prepare_fork() {
+  m_storage->prepare_fork();
 }
 
-void Table::rollback_changes() {
-  m_pre_data.clear();
+void Table::after_fork() {
+  m_storage->after_fork();
 }
@@ -1,38 +1,234 @@
 #ifndef TABLE_H
 #define TABLE_H
 
-#include <map>
+#include <atomic>
+#include <cstdint>
+#include <functional>
 #include <string>
-#include <pthread.h>
+#include <string_view>
+#include <vector>
+#include "flat_hash_map.h"
+#include "shard_lock.h"
+#include "storage.h"
 
+class TableFile; // forward declaration
+class WalRecord; // forward declaration
+
+// A table's keys are partitioned into shards by hash, each with its
+// own lock and data, so that clients working on different keys of the
+// same table don't serialize on one lock. A transaction locks only
+// the shards of the keys it touches: shared for the keys it only
+// reads, so that transactions reading the same keys don't exclude
+// each other, and exclusively for the keys it writes.
+//
+// Committed values are versioned with timestamps from CommitClock, so
+// get_snapshot() can read a consistent snapshot without taking (or
+// waiting for) shard locks. A shard's writers hold its exclusive lock
+// until their commit is published, so at most two versions of a key
+// are ever needed: one being installed by the current commit, and the
+// one visible to snapshots older than it. The exception is pinned
+// snapshots (see CommitClock), which may be older still: a commit
+// keeps the versions they can see, and a shard isn't flushed while
+// any snapshot is pinned.
+//
+// Snapshot reads take no lock at all. Each key's versions are a chain
+// of immutable Versions, newest first, and the shard's index of keys
+// is probed like Catalog's: commits publish new versions, keys and
+// index arrays with release stores. Whatever a commit unlinks (older
+// versions, a replaced array, or a flushed shard's whole index) is
+// freed once no read that started before the unlinking is still
+// running. Readers only announce themselves on one of the shard's two
+// reader counts (see ReadSection), and a commit never waits for them.
+//
+// A table restored from a snapshot reads the snapshot's values
+// directly from its memory-mapped TableFile (the base), whose values
+// are older than any version in the shards: the shards hold only the
+// changes committed since (the delta).
+//
+// Between the two is the table's storage engine (see Storage): when a
+// shard's versions reach the engine's flush size, the latest version
+// of each key is handed over to the engine, and the shard starts over
+// empty. The engine's versions are older than the shard's, and newer
+// than the base's.
 class Table {
+public:
+  static const unsigned NUM_SHARDS = 64;
+
 private:
+  // A committed version of a key, immutable once published (other
+  // than next, when the versions between are discarded)
+  struct Version {
+    uint64_t ts;          // commit timestamp
+    uint64_t replaced_ts; // timestamp of the version it replaced in the shard (0 if none)
+    std::string value;
+    std::atomic<Version *> next; // the next older version kept, if any
+  };
+
+  struct Entry {
+    size_t hash;
+    std::string key;
+    std::atomic<Version *> latest;
+  };
+
+  // A shard's keys, by open addressing. Only the lock holder inserts,
+  // and keys are only removed by replacing the whole index.
+  struct Index {
+    size_t mask; // number of slots - 1
+    size_t size;
+    std::atomic<Entry *> *slots;
+  };
+
+  // Memory unlinked from a shard, waiting to be freed
+  struct Garbage {
+    std::vector<Version *> versions;
+    std::vector<Index *> arrays;  // replaced by a larger one (entries still in use)
+    std::vector<Index *> indexes; // flushed, with their entries and versions
+  };
+
+  struct Shard {
+    std::atomic<Index *> index;
+
+    // Garbage is freed by epochs: what is unlinked during an epoch
+    // goes into garbage[epoch & 1], and readers count themselves in
+    // readers[epoch & 1] (see ReadSection). Once the previous epoch's
+    // readers have left, nobody can reach its garbage, which is freed,
+    // and a new epoch starts. Only the lock holder changes epochs.
+    std::atomic<uint64_t> epoch;
+    std::atomic<unsigned> readers[2];
+    Garbage garbage[2];
+
+    // Not a mutex, since a transaction's lock may be released by a
+    // different worker thread than the one that acquired it
+    ShardLock lock;
+
+    size_t bytes;    // size of the keys, versions and values in the index
+    size_t flush_at; // flush the index to the storage engine at this size (0: never)
+  };
+
+  // Outcome of looking a key up in a shard's versions
+  enum Lookup { FOUND, NOT_IN_SHARD, RETRY };
+
+  class ReadSection; // forward declaration
+
   std::string m_name;
-  std::map<std::string, std::string> m_data;
-  std::map<std::string, std::string> m_pre_data;
-  pthread_mutex_t m_lock;
+  Storage *m_storage;
+  Shard m_shards[NUM_SHARDS];
+  TableFile *m_base; // null if the table has no base
+  uint64_t m_base_ts;
 
   // copy constructor and assignment operator are prohibited
   Table( const Table & );
   Table &operator=( const Table & );
 
+  static Index *new_index( size_t num_slots );
+  static Entry *find_entry( const Index *index, std::string_view key, size_t hash );
+  static const Version *visible_version( const Entry *entry, uint64_t ts );
+  static void free_index( Index *index, bool with_entries );
+  static void free_garbage( Garbage &garbage );
+  Entry *insert_entry( Shard &s, std::string &&key, size_t hash );
+  void retire( Shard &s, Version *version );
+  void reclaim( Shard &s );
+  void flush_shard( unsigned shard );
+  Lookup find_version( Shard &s, const std::string &key, size_t hash, bool pinned, uint64_t snapshot, std::string &value, uint64_t &ts );
+  bool read_version( const std::string &key, bool pinned, uint64_t snapshot, std::string &value, uint64_t &ts );
+
 public:
-  Table( const std::string &name );
+  // Throws CommException if the storage engine can't be created
+  Table( const std::string &name, Storage::Kind kind = Storage::MEMORY );
   ~Table();
 
-  std::string get_name() const { return m_name; }
+  const std::string &get_name() const { return m_name; }
+  Storage *get_storage() const { return m_storage; }
 
-  void lock();
-  void unlock();
-  bool trylock();
+  // Serve the values in base (which the table takes ownership of) as
+  // versions with timestamp ts, under any committed later. Only for use
+  // before the table is shared.
+  void set_base( TableFile *base, uint64_t ts );
 
-  // Note: these functions should only be called while the
-  // table's lock is held!
-  void set( const std::string &key, const std::string &value );
+  // The shard containing the given key
+  static unsigned shard_of( std::string_view key );
+
+  // The shard containing a key with the given FlatHashMap::hash(),
+  // chosen by the hash's high bits, as FlatHashMap uses the low bits
+  static unsigned shard_of_hash( size_t hash ) { return unsigned(hash >> (sizeof(size_t) * 8 - 6)); }
+  static_assert(NUM_SHARDS == 64, "shard_of_hash() assumes 64 shards");
+
+  // Unlocking a shard flushes it to the storage engine if it has
+  // reached the flush size: the lock holder's commits have all ended
+  // by then, so every version in the shard is published
+  void lock_shard( unsigned shard );
+  void unlock_shard( unsigned shard );
+  bool trylock_shard( unsigned shard );
+
+  // A transaction locks a shard with its id as the owner, so that a
+  // request finding the shard locked can find out whom it would wait
+  // for (see ClientConnection::lock_for_transaction()). A request
+  // that fails to lock a shard can wait to be told when to retry (see
+  // ShardLock).
+  bool trylock_shard( unsigned shard, uint64_t owner, LockWaiter *waiter = nullptr );
+  void stop_waiting_for_shard( unsigned shard, LockWaiter *waiter );
+  void get_shard_holders( unsigned shard, uint64_t self, std::vector<uint64_t> &holders );
+
+  // Shared locking, by a transaction which only reads the shard (see
+  // ShardLock). A transaction's shared lock can be upgraded to an
+  // exclusive one, if no other transaction shares it.
+  bool trylock_shard_shared( unsigned shard, uint64_t owner, LockWaiter *waiter = nullptr );
+  bool upgrade_shard_lock( unsigned shard, uint64_t owner, LockWaiter *waiter = nullptr );
+  void unlock_shard_shared( unsigned shard, uint64_t owner );
+
+  // Whether a transaction reading the shard should lock it exclusively
+  // straight away, as such reads are usually followed by writes, and
+  // recording whether a transaction's read was (see ShardLock)
+  bool expects_write_after_read( unsigned shard ) const { return m_shards[shard].lock.expects_write_after_read(); }
+  void note_read( unsigned shard, bool then_written ) { m_shards[shard].lock.note_read(then_written); }
+
+  // Note: these functions should only be called while the lock of
+  // the key's shard (or of the given shard) is held! get() and
+  // has_key() see the latest committed values; a shared lock is
+  // enough for them. Uncommitted changes are kept by their writer
+  // (see WriteSet), so a read probes the shard's versions alone.
   bool has_key( const std::string &key );
   std::string get( const std::string &key );
-  void commit_changes();
-  void rollback_changes();
+
+  // Install a shard's writes (all to keys in the shard) as versions
+  // with the given timestamp, which must be from
+  // CommitClock::begin_commit(), adding them to the commit's log record
+  // (if any, and if commits are logged). Requires the exclusive lock.
+  // The keys and values are moved out of writes rather than copied,
+  // and writes is left empty.
+  void commit_changes( unsigned shard, FlatHashMap<std::string> &writes, uint64_t ts, WalRecord *record = nullptr );
+
+  // Read the key's value in the latest snapshot. Doesn't require
+  // the shard's lock.
+  std::string get_snapshot( const std::string &key );
+
+  // Like get_snapshot(), but also returns the timestamp of the version
+  // read, and returns false rather than throwing if the key isn't present
+  bool read_snapshot( const std::string &key, std::string &value, uint64_t &ts );
+
+  // Read the key's value in a snapshot pinned with
+  // CommitClock::pin_snapshot(). Doesn't require the shard's lock.
+  std::string get_snapshot( const std::string &key, uint64_t snapshot );
+
+  // Timestamp of the key's latest committed version (0 if none)
+  uint64_t latest_ts( const std::string &key );
+
+  // Install a committed version recovered from the log, replacing the
+  // key's versions. Takes no locks: only for use while the table isn't
+  // yet shared, and by one thread per shard.
+  void recover( std::string_view key, std::string_view value, uint64_t ts );
+
+  // Call f(key, value) for each key's version in the snapshot at ts
+  // (in no particular order). Takes no locks: only for use while no
+  // commit can be installing versions (e.g. in a child forked while
+  // commits were blocked).
+  void scan_snapshot( uint64_t ts, const std::function<void(std::string_view, std::string_view)> &f );
+
+  // Hold off the storage engine's changes (while commits are held off
+  // by CommitClock::freeze()), so that a child forked in between can
+  // scan_snapshot() a consistent table
+  void prepare_fork();
+  void after_fork();
 };
 
 #endif // TABLE_H
@@ -0,0 +1,322 @@
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "checksum.h"
+#include "exceptions.h"
+#include "table_file.h"
+
+namespace {
+
+uint64_t get_uint(const char *p, int nbytes) {
+  uint64_t val = 0;
+  for (int i = nbytes - 1; i >= 0; i--) {
+    val = (val << 8) | (unsigned char) p[i];
+  }
+  return val;
+}
+
+void append_uint(std::string &buf, uint64_t val, int nbytes) {
+  for (int i = 0; i < nbytes; i++) {
+    buf += char(val >> (8 * i));
+  }
+}
+
+// Read one entry from the front of a block. Returns false if the
+// entry is malformed.
+bool next_entry(std::string_view &block, std::string_view &key, std::string_view &value) {
+  if (block.size() < 4) {
+    return false;
+  }
+  uint64_t len = get_uint(block.data(), 4);
+  if (block.size() - 4 < len + 4) {
+    return false;
+  }
+  key = block.substr(4, len);
+  block.remove_prefix(4 + len);
+  len = get_uint(block.data(), 4);
+  if (block.size() - 4 < len) {
+    return false;
+  }
+  value = block.substr(4, len);
+  block.remove_prefix(4 + len);
+  return true;
+}
+
+}
+
+////////////////////////////////////////////////////////////////////////
+// TableFile
+////////////////////////////////////////////////////////////////////////
+
+TableFile::TableFile( std::string_view data )
+  : m_data( data )
+  , m_num_keys( 0 )
+  , m_num_blocks( 0 )
+{
+  if (data.size() < FOOTER_LEN) {
+    throw CommException("Table file is truncated");
+  }
+  const char *footer = data.data() + data.size() - FOOTER_LEN;
+  m_num_keys = get_uint(footer, 8);
+  uint64_t index_offset = get_uint(footer + 8, 8);
+  m_num_blocks = uint32_t(get_uint(footer + 16, 4));
+  uint32_t index_crc = uint32_t(get_uint(footer + 20, 4));
+
+  uint64_t index_len = uint64_t(m_num_blocks) * INDEX_ENTRY_LEN;
+  if (index_offset > data.size() - FOOTER_LEN || data.size() - FOOTER_LEN - index_offset != index_len) {
+    throw CommException("Table file is corrupted");
+  }
+  m_index = data.substr(index_offset, index_len);
+  if (crc32(m_index.data(), m_index.size()) != index_crc) {
+    throw CommException("Table file is corrupted");
+  }
+  for (uint32_t i = 0; i < m_num_blocks; i++) {
+    const char *entry = m_index.data() + i * INDEX_ENTRY_LEN;
+    uint64_t offset = get_uint(entry, 8), len = get_uint(entry + 8, 4);
+    if (offset > index_offset || index_offset - offset < len || len < 8) {
+      throw CommException("Table file is corrupted");
+    }
+  }
+  m_verified = std::vector<std::atomic<bool>>(m_num_blocks);
+}
+
+TableFile::~TableFile()
+{
+}
+
+// The block's data, verifying its checksum if it hasn't been yet
+std::string_view TableFile::block( uint32_t i ) const
+{
+  const char *entry = m_index.data() + i * INDEX_ENTRY_LEN;
+  std::string_view data = m_data.substr(get_uint(entry, 8), get_uint(entry + 8, 4));
+  if (!m_verified[i].load(std::memory_order_relaxed)) {
+    if (crc32(data.data(), data.size()) != uint32_t(get_uint(entry + 12, 4))) {
+      throw OperationException("Table file block is corrupted. ");
+    }
+    // Racing threads may both verify the block, which is harmless
+    m_verified[i].store(true, std::memory_order_relaxed);
+  }
+  return data;
+}
+
+// The block's first key (not verified by the checksum, which is only
+// used to choose a block)
+std::string_view TableFile::first_key( uint32_t i ) const
+{
+  const char *entry = m_index.data() + i * INDEX_ENTRY_LEN;
+  std::string_view data = m_data.substr(get_uint(entry, 8), get_uint(entry + 8, 4));
+  uint64_t len = get_uint(data.data(), 4);
+  return data.substr(4, len);
+}
+
+bool TableFile::find( std::string_view key, std::string_view &value ) const
+{
+  // Find the last block whose first key is <= key
+  uint32_t lo = 0, hi = m_num_blocks;
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if (first_key(mid) <= key) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo == 0) {
+    return false;
+  }
+
+  std::string_view data = block(lo - 1), entry_key;
+  while (!data.empty()) {
+    if (!next_entry(data, entry_key, value)) {
+      throw OperationException("Table file block is corrupted. ");
+    }
+    if (entry_key == key) {
+      return true;
+    }
+    if (entry_key > key) {
+      break;
+    }
+  }
+  return false;
+}
+
+void TableFile::for_each( const std::function<void(std::string_view, std::string_view)> &f ) const
+{
+  for (uint32_t i = 0; i < m_num_blocks; i++) {
+    std::string_view data = block(i), key, value;
+    while (!data.empty()) {
+      if (!next_entry(data, key, value)) {
+        throw OperationException("Table file block is corrupted. ");
+      }
+      f(key, value);
+    }
+  }
+}
+
+TableFile::Iterator::Iterator( const TableFile &file )
+  : m_file( file )
+  , m_next_block( 0 )
+  , m_valid( false )
+{
+  next();
+}
+
+void TableFile::Iterator::next()
+{
+  while (m_rest.empty()) {
+    if (m_next_block == m_file.m_num_blocks) {
+      m_valid = false;
+      return;
+    }
+    m_rest = m_file.block(m_next_block++);
+  }
+  if (!next_entry(m_rest, m_key, m_value)) {
+    throw OperationException("Table file block is corrupted. ");
+  }
+  m_valid = true;
+}
+
+////////////////////////////////////////////////////////////////////////
+// FileWriter
+////////////////////////////////////////////////////////////////////////
+
+FileWriter::FileWriter( int fd )
+  : m_fd( fd )
+  , m_offset( 0 )
+  , m_ok( true )
+{
+  m_buf.reserve(BUFFER_SIZE);
+}
+
+FileWriter::~FileWriter()
+{
+}
+
+void FileWriter::put( const char *data, size_t len )
+{
+  m_buf.append(data, len);
+  m_offset += len;
+  if (m_buf.size() >= BUFFER_SIZE) {
+    flush();
+  }
+}
+
+void FileWriter::put_uint( uint64_t val, int nbytes )
+{
+  char bytes[8];
+  for (int i = 0; i < nbytes; i++) {
+    bytes[i] = char(val >> (8 * i));
+  }
+  put(bytes, nbytes);
+}
+
+bool FileWriter::flush()
+{
+  const char *p = m_buf.data();
+  size_t len = m_buf.size();
+  while (m_ok && len > 0) {
+    ssize_t n = write(m_fd, p, len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      m_ok = false;
+      break;
+    }
+    p += n;
+    len -= size_t(n);
+  }
+  m_buf.clear();
+  return m_ok;
+}
+
+////////////////////////////////////////////////////////////////////////
+// TableFileBuilder
+////////////////////////////////////////////////////////////////////////
+
+TableFileBuilder::TableFileBuilder( FileWriter &out )
+  : m_out( out )
+  , m_start( out.get_offset() )
+  , m_num_keys( 0 )
+  , m_num_blocks( 0 )
+{
+}
+
+TableFileBuilder::~TableFileBuilder()
+{
+}
+
+void TableFileBuilder::add( std::string_view key, std::string_view value )
+{
+  append_uint(m_block, key.size(), 4);
+  m_block += key;
+  append_uint(m_block, value.size(), 4);
+  m_block += value;
+  m_num_keys++;
+  if (m_block.size() >= TableFile::BLOCK_SIZE) {
+    finish_block();
+  }
+}
+
+void TableFileBuilder::finish_block()
+{
+  append_uint(m_index, m_out.get_offset() - m_start, 8);
+  append_uint(m_index, m_block.size(), 4);
+  append_uint(m_index, crc32(m_block.data(), m_block.size()), 4);
+  m_out.put(m_block);
+  m_block.clear();
+  m_num_blocks++;
+}
+
+uint64_t TableFileBuilder::finish()
+{
+  if (!m_block.empty()) {
+    finish_block();
+  }
+  uint64_t index_offset = m_out.get_offset() - m_start;
+  m_out.put(m_index);
+  m_out.put_uint(m_num_keys, 8);
+  m_out.put_uint(index_offset, 8);
+  m_out.put_uint(m_num_blocks, 4);
+  m_out.put_uint(crc32(m_index.data(), m_index.size()), 4);
+  return m_out.get_offset() - m_start;
+}
+
+////////////////////////////////////////////////////////////////////////
+// MappedFile
+////////////////////////////////////////////////////////////////////////
+
+MappedFile::MappedFile( const std::string &path )
+  : m_addr( nullptr )
+  , m_len( 0 )
+{
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    throw CommException("Could not open " + path + ": " + strerror(errno));
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    throw CommException("Could not read " + path);
+  }
+  m_len = size_t(st.st_size);
+  if (m_len > 0) {
+    m_addr = mmap(nullptr, m_len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (m_addr == MAP_FAILED) {
+      int err = errno;
+      close(fd);
+      throw CommException("Could not map " + path + ": " + strerror(err));
+    }
+  }
+  close(fd);
+}
+
+MappedFile::~MappedFile()
+{
+  if (m_addr != nullptr) {
+    munmap(m_addr, m_len);
+  }
+}
@@ -0,0 +1,153 @@
+#ifndef TABLE_FILE_H
+#define TABLE_FILE_H
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Immutable on-disk table, meant to be read in place from a memory
+// mapping (lookups return views into the mapped data, and opening one
+// reads only its footer). The entries are sorted by key and packed
+// into blocks of about BLOCK_SIZE bytes:
+//
+//   blocks   each entry: u32 length, key, u32 length, value
+//   index    each block: u64 offset, u32 length, u32 CRC-32 of the block
+//   footer   u64 number of keys, u64 index offset, u32 number of blocks,
+//            u32 CRC-32 of the index
+//
+// with all integers little endian and offsets relative to the start
+// of the table file. A lookup binary searches the index by the first
+// key of each block, then scans one block. Each block's checksum is
+// verified the first time it is read.
+class TableFile {
+public:
+  static const size_t BLOCK_SIZE = 4096;
+  static const size_t INDEX_ENTRY_LEN = 16;
+  static const size_t FOOTER_LEN = 24;
+
+private:
+  std::string_view m_data;
+  std::string_view m_index;
+  uint64_t m_num_keys;
+  uint32_t m_num_blocks;
+  mutable std::vector<std::atomic<bool>> m_verified; // blocks whose checksum is verified
+
+  // copy constructor and assignment operator are prohibited
+  TableFile( const TableFile & );
+  TableFile &operator=( const TableFile & );
+
+  std::string_view block( uint32_t i ) const;
+  std::string_view first_key( uint32_t i ) const;
+
+public:
+  // data must outlive the TableFile. Throws CommException if its
+  // footer or index is corrupted.
+  TableFile( std::string_view data );
+  ~TableFile();
+
+  uint64_t get_num_keys() const { return m_num_keys; }
+
+  // Find key's value (a view into the table file). Throws
+  // OperationException if the block it would be in is corrupted.
+  bool find( std::string_view key, std::string_view &value ) const;
+
+  // Call f(key, value) for each entry, in key order
+  void for_each( const std::function<void(std::string_view, std::string_view)> &f ) const;
+
+  // Iterates over the entries in key order (e.g. to merge table files)
+  class Iterator {
+  private:
+    const TableFile &m_file;
+    uint32_t m_next_block;
+    std::string_view m_rest; // the unread part of the current block
+    std::string_view m_key;
+    std::string_view m_value;
+    bool m_valid;
+
+  public:
+    Iterator( const TableFile &file );
+
+    bool valid() const { return m_valid; }
+    std::string_view key() const { return m_key; }
+    std::string_view value() const { return m_value; }
+    void next();
+  };
+};
+
+// Buffered output to a file descriptor, keeping track of the offset
+class FileWriter {
+private:
+  static const size_t BUFFER_SIZE = 1 << 20;
+
+  int m_fd;
+  std::string m_buf;
+  uint64_t m_offset;
+  bool m_ok;
+
+  // copy constructor and assignment operator are prohibited
+  FileWriter( const FileWriter & );
+  FileWriter &operator=( const FileWriter & );
+
+public:
+  FileWriter( int fd );
+  ~FileWriter();
+
+  void put( const char *data, size_t len );
+  void put( std::string_view str ) { put(str.data(), str.size()); }
+  void put_uint( uint64_t val, int nbytes );
+
+  uint64_t get_offset() const { return m_offset; }
+
+  // Write out everything buffered. Returns false (with errno set) if
+  // this or any earlier write failed.
+  bool flush();
+};
+
+// Writes a TableFile. Entries must be added in increasing key order.
+class TableFileBuilder {
+private:
+  FileWriter &m_out;
+  uint64_t m_start;
+  std::string m_block;
+  std::string m_index;
+  uint64_t m_num_keys;
+  uint32_t m_num_blocks;
+
+  // copy constructor and assignment operator are prohibited
+  TableFileBuilder( const TableFileBuilder & );
+  TableFileBuilder &operator=( const TableFileBuilder & );
+
+  void finish_block();
+
+public:
+  TableFileBuilder( FileWriter &out );
+  ~TableFileBuilder();
+
+  void add( std::string_view key, std::string_view value );
+
+  // Write the index and footer, and return the table file's length
+  uint64_t finish();
+};
+
+// A read-only memory mapping of a whole file
+class MappedFile {
+private:
+  void *m_addr;
+  size_t m_len;
+
+  // copy constructor and assignment operator are prohibited
+  MappedFile( const MappedFile & );
+  MappedFile &operator=( const MappedFile & );
+
+public:
+  // Throws CommException if the file can't be opened or mapped
+  MappedFile( const std::string &path );
+  ~MappedFile();
+
+  std::string_view get_data() const { return std::string_view(static_cast<const char *>(m_addr), m_len); }
+};
+
+#endif // TABLE_FILE_H
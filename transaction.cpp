@@ -0,0 +1,126 @@
+#include "commit_clock.h"
+#include "exceptions.h"
+#include "shard_lock.h"
+#include "table.h"
+#include "transaction.h"
+
+Transaction::Transaction()
+  : m_waiter( nullptr )
+  , m_wait_table( nullptr )
+  , m_wait_shard( 0 )
+  , m_commit_lsn( 0 )
+{
+}
+
+Transaction::~Transaction()
+{
+  wait_for_shard(nullptr, 0);
+}
+
+void Transaction::clear()
+{
+  m_reads.clear();
+  m_writes.clear();
+  wait_for_shard(nullptr, 0);
+}
+
+// Note which shard's lock (if any: table null) the commit now waits
+// for, no longer waiting for any other
+void Transaction::wait_for_shard( Table *table, unsigned shard )
+{
+  if (m_wait_table != nullptr && (m_wait_table != table || m_wait_shard != shard)) {
+    m_wait_table->stop_waiting_for_shard(m_wait_shard, m_waiter);
+  }
+  m_wait_table = table;
+  m_wait_shard = shard;
+}
+
+std::string Transaction::get( Table *table, const std::string &key )
+{
+  // Read our own writes
+  std::string *written = m_writes.find(table, key);
+  if (written != nullptr) {
+    return *written;
+  }
+
+  std::string value;
+  uint64_t ts = 0;
+  bool found = table->read_snapshot(key, value, ts);
+  m_reads.push_back(Read{ table, key, ts });
+  if (!found) {
+    throw OperationException("Key not found: " + key);
+  }
+  return value;
+}
+
+void Transaction::set( Table *table, const std::string &key, std::string value )
+{
+  m_writes.set(table, key, std::move(value));
+}
+
+// Try to lock the shards of all of the writes. Blocking isn't
+// necessary (a failed commit is retried), so there's no lock
+// ordering to worry about.
+bool Transaction::lock_write_shards()
+{
+  m_locked.clear();
+  bool locked = true;
+  m_writes.for_each_shard([this, &locked](Table *table, unsigned shard) {
+    if (!locked) {
+      return;
+    }
+    if (table->trylock_shard(shard, 0, m_waiter)) {
+      m_locked.push_back(std::make_pair(table, shard));
+    } else {
+      wait_for_shard(table, shard);
+      locked = false;
+    }
+  });
+  if (!locked) {
+    unlock_write_shards();
+    return false;
+  }
+  wait_for_shard(nullptr, 0);
+  return true;
+}
+
+void Transaction::unlock_write_shards()
+{
+  for (const std::pair<Table*, unsigned> &shard : m_locked) {
+    shard.first->unlock_shard(shard.second);
+  }
+  m_locked.clear();
+}
+
+bool Transaction::commit( LockWaiter *waiter )
+{
+  if (waiter != m_waiter) {
+    wait_for_shard(nullptr, 0);
+    m_waiter = waiter;
+  }
+  if (!lock_write_shards()) {
+    return false;
+  }
+
+  // Validate once every earlier commit has been installed. A later one
+  // may install a newer version meanwhile, which only fails the
+  // validation needlessly; this commit's writes are locked.
+  uint64_t ts = CommitClock::begin_commit();
+  m_record.begin_commit(ts);
+  CommitClock::wait_for_earlier(ts);
+  for (const Read &read : m_reads) {
+    if (read.table->latest_ts(read.key) != read.ts) {
+      CommitClock::cancel_commit(ts);
+      unlock_write_shards();
+      clear();
+      throw FailedTransaction("Transaction conflicted with a concurrent update. ");
+    }
+  }
+
+  m_writes.commit(ts, &m_record);
+  m_commit_lsn = CommitClock::end_commit(ts, m_record);
+
+  unlock_write_shards();
+  clear();
+  return true;
+}
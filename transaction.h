@@ -0,0 +1,70 @@
+#ifndef TRANSACTION_H
+#define TRANSACTION_H
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+#include "wal.h"
+#include "write_set.h"
+
+class Table; // forward declaration
+class LockWaiter; // forward declaration
+
+// An optimistic transaction. Reads see the latest snapshot, and record
+// the version they read; writes are buffered in the transaction. At
+// commit, the reads are validated (no key that was read has been
+// changed since) and the writes are installed as a single commit, so
+// shard locks are only held for the duration of the commit itself.
+class Transaction {
+private:
+  struct Read {
+    Table *table;
+    std::string key;
+    uint64_t ts; // version read (0 if the key wasn't present)
+  };
+
+  std::vector<Read> m_reads;
+  WriteSet m_writes;
+  std::vector<std::pair<Table*, unsigned>> m_locked; // during commit
+  LockWaiter *m_waiter;   // the commit's waiter, waiting for this
+  Table *m_wait_table;    // table's shard lock (see ShardLock), if
+  unsigned m_wait_shard;  // m_wait_table isn't null
+  WalRecord m_record;
+  uint64_t m_commit_lsn;
+
+  // copy constructor and assignment operator are prohibited
+  Transaction( const Transaction & );
+  Transaction &operator=( const Transaction & );
+
+  bool lock_write_shards();
+  void unlock_write_shards();
+  void wait_for_shard( Table *table, unsigned shard );
+
+public:
+  Transaction();
+  ~Transaction();
+
+  bool empty() const { return m_reads.empty() && m_writes.empty(); }
+
+  // Discard the reads and writes (and stop waiting for a lock)
+  void clear();
+
+  // The key's value as seen by the transaction.
+  // Throws OperationException if the key isn't present.
+  std::string get( Table *table, const std::string &key );
+  void set( Table *table, const std::string &key, std::string value );
+
+  // Validate the transaction and install its writes. Returns false
+  // (without changing anything) if some of the shards it writes are
+  // locked, in which case the commit should be retried when waiter
+  // (if not null) is told to, as it waits for the first of them.
+  // Throws FailedTransaction if validation fails; either way, the
+  // transaction is cleared if commit() doesn't return false.
+  bool commit( LockWaiter *waiter = nullptr );
+
+  // LSN of the last successful commit (see CommitClock::end_commit())
+  uint64_t get_commit_lsn() const { return m_commit_lsn; }
+};
+
+#endif // TRANSACTION_H
@@ -2,11 +2,32 @@
 
 #include "message.h"
 #include "message_serialization.h"
+#include "binary_serialization.h"
 #include "table.h"
+#include "table_file.h"
+#include "commit_clock.h"
+#include "recovery.h"
+#include "snapshot.h"
+#include "transaction.h"
+#include "wal.h"
+#include "write_set.h"
+#include "io_uring.h"
+#include "flat_hash_map.h"
+#include "catalog.h"
+#include "deadlock_detector.h"
+#include "lsm_storage.h"
 #include "value_stack.h"
+#include "value.h"
 #include "exceptions.h"
 #include "tctest.h"
 #include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 struct TestObjs
 {
@@ -68,26 +89,50 @@ struct TestObjs
 TestObjs *setup();
 void cleanup( TestObjs *objs );
 
-// Guard object to ensure that Table is locked and unlocked
-// in unit tests. This could be used to manage locking and
-// unlocking a Table when autocommit (no multi-table transactions)
-// is desired.
+// Guard object to ensure that the shards of a Table holding the given
+// keys are locked and unlocked in unit tests. This could be used to
+// manage locking and unlocking when autocommit (no multi-table
+// transactions) is desired. The shards are locked in order, as by
+// clients locking several.
 class TableGuard {
 public:
   Table *m_table;
+  std::vector<unsigned> m_shards;
 
-  TableGuard( Table *table )
+  TableGuard( Table *table, const std::vector<std::string> &keys )
     : m_table( table )
   {
-    m_table->lock();
+    for ( const std::string &key : keys ) {
+      m_shards.push_back( Table::shard_of( key ) );
+    }
+    std::sort( m_shards.begin(), m_shards.end() );
+    m_shards.erase( std::unique( m_shards.begin(), m_shards.end() ), m_shards.end() );
+    for ( unsigned shard : m_shards ) {
+      m_table->lock_shard( shard );
+    }
   }
 
   ~TableGuard()
   {
-    m_table->unlock();
+    for ( unsigned shard : m_shards ) {
+      m_table->unlock_shard( shard );
+    }
   }
 };
 
+// A shard lock waiter which counts the times it is told to retry
+class CountingWaiter : public LockWaiter {
+public:
+  int m_wakeups;
+
+  CountingWaiter()
+    : m_wakeups( 0 )
+  {
+  }
+
+  void lock_released() { m_wakeups++; }
+};
+
 // Prototypes of test functions
 void test_message_default_ctor( TestObjs *objs );
 void test_message_get_message_type( TestObjs *objs );
@@ -101,13 +146,35 @@ void test_message_serialization_encode_long( TestObjs *objs );
 void test_message_serialization_encode_too_long( TestObjs *objs );
 void test_message_serialization_decode( TestObjs *objs );
 void test_message_serialization_decode_invalid( TestObjs *objs );
+void test_message_serialization_decode_reuse( TestObjs *objs );
+void test_message_serialization_encode_frames( TestObjs *objs );
+void test_binary_serialization_round_trip( TestObjs *objs );
+void test_binary_serialization_invalid( TestObjs *objs );
+void test_multi_key_serialization( TestObjs *objs );
+void test_counter_serialization( TestObjs *objs );
 void test_table_has_key( TestObjs *objs );
 void test_table_get( TestObjs *objs );
 void test_table_commit_changes( TestObjs *objs );
 void test_table_rollback_changes( TestObjs *objs );
 void test_table_commit_and_rollback( TestObjs *objs );
+void test_table_shard_locks( TestObjs *objs );
+void test_deadlock_detector( TestObjs *objs );
+void test_table_shared_locks( TestObjs *objs );
+void test_table_snapshot_reads( TestObjs *objs );
+void test_table_pinned_snapshots( TestObjs *objs );
+void test_transaction_optimistic( TestObjs *objs );
+void test_flat_hash_map( TestObjs *objs );
+void test_catalog( TestObjs *objs );
+void test_wal_records( TestObjs *objs );
+void test_wal_io_uring( TestObjs *objs );
+void test_recovery_parallel_replay( TestObjs *objs );
+void test_table_file( TestObjs *objs );
+void test_snapshot_write_load( TestObjs *objs );
+void test_snapshot_log_rotation( TestObjs *objs );
+void test_lsm_storage( TestObjs *objs );
 void test_value_stack( TestObjs *objs );
 void test_value_stack_exceptions( TestObjs *objs );
+void test_value_arithmetic( TestObjs *objs );
 
 int main(int argc, char **argv)
 {
@@ -129,13 +196,35 @@ int main(int argc, char **argv)
   TEST( test_message_serialization_encode_too_long );
   TEST( test_message_serialization_decode );
   TEST( test_message_serialization_decode_invalid );
+  TEST( test_message_serialization_decode_reuse );
+  TEST( test_message_serialization_encode_frames );
+  TEST( test_binary_serialization_round_trip );
+  TEST( test_binary_serialization_invalid );
+  TEST( test_multi_key_serialization );
+  TEST( test_counter_serialization );
   TEST( test_table_has_key );
   TEST( test_table_get );
   TEST( test_table_commit_changes );
   TEST( test_table_rollback_changes );
   TEST( test_table_commit_and_rollback );
+  TEST( test_table_shard_locks );
+  TEST( test_deadlock_detector );
+  TEST( test_table_shared_locks );
+  TEST( test_table_snapshot_reads );
+  TEST( test_table_pinned_snapshots );
+  TEST( test_transaction_optimistic );
+  TEST( test_flat_hash_map );
+  TEST( test_catalog );
+  TEST( test_wal_records );
+  TEST( test_wal_io_uring );
+  TEST( test_recovery_parallel_replay );
+  TEST( test_table_file );
+  TEST( test_snapshot_write_load );
+  TEST( test_snapshot_log_rotation );
+  TEST( test_lsm_storage );
   TEST( test_value_stack );
   TEST( test_value_stack_exceptions );
+  TEST( test_value_arithmetic );
 
   TEST_FINI();
 }
@@ -296,6 +385,13 @@ void test_message_is_valid( TestObjs *objs )
   ASSERT( !objs->invalid_login_req.is_valid() );
   ASSERT( !objs->invalid_create_req.is_valid() );
   ASSERT( !objs->invalid_data_resp.is_valid() );
+
+  // Identifiers are limited in length (the binary protocol could
+  // otherwise carry names too long for the log's 16-bit lengths)
+  std::string longest( Message::MAX_IDENTIFIER_LEN, 'a' );
+  ASSERT( Message( MessageType::CREATE, { longest } ).is_valid() );
+  ASSERT( !Message( MessageType::CREATE, { longest + "a" } ).is_valid() );
+  ASSERT( !Message( MessageType::SET, { "t", longest + "a" } ).is_valid() );
 }
 
 void test_message_serialization_encode( TestObjs *objs )
@@ -399,112 +495,168 @@ void test_message_serialization_decode_invalid( TestObjs *objs )
   }
 }
 
+// Decoding into the same Message object repeatedly (as the server does)
+// must not leave anything behind from earlier messages
+void test_message_serialization_decode_reuse( TestObjs *objs )
+{
+  Message msg;
+
+  MessageSerialization::decode( objs->encoded_get_req, msg );
+  ASSERT( 2 == msg.get_num_args() );
+
+  MessageSerialization::decode( "PUSH   7\n", msg );
+  ASSERT( MessageType::PUSH == msg.get_message_type() );
+  ASSERT( 1 == msg.get_num_args() );
+  ASSERT( "7" == msg.get_value() );
+
+  MessageSerialization::decode( "\tSET  t1 \t k1 \r\n", msg );
+  ASSERT( MessageType::SET == msg.get_message_type() );
+  ASSERT( 2 == msg.get_num_args() );
+  ASSERT( "t1" == msg.get_table() );
+  ASSERT( "k1" == msg.get_key() );
+
+  MessageSerialization::decode( "ADD\n", msg );
+  ASSERT( MessageType::ADD == msg.get_message_type() );
+  ASSERT( 0 == msg.get_num_args() );
+
+  MessageSerialization::decode( "FAILED \"not  so\tfast\"\n", msg );
+  ASSERT( MessageType::FAILED == msg.get_message_type() );
+  ASSERT( "not so fast" == msg.get_quoted_text() );
+
+  // Only a prefix of the buffer is decoded
+  std::string buf = "GET t2 k2\nPUSH 99\n";
+  MessageSerialization::decode( std::string_view( buf ).substr( 0, 10 ), msg );
+  ASSERT( MessageType::GET == msg.get_message_type() );
+  ASSERT( "k2" == msg.get_key() );
+
+  const char *invalid[] = { "\n", "   \n", "SETX t k\n", "set t k\n", "GET t\n", "PUSH 1 2\n" };
+  for ( const char *s : invalid ) {
+    try {
+      MessageSerialization::decode( s, msg );
+      FAIL( "No exception thrown decoding invalid message" );
+    } catch ( InvalidMessage &ex ) {
+      // Good
+    }
+  }
+}
+
 void test_table_has_key( TestObjs *objs )
 {
+  WriteSet writes;
+
   {
-    TableGuard g( objs->invoices ); // ensure table is locked and unlocked
+    TableGuard g( objs->invoices, { "abc123", "xyz456", "nonexistent" } ); // ensure shards are locked and unlocked
 
-    objs->invoices->set( "abc123", "1000" );
-    objs->invoices->set( "xyz456", "1318" );
+    writes.set( objs->invoices, "abc123", "1000" );
+    writes.set( objs->invoices, "xyz456", "1318" );
   }
 
   {
-    TableGuard g( objs->invoices ); // ensure table is locked and unlocked
+    TableGuard g( objs->invoices, { "abc123", "xyz456", "nonexistent" } ); // ensure shards are locked and unlocked
 
     // Changes should be visible even though we haven't committed them
-    ASSERT( objs->invoices->has_key( "abc123" ) );
-    ASSERT( objs->invoices->has_key( "xyz456" ) );
+    ASSERT( writes.has_key( objs->invoices, "abc123" ) );
+    ASSERT( writes.has_key( objs->invoices, "xyz456" ) );
+
+    ASSERT( !writes.has_key( objs->invoices, "nonexistent" ) );
 
-    ASSERT( !objs->invoices->has_key( "nonexistent" ) );
+    // ...but only to the writer: the table holds committed values only
+    ASSERT( !objs->invoices->has_key( "abc123" ) );
   }
 }
 
 void test_table_get( TestObjs *objs )
 {
+  WriteSet writes;
+
   {
-    TableGuard g( objs->invoices ); // ensure table is locked and unlocked
+    TableGuard g( objs->invoices, { "abc123", "xyz456", "nonexistent" } ); // ensure shards are locked and unlocked
 
-    objs->invoices->set( "abc123", "1000" );
-    objs->invoices->set( "xyz456", "1318" );
+    writes.set( objs->invoices, "abc123", "1000" );
+    writes.set( objs->invoices, "xyz456", "1318" );
   }
 
   {
-    TableGuard g( objs->invoices ); // ensure table is locked and unlocked
+    TableGuard g( objs->invoices, { "abc123", "xyz456", "nonexistent" } ); // ensure shards are locked and unlocked
 
     // Changes should be visible even though we haven't committed them
-    ASSERT( "1000" == objs->invoices->get( "abc123" ) );
-    ASSERT( "1318" == objs->invoices->get( "xyz456" ) );
+    ASSERT( "1000" == writes.get( objs->invoices, "abc123" ) );
+    ASSERT( "1318" == writes.get( objs->invoices, "xyz456" ) );
 
-    ASSERT( !objs->invoices->has_key( "nonexistent" ) );
+    ASSERT( !writes.has_key( objs->invoices, "nonexistent" ) );
   }
 }
 
 void test_table_commit_changes( TestObjs *objs )
 {
+  WriteSet writes;
+
   {
-    TableGuard g( objs->invoices ); // ensure table is locked and unlocked
+    TableGuard g( objs->invoices, { "abc123", "xyz456", "nonexistent" } ); // ensure shards are locked and unlocked
 
-    objs->invoices->set( "abc123", "1000" );
-    objs->invoices->set( "xyz456", "1318" );
+    writes.set( objs->invoices, "abc123", "1000" );
+    writes.set( objs->invoices, "xyz456", "1318" );
   }
 
   {
-    TableGuard g( objs->invoices ); // ensure table is locked and unlocked
+    TableGuard g( objs->invoices, { "abc123", "xyz456", "nonexistent" } ); // ensure shards are locked and unlocked
 
     // Changes should be visible even though we haven't committed them
-    ASSERT( "1000" == objs->invoices->get( "abc123" ) );
-    ASSERT( "1318" == objs->invoices->get( "xyz456" ) );
+    ASSERT( "1000" == writes.get( objs->invoices, "abc123" ) );
+    ASSERT( "1318" == writes.get( objs->invoices, "xyz456" ) );
 
-    ASSERT( !objs->invoices->has_key( "nonexistent" ) );
+    ASSERT( !writes.has_key( objs->invoices, "nonexistent" ) );
   }
 
   {
-    TableGuard g( objs->invoices ); // ensure table is locked and unlocked
+    TableGuard g( objs->invoices, { "abc123", "xyz456", "nonexistent" } ); // ensure shards are locked and unlocked
 
     // Commit changes
-    objs->invoices->commit_changes();
+    writes.commit();
 
     // Changes should still be visible
-    ASSERT( "1000" == objs->invoices->get( "abc123" ) );
-    ASSERT( "1318" == objs->invoices->get( "xyz456" ) );
+    ASSERT( "1000" == writes.get( objs->invoices, "abc123" ) );
+    ASSERT( "1318" == writes.get( objs->invoices, "xyz456" ) );
 
-    ASSERT( !objs->invoices->has_key( "nonexistent" ) );
+    ASSERT( !writes.has_key( objs->invoices, "nonexistent" ) );
   }
 }
 
 void test_table_rollback_changes( TestObjs *objs )
 {
+  WriteSet writes;
+
   {
-    TableGuard g( objs->invoices ); // ensure table is locked and unlocked
+    TableGuard g( objs->invoices, { "abc123", "xyz456", "nonexistent" } ); // ensure shards are locked and unlocked
 
-    objs->invoices->set( "abc123", "1000" );
-    objs->invoices->set( "xyz456", "1318" );
+    writes.set( objs->invoices, "abc123", "1000" );
+    writes.set( objs->invoices, "xyz456", "1318" );
   }
 
   {
-    TableGuard g( objs->invoices ); // ensure table is locked and unlocked
+    TableGuard g( objs->invoices, { "abc123", "xyz456", "nonexistent" } ); // ensure shards are locked and unlocked
 
     // Changes should be visible even though we haven't committed them
-    ASSERT( "1000" == objs->invoices->get( "abc123" ) );
-    ASSERT( "1318" == objs->invoices->get( "xyz456" ) );
+    ASSERT( "1000" == writes.get( objs->invoices, "abc123" ) );
+    ASSERT( "1318" == writes.get( objs->invoices, "xyz456" ) );
 
-    ASSERT( !objs->invoices->has_key( "nonexistent" ) );
+    ASSERT( !writes.has_key( objs->invoices, "nonexistent" ) );
   }
 
   {
-    TableGuard g( objs->invoices ); // ensure table is locked and unlocked
+    TableGuard g( objs->invoices, { "abc123", "xyz456", "nonexistent" } ); // ensure shards are locked and unlocked
 
     // Rollback changes
-    objs->invoices->rollback_changes();
+    writes.clear();
   }
 
   {
-    TableGuard g( objs->invoices ); // ensure table is locked and unlocked
+    TableGuard g( objs->invoices, { "abc123", "xyz456", "nonexistent" } ); // ensure shards are locked and unlocked
 
     // Table should be empty again!
-    ASSERT( !objs->invoices->has_key( "abc123" ) );
-    ASSERT( !objs->invoices->has_key( "xyz456" ) );
-    ASSERT( !objs->invoices->has_key( "nonexistent" ) );
+    ASSERT( !writes.has_key( objs->invoices, "abc123" ) );
+    ASSERT( !writes.has_key( objs->invoices, "xyz456" ) );
+    ASSERT( !writes.has_key( objs->invoices, "nonexistent" ) );
   }
 }
 
@@ -513,60 +665,62 @@ void test_table_rollback_changes( TestObjs *objs )
 // there.
 void test_table_commit_and_rollback( TestObjs *objs )
 {
+  WriteSet writes;
+
   // Add some data
   {
-    TableGuard g( objs->line_items );
+    TableGuard g( objs->line_items, { "apples", "bananas", "oranges" } );
 
-    objs->line_items->set( "apples", "100" );
-    objs->line_items->set( "bananas", "150" );
+    writes.set( objs->line_items, "apples", "100" );
+    writes.set( objs->line_items, "bananas", "150" );
   }
 
   // Commit changes
   {
-    TableGuard g( objs->line_items );
+    TableGuard g( objs->line_items, { "apples", "bananas", "oranges" } );
 
-    objs->line_items->commit_changes();
+    writes.commit();
   }
 
   // Ensure that data is there
   {
-    TableGuard g( objs->line_items );
+    TableGuard g( objs->line_items, { "apples", "bananas", "oranges" } );
 
-    ASSERT( "100" == objs->line_items->get( "apples" ) );
-    ASSERT( "150" == objs->line_items->get( "bananas" ) );
+    ASSERT( "100" == writes.get( objs->line_items, "apples" ) );
+    ASSERT( "150" == writes.get( objs->line_items, "bananas" ) );
   }
 
   // Add more data
   {
-    TableGuard g( objs->line_items );
+    TableGuard g( objs->line_items, { "apples", "bananas", "oranges" } );
 
-    objs->line_items->set( "oranges", "220" );
+    writes.set( objs->line_items, "oranges", "220" );
   }
 
   // Ensure that data is there
   {
-    TableGuard g( objs->line_items );
+    TableGuard g( objs->line_items, { "apples", "bananas", "oranges" } );
 
-    ASSERT( "100" == objs->line_items->get( "apples" ) );
-    ASSERT( "150" == objs->line_items->get( "bananas" ) );
-    ASSERT( "220" == objs->line_items->get( "oranges" ) );
+    ASSERT( "100" == writes.get( objs->line_items, "apples" ) );
+    ASSERT( "150" == writes.get( objs->line_items, "bananas" ) );
+    ASSERT( "220" == writes.get( objs->line_items, "oranges" ) );
   }
 
   // Rollback most recent change
   {
-    TableGuard g( objs->line_items );
+    TableGuard g( objs->line_items, { "apples", "bananas", "oranges" } );
 
-    objs->line_items->rollback_changes();
+    writes.clear();
   }
 
   // Original data should still be there (since it was committed),
   // but pending change shouldn't be there
   {
-    TableGuard g( objs->line_items );
+    TableGuard g( objs->line_items, { "apples", "bananas", "oranges" } );
 
-    ASSERT( "100" == objs->line_items->get( "apples" ) );
-    ASSERT( "150" == objs->line_items->get( "bananas" ) );
-    ASSERT( !objs->line_items->has_key( "oranges" ) );
+    ASSERT( "100" == writes.get( objs->line_items, "apples" ) );
+    ASSERT( "150" == writes.get( objs->line_items, "bananas" ) );
+    ASSERT( !writes.has_key( objs->line_items, "oranges" ) );
   }
 }
 
@@ -615,3 +769,1323 @@ void test_value_stack_exceptions( TestObjs *objs )
     // good
   }
 }
+
+void test_message_serialization_encode_frames( TestObjs *objs )
+{
+  ASSERT( "OK\n" == MessageSerialization::frame( MessageType::OK ) );
+  ASSERT( "COMMIT\n" == MessageSerialization::frame( MessageType::COMMIT ) );
+  ASSERT( "DATA " == MessageSerialization::prefix( MessageType::DATA ) );
+  ASSERT( "FAILED " == MessageSerialization::prefix( MessageType::FAILED ) );
+
+  // encode() reuses the output string, replacing its previous contents
+  std::string encoded;
+  MessageSerialization::encode( objs->data_resp, encoded );
+  ASSERT( "DATA 10012\n" == encoded );
+  MessageSerialization::encode( objs->ok_resp, encoded );
+  ASSERT( "OK\n" == encoded );
+}
+
+void test_binary_serialization_round_trip( TestObjs *objs )
+{
+  std::string encoded;
+  Message msg;
+
+  BinarySerialization::encode( objs->set_req, encoded );
+  ASSERT( encoded.size() == BinarySerialization::frame_length( encoded ) );
+  BinarySerialization::decode( encoded, msg );
+  ASSERT( MessageType::SET == msg.get_message_type() );
+  ASSERT( objs->set_req.get_table() == msg.get_table() );
+  ASSERT( objs->set_req.get_key() == msg.get_key() );
+
+  // Integer values are sent as ARG_INT, and decode to decimal
+  Message push( MessageType::PUSH, { "-9223372036854775808" } );
+  BinarySerialization::encode( push, encoded );
+  ASSERT( BinarySerialization::HEADER_LEN + 9 == encoded.size() );
+  ASSERT( BinarySerialization::ARG_INT == uint8_t( encoded[BinarySerialization::HEADER_LEN] ) );
+  BinarySerialization::decode( encoded, msg );
+  ASSERT( "-9223372036854775808" == msg.get_value() );
+
+  // Values may contain whitespace and exceed the text protocol's limit
+  std::string value( 5000, ' ' );
+  value += "\n007";
+  BinarySerialization::encode( Message( MessageType::DATA, { value } ), encoded );
+  BinarySerialization::decode( encoded, msg );
+  ASSERT( MessageType::DATA == msg.get_message_type() );
+  ASSERT( value == msg.get_value() );
+
+  BinarySerialization::decode( BinarySerialization::frame( MessageType::OK ), msg );
+  ASSERT( MessageType::OK == msg.get_message_type() );
+  ASSERT( 0 == msg.get_num_args() );
+
+  char buf[BinarySerialization::INT_FRAME_LEN];
+  size_t len = BinarySerialization::encode_int( MessageType::DATA, 42, buf );
+  BinarySerialization::decode( std::string_view( buf, len ), msg );
+  ASSERT( "42" == msg.get_value() );
+
+  int64_t n;
+  ASSERT( BinarySerialization::parse_int( "-17", n ) && -17 == n );
+  ASSERT( !BinarySerialization::parse_int( "017", n ) );
+  ASSERT( !BinarySerialization::parse_int( "-0", n ) );
+  ASSERT( !BinarySerialization::parse_int( "12a", n ) );
+  ASSERT( !BinarySerialization::parse_int( "99999999999999999999", n ) );
+}
+
+void test_binary_serialization_invalid( TestObjs *objs )
+{
+  std::string encoded;
+  BinarySerialization::encode( objs->get_req, encoded );
+
+  std::vector<std::string> invalid;
+  invalid.push_back( encoded.substr( 0, encoded.size() - 1 ) ); // truncated
+  invalid.push_back( encoded + 'x' );                           // trailing garbage
+  std::string bad_opcode = encoded;
+  bad_opcode[4] = char( 200 );
+  invalid.push_back( bad_opcode );
+  std::string bad_tag = encoded;
+  bad_tag[BinarySerialization::HEADER_LEN] = char( 7 );
+  invalid.push_back( bad_tag );
+  // GET with an invalid table name
+  BinarySerialization::encode( Message( MessageType::GET, { "1table", "key" } ), encoded );
+  invalid.push_back( encoded );
+
+  Message msg;
+  for ( const std::string &s : invalid ) {
+    try {
+      BinarySerialization::decode( s, msg );
+      FAIL( "No exception thrown decoding invalid message" );
+    } catch ( InvalidMessage &ex ) {
+      // Good
+    }
+  }
+}
+
+void test_table_shard_locks( TestObjs *objs )
+{
+  Table *table = objs->invoices;
+
+  // Find two keys in different shards
+  std::string key1 = "k0", key2;
+  for ( int i = 1; key2.empty(); i++ ) {
+    std::string k = "k" + std::to_string( i );
+    if ( Table::shard_of( k ) != Table::shard_of( key1 ) ) {
+      key2 = k;
+    }
+  }
+  unsigned shard1 = Table::shard_of( key1 ), shard2 = Table::shard_of( key2 );
+
+  // Holding one shard's lock doesn't prevent locking another
+  ASSERT( table->trylock_shard( shard1 ) );
+  ASSERT( !table->trylock_shard( shard1 ) );
+  ASSERT( table->trylock_shard( shard2 ) );
+  WriteSet writes1, writes2;
+  writes1.set( table, key1, "1" );
+  writes2.set( table, key2, "2" );
+
+  // Changes are committed and rolled back per shard
+  writes1.commit();
+  writes2.clear();
+  ASSERT( table->has_key( key1 ) );
+  ASSERT( !table->has_key( key2 ) );
+
+  // Unlocking one shard leaves the other locked
+  table->unlock_shard( shard1 );
+  ASSERT( table->trylock_shard( shard1 ) );
+  ASSERT( !table->trylock_shard( shard2 ) );
+  table->unlock_shard( shard1 );
+  table->unlock_shard( shard2 );
+}
+
+void test_table_snapshot_reads( TestObjs *objs )
+{
+  Table *table = objs->line_items;
+  unsigned shard = Table::shard_of( "qty" );
+  WriteSet writes;
+
+  table->lock_shard( shard );
+  writes.set( table, "qty", "1" );
+  writes.commit();
+  table->unlock_shard( shard );
+  ASSERT( "1" == table->get_snapshot( "qty" ) );
+
+  // Versions installed by a commit aren't visible to snapshot reads
+  // until the commit is published
+  table->lock_shard( shard );
+  writes.set( table, "qty", "2" );
+  writes.set( table, "price", "10" );
+  ASSERT( "1" == table->get_snapshot( "qty" ) );
+  uint64_t ts = CommitClock::begin_commit();
+  writes.commit( ts );
+  ASSERT( writes.empty() );
+  ASSERT( "1" == table->get_snapshot( "qty" ) );
+  ASSERT( "2" == table->get( "qty" ) );
+  try {
+    table->get_snapshot( "price" );
+    FAIL( "Unpublished key was visible" );
+  } catch ( OperationException &ex ) {
+    // Good
+  }
+  CommitClock::end_commit( ts );
+  table->unlock_shard( shard );
+
+  ASSERT( "2" == table->get_snapshot( "qty" ) );
+  ASSERT( "10" == table->get_snapshot( "price" ) );
+
+  // Commits run concurrently, but are published in timestamp order: a
+  // later commit that ends first waits for the earlier one
+  uint64_t first = CommitClock::begin_commit();
+  uint64_t second = CommitClock::begin_commit();
+  ASSERT( second == first + 1 );
+  std::atomic<bool> ended( false );
+  std::thread later( [second, &ended]() {
+    CommitClock::end_commit( second );
+    ended = true;
+  } );
+  usleep( 20000 );
+  ASSERT( !ended );
+  ASSERT( first - 1 == CommitClock::snapshot() );
+  CommitClock::end_commit( first );
+  later.join();
+  ASSERT( ended );
+  ASSERT( second == CommitClock::snapshot() );
+
+  // Snapshot reads run alongside commits that replace versions and
+  // grow the shard's index: a reader never sees a key's value go
+  // backwards, nor a key disappear once it has seen it
+  Table counters( "counters" );
+  unsigned counter_shard = Table::shard_of( "counter" );
+  std::vector<std::string> keys;
+  for ( int i = 0; keys.size() < 500; i++ ) {
+    std::string key = "key" + std::to_string( i );
+    if ( Table::shard_of( key ) == counter_shard ) {
+      keys.push_back( key );
+    }
+  }
+  std::atomic<bool> done( false );
+  std::atomic<bool> went_back( false );
+  std::vector<std::thread> readers;
+  for ( int r = 0; r < 3; r++ ) {
+    readers.emplace_back( [&]() {
+      long last = 0;
+      size_t seen = 0;
+      std::string value;
+      uint64_t value_ts;
+      while ( !done.load() ) {
+        if ( counters.read_snapshot( "counter", value, value_ts ) ) {
+          long n = std::stol( value );
+          if ( n < last ) {
+            went_back = true;
+          }
+          last = n;
+          seen = std::max( seen, size_t( n ) );
+        }
+        if ( seen > 0 && !counters.read_snapshot( keys[seen - 1], value, value_ts ) ) {
+          went_back = true;
+        }
+      }
+    } );
+  }
+  WriteSet counter_writes;
+  for ( size_t n = 1; n <= keys.size(); n++ ) {
+    counters.lock_shard( counter_shard );
+    counter_writes.set( &counters, keys[n - 1], "x" );
+    counter_writes.set( &counters, "counter", std::to_string( n ) );
+    counter_writes.commit();
+    counters.unlock_shard( counter_shard );
+  }
+  done = true;
+  for ( std::thread &reader : readers ) {
+    reader.join();
+  }
+  ASSERT( !went_back );
+  ASSERT( std::to_string( keys.size() ) == counters.get_snapshot( "counter" ) );
+}
+
+void test_transaction_optimistic( TestObjs *objs )
+{
+  WriteSet writes;
+  Table *table = objs->invoices;
+  {
+    TableGuard g( table, { "balance" } );
+    writes.set( table, "balance", "100" );
+    writes.commit();
+  }
+
+  // Writes are buffered until commit, and read back by the transaction
+  Transaction txn1, txn2;
+  ASSERT( "100" == txn1.get( table, "balance" ) );
+  txn1.set( table, "balance", "150" );
+  ASSERT( "150" == txn1.get( table, "balance" ) );
+  ASSERT( "100" == table->get_snapshot( "balance" ) );
+
+  // A transaction whose reads are still current commits
+  ASSERT( "100" == txn2.get( table, "balance" ) );
+  txn2.set( table, "balance", "90" );
+  ASSERT( txn2.commit() );
+  ASSERT( txn2.empty() );
+  ASSERT( "90" == table->get_snapshot( "balance" ) );
+
+  // The other one read a value that has since changed
+  try {
+    txn1.commit();
+    FAIL( "Conflicting transaction committed" );
+  } catch ( FailedTransaction &ex ) {
+    // Good
+  }
+  ASSERT( txn1.empty() );
+  ASSERT( "90" == table->get_snapshot( "balance" ) );
+
+  // Commit is deferred while a written shard is locked
+  unsigned shard = Table::shard_of( "balance" );
+  txn1.set( table, "balance", "0" );
+  table->lock_shard( shard );
+  ASSERT( !txn1.commit() );
+  table->unlock_shard( shard );
+  ASSERT( txn1.commit() );
+  ASSERT( "0" == table->get_snapshot( "balance" ) );
+}
+
+void test_flat_hash_map( TestObjs * )
+{
+  FlatHashMap<std::string> map;
+  ASSERT( map.empty() );
+  ASSERT( nullptr == map.find( "missing" ) );
+
+  // Enough keys to grow the table several times, including keys
+  // too long to be stored inline
+  const int n = 5000;
+  for ( int i = 0; i < n; i++ ) {
+    std::string key = ( i % 2 ) ? std::to_string( i ) : "a_rather_long_key_name_" + std::to_string( i );
+    map[key] = std::to_string( i * 2 );
+  }
+  ASSERT( size_t( n ) == map.size() );
+  for ( int i = 0; i < n; i++ ) {
+    std::string key = ( i % 2 ) ? std::to_string( i ) : "a_rather_long_key_name_" + std::to_string( i );
+    std::string *value = map.find( key, FlatHashMap<std::string>::hash( key ) );
+    ASSERT( value != nullptr );
+    ASSERT( std::to_string( i * 2 ) == *value );
+  }
+  ASSERT( nullptr == map.find( std::to_string( n + 1 ) ) );
+
+  // Assigning to an existing key doesn't add an entry
+  map["1"] = "one";
+  ASSERT( size_t( n ) == map.size() );
+  ASSERT( "one" == *map.find( "1" ) );
+
+  size_t count = 0;
+  map.for_each( [&count]( const std::string &, std::string & ) { count++; } );
+  ASSERT( size_t( n ) == count );
+
+  map.clear();
+  ASSERT( map.empty() );
+  ASSERT( nullptr == map.find( "1" ) );
+  map["x"] = "y";
+  ASSERT( "y" == *map.find( "x" ) );
+
+  // Draining hands the entries over (e.g. into another map) and
+  // leaves the map empty
+  FlatHashMap<std::string> other;
+  std::string long_key( 100, 'k' );
+  map[long_key] = "z";
+  map.drain( [&other]( std::string &key, std::string &value ) {
+    size_t hash = FlatHashMap<std::string>::hash( key );
+    other.insert( std::move( key ), hash ) = std::move( value );
+  } );
+  ASSERT( map.empty() );
+  ASSERT( 2 == other.size() );
+  ASSERT( "y" == *other.find( "x" ) );
+  ASSERT( "z" == *other.find( long_key ) );
+}
+
+void test_wal_records( TestObjs * )
+{
+  std::string log;
+  WalRecord record;
+  record.begin_create( "fruit" );
+  log += record.finish();
+  record.begin_commit( 7 );
+  record.add_write( "fruit", "apples", "42" );
+  record.add_write( "fruit", "pears", std::string( "a b\n\0c", 6 ) );
+  ASSERT( 2 == record.get_num_writes() );
+  log += record.finish();
+  size_t complete_len = log.size();
+
+  // A record that was only partly written
+  record.begin_commit( 8 );
+  record.add_write( "fruit", "plums", "1" );
+  std::string_view torn = record.finish();
+  log += torn.substr( 0, torn.size() - 1 );
+
+  WalReader reader( log );
+  WalReader::Record rec;
+  ASSERT( reader.next( rec ) );
+  ASSERT( WalRecord::CREATE == rec.type );
+  ASSERT( "fruit" == rec.table );
+  ASSERT( reader.next( rec ) );
+  ASSERT( WalRecord::COMMIT == rec.type );
+  ASSERT( 7 == rec.ts );
+  ASSERT( 2 == rec.writes.size() );
+  ASSERT( "apples" == rec.writes[0].key );
+  ASSERT( "42" == rec.writes[0].value );
+  ASSERT( std::string_view( "a b\n\0c", 6 ) == rec.writes[1].value );
+  ASSERT( !reader.next( rec ) );
+  ASSERT( complete_len == reader.get_valid_end() );
+
+  // A corrupted record is detected by its checksum
+  std::string corrupted = log.substr( 0, complete_len );
+  corrupted[complete_len - 1] ^= 1;
+  WalReader reader2( corrupted );
+  ASSERT( reader2.next( rec ) );
+  ASSERT( !reader2.next( rec ) );
+
+  // Records appended to a SYNC log by concurrent threads are synced
+  // (possibly in groups) by whichever waits first, in append order
+  std::string path = "/tmp/unit_tests_wal_sync." + std::to_string( getpid() );
+  Wal *wal = new Wal( path, Wal::SYNC );
+  wal->open( 0 );
+  std::vector<std::thread> appenders;
+  std::atomic<uint64_t> next_ts( 1 );
+  std::atomic<bool> not_durable( false );
+  pthread_mutex_t order = PTHREAD_MUTEX_INITIALIZER;
+  for ( int i = 0; i < 4; i++ ) {
+    appenders.emplace_back( [&]() {
+      WalRecord rec_i;
+      for ( int j = 0; j < 25; j++ ) {
+        // Appended under a lock, in timestamp order, as commits are
+        pthread_mutex_lock( &order );
+        uint64_t ts = next_ts++;
+        rec_i.begin_commit( ts );
+        rec_i.add_write( "fruit", "key", std::to_string( ts ) );
+        uint64_t lsn = wal->append_unsynced( rec_i.finish() );
+        pthread_mutex_unlock( &order );
+        wal->wait_durable( lsn );
+        if ( !wal->is_durable( lsn ) ) {
+          not_durable = true;
+        }
+      }
+    } );
+  }
+  for ( std::thread &appender : appenders ) {
+    appender.join();
+  }
+  ASSERT( !not_durable );
+  ASSERT( wal->get_num_syncs() <= 100 );
+  delete wal;
+
+  std::string data;
+  Wal::read_file( path, data );
+  WalReader reader3( data );
+  for ( uint64_t ts = 1; ts <= 100; ts++ ) {
+    ASSERT( reader3.next( rec ) );
+    ASSERT( ts == rec.ts );
+  }
+  ASSERT( !reader3.next( rec ) );
+  unlink( path.c_str() );
+}
+
+void test_recovery_parallel_replay( TestObjs * )
+{
+  std::string log;
+  WalRecord record;
+  record.begin_create( "fruit" );
+  log += record.finish();
+  record.begin_create( "veg" );
+  log += record.finish();
+  // Many commits, so that every thread gets a range, overwriting
+  // each key several times
+  for ( uint64_t ts = 1; ts <= 1000; ts++ ) {
+    record.begin_commit( ts );
+    record.add_write( "fruit", "key" + std::to_string( ts % 100 ), std::to_string( ts ) );
+    record.add_write( "veg", "count", std::to_string( ts ) );
+    log += record.finish();
+  }
+  size_t valid_len = log.size();
+  record.begin_commit( 1001 );
+  record.add_write( "fruit", "key1", "torn" );
+  std::string_view torn = record.finish();
+  log += torn.substr( 0, torn.size() - 3 );
+
+  std::map<std::string, Table*> tables;
+  Recovery recovery( log, 8 );
+  recovery.run( tables );
+  const Recovery::Stats &stats = recovery.get_stats();
+  ASSERT( 1002 == stats.num_records );
+  ASSERT( 2000 == stats.num_writes );
+  ASSERT( 2 == stats.num_tables );
+  ASSERT( valid_len == stats.valid_end );
+  ASSERT( 1000 == stats.last_ts );
+  // Make the recovered versions visible (earlier tests may have
+  // already advanced the clock)
+  CommitClock::recover( std::max( CommitClock::snapshot(), stats.last_ts ) );
+
+  ASSERT( 2 == tables.size() );
+  Table *fruit = tables["fruit"];
+  ASSERT( "1000" == fruit->get_snapshot( "key0" ) );
+  ASSERT( "901" == fruit->get_snapshot( "key1" ) );
+  ASSERT( "999" == fruit->get_snapshot( "key99" ) );
+  ASSERT( 999 == fruit->latest_ts( "key99" ) );
+  ASSERT( "1000" == tables["veg"]->get_snapshot( "count" ) );
+  for ( auto &pair : tables ) {
+    delete pair.second;
+  }
+  tables.clear();
+
+  // A corrupted record in the middle discards everything after it
+  std::string corrupted = log.substr( 0, valid_len );
+  size_t middle = corrupted.size() / 2;
+  corrupted[middle] ^= 1;
+  Recovery recovery2( corrupted, 4 );
+  recovery2.run( tables );
+  ASSERT( recovery2.get_stats().num_records < 1002 );
+  ASSERT( recovery2.get_stats().valid_end <= middle );
+  for ( auto &pair : tables ) {
+    delete pair.second;
+  }
+  tables.clear();
+
+  // A commit to a table that was never created
+  record.begin_commit( 1 );
+  record.add_write( "nuts", "almonds", "1" );
+  std::string orphan( record.finish() );
+  Recovery recovery3( orphan, 2 );
+  try {
+    recovery3.run( tables );
+    FAIL( "Recovery of a commit to an unknown table succeeded" );
+  } catch ( CommException &ex ) {
+    // good
+  }
+}
+
+void test_snapshot_write_load( TestObjs * )
+{
+  WriteSet writes;
+  std::map<std::string, Table*> tables;
+  Table *fruit = new Table( "fruit" );
+  tables["fruit"] = fruit;
+  tables["empty"] = new Table( "empty" );
+
+  uint64_t ts;
+  {
+    TableGuard g( fruit, { "apples", "pears", "plums" } );
+    writes.set( fruit, "apples", "42" );
+    writes.set( fruit, "pears", std::string( "a b\n\0c", 6 ) );
+    writes.commit();
+    ts = CommitClock::snapshot();
+    writes.set( fruit, "apples", "43" );
+    writes.set( fruit, "plums", "7" );
+    writes.commit();
+  }
+
+  // The snapshot has the versions as of ts
+  std::string path = "/tmp/unit_tests_snapshot." + std::to_string( getpid() );
+  ASSERT( Snapshot::write( path, tables, ts ) );
+
+  std::map<std::string, Table*> loaded;
+  MappedFile *mapped = new MappedFile( path );
+  ASSERT( ts == Snapshot::load( *mapped, loaded ) );
+  ASSERT( 2 == loaded.size() );
+  ASSERT( "42" == loaded["fruit"]->get_snapshot( "apples" ) );
+  ASSERT( std::string( "a b\n\0c", 6 ) == loaded["fruit"]->get_snapshot( "pears" ) );
+  std::string value;
+  uint64_t version_ts;
+  ASSERT( !loaded["fruit"]->read_snapshot( "plums", value, version_ts ) );
+  ASSERT( loaded.find( "empty" ) != loaded.end() );
+
+  // Only the commits after the snapshot are replayed from a log
+  std::string log;
+  WalRecord record;
+  record.begin_commit( ts );
+  record.add_write( "fruit", "apples", "stale" );
+  log += record.finish();
+  record.begin_create( "veg" );
+  log += record.finish();
+  record.begin_commit( ts + 1 );
+  record.add_write( "fruit", "plums", "8" );
+  record.add_write( "veg", "leeks", "3" );
+  log += record.finish();
+  Recovery recovery( log, 2, ts );
+  recovery.run( loaded );
+  ASSERT( 1 == recovery.get_stats().num_tables );
+  CommitClock::recover( std::max( CommitClock::snapshot(), ts + 1 ) );
+  ASSERT( "42" == loaded["fruit"]->get_snapshot( "apples" ) );
+  ASSERT( "8" == loaded["fruit"]->get_snapshot( "plums" ) );
+  ASSERT( "3" == loaded["veg"]->get_snapshot( "leeks" ) );
+
+  // Commits go to the delta, over the base
+  Table *loaded_fruit = loaded["fruit"];
+  {
+    TableGuard g( loaded_fruit, { "apples" } );
+    ASSERT( "42" == loaded_fruit->get( "apples" ) );
+    writes.set( loaded_fruit, "apples", "44" );
+    writes.commit();
+  }
+  ASSERT( "44" == loaded_fruit->get_snapshot( "apples" ) );
+  ASSERT( loaded_fruit->latest_ts( "pears" ) == ts );
+
+  // A snapshot of the loaded tables merges the base and the delta
+  std::string path2 = path + ".2";
+  ASSERT( Snapshot::write( path2, loaded, CommitClock::snapshot() ) );
+  std::map<std::string, Table*> reloaded;
+  MappedFile *mapped2 = new MappedFile( path2 );
+  Snapshot::load( *mapped2, reloaded );
+  ASSERT( 3 == reloaded.size() );
+  ASSERT( "44" == reloaded["fruit"]->get_snapshot( "apples" ) );
+  ASSERT( std::string( "a b\n\0c", 6 ) == reloaded["fruit"]->get_snapshot( "pears" ) );
+  ASSERT( "8" == reloaded["fruit"]->get_snapshot( "plums" ) );
+  ASSERT( "3" == reloaded["veg"]->get_snapshot( "leeks" ) );
+
+  // A table name too long for the directory fails the snapshot,
+  // leaving the previous one in place
+  std::map<std::string, Table*> long_named;
+  Table long_table( std::string( 70000, 't' ) );
+  long_named[long_table.get_name()] = &long_table;
+  ASSERT( !Snapshot::write( path2, long_named, CommitClock::snapshot() ) );
+  ASSERT( ENAMETOOLONG == errno );
+  ASSERT( access( ( path2 + ".tmp" ).c_str(), F_OK ) != 0 );
+
+  // A corrupted directory is detected when loading, a corrupted block
+  // when it is read
+  std::string data;
+  Wal::read_file( path2, data );
+  std::string bad_footer = data;
+  bad_footer[bad_footer.size() - 1] ^= 1;
+  std::string bad_block = data;
+  bad_block[40] ^= 1; // in fruit's first block (after empty's footer)
+  std::map<std::string, Table*> corrupted;
+  FILE *out = fopen( path2.c_str(), "wb" );
+  fwrite( bad_footer.data(), 1, bad_footer.size(), out );
+  fclose( out );
+  try {
+    MappedFile bad( path2 );
+    Snapshot::load( bad, corrupted );
+    FAIL( "Loading a corrupted snapshot succeeded" );
+  } catch ( CommException &ex ) {
+    // good
+  }
+  out = fopen( path2.c_str(), "wb" );
+  fwrite( bad_block.data(), 1, bad_block.size(), out );
+  fclose( out );
+  MappedFile *bad = new MappedFile( path2 );
+  Snapshot::load( *bad, corrupted );
+  try {
+    corrupted["fruit"]->get_snapshot( "apples" );
+    FAIL( "Reading a corrupted block succeeded" );
+  } catch ( OperationException &ex ) {
+    // good
+  }
+  unlink( path.c_str() );
+  unlink( path2.c_str() );
+
+  for ( std::map<std::string, Table*> *map : { &tables, &loaded, &reloaded, &corrupted } ) {
+    for ( auto &pair : *map ) {
+      delete pair.second;
+    }
+  }
+  delete mapped;
+  delete mapped2;
+  delete bad;
+}
+
+void test_snapshot_log_rotation( TestObjs * )
+{
+  std::string log_path = "/tmp/unit_tests_rotate." + std::to_string( getpid() );
+  std::string snap_path = log_path + ".snap";
+  unlink( log_path.c_str() );
+  Wal *wal = new Wal( log_path, Wal::BATCHED );
+  wal->open( 0 );
+  WalRecord record;
+  record.begin_create( "fruit" );
+  wal->append( record.finish() );
+  for ( uint64_t ts = 1; ts <= 3; ts++ ) {
+    record.begin_commit( ts );
+    record.add_write( "fruit", "count", std::to_string( ts ) );
+    record.add_write( "fruit", "key" + std::to_string( ts ), "v" );
+    wal->append( record.finish() );
+  }
+  uint64_t cut = wal->get_appended_lsn();
+  wal->wait_durable( cut );
+
+  // Snapshot the tables as of ts 3, as recovered from the log
+  std::string data;
+  Wal::read_file( log_path, data );
+  std::map<std::string, Table*> tables;
+  Recovery recovery( data, 2 );
+  recovery.run( tables );
+  ASSERT( Snapshot::write( snap_path, tables, 3 ) );
+  for ( auto &pair : tables ) {
+    delete pair.second;
+  }
+
+  // Records appended before and after rotating are kept, with their
+  // LSNs carrying on; the ones the snapshot covers are dropped
+  record.begin_commit( 4 );
+  record.add_write( "fruit", "count", "4" );
+  uint64_t lsn = wal->append( record.finish() );
+  ASSERT( wal->rotate( cut ) );
+  record.begin_create( "veg" );
+  wal->append( record.finish() );
+  record.begin_commit( 5 );
+  record.add_write( "veg", "leeks", "5" );
+  lsn = wal->append( record.finish() );
+  ASSERT( lsn > cut );
+  wal->wait_durable( lsn );
+  delete wal;
+  Wal::read_file( log_path, data );
+  ASSERT( lsn - cut == data.size() );
+
+  // A restart from the snapshot and the shortened log has everything
+  std::map<std::string, Table*> restarted;
+  MappedFile *mapped = new MappedFile( snap_path );
+  uint64_t snap_ts = Snapshot::load( *mapped, restarted );
+  ASSERT( 3 == snap_ts );
+  Recovery replay( data, 2, snap_ts );
+  replay.run( restarted );
+  ASSERT( 3 == replay.get_stats().num_records );
+  ASSERT( 5 == replay.get_stats().last_ts );
+  CommitClock::recover( std::max( CommitClock::snapshot(), uint64_t( 5 ) ) );
+  ASSERT( "4" == restarted["fruit"]->get_snapshot( "count" ) );
+  ASSERT( "v" == restarted["fruit"]->get_snapshot( "key1" ) );
+  ASSERT( "v" == restarted["fruit"]->get_snapshot( "key3" ) );
+  ASSERT( "5" == restarted["veg"]->get_snapshot( "leeks" ) );
+  for ( auto &pair : restarted ) {
+    delete pair.second;
+  }
+  delete mapped;
+  unlink( log_path.c_str() );
+  unlink( snap_path.c_str() );
+}
+
+void test_table_file( TestObjs * )
+{
+  // Enough keys for many blocks
+  std::vector<std::string> keys;
+  for ( int i = 0; i < 5000; i++ ) {
+    keys.push_back( "key" + std::to_string( i ) );
+  }
+  std::sort( keys.begin(), keys.end() );
+
+  std::string path = "/tmp/unit_tests_table_file." + std::to_string( getpid() );
+  int fd = open( path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+  ASSERT( fd >= 0 );
+  FileWriter out( fd );
+  TableFileBuilder builder( out );
+  for ( const std::string &key : keys ) {
+    builder.add( key, "value of " + key );
+  }
+  builder.finish();
+  ASSERT( out.flush() );
+  close( fd );
+
+  MappedFile mapped( path );
+  TableFile file( mapped.get_data() );
+  ASSERT( 5000 == file.get_num_keys() );
+  std::string_view value;
+  for ( const std::string &key : keys ) {
+    ASSERT( file.find( key, value ) );
+    ASSERT( "value of " + key == value );
+  }
+  ASSERT( !file.find( "a", value ) );
+  ASSERT( !file.find( "key10000", value ) );
+  ASSERT( !file.find( "zzz", value ) );
+
+  size_t i = 0;
+  file.for_each( [&keys, &i]( std::string_view key, std::string_view ) {
+    ASSERT( i < keys.size() && keys[i] == key );
+    i++;
+  } );
+  ASSERT( 5000 == i );
+  unlink( path.c_str() );
+}
+
+void test_lsm_storage( TestObjs * )
+{
+  WriteSet writes;
+  // A memtable of 64 bytes per shard makes nearly every commit flush,
+  // and the flushes fill L0 several times over
+  std::string dir = "/tmp/unit_tests_lsm." + std::to_string( getpid() );
+  ASSERT( mkdir( dir.c_str(), 0755 ) == 0 );
+  Storage::configure( dir, 64 * Table::NUM_SHARDS );
+
+  std::map<std::string, Table*> tables;
+  Table *nums = new Table( "nums", Storage::LSM );
+  tables["nums"] = nums;
+  LsmStorage *lsm = dynamic_cast<LsmStorage *>( nums->get_storage() );
+  ASSERT( lsm != nullptr );
+
+  const int NUM_KEYS = 2000;
+  for ( int round = 0; round < 2; round++ ) {
+    for ( int i = 0; i < NUM_KEYS; i += 100 ) {
+      std::vector<std::string> keys;
+      for ( int j = i; j < i + 100; j++ ) {
+        keys.push_back( "k" + std::to_string( j ) );
+      }
+      TableGuard g( nums, keys );
+      for ( int j = i; j < i + 100; j++ ) {
+        writes.set( nums, keys[j - i], std::to_string( j * 10 + round ) );
+      }
+      writes.commit();
+    }
+  }
+  uint64_t ts = CommitClock::snapshot();
+  lsm->wait_compactions();
+
+  LsmStorage::Stats stats = lsm->get_stats();
+  ASSERT( stats.bytes_flushed > 0 );
+  ASSERT( stats.num_compactions > 0 );
+  std::vector<unsigned> shape = lsm->get_shape( Table::shard_of( "k1" ) );
+  ASSERT( shape[0] < LsmStorage::L0_RUNS );
+  ASSERT( shape.size() > 1 );
+
+  // The newest version of each key wins, wherever it is
+  for ( int i = 0; i < NUM_KEYS; i++ ) {
+    std::string key = "k" + std::to_string( i );
+    ASSERT( std::to_string( i * 10 + 1 ) == nums->get_snapshot( key ) );
+    ASSERT( nums->latest_ts( key ) > 0 );
+  }
+  {
+    TableGuard g( nums, { "k1999", "k2000", "k1" } );
+    ASSERT( nums->has_key( "k1999" ) );
+    ASSERT( !nums->has_key( "k2000" ) );
+    ASSERT( "11" == nums->get( "k1" ) );
+  }
+  ASSERT( lsm->get_stats().bloom_skips > 0 );
+
+  // A scan yields each key once
+  std::map<std::string, std::string> scanned;
+  size_t num_scanned = 0;
+  nums->scan_snapshot( ts, [&scanned, &num_scanned]( std::string_view key, std::string_view value ) {
+    scanned[std::string( key )] = std::string( value );
+    num_scanned++;
+  } );
+  ASSERT( NUM_KEYS == num_scanned );
+  ASSERT( NUM_KEYS == scanned.size() );
+  ASSERT( "19991" == scanned["k1999"] );
+
+  // The engine is kept in snapshots and the log
+  std::string path = dir + "/snapshot";
+  ASSERT( Snapshot::write( path, tables, ts ) );
+  std::map<std::string, Table*> loaded;
+  MappedFile *mapped = new MappedFile( path );
+  Snapshot::load( *mapped, loaded );
+  ASSERT( Storage::LSM == loaded["nums"]->get_storage()->get_kind() );
+  ASSERT( "19991" == loaded["nums"]->get_snapshot( "k1999" ) );
+
+  WalRecord record;
+  record.begin_create( "logged", Storage::LSM );
+  std::string log( record.finish() );
+  record.begin_create( "plain" );
+  log += record.finish();
+  Recovery recovery( log, 1 );
+  recovery.run( loaded );
+  ASSERT( Storage::LSM == loaded["logged"]->get_storage()->get_kind() );
+  ASSERT( Storage::MEMORY == loaded["plain"]->get_storage()->get_kind() );
+
+  // CREATE takes an optional storage engine
+  Message msg;
+  MessageSerialization::decode( "CREATE nums LSM\n", msg );
+  ASSERT( 2 == msg.get_num_args() );
+  ASSERT( "LSM" == msg.get_arg( 1 ) );
+  std::string encoded;
+  MessageSerialization::encode( msg, encoded );
+  ASSERT( "CREATE nums LSM\n" == encoded );
+  Storage::Kind kind;
+  ASSERT( Storage::parse_kind( "MEMORY", kind ) && Storage::MEMORY == kind );
+  ASSERT( !Storage::parse_kind( "BTREE", kind ) );
+
+  // Dropping a table removes its runs
+  for ( auto &pair : loaded ) {
+    delete pair.second;
+  }
+  delete mapped;
+  delete nums;
+  unlink( path.c_str() );
+  ASSERT( rmdir( dir.c_str() ) == 0 );
+  Storage::configure( ".", 64 << 20 );
+}
+
+void test_wal_io_uring( TestObjs * )
+{
+  std::string path = "/tmp/unit_tests_wal." + std::to_string( getpid() );
+
+  // The ring's operations complete with system call results
+  bool have_ring = false;
+  try {
+    IoUring ring( 4 );
+    have_ring = true;
+    int fd = open( path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644 );
+    ASSERT( fd >= 0 );
+    ring.write( fd, "hello", 5, 0, 1, true );
+    ring.fdatasync( fd, 2 );
+    ring.submit( 2 );
+    uint64_t data;
+    int result;
+    int results[3] = { 0, -1, -1 };
+    while ( ring.next_completion( data, result ) ) {
+      results[data] = result;
+    }
+    ASSERT( 5 == results[1] );
+    ASSERT( 0 == results[2] );
+    char buf[8];
+    ring.read( fd, buf, sizeof( buf ), 3 );
+    ring.submit( 1 );
+    ASSERT( ring.next_completion( data, result ) );
+    ASSERT( 3 == data );
+    ASSERT( 5 == result ); // read from the start, as the write didn't move the position
+    ASSERT( 0 == memcmp( buf, "hello", 5 ) );
+    close( fd );
+  } catch ( CommException & ) {
+    // io_uring isn't available here; the log falls back
+  }
+
+  // Group commits written through the ring (at explicit offsets)
+  // follow any existing records, and read back intact
+  unlink( path.c_str() );
+  WalRecord record;
+  std::string prefix;
+  record.begin_create( "fruit" );
+  prefix += record.finish();
+  int fd = open( path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+  ASSERT( ssize_t( prefix.size() ) == write( fd, prefix.data(), prefix.size() ) );
+  close( fd );
+
+  Wal *wal = new Wal( path, Wal::BATCHED, 0, true );
+  wal->open( prefix.size() );
+  ASSERT( have_ring == wal->is_using_io_uring() );
+  uint64_t lsn = 0;
+  for ( uint64_t ts = 1; ts <= 200; ts++ ) {
+    record.begin_commit( ts );
+    record.add_write( "fruit", "key" + std::to_string( ts ), std::string( ts, 'v' ) );
+    lsn = wal->append( record.finish() );
+  }
+  wal->wait_durable( lsn );
+  delete wal;
+
+  std::string data;
+  Wal::read_file( path, data );
+  ASSERT( lsn == data.size() );
+  WalReader reader( data );
+  WalReader::Record rec;
+  ASSERT( reader.next( rec ) );
+  ASSERT( WalRecord::CREATE == rec.type );
+  for ( uint64_t ts = 1; ts <= 200; ts++ ) {
+    ASSERT( reader.next( rec ) );
+    ASSERT( ts == rec.ts );
+    ASSERT( std::string( ts, 'v' ) == rec.writes[0].value );
+  }
+  ASSERT( !reader.next( rec ) );
+  unlink( path.c_str() );
+}
+
+void test_catalog( TestObjs * )
+{
+  Catalog catalog;
+  std::vector<Table *> tables;
+  tables.push_back( new Table( "t0" ) );
+  ASSERT( catalog.insert( tables[0] ) );
+  ASSERT( tables[0] == catalog.find( "t0" ) );
+  ASSERT( nullptr == catalog.find( "t1" ) );
+
+  // A table of the same name isn't added
+  Table dup( "t0" );
+  ASSERT( !catalog.insert( &dup ) );
+  ASSERT( tables[0] == catalog.find( "t0" ) );
+
+  // Lookups running during insertions (which replace the index as it
+  // grows) always find the tables inserted before them
+  std::atomic<bool> done( false );
+  std::atomic<bool> missed( false );
+  Table *first = tables[0];
+  std::thread reader( [&]() {
+    while ( !done.load() ) {
+      if ( catalog.find( "t0" ) != first ) {
+        missed.store( true );
+      }
+    }
+  } );
+  for ( int i = 1; i < 200; i++ ) {
+    tables.push_back( new Table( "t" + std::to_string( i ) ) );
+    ASSERT( catalog.insert( tables.back() ) );
+  }
+  done.store( true );
+  reader.join();
+  ASSERT( !missed.load() );
+
+  ASSERT( 200 == catalog.size() );
+  for ( int i = 0; i < 200; i++ ) {
+    ASSERT( tables[i] == catalog.find( "t" + std::to_string( i ) ) );
+  }
+  ASSERT( nullptr == catalog.find( "t200" ) );
+  for ( Table *table : tables ) {
+    delete table;
+  }
+}
+
+void test_multi_key_serialization( TestObjs * )
+{
+  Message msg;
+  std::string encoded;
+
+  MessageSerialization::decode( "MSET row a b c\n", msg );
+  ASSERT( MessageType::MSET == msg.get_message_type() );
+  ASSERT( 4 == msg.get_num_args() );
+  ASSERT( "row" == msg.get_table() );
+  ASSERT( "c" == msg.get_arg( 3 ) );
+  MessageSerialization::encode( msg, encoded );
+  ASSERT( "MSET row a b c\n" == encoded );
+
+  MessageSerialization::decode( "MPUSH 1 two 3\n", msg );
+  ASSERT( MessageType::MPUSH == msg.get_message_type() );
+  ASSERT( 3 == msg.get_num_args() );
+  MessageSerialization::decode( "DATA 1 two 3\n", msg );
+  ASSERT( 3 == msg.get_num_args() );
+  ASSERT( "two" == msg.get_arg( 1 ) );
+
+  // A table and at least one key, all identifiers
+  try {
+    MessageSerialization::decode( "MGET row\n", msg );
+    FAIL( "MGET without keys was decoded" );
+  } catch ( InvalidMessage & ) {
+  }
+  try {
+    MessageSerialization::decode( "MGET row 9lives\n", msg );
+    FAIL( "MGET with an invalid key was decoded" );
+  } catch ( InvalidMessage & ) {
+  }
+
+  // Multi-key requests may exceed the usual length limit, up to
+  // Message::MAX_ARGS arguments
+  std::string line = "MGET row";
+  for ( unsigned i = 1; i < Message::MAX_ARGS; i++ ) {
+    line += " key_with_a_long_name" + std::to_string( i );
+  }
+  line += "\n";
+  ASSERT( line.size() > Message::MAX_ENCODED_LEN );
+  ASSERT( Message::MAX_MULTI_ENCODED_LEN == MessageSerialization::max_length( line.substr( 0, 10 ) ) );
+  ASSERT( Message::MAX_ENCODED_LEN == MessageSerialization::max_length( "GET row k" ) );
+  MessageSerialization::decode( line, msg );
+  ASSERT( Message::MAX_ARGS == msg.get_num_args() );
+  try {
+    MessageSerialization::decode( line.substr( 0, line.size() - 1 ) + " extra\n", msg );
+    FAIL( "MGET with too many arguments was decoded" );
+  } catch ( InvalidMessage & ) {
+  }
+  try {
+    MessageSerialization::decode( "GET " + std::string( Message::MAX_ENCODED_LEN, 'k' ) + "\n", msg );
+    FAIL( "overlong GET was decoded" );
+  } catch ( InvalidMessage & ) {
+  }
+
+  // The binary protocol carries up to Message::MAX_ARGS arguments too,
+  // with MPUSH values sent as integers where possible
+  Message mpush( MessageType::MPUSH, { "1", "x y", "-5" } );
+  BinarySerialization::encode( mpush, encoded );
+  ASSERT( BinarySerialization::ARG_INT == uint8_t( encoded[BinarySerialization::HEADER_LEN] ) );
+  BinarySerialization::decode( encoded, msg );
+  ASSERT( MessageType::MPUSH == msg.get_message_type() );
+  ASSERT( 3 == msg.get_num_args() );
+  ASSERT( "x y" == msg.get_arg( 1 ) );
+  ASSERT( "-5" == msg.get_arg( 2 ) );
+
+  std::vector<std::string> values;
+  for ( unsigned i = 0; i < Message::MAX_ARGS; i++ ) {
+    values.push_back( i % 2 ? std::to_string( i ) : "v " + std::to_string( i ) );
+  }
+  encoded = "prefix";
+  BinarySerialization::encode_data( values.data(), values.size(), encoded );
+  ASSERT( 0 == encoded.compare( 0, 6, "prefix" ) );
+  BinarySerialization::decode( std::string_view( encoded ).substr( 6 ), msg );
+  ASSERT( MessageType::DATA == msg.get_message_type() );
+  ASSERT( Message::MAX_ARGS == msg.get_num_args() );
+  for ( unsigned i = 0; i < Message::MAX_ARGS; i++ ) {
+    ASSERT( values[i] == msg.get_arg( i ) );
+  }
+  values.push_back( "one too many" );
+  encoded.clear();
+  try {
+    BinarySerialization::encode_data( values.data(), values.size(), encoded );
+    FAIL( "DATA with too many values was encoded" );
+  } catch ( InvalidMessage & ) {
+  }
+  ASSERT( encoded.empty() );
+}
+
+void test_counter_serialization( TestObjs * )
+{
+  Message msg;
+  std::string encoded;
+
+  MessageSerialization::decode( "INCR fruit apples\n", msg );
+  ASSERT( MessageType::INCR == msg.get_message_type() );
+  ASSERT( "fruit" == msg.get_table() );
+  ASSERT( "apples" == msg.get_key() );
+  MessageSerialization::decode( "DECR fruit apples\n", msg );
+  ASSERT( MessageType::DECR == msg.get_message_type() );
+  MessageSerialization::decode( "INCRBY fruit apples -42\n", msg );
+  ASSERT( MessageType::INCRBY == msg.get_message_type() );
+  ASSERT( 3 == msg.get_num_args() );
+  ASSERT( "-42" == msg.get_arg( 2 ) );
+  MessageSerialization::encode( msg, encoded );
+  ASSERT( "INCRBY fruit apples -42\n" == encoded );
+
+  // The table and key must be identifiers, and INCRBY needs a delta
+  try {
+    MessageSerialization::decode( "INCR fruit 9lives\n", msg );
+    FAIL( "INCR with an invalid key was decoded" );
+  } catch ( InvalidMessage & ) {
+  }
+  try {
+    MessageSerialization::decode( "INCRBY fruit apples\n", msg );
+    FAIL( "INCRBY without a delta was decoded" );
+  } catch ( InvalidMessage & ) {
+  }
+
+  // The binary protocol sends the delta as an integer
+  Message incrby( MessageType::INCRBY, { "fruit", "apples", "7" } );
+  BinarySerialization::encode( incrby, encoded );
+  ASSERT( BinarySerialization::ARG_INT == uint8_t( encoded[encoded.size() - 9] ) );
+  BinarySerialization::decode( encoded, msg );
+  ASSERT( MessageType::INCRBY == msg.get_message_type() );
+  ASSERT( "apples" == msg.get_key() );
+  ASSERT( "7" == msg.get_arg( 2 ) );
+}
+
+void test_value_arithmetic( TestObjs *objs )
+{
+  // Strings are parsed only when used as integers
+  Value s( std::string( "-42" ) );
+  ASSERT( Value::STRING == s.get_kind() );
+  ASSERT( -42 == s.to_int() );
+  ASSERT( "-42" == s.to_string() );
+  Value n( int64_t( 9000000000 ) );
+  ASSERT( n.is_int() );
+  ASSERT( "9000000000" == n.to_string() );
+  ASSERT( "9000000000" == n.take_string() );
+
+  const char *not_ints[] = { "", "abc", "12x", "+5", "99999999999999999999" };
+  for ( const char *str : not_ints ) {
+    try {
+      Value( std::string( str ) ).to_int();
+      FAIL( "non-integer was parsed" );
+    } catch ( OperationException & ) {
+    }
+  }
+
+  ASSERT( 7 == Value::add( 3, 4 ) );
+  ASSERT( -1 == Value::sub( 3, 4 ) );
+  ASSERT( 12 == Value::mul( 3, 4 ) );
+  ASSERT( -3 == Value::div( -7, 2 ) );
+  ASSERT( INT64_MAX == Value::div( -INT64_MAX, -1 ) );
+
+  // Overflow and division by zero fail rather than wrapping around
+  // (or crashing)
+  try {
+    Value::add( INT64_MAX, 1 );
+    FAIL( "add overflowed" );
+  } catch ( OperationException & ) {
+  }
+  try {
+    Value::sub( INT64_MIN, 1 );
+    FAIL( "sub overflowed" );
+  } catch ( OperationException & ) {
+  }
+  try {
+    Value::mul( int64_t( 1 ) << 32, int64_t( 1 ) << 31 );
+    FAIL( "mul overflowed" );
+  } catch ( OperationException & ) {
+  }
+  try {
+    Value::div( INT64_MIN, -1 );
+    FAIL( "div overflowed" );
+  } catch ( OperationException & ) {
+  }
+  try {
+    Value::div( 1, 0 );
+    FAIL( "divided by zero" );
+  } catch ( OperationException & ) {
+  }
+
+  // The stack keeps integers as they are, and formats them on request
+  objs->valstack.push( Value( int64_t( 5 ) ) );
+  objs->valstack.push( "text" );
+  ASSERT( 2 == objs->valstack.size() );
+  ASSERT( Value::STRING == objs->valstack.top().get_kind() );
+  objs->valstack.pop();
+  ASSERT( objs->valstack.top().is_int() );
+  ASSERT( "5" == objs->valstack.get_top() );
+  objs->valstack.pop();
+  ASSERT( objs->valstack.is_empty() );
+}
+
+void test_deadlock_detector( TestObjs *objs )
+{
+  DeadlockDetector detector;
+  uint64_t t1 = detector.begin_transaction();
+  uint64_t t2 = detector.begin_transaction();
+  uint64_t t3 = detector.begin_transaction();
+  ASSERT( 0 != t1 && t1 != t2 && t2 != t3 );
+
+  // A chain of waits, which the last would close into a cycle: only
+  // that waiter is refused
+  ASSERT( detector.wait( t1, { t2 } ) );
+  ASSERT( detector.wait( t2, { t3 } ) );
+  ASSERT( !detector.wait( t3, { t1 } ) );
+  ASSERT( !detector.wait( t3, { 0, t2 } ) );
+  ASSERT( !detector.wait( t2, { t1 } ) );
+  ASSERT( detector.wait( t2, { t3 } ) );
+
+  // Once t2 stops waiting (or waits for a request outside of any
+  // transaction), t3 can wait for t1
+  detector.stop_waiting( t2 );
+  ASSERT( detector.wait( t3, { t1 } ) );
+  ASSERT( !detector.wait( t2, { t3 } ) );
+  ASSERT( detector.wait( t3, { 0 } ) );
+  ASSERT( detector.wait( t2, { t3 } ) );
+
+  // Two transactions sharing a lock, both waiting to upgrade it
+  detector.stop_waiting( t1 );
+  detector.stop_waiting( t2 );
+  ASSERT( detector.wait( t1, { t2, t3 } ) );
+  ASSERT( !detector.wait( t2, { t1 } ) );
+  ASSERT( !detector.wait( t3, { t2, t1 } ) );
+
+  // A table shard records the transactions holding its lock
+  std::vector<uint64_t> holders;
+  ASSERT( objs->line_items->trylock_shard( 5, t1 ) );
+  objs->line_items->get_shard_holders( 5, t2, holders );
+  ASSERT( std::vector<uint64_t>{ t1 } == holders );
+  ASSERT( !objs->line_items->trylock_shard( 5, t2 ) );
+  objs->line_items->unlock_shard( 5 );
+  holders.clear();
+  objs->line_items->get_shard_holders( 5, t2, holders );
+  ASSERT( holders.empty() );
+}
+
+void test_table_shared_locks( TestObjs *objs )
+{
+  WriteSet writes;
+  Table *table = objs->line_items;
+  unsigned shard = Table::shard_of( "apples" );
+
+  // Any number of transactions can share a lock, which excludes
+  // exclusive holders
+  ASSERT( table->trylock_shard_shared( shard, 1 ) );
+  ASSERT( table->trylock_shard_shared( shard, 2 ) );
+  ASSERT( !table->trylock_shard( shard ) );
+  ASSERT( !table->trylock_shard( shard, 3 ) );
+  std::vector<uint64_t> holders;
+  table->get_shard_holders( shard, 1, holders );
+  ASSERT( std::vector<uint64_t>{ 2 } == holders );
+
+  // Upgrading only succeeds for the lock's only holder
+  ASSERT( !table->upgrade_shard_lock( shard, 1 ) );
+  table->unlock_shard_shared( shard, 2 );
+  ASSERT( table->upgrade_shard_lock( shard, 1 ) );
+  ASSERT( !table->trylock_shard_shared( shard, 2 ) );
+  writes.set( table, "apples", "7" );
+  writes.commit();
+  table->unlock_shard( shard );
+
+  // lock() waits for the sharers to leave
+  ASSERT( table->trylock_shard_shared( shard, 4 ) );
+  std::atomic<bool> locked( false );
+  std::thread locker( [table, shard, &locked]() {
+    table->lock_shard( shard );
+    locked = true;
+    table->unlock_shard( shard );
+  } );
+  usleep( 20000 );
+  ASSERT( !locked );
+  table->unlock_shard_shared( shard, 4 );
+  locker.join();
+  ASSERT( locked );
+
+  // A writer that fails to lock the shard waits for it, and new
+  // sharers are refused meanwhile, so that they can't starve it. The
+  // writer is told to retry once the lock is released.
+  CountingWaiter writer, reader, other_writer;
+  ASSERT( table->trylock_shard_shared( shard, 5 ) );
+  ASSERT( !table->trylock_shard( shard, 0, &writer ) );
+  ASSERT( !table->trylock_shard_shared( shard, 6, &reader ) );
+  ASSERT( 0 == writer.m_wakeups );
+  table->unlock_shard_shared( shard, 5 );
+  ASSERT( 1 == writer.m_wakeups );
+  ASSERT( 0 == reader.m_wakeups );
+
+  // Waiters are served in order: nobody else can lock it exclusively
+  // ahead of the writer, which wakes the reader when it's done
+  ASSERT( !table->trylock_shard( shard, 0, &other_writer ) );
+  ASSERT( table->trylock_shard( shard, 0, &writer ) );
+  table->unlock_shard( shard );
+  ASSERT( 1 == reader.m_wakeups );
+  ASSERT( 0 == other_writer.m_wakeups );
+  ASSERT( table->trylock_shard_shared( shard, 6, &reader ) );
+  table->stop_waiting_for_shard( shard, &other_writer );
+
+  // Likewise for an upgrade, until the writer gives up, which tells
+  // the waiters behind it to retry
+  ASSERT( table->trylock_shard_shared( shard, 7 ) );
+  ASSERT( !table->upgrade_shard_lock( shard, 6, &writer ) );
+  ASSERT( !table->trylock_shard_shared( shard, 8, &reader ) );
+  table->stop_waiting_for_shard( shard, &writer );
+  ASSERT( 2 == reader.m_wakeups );
+  ASSERT( table->trylock_shard_shared( shard, 8, &reader ) );
+  table->unlock_shard_shared( shard, 6 );
+  table->unlock_shard_shared( shard, 7 );
+  table->unlock_shard_shared( shard, 8 );
+
+  // Reads are expected to lead to writes once more of them did than
+  // didn't recently
+  ASSERT( !table->expects_write_after_read( shard ) );
+  table->note_read( shard, true );
+  ASSERT( table->expects_write_after_read( shard ) );
+  table->note_read( shard, false );
+  ASSERT( !table->expects_write_after_read( shard ) );
+  table->note_read( shard, false );
+  table->note_read( shard, true );
+  ASSERT( table->expects_write_after_read( shard ) );
+}
+
+void test_table_pinned_snapshots( TestObjs * )
+{
+  WriteSet writes;
+  Table table( "pinned" );
+  auto commit = [&table, &writes]( const std::string &key, const std::string &value ) {
+    unsigned shard = Table::shard_of( key );
+    table.lock_shard( shard );
+    writes.set( &table, key, value );
+    writes.commit();
+    table.unlock_shard( shard );
+  };
+
+  commit( "qty", "1" );
+  uint64_t first = CommitClock::pin_snapshot();
+  commit( "qty", "2" );
+  uint64_t second = CommitClock::pin_snapshot();
+  commit( "qty", "3" );
+  commit( "qty", "4" );
+  commit( "qty", "5" );
+
+  // Each pinned snapshot still sees the version it started with, well
+  // after the latest two versions have moved on
+  ASSERT( "1" == table.get_snapshot( "qty", first ) );
+  ASSERT( "2" == table.get_snapshot( "qty", second ) );
+  ASSERT( "5" == table.get_snapshot( "qty" ) );
+  ASSERT( CommitClock::is_pinned( first, first + 1 ) );
+  ASSERT( !CommitClock::is_pinned( second + 1, CommitClock::snapshot() + 1 ) );
+
+  // Keys committed after the pin aren't visible to it
+  commit( "qty-new", "1" );
+  ASSERT( "1" == table.get_snapshot( "qty-new" ) );
+  try {
+    table.get_snapshot( "qty-new", first );
+    FAIL( "Key committed after the pin was visible" );
+  } catch ( OperationException &ex ) {
+    // Good
+  }
+
+  CommitClock::unpin_snapshot( first );
+  ASSERT( "2" == table.get_snapshot( "qty", second ) );
+  CommitClock::unpin_snapshot( second );
+  ASSERT( !CommitClock::has_pinned_snapshots() );
+  commit( "qty", "6" );
+  ASSERT( "6" == table.get_snapshot( "qty" ) );
+}
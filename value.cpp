@@ -0,0 +1,94 @@
+#include <charconv>
+#include <utility>
+#include "exceptions.h"
+#include "value.h"
+
+Value::Value()
+  : m_kind( STRING )
+  , m_int( 0 )
+{
+}
+
+Value::Value( int64_t n )
+  : m_kind( INT )
+  , m_int( n )
+{
+}
+
+Value::Value( const std::string &s )
+  : m_kind( STRING )
+  , m_int( 0 )
+  , m_str( s )
+{
+}
+
+Value::Value( std::string &&s )
+  : m_kind( STRING )
+  , m_int( 0 )
+  , m_str( std::move(s) )
+{
+}
+
+int64_t Value::to_int() const
+{
+  return m_kind == INT ? m_int : parse_int(m_str);
+}
+
+std::string Value::to_string() const
+{
+  return m_kind == INT ? std::to_string(m_int) : m_str;
+}
+
+std::string Value::take_string()
+{
+  return m_kind == INT ? std::to_string(m_int) : std::move(m_str);
+}
+
+int64_t Value::parse_int( std::string_view s )
+{
+  int64_t n;
+  const char *end = s.data() + s.size();
+  std::from_chars_result res = std::from_chars(s.data(), end, n);
+  if (s.empty() || res.ec != std::errc() || res.ptr != end) {
+    throw OperationException("Operand is not an integer. ");
+  }
+  return n;
+}
+
+int64_t Value::add( int64_t lhs, int64_t rhs )
+{
+  int64_t result;
+  if (__builtin_add_overflow(lhs, rhs, &result)) {
+    throw OperationException("Integer overflow. ");
+  }
+  return result;
+}
+
+int64_t Value::sub( int64_t lhs, int64_t rhs )
+{
+  int64_t result;
+  if (__builtin_sub_overflow(lhs, rhs, &result)) {
+    throw OperationException("Integer overflow. ");
+  }
+  return result;
+}
+
+int64_t Value::mul( int64_t lhs, int64_t rhs )
+{
+  int64_t result;
+  if (__builtin_mul_overflow(lhs, rhs, &result)) {
+    throw OperationException("Integer overflow. ");
+  }
+  return result;
+}
+
+int64_t Value::div( int64_t lhs, int64_t rhs )
+{
+  if (rhs == 0) {
+    throw OperationException("Division by zero. ");
+  }
+  if (rhs == -1) {
+    return sub(0, lhs); // INT64_MIN / -1 overflows
+  }
+  return lhs / rhs;
+}
@@ -0,0 +1,54 @@
+#ifndef VALUE_H
+#define VALUE_H
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+// A value on the operand stack: a 64-bit integer, or a string of any
+// bytes. The results of arithmetic stay integers, so a chain of
+// arithmetic requests never formats or parses text: an integer is
+// only formatted when it is stored in a table or sent as text, and a
+// string only parsed when it is used as an operand.
+class Value {
+public:
+  enum Kind { INT, STRING };
+
+private:
+  Kind m_kind;
+  int64_t m_int;
+  std::string m_str;
+
+public:
+  Value();
+  Value( int64_t n );
+  Value( const std::string &s );
+  Value( std::string &&s );
+
+  Kind get_kind() const { return m_kind; }
+  bool is_int() const { return m_kind == INT; }
+
+  // The integer value. Throws OperationException if the value is a
+  // string that isn't a decimal integer in the range of int64.
+  int64_t to_int() const;
+
+  // The decimal representation of an integer, or the string
+  std::string to_string() const;
+
+  // As to_string(), but a string is moved out rather than copied
+  // (leaving the value empty)
+  std::string take_string();
+
+  // Parse a decimal integer (with an optional leading '-'). Throws
+  // OperationException if s isn't one or is out of range.
+  static int64_t parse_int( std::string_view s );
+
+  // Checked arithmetic: throw OperationException if the result would
+  // overflow, or on division by zero
+  static int64_t add( int64_t lhs, int64_t rhs );
+  static int64_t sub( int64_t lhs, int64_t rhs );
+  static int64_t mul( int64_t lhs, int64_t rhs );
+  static int64_t div( int64_t lhs, int64_t rhs );
+};
+
+#endif // VALUE_H
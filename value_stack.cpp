@@ -1,3 +1,4 @@
+#include <utility>
 #include "value_stack.h"
 #include "exceptions.h"
 
@@ -14,12 +15,25 @@ bool ValueStack::is_empty() const
   return m_stack.empty();
 }
 
-void ValueStack::push(const std::string &value)
+void ValueStack::push(std::string value)
 {
-  m_stack.push_back(value);
+  m_stack.emplace_back(std::move(value));
+}
+
+void ValueStack::push(Value value)
+{
+  m_stack.push_back(std::move(value));
 }
 
 std::string ValueStack::get_top() const
+{
+  if (is_empty()) {
+    throw OperationException("Stack is empty");
+  }
+  return m_stack.back().to_string();
+}
+
+Value &ValueStack::top()
 {
   if (is_empty()) {
     throw OperationException("Stack is empty");
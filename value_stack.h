@@ -3,22 +3,27 @@
 
 #include <vector>
 #include <string>
+#include "value.h"
 
 class ValueStack {
 private:
-  std::vector<std::string> m_stack;
+  std::vector<Value> m_stack;
 
 public:
   ValueStack();
   ~ValueStack();
 
   bool is_empty() const;
-  void push( const std::string &value );
+  size_t size() const { return m_stack.size(); }
+  void push( std::string value );
+  void push( Value value );
 
-  // Note: get_top() and pop() should throw OperationException
+  // Note: get_top(), top() and pop() should throw OperationException
   // if called when the stack is empty
 
+  // The top value as a string
   std::string get_top() const;
+  Value &top();
   void pop();
 };
 
@@ -0,0 +1,598 @@
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "checksum.h"
+#include "exceptions.h"
+#include "io_uring.h"
+#include "guard.h"
+#include "wal.h"
+
+namespace {
+
+void put_u16(std::string &buf, uint16_t val) {
+  buf += char(val);
+  buf += char(val >> 8);
+}
+
+void put_u32(std::string &buf, uint32_t val) {
+  for (int i = 0; i < 4; i++) {
+    buf += char(val >> (8 * i));
+  }
+}
+
+void put_u64(std::string &buf, uint64_t val) {
+  for (int i = 0; i < 8; i++) {
+    buf += char(val >> (8 * i));
+  }
+}
+
+void set_u32(char *p, uint32_t val) {
+  for (int i = 0; i < 4; i++) {
+    p[i] = char(val >> (8 * i));
+  }
+}
+
+uint64_t get_uint(const char *p, int nbytes) {
+  uint64_t val = 0;
+  for (int i = nbytes - 1; i >= 0; i--) {
+    val = (val << 8) | (unsigned char) p[i];
+  }
+  return val;
+}
+
+// Bounds-checked reads from a record's payload
+class PayloadReader {
+private:
+  std::string_view m_data;
+  size_t m_pos;
+
+public:
+  PayloadReader(std::string_view data) : m_data(data), m_pos(0) { }
+
+  bool get(int nbytes, uint64_t &val) {
+    if (m_data.size() - m_pos < size_t(nbytes)) {
+      return false;
+    }
+    val = get_uint(m_data.data() + m_pos, nbytes);
+    m_pos += nbytes;
+    return true;
+  }
+
+  bool get_string(int len_bytes, std::string_view &str) {
+    uint64_t len;
+    if (!get(len_bytes, len) || m_data.size() - m_pos < len) {
+      return false;
+    }
+    str = m_data.substr(m_pos, len);
+    m_pos += len;
+    return true;
+  }
+
+  bool at_end() const { return m_pos == m_data.size(); }
+};
+
+}
+
+////////////////////////////////////////////////////////////////////////
+// WalRecord
+////////////////////////////////////////////////////////////////////////
+
+WalRecord::WalRecord()
+  : m_num_writes( 0 )
+{
+}
+
+WalRecord::~WalRecord()
+{
+}
+
+void WalRecord::begin_create( const std::string &table, uint8_t engine )
+{
+  m_data.assign(HEADER_LEN, '\0');
+  m_data += char(CREATE);
+  put_u64(m_data, 0);
+  assert(table.size() <= UINT16_MAX); // see Message::MAX_IDENTIFIER_LEN
+  put_u16(m_data, uint16_t(table.size()));
+  m_data += table;
+  m_data += char(engine);
+  m_num_writes = 0;
+}
+
+void WalRecord::begin_commit( uint64_t ts )
+{
+  m_data.assign(HEADER_LEN, '\0');
+  m_data += char(COMMIT);
+  put_u64(m_data, ts);
+  put_u32(m_data, 0); // number of writes, filled in by finish()
+  m_num_writes = 0;
+}
+
+void WalRecord::add_write( const std::string &table, const std::string &key, const std::string &value )
+{
+  assert(table.size() <= UINT16_MAX);
+  put_u16(m_data, uint16_t(table.size()));
+  m_data += table;
+  put_u32(m_data, uint32_t(key.size()));
+  m_data += key;
+  put_u32(m_data, uint32_t(value.size()));
+  m_data += value;
+  m_num_writes++;
+}
+
+std::string_view WalRecord::finish()
+{
+  if (m_data[HEADER_LEN] == char(COMMIT)) {
+    set_u32(&m_data[HEADER_LEN + 9], m_num_writes);
+  }
+  size_t payload_len = m_data.size() - HEADER_LEN;
+  set_u32(&m_data[0], uint32_t(payload_len));
+  set_u32(&m_data[4], crc32(m_data.data() + HEADER_LEN, payload_len));
+  return m_data;
+}
+
+////////////////////////////////////////////////////////////////////////
+// WalReader
+////////////////////////////////////////////////////////////////////////
+
+WalReader::WalReader( std::string_view data )
+  : m_data( data )
+  , m_pos( 0 )
+{
+}
+
+WalReader::~WalReader()
+{
+}
+
+bool WalReader::next( Record &rec )
+{
+  size_t pos = m_pos;
+  std::string_view record;
+  if (!next_frame(record) || !check(record, rec)) {
+    m_pos = pos;
+    return false;
+  }
+  return true;
+}
+
+bool WalReader::next_frame( std::string_view &record )
+{
+  if (m_data.size() - m_pos < WalRecord::HEADER_LEN) {
+    return false;
+  }
+  uint64_t len = get_uint(m_data.data() + m_pos, 4);
+  if (m_data.size() - m_pos - WalRecord::HEADER_LEN < len) {
+    return false;
+  }
+  record = m_data.substr(m_pos, WalRecord::HEADER_LEN + len);
+  m_pos += record.size();
+  return true;
+}
+
+bool WalReader::check( std::string_view record, Record &rec )
+{
+  uint32_t crc = uint32_t(get_uint(record.data() + 4, 4));
+  std::string_view payload = record.substr(WalRecord::HEADER_LEN);
+  if (crc32(payload.data(), payload.size()) != crc) {
+    return false;
+  }
+
+  PayloadReader in(payload);
+  uint64_t type, ts;
+  if (!in.get(1, type) || !in.get(8, ts)) {
+    return false;
+  }
+  rec.type = WalRecord::Type(type);
+  rec.ts = ts;
+  rec.writes.clear();
+  if (type == WalRecord::CREATE) {
+    uint64_t engine = 0;
+    if (!in.get_string(2, rec.table) || (!in.at_end() && !in.get(1, engine))) {
+      return false;
+    }
+    rec.engine = uint8_t(engine);
+  } else if (type == WalRecord::COMMIT) {
+    uint64_t count;
+    if (!in.get(4, count)) {
+      return false;
+    }
+    for (uint64_t i = 0; i < count; i++) {
+      Write w;
+      if (!in.get_string(2, w.table) || !in.get_string(4, w.key) || !in.get_string(4, w.value)) {
+        return false;
+      }
+      rec.writes.push_back(w);
+    }
+  } else {
+    return false;
+  }
+  return in.at_end();
+}
+
+////////////////////////////////////////////////////////////////////////
+// Wal
+////////////////////////////////////////////////////////////////////////
+
+Wal::Wal( const std::string &path, Durability durability, unsigned window_us, bool use_io_uring )
+  : m_path( path )
+  , m_durability( durability )
+  , m_window_us( window_us )
+  , m_use_io_uring( use_io_uring )
+  , m_fd( -1 )
+  , m_ring( nullptr )
+  , m_appended_lsn( 0 )
+  , m_written_lsn( 0 )
+  , m_durable_lsn( 0 )
+  , m_shutdown( false )
+  , m_started( false )
+  , m_writing( false )
+  , m_num_syncs( 0 )
+  , m_file_start( 0 )
+{
+  pthread_mutex_init(&m_lock, nullptr);
+  pthread_cond_init(&m_appended, nullptr);
+  pthread_cond_init(&m_synced, nullptr);
+}
+
+Wal::~Wal()
+{
+  shutdown();
+  delete m_ring;
+  if (m_fd >= 0) {
+    close(m_fd);
+  }
+  pthread_cond_destroy(&m_synced);
+  pthread_cond_destroy(&m_appended);
+  pthread_mutex_destroy(&m_lock);
+}
+
+void Wal::open( uint64_t offset )
+{
+  // Readable too, for rotate() to copy records from
+  m_fd = ::open(m_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (m_fd < 0) {
+    throw CommException("Could not open log " + m_path + ": " + strerror(errno));
+  }
+  if (ftruncate(m_fd, off_t(offset)) < 0 || lseek(m_fd, off_t(offset), SEEK_SET) < 0) {
+    throw CommException("Could not truncate log " + m_path + ": " + strerror(errno));
+  }
+  m_appended_lsn = offset;
+  m_written_lsn = offset;
+  m_durable_lsn.store(offset);
+
+  if (m_durability == BATCHED && m_use_io_uring) {
+    try {
+      // A write and its sync
+      m_ring = new IoUring(2);
+    } catch (CommException &e) {
+      std::cerr << "Error: " << e.what() << ", logging without io_uring\n";
+    }
+  }
+
+  if (m_durability != SYNC) {
+    if (pthread_create(&m_thread, nullptr, writer_main, this) != 0) {
+      throw CommException("Could not create log writer thread");
+    }
+    m_started = true;
+  }
+}
+
+void Wal::shutdown()
+{
+  {
+    Guard g(m_lock);
+    m_shutdown = true;
+    pthread_cond_signal(&m_appended);
+  }
+  if (m_started) {
+    pthread_join(m_thread, nullptr);
+    m_started = false;
+  }
+}
+
+uint64_t Wal::append( std::string_view record )
+{
+  uint64_t lsn = append_unsynced(record);
+  if (m_durability == SYNC) {
+    wait_durable(lsn);
+  }
+  return lsn;
+}
+
+uint64_t Wal::append_unsynced( std::string_view record )
+{
+  Guard g(m_lock);
+  m_appended_lsn += record.size();
+  m_pending.append(record.data(), record.size());
+
+  if (m_durability == SYNC) {
+    // Written by wait_durable()
+    return m_appended_lsn;
+  }
+  if (m_durability == NONE) {
+    // Nobody waits for the record
+    m_durable_lsn.store(m_appended_lsn, std::memory_order_release);
+  }
+  pthread_cond_signal(&m_appended);
+  return m_appended_lsn;
+}
+
+void Wal::wait_durable( uint64_t lsn )
+{
+  Guard g(m_lock);
+  while (!is_durable(lsn)) {
+    if (m_durability != SYNC || m_writing) {
+      pthread_cond_wait(&m_synced, &m_lock);
+      continue;
+    }
+
+    // Write and sync everything appended so far, without the lock, so
+    // that records appended meanwhile wait to go in the next group.
+    // Only one thread does so at a time, which keeps the records in
+    // order.
+    m_writing = true;
+    m_batch.swap(m_pending);
+    uint64_t synced_lsn = m_appended_lsn;
+    pthread_mutex_unlock(&m_lock);
+
+    write_fully(m_batch.data(), m_batch.size());
+    if (fdatasync(m_fd) < 0) {
+      std::cerr << "Error: Could not sync log: " << strerror(errno) << "\n";
+      std::abort();
+    }
+    m_batch.clear();
+
+    pthread_mutex_lock(&m_lock);
+    m_writing = false;
+    m_written_lsn = synced_lsn;
+    m_num_syncs++;
+    m_durable_lsn.store(synced_lsn, std::memory_order_release);
+    pthread_cond_broadcast(&m_synced);
+  }
+}
+
+void Wal::add_sync_callback( std::function<void()> callback )
+{
+  Guard g(m_lock);
+  m_sync_callbacks.push_back(callback);
+}
+
+uint64_t Wal::get_num_syncs()
+{
+  Guard g(m_lock);
+  return m_num_syncs;
+}
+
+uint64_t Wal::get_appended_lsn()
+{
+  Guard g(m_lock);
+  return m_appended_lsn;
+}
+
+// Copy the current file's bytes between the given LSNs to fd
+bool Wal::copy_records( int fd, uint64_t from, uint64_t to )
+{
+  char buf[65536];
+  while (from < to) {
+    size_t len = size_t(std::min<uint64_t>(to - from, sizeof(buf)));
+    ssize_t n = pread(m_fd, buf, len, off_t(from - m_file_start));
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    for (ssize_t done = 0; done < n; ) {
+      ssize_t w = write(fd, buf + done, size_t(n - done));
+      if (w < 0 && errno == EINTR) {
+        continue;
+      }
+      if (w < 0) {
+        return false;
+      }
+      done += w;
+    }
+    from += uint64_t(n);
+  }
+  return true;
+}
+
+// The bytes already in the file never change, so most of them are
+// copied without the lock; only the last few are copied with it held
+// (and no write in progress), just before the new file replaces the
+// old one. LSNs carry on across files: m_file_start is the LSN at the
+// start of the current one.
+bool Wal::rotate( uint64_t lsn )
+{
+  std::string tmp_path = m_path + ".tmp";
+  int fd = ::open(tmp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    return false;
+  }
+
+  uint64_t copied;
+  {
+    Guard g(m_lock);
+    copied = m_written_lsn;
+  }
+  bool ok = copy_records(fd, lsn, copied);
+
+  Guard g(m_lock);
+  while (ok && m_writing) {
+    pthread_cond_wait(&m_synced, &m_lock);
+  }
+  ok = ok && copy_records(fd, copied, m_written_lsn)
+      && fdatasync(fd) == 0
+      && rename(tmp_path.c_str(), m_path.c_str()) == 0;
+  if (!ok) {
+    int saved_errno = errno;
+    close(fd);
+    unlink(tmp_path.c_str());
+    errno = saved_errno;
+    return false;
+  }
+
+  // Make the rename durable before the old file's records are relied
+  // on being gone
+  std::string dir = m_path.find('/') == std::string::npos ? "." : m_path.substr(0, m_path.rfind('/') + 1);
+  int dir_fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dir_fd >= 0) {
+    fsync(dir_fd);
+    close(dir_fd);
+  }
+  close(m_fd);
+  m_fd = fd;
+  m_file_start = lsn;
+  return true;
+}
+
+// Failing to write the log leaves no way to keep the durability
+// promise, so it is fatal
+void Wal::write_fully( const char *data, size_t len )
+{
+  while (len > 0) {
+    ssize_t n = write(m_fd, data, len);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      std::cerr << "Error: Could not write log: " << strerror(errno) << "\n";
+      std::abort();
+    }
+    data += n;
+    len -= size_t(n);
+  }
+}
+
+// Like write_fully() followed by fdatasync(), through m_ring: the
+// write (at the given offset) is linked to the sync, so both are
+// submitted at once, and the sync only runs if the write was complete.
+// After a short write the sync is cancelled, and the rest is retried.
+void Wal::write_and_sync( const char *data, size_t len, uint64_t offset )
+{
+  enum { WRITE = 1, SYNC = 2 };
+  while (true) {
+    m_ring->write(m_fd, data, len, offset, WRITE, true);
+    m_ring->fdatasync(m_fd, SYNC);
+    m_ring->submit(2);
+
+    int written = 0, synced = 0;
+    uint64_t op;
+    int result;
+    for (int i = 0; i < 2; i++) {
+      while (!m_ring->next_completion(op, result)) {
+        m_ring->submit(1);
+      }
+      (op == WRITE ? written : synced) = result;
+    }
+
+    if (written < 0 && written != -EINTR && written != -EAGAIN) {
+      std::cerr << "Error: Could not write log: " << strerror(-written) << "\n";
+      std::abort();
+    }
+    if (written > 0) {
+      data += written;
+      len -= size_t(written);
+      offset += uint64_t(written);
+    }
+    if (len == 0 && synced == 0) {
+      return;
+    }
+    if (len == 0 && synced != -ECANCELED) {
+      std::cerr << "Error: Could not sync log: " << strerror(-synced) << "\n";
+      std::abort();
+    }
+  }
+}
+
+void *Wal::writer_main( void *arg )
+{
+  Wal *wal = static_cast<Wal *>(arg);
+  std::string batch;
+
+  pthread_mutex_lock(&wal->m_lock);
+  while (true) {
+    while (wal->m_pending.empty() && !wal->m_shutdown) {
+      pthread_cond_wait(&wal->m_appended, &wal->m_lock);
+    }
+    if (wal->m_pending.empty()) {
+      break; // shut down, and everything has been written
+    }
+
+    // Give concurrent commits the chance to join the group
+    if (wal->m_window_us > 0 && !wal->m_shutdown) {
+      pthread_mutex_unlock(&wal->m_lock);
+      usleep(wal->m_window_us);
+      pthread_mutex_lock(&wal->m_lock);
+    }
+
+    batch.swap(wal->m_pending);
+    uint64_t lsn = wal->m_appended_lsn;
+    uint64_t file_start = wal->m_file_start;
+    wal->m_writing = true;
+    pthread_mutex_unlock(&wal->m_lock);
+
+    if (wal->m_ring != nullptr) {
+      wal->write_and_sync(batch.data(), batch.size(), lsn - batch.size() - file_start);
+    } else {
+      wal->write_fully(batch.data(), batch.size());
+      if (wal->m_durability == BATCHED && fdatasync(wal->m_fd) < 0) {
+        std::cerr << "Error: Could not sync log: " << strerror(errno) << "\n";
+        std::abort();
+      }
+    }
+    batch.clear();
+
+    pthread_mutex_lock(&wal->m_lock);
+    wal->m_writing = false;
+    wal->m_written_lsn = lsn;
+    if (wal->m_durability == BATCHED) {
+      wal->m_num_syncs++;
+      wal->m_durable_lsn.store(lsn, std::memory_order_release);
+      for (const std::function<void()> &callback : wal->m_sync_callbacks) {
+        callback();
+      }
+    }
+    pthread_cond_broadcast(&wal->m_synced);
+  }
+  pthread_mutex_unlock(&wal->m_lock);
+  return nullptr;
+}
+
+void Wal::read_file( const std::string &path, std::string &data )
+{
+  data.clear();
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    if (errno == ENOENT) {
+      return;
+    }
+    throw CommException("Could not open " + path + ": " + strerror(errno));
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    throw CommException("Could not read " + path);
+  }
+  data.resize(size_t(st.st_size));
+  size_t pos = 0;
+  while (pos < data.size()) {
+    ssize_t n = read(fd, &data[pos], data.size() - pos);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      close(fd);
+      throw CommException("Could not read " + path);
+    }
+    pos += size_t(n);
+  }
+  close(fd);
+}
@@ -0,0 +1,208 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <pthread.h>
+
+class IoUring; // forward declaration
+
+// Write-ahead log records. Each record is
+//
+//   u32 payload length, u32 CRC-32 of the payload, payload
+//
+// where the payload is a u8 record type and a u64 commit timestamp,
+// followed by
+//
+//   CREATE: u16 length, table name, then optionally a u8 storage
+//           engine (see Storage::Kind; absent in older logs, meaning
+//           MEMORY)
+//   COMMIT: u32 count, then count writes, each
+//           u16 length, table name, u32 length, key, u32 length, value
+//
+// All integers are little endian.
+class WalRecord {
+public:
+  enum Type { CREATE = 1, COMMIT = 2 };
+
+  // Size of the length and checksum fields
+  static const size_t HEADER_LEN = 8;
+
+private:
+  std::string m_data;
+  uint32_t m_num_writes;
+
+public:
+  WalRecord();
+  ~WalRecord();
+
+  void begin_create( const std::string &table, uint8_t engine = 0 );
+  void begin_commit( uint64_t ts );
+  void add_write( const std::string &table, const std::string &key, const std::string &value );
+
+  uint32_t get_num_writes() const { return m_num_writes; }
+
+  // Complete the record (filling in the length and checksum), and
+  // return its encoding
+  std::string_view finish();
+};
+
+// Read the records of a log, stopping at the end of the data or at
+// the first incomplete or corrupted record (e.g. one that was being
+// written when the server crashed).
+class WalReader {
+public:
+  struct Write {
+    std::string_view table;
+    std::string_view key;
+    std::string_view value;
+  };
+
+  struct Record {
+    WalRecord::Type type;
+    uint64_t ts;
+    std::string_view table; // CREATE only
+    uint8_t engine;         // CREATE only
+    std::vector<Write> writes; // COMMIT only
+  };
+
+private:
+  std::string_view m_data;
+  size_t m_pos;
+
+public:
+  WalReader( std::string_view data );
+  ~WalReader();
+
+  bool next( Record &rec );
+
+  // Like next(), but only frames the record (without verifying its
+  // checksum or decoding it), so that records can be checked and
+  // decoded elsewhere (e.g. by several threads) with check()
+  bool next_frame( std::string_view &record );
+
+  // Offset of the end of the last valid record read
+  size_t get_valid_end() const { return m_pos; }
+
+  // Verify the checksum of a record framed by next_frame(), and
+  // decode it. Returns false if the record is corrupted.
+  static bool check( std::string_view record, Record &rec );
+};
+
+// Append-only write-ahead log file. Records are appended (in commit
+// order) by committing threads; how they get to disk depends on the
+// durability level:
+//
+//   NONE      a background thread writes appended records to the file
+//             (without syncing it); commits never wait
+//   BATCHED   group commit: the background thread writes everything
+//             appended since its last write, and makes it durable with
+//             a single fdatasync(); a commit's response is held until
+//             its record is durable
+//   SYNC      each commit's record is written and synced before the
+//             commit returns, by the committing thread: one waiting
+//             commit writes and syncs everything appended so far,
+//             while later ones wait to form the next group
+//
+// A record's LSN is the log offset just past its end (counting any
+// records rotated out of the file, see rotate()), so a record is
+// durable once get_durable_lsn() has reached its LSN.
+//
+// With use_io_uring, a BATCHED log's writer thread hands each group's
+// write and fdatasync() to the kernel together (see IoUring), with one
+// system call instead of two (or more, for short writes). If io_uring
+// isn't available it uses the ordinary calls.
+class Wal {
+public:
+  enum Durability { NONE, BATCHED, SYNC };
+
+private:
+  std::string m_path;
+  Durability m_durability;
+  unsigned m_window_us;
+  bool m_use_io_uring;
+  int m_fd;
+  IoUring *m_ring;             // BATCHED writes, if using io_uring
+
+  pthread_mutex_t m_lock;
+  pthread_cond_t m_appended;   // signalled when records are appended
+  pthread_cond_t m_synced;     // broadcast when the durable LSN advances
+  std::string m_pending;       // appended but not yet written
+  uint64_t m_appended_lsn;
+  uint64_t m_written_lsn;      // end of the records written to the file
+  std::atomic<uint64_t> m_durable_lsn;
+  bool m_shutdown;
+  bool m_started;
+  bool m_writing;              // a group is being written (without the lock)
+  std::string m_batch;         // the SYNC group being written
+  pthread_t m_thread;
+  uint64_t m_num_syncs;
+  uint64_t m_file_start;       // LSN at the start of the file (see rotate())
+  std::vector<std::function<void()>> m_sync_callbacks;
+
+  // copy constructor and assignment operator are prohibited
+  Wal( const Wal & );
+  Wal &operator=( const Wal & );
+
+  static void *writer_main( void *arg );
+  void write_fully( const char *data, size_t len );
+  void write_and_sync( const char *data, size_t len, uint64_t offset );
+  bool copy_records( int fd, uint64_t from, uint64_t to );
+
+public:
+  // Records are batched for window_us microseconds before each
+  // background write (so that more commits can join a group)
+  Wal( const std::string &path, Durability durability, unsigned window_us = 0, bool use_io_uring = false );
+  ~Wal();
+
+  // Open the log for appending, at the given offset (anything after
+  // it, such as a torn record, is truncated), and start the background
+  // writer. Throws CommException on failure.
+  void open( uint64_t offset );
+  void shutdown();
+
+  const std::string &get_path() const { return m_path; }
+  Durability get_durability() const { return m_durability; }
+  bool is_using_io_uring() const { return m_ring != nullptr; }
+
+  // Append a record, and return its LSN. A SYNC log's record is
+  // durable on return.
+  uint64_t append( std::string_view record );
+
+  // Like append(), but a SYNC log's record isn't written until
+  // wait_durable() is called for it, so appends can be kept in commit
+  // order under a lock without syncing under it
+  uint64_t append_unsynced( std::string_view record );
+
+  uint64_t get_durable_lsn() const { return m_durable_lsn.load(std::memory_order_acquire); }
+  bool is_durable( uint64_t lsn ) const { return lsn <= get_durable_lsn(); }
+
+  // Block until the record with the given LSN is durable (for a SYNC
+  // log, writing and syncing it if no other thread is doing so)
+  void wait_durable( uint64_t lsn );
+
+  // Register a function that is called (from the writer thread)
+  // whenever the durable LSN advances
+  void add_sync_callback( std::function<void()> callback );
+
+  uint64_t get_num_syncs();
+
+  // LSN of the latest record appended
+  uint64_t get_appended_lsn();
+
+  // Replace the log file with a new one holding only the records after
+  // lsn, e.g. once a snapshot covers the ones before. Appends carry on
+  // meanwhile, and LSNs are unchanged. Returns false, leaving the log
+  // as it was, if the new file can't be written.
+  bool rotate( uint64_t lsn );
+
+  // Read the whole log (or other file) at path into data (leaving data empty if the
+  // file doesn't exist). Throws CommException on failure.
+  static void read_file( const std::string &path, std::string &data );
+};
+
+#endif // WAL_H
@@ -0,0 +1,90 @@
+#include <sched.h>
+#include <unistd.h>
+#include "exceptions.h"
+#include "guard.h"
+#include "client_connection.h"
+#include "event_loop.h"
+#include "worker_pool.h"
+
+WorkerPool::WorkerPool( unsigned num_threads, int cpu )
+  : m_num_threads( num_threads )
+  , m_cpu( cpu )
+  , m_shutdown( false )
+{
+  if (m_num_threads == 0) {
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    m_num_threads = (ncpus > 0) ? unsigned(ncpus) : 1;
+  }
+  pthread_mutex_init(&m_lock, nullptr);
+  pthread_cond_init(&m_cond, nullptr);
+}
+
+WorkerPool::~WorkerPool()
+{
+  shutdown();
+  pthread_cond_destroy(&m_cond);
+  pthread_mutex_destroy(&m_lock);
+}
+
+void WorkerPool::start()
+{
+  for (unsigned i = 0; i < m_num_threads; i++) {
+    pthread_t thr_id;
+    if (pthread_create(&thr_id, nullptr, worker_main, this) != 0) {
+      throw CommException("Could not create worker thread");
+    }
+    m_threads.push_back(thr_id);
+    if (m_cpu >= 0) {
+      cpu_set_t cpus;
+      CPU_ZERO(&cpus);
+      CPU_SET(m_cpu, &cpus);
+      pthread_setaffinity_np(thr_id, sizeof(cpus), &cpus);
+    }
+  }
+}
+
+void WorkerPool::shutdown()
+{
+  {
+    Guard g(m_lock);
+    m_shutdown = true;
+    pthread_cond_broadcast(&m_cond);
+  }
+  for (pthread_t thr_id : m_threads) {
+    pthread_join(thr_id, nullptr);
+  }
+  m_threads.clear();
+}
+
+void WorkerPool::submit( ClientConnection *conn )
+{
+  Guard g(m_lock);
+  m_queue.push_back(conn);
+  pthread_cond_signal(&m_cond);
+}
+
+ClientConnection *WorkerPool::next_task()
+{
+  Guard g(m_lock);
+  while (m_queue.empty() && !m_shutdown) {
+    pthread_cond_wait(&m_cond, &m_lock);
+  }
+  if (m_queue.empty()) {
+    return nullptr;
+  }
+  ClientConnection *conn = m_queue.front();
+  m_queue.pop_front();
+  return conn;
+}
+
+void *WorkerPool::worker_main( void *arg )
+{
+  WorkerPool *pool = static_cast<WorkerPool *>(arg);
+
+  ClientConnection *conn;
+  while ((conn = pool->next_task()) != nullptr) {
+    conn->process_requests();
+    conn->get_event_loop()->request_completed(conn);
+  }
+  return nullptr;
+}
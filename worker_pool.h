@@ -0,0 +1,44 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <deque>
+#include <vector>
+#include <pthread.h>
+
+class ClientConnection; // forward declaration
+
+// Fixed-size pool of threads which execute client requests.
+// The event loop submits a connection once a complete request has
+// been received; the worker runs it and hands the connection back
+// to the connection's event loop.
+class WorkerPool {
+private:
+  unsigned m_num_threads;
+  int m_cpu;
+  std::vector<pthread_t> m_threads;
+  std::deque<ClientConnection *> m_queue;
+  pthread_mutex_t m_lock;
+  pthread_cond_t m_cond;
+  bool m_shutdown;
+
+  // copy constructor and assignment operator are prohibited
+  WorkerPool( const WorkerPool & );
+  WorkerPool &operator=( const WorkerPool & );
+
+  ClientConnection *next_task();
+  static void *worker_main( void *arg );
+
+public:
+  // A thread count of 0 means one thread per online CPU.
+  // If cpu is non-negative, the worker threads are pinned to that CPU.
+  WorkerPool( unsigned num_threads = 0, int cpu = -1 );
+  ~WorkerPool();
+
+  unsigned get_num_threads() const { return m_num_threads; }
+
+  void start();
+  void shutdown();
+  void submit( ClientConnection *conn );
+};
+
+#endif // WORKER_POOL_H
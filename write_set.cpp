@@ -0,0 +1,95 @@
+#include "commit_clock.h"
+#include "table.h"
+#include "wal.h"
+#include "write_set.h"
+
+WriteSet::WriteSet()
+{
+}
+
+WriteSet::~WriteSet()
+{
+  clear();
+  for (Writes *writes : m_spare) {
+    delete writes;
+  }
+}
+
+// Transactions write to few shards, so a linear search is enough
+WriteSet::Writes *WriteSet::find_writes( Table *table, unsigned shard )
+{
+  for (ShardWrites &shard_writes : m_shards) {
+    if (shard_writes.table == table && shard_writes.shard == shard) {
+      return shard_writes.writes;
+    }
+  }
+  return nullptr;
+}
+
+void WriteSet::set( Table *table, const std::string &key, std::string value )
+{
+  size_t hash = Writes::hash(key);
+  unsigned shard = Table::shard_of_hash(hash);
+  Writes *writes = find_writes(table, shard);
+  if (writes == nullptr) {
+    if (m_spare.empty()) {
+      writes = new Writes();
+    } else {
+      writes = m_spare.back();
+      m_spare.pop_back();
+    }
+    m_shards.push_back(ShardWrites{ table, shard, writes });
+  }
+  writes->get_or_insert(key, hash) = std::move(value);
+}
+
+std::string *WriteSet::find( Table *table, const std::string &key )
+{
+  if (m_shards.empty()) {
+    return nullptr;
+  }
+  size_t hash = Writes::hash(key);
+  Writes *writes = find_writes(table, Table::shard_of_hash(hash));
+  return writes != nullptr ? writes->find(key, hash) : nullptr;
+}
+
+std::string WriteSet::get( Table *table, const std::string &key )
+{
+  std::string *value = find(table, key);
+  if (value != nullptr) {
+    return *value;
+  }
+  return table->get(key);
+}
+
+bool WriteSet::has_key( Table *table, const std::string &key )
+{
+  return find(table, key) != nullptr || table->has_key(key);
+}
+
+void WriteSet::commit( uint64_t ts, WalRecord *record )
+{
+  for (ShardWrites &shard_writes : m_shards) {
+    shard_writes.table->commit_changes(shard_writes.shard, *shard_writes.writes, ts, record);
+    m_spare.push_back(shard_writes.writes);
+  }
+  m_shards.clear();
+}
+
+uint64_t WriteSet::commit()
+{
+  WalRecord record;
+  uint64_t ts = CommitClock::begin_commit();
+  record.begin_commit(ts);
+  commit(ts, &record);
+  return CommitClock::end_commit(ts, record);
+}
+
+void WriteSet::clear()
+{
+  for (ShardWrites &shard_writes : m_shards) {
+    shard_writes.writes->clear();
+    m_spare.push_back(shard_writes.writes);
+  }
+  m_shards.clear();
+}
@@ -0,0 +1,77 @@
+#ifndef WRITE_SET_H
+#define WRITE_SET_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "flat_hash_map.h"
+
+class Table; // forward declaration
+class WalRecord; // forward declaration
+
+// Writes that haven't been committed yet, private to the transaction
+// (or request) making them, so that tables only ever hold committed
+// versions: the writer reads its own writes from here, and other
+// readers probe the table alone. The writes are grouped by table
+// shard, and a commit installs each shard's writes in one go (see
+// Table::commit_changes()). Writing requires the exclusive lock of
+// the key's shard by the time of the commit.
+class WriteSet {
+public:
+  typedef FlatHashMap<std::string> Writes;
+
+private:
+  struct ShardWrites {
+    Table *table;
+    unsigned shard;
+    Writes *writes;
+  };
+
+  std::vector<ShardWrites> m_shards; // shards written to
+  std::vector<Writes *> m_spare;     // emptied maps, kept for reuse
+
+  // copy constructor and assignment operator are prohibited
+  WriteSet( const WriteSet & );
+  WriteSet &operator=( const WriteSet & );
+
+  Writes *find_writes( Table *table, unsigned shard );
+
+public:
+  WriteSet();
+  ~WriteSet();
+
+  bool empty() const { return m_shards.empty(); }
+
+  void set( Table *table, const std::string &key, std::string value );
+
+  // The value written to the key, or nullptr if it hasn't been written
+  std::string *find( Table *table, const std::string &key );
+
+  // The key's value as seen by the writer: its own write, or else the
+  // table's latest committed value (which requires the shard's lock,
+  // see Table::get()). Throws OperationException if the key isn't present.
+  std::string get( Table *table, const std::string &key );
+  bool has_key( Table *table, const std::string &key );
+
+  // Call f(table, shard) for each shard written to
+  template<typename F>
+  void for_each_shard( F f ) const {
+    for (const ShardWrites &shard : m_shards) {
+      f(shard.table, shard.shard);
+    }
+  }
+
+  // Install the writes as versions with the given timestamp, which
+  // must be from CommitClock::begin_commit(), adding them to the
+  // commit's log record (if any), and empty the write set
+  void commit( uint64_t ts, WalRecord *record = nullptr );
+
+  // Commit the writes on their own. Returns the commit's LSN (see
+  // CommitClock::end_commit()).
+  uint64_t commit();
+
+  // Discard the writes
+  void clear();
+};
+
+#endif // WRITE_SET_H